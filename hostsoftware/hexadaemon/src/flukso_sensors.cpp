@@ -0,0 +1,230 @@
+#include "flukso_sensors.hpp"
+
+#include <sys/inotify.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <boost/asio/placeholders.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+#include <libhexabus/error.hpp>
+
+using namespace hexadaemon;
+
+namespace bf = boost::filesystem;
+
+static bool is_sensor_id(const std::string& name)
+{
+	if ( name.size() != 32 )
+		return false;
+
+	for ( std::string::const_iterator it = name.begin(), end = name.end(); it != end; ++it )
+	{
+		if ( !(*it >= '0' && *it <= '9') && !(*it >= 'a' && *it <= 'f') )
+			return false;
+	}
+
+	return true;
+}
+
+FluksoSensors::FluksoSensors(boost::asio::io_service& io, const std::string& directory, bool debug)
+	: _directory(directory)
+	, _debug(debug)
+	, _inotify(io)
+	, _watch(-1)
+	, _retry_timer(io)
+{
+	int fd = inotify_init();
+	if ( fd < 0 )
+		throw hexabus::NetworkException("inotify_init", boost::system::error_code(errno, boost::system::system_category()));
+	_inotify.assign(fd);
+
+	watch(boost::system::error_code());
+	read_events();
+}
+
+FluksoSensors::~FluksoSensors()
+{
+	boost::system::error_code ignored;
+	_retry_timer.cancel(ignored);
+	_inotify.close(ignored);
+}
+
+uint32_t FluksoSensors::value(const std::string& id) const
+{
+	boost::mutex::scoped_lock lock(_values_mutex);
+	boost::unordered_map<std::string, uint32_t>::const_iterator it = _values.find(id);
+
+	return it != _values.end() ? it->second : 0;
+}
+
+void FluksoSensors::watch(const boost::system::error_code& error)
+{
+	if ( error )
+		return;
+
+	_watch = inotify_add_watch(_inotify.native_handle(), _directory.c_str(),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+	if ( _watch < 0 )
+	{
+		_debug && std::cout << "Cannot watch " << _directory << ": " << strerror(errno) << std::endl;
+		_retry_timer.expires_from_now(boost::posix_time::seconds(5));
+		_retry_timer.async_wait(boost::bind(&FluksoSensors::watch, this, _1));
+		return;
+	}
+
+	// pick up the files written before the watch was added
+	scan();
+}
+
+void FluksoSensors::scan()
+{
+	boost::system::error_code err;
+
+	for ( bf::directory_iterator sensors(_directory, err), end; !err && sensors != end; sensors.increment(err) )
+	{
+		std::string filename = sensors->path().filename().string();
+		if ( !is_sensor_id(filename) ) {
+			_debug && std::cout << "Ignoring file: " << filename << std::endl;
+			continue;
+		}
+
+		load(filename);
+	}
+}
+
+void FluksoSensors::load(const std::string& filename)
+{
+	_debug && std::cout << "Parsing file: " << filename << std::endl;
+
+	std::ifstream file((bf::path(_directory) / filename).string().c_str());
+	if ( file.fail() )
+		return;
+
+	std::string flukso_data;
+	file >> flukso_data;
+	file.close();
+
+	uint32_t value;
+	boost::mutex::scoped_lock lock(_values_mutex);
+	switch ( parse(flukso_data, value) )
+	{
+		case PARSE_VALUE:
+			_values[filename] = value;
+			_debug && std::cout << "Updating _values[" << filename << "] = " << value << std::endl;
+			break;
+
+		case PARSE_NO_VALUE:
+			_debug && std::cerr << "No Values " << filename << std::endl;
+			_values[filename] = 0;
+			break;
+
+		case PARSE_ERROR:
+			std::cerr << "Error parsing " << filename << std::endl;
+			_debug && std::cout << "Content of " << filename << ": \'" << flukso_data << "\'" << std::endl;
+			break;
+	}
+}
+
+void FluksoSensors::read_events()
+{
+	_inotify.async_read_some(boost::asio::buffer(_events),
+			boost::bind(&FluksoSensors::handle_events, this,
+				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void FluksoSensors::handle_events(const boost::system::error_code& error, size_t size)
+{
+	if ( error )
+	{
+		if ( error != boost::asio::error::operation_aborted )
+			std::cerr << "Error reading inotify events: " << error.message() << std::endl;
+		return;
+	}
+
+	for ( size_t offset = 0; offset + sizeof(inotify_event) <= size; )
+	{
+		// events are not necessarily aligned in the buffer
+		inotify_event event;
+		memcpy(&event, &_events[offset], sizeof(event));
+		const char* name = &_events[offset + sizeof(event)];
+		offset += sizeof(event) + event.len;
+
+		if ( event.wd != _watch )
+			continue;
+
+		if ( event.mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED) )
+		{
+			// fluksod recreates the directory when it restarts
+			inotify_rm_watch(_inotify.native_handle(), _watch);
+			_watch = -1;
+			watch(boost::system::error_code());
+			continue;
+		}
+
+		if ( event.len > 0 && is_sensor_id(std::string(name, strnlen(name, event.len))) )
+			load(std::string(name, strnlen(name, event.len)));
+	}
+
+	read_events();
+}
+
+FluksoSensors::parse_result FluksoSensors::parse(const std::string& data, uint32_t& value)
+{
+	const char* p = data.c_str();
+	const char* end = p + data.size();
+	bool found = false;
+
+	if ( p == end || *p++ != '[' )
+		return PARSE_ERROR;
+
+	for (;;)
+	{
+		if ( p == end || *p++ != '[' )
+			return PARSE_ERROR;
+
+		// timestamp
+		while ( p != end && *p >= '0' && *p <= '9' )
+			p++;
+		if ( p == end || *p++ != ',' )
+			return PARSE_ERROR;
+
+		if ( end - p >= 5 && memcmp(p, "\"nan\"", 5) == 0 )
+		{
+			p += 5;
+		}
+		else
+		{
+			const char* digits = p;
+			uint64_t v = 0;
+			while ( p != end && *p >= '0' && *p <= '9' )
+			{
+				v = v * 10 + (*p++ - '0');
+				if ( v > 0xFFFFFFFFULL )
+					return PARSE_ERROR;
+			}
+			if ( p == digits )
+				return PARSE_ERROR;
+
+			value = v;
+			found = true;
+		}
+
+		if ( p == end || *p++ != ']' )
+			return PARSE_ERROR;
+		if ( p == end )
+			return PARSE_ERROR;
+		if ( *p == ']' )
+			break;
+		if ( *p++ != ',' )
+			return PARSE_ERROR;
+	}
+
+	if ( ++p != end )
+		return PARSE_ERROR;
+
+	return found ? PARSE_VALUE : PARSE_NO_VALUE;
+}
@@ -0,0 +1,63 @@
+#ifndef _FLUKSO_SENSORS_HPP
+#define _FLUKSO_SENSORS_HPP
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/array.hpp>
+#include <string>
+
+namespace hexadaemon {
+	/**
+	 * Keeps the latest value of every sensor fluksod writes to its sensor
+	 * directory. Files are parsed once when fluksod has written them, which
+	 * inotify reports, so reading a value does not touch the file system.
+	 *
+	 * While the directory does not exist, watching it is retried every few
+	 * seconds. Values can be read from any thread.
+	 */
+	class FluksoSensors {
+		public:
+			FluksoSensors(boost::asio::io_service& io, const std::string& directory, bool debug = false);
+			~FluksoSensors();
+
+			// latest value of the sensor with the given id, 0 if there is none
+			uint32_t value(const std::string& id) const;
+
+			enum parse_result {
+				PARSE_ERROR,
+				PARSE_VALUE,
+				PARSE_NO_VALUE
+			};
+
+			/**
+			 * Parses the JSON array of [timestamp,value] pairs fluksod writes
+			 * and returns the last value that is not "nan".
+			 */
+			static parse_result parse(const std::string& data, uint32_t& value);
+
+		private:
+			FluksoSensors(const FluksoSensors&);
+			FluksoSensors& operator=(const FluksoSensors&);
+
+			std::string _directory;
+			bool _debug;
+			mutable boost::mutex _values_mutex;
+			boost::unordered_map<std::string, uint32_t> _values;
+
+			boost::asio::posix::stream_descriptor _inotify;
+			int _watch;
+			boost::array<char, 4096> _events;
+			boost::asio::deadline_timer _retry_timer;
+
+			void watch(const boost::system::error_code& error);
+			void scan();
+			void load(const std::string& filename);
+			void read_events();
+			void handle_events(const boost::system::error_code& error, size_t size);
+	};
+}
+
+#endif // _FLUKSO_SENSORS_HPP
@@ -2,10 +2,6 @@
 
 #include <syslog.h>
 
-#include <fstream>
-
-#include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 #include <boost/ref.hpp>
 
 #include <libhexabus/device.hpp>
@@ -23,15 +19,16 @@ extern "C" {
 
 using namespace hexadaemon;
 
-namespace bf = boost::filesystem;
-
 #ifndef UCI_FOUND
 	std::string _device_name = "Hexadaemon";
 #endif /* UCI_FOUND */
 
-HexabusServer::HexabusServer(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval, bool debug)
+HexabusServer::HexabusServer(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval, bool debug, int deadband, int heartbeat)
 	: _device(io, interfaces, addresses, interval)
 	, _debug(debug)
+	, _deadband(deadband)
+	, _heartbeat(heartbeat)
+	, _flukso(io, "/var/run/fluksod/sensor/", debug)
 {
 	_init();
 }
@@ -50,42 +47,49 @@ void HexabusServer::_init() {
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_POWER_METER, "HexabusPlug+ Power meter (W)"));
 	powerEP->onRead(boost::bind(&HexabusServer::get_sum, this));
-	_device.addEndpoint(powerEP);
+	_addSensorEndpoint(powerEP);
 
 	ep_it = ep_registry.find(EP_FLUKSO_L1);
 	hexabus::TypedEndpointFunctions<uint32_t>::Ptr l1EP = ep_it != ep_registry.end()
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_FLUKSO_L1, "Flukso Phase 1"));
 	l1EP->onRead(boost::bind(&HexabusServer::get_sensor, this, 1));
-	_device.addEndpoint(l1EP);
+	_addSensorEndpoint(l1EP);
 
 	ep_it = ep_registry.find(EP_FLUKSO_L2);
 	hexabus::TypedEndpointFunctions<uint32_t>::Ptr l2EP = ep_it != ep_registry.end()
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_FLUKSO_L2, "Flukso Phase 2"));
 	l2EP->onRead(boost::bind(&HexabusServer::get_sensor, this, 2));
-	_device.addEndpoint(l2EP);
+	_addSensorEndpoint(l2EP);
 
 	ep_it = ep_registry.find(EP_FLUKSO_L3);
 	hexabus::TypedEndpointFunctions<uint32_t>::Ptr l3EP = ep_it != ep_registry.end()
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_FLUKSO_L3, "Flukso Phase 3"));
 	l3EP->onRead(boost::bind(&HexabusServer::get_sensor, this, 3));
-	_device.addEndpoint(l3EP);
+	_addSensorEndpoint(l3EP);
 
 	ep_it = ep_registry.find(EP_FLUKSO_S01);
 	hexabus::TypedEndpointFunctions<uint32_t>::Ptr l4EP = ep_it != ep_registry.end()
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_FLUKSO_S01, "Flukso S0 1"));
 	l4EP->onRead(boost::bind(&HexabusServer::get_sensor, this, 4));
-	_device.addEndpoint(l4EP);
+	_addSensorEndpoint(l4EP);
 
 	ep_it = ep_registry.find(EP_FLUKSO_S02);
 	hexabus::TypedEndpointFunctions<uint32_t>::Ptr l5EP = ep_it != ep_registry.end()
 		? hexabus::TypedEndpointFunctions<uint32_t>::fromEndpointDescriptor(ep_it->second)
 		: hexabus::TypedEndpointFunctions<uint32_t>::Ptr(new hexabus::TypedEndpointFunctions<uint32_t>(EP_FLUKSO_S02, "Flukso S0 2"));
 	l5EP->onRead(boost::bind(&HexabusServer::get_sensor, this, 5));
-	_device.addEndpoint(l5EP);
+	_addSensorEndpoint(l5EP);
+}
+
+void HexabusServer::_addSensorEndpoint(const hexabus::EndpointFunctions::Ptr& ep)
+{
+	if ( _deadband >= 0 )
+		ep->broadcastOnChange(_deadband, boost::posix_time::seconds(_heartbeat));
+	_device.addEndpoint(ep);
 }
 
 static const char* entry_names[6] = {
@@ -108,72 +112,26 @@ unsigned long endpoints[6] = {
 
 uint32_t HexabusServer::get_sensor(int map_idx)
 {
-	updateFluksoValues();
 	_debug && std::cout << "Reading value for " << entry_names[map_idx] << std::endl;
-	return _flukso_values[_sensor_mapping[map_idx]];
+	return _sensor_value(map_idx);
 }
 
 uint32_t HexabusServer::get_sum()
 {
-	updateFluksoValues();
 	int result = 0;
 
-	result += _flukso_values[_sensor_mapping[1]];
-	result += _flukso_values[_sensor_mapping[2]];
-	result += _flukso_values[_sensor_mapping[3]];
+	result += _sensor_value(1);
+	result += _sensor_value(2);
+	result += _sensor_value(3);
 
 	return result;
 }
 
-void HexabusServer::updateFluksoValues()
+uint32_t HexabusServer::_sensor_value(int map_idx) const
 {
-	bf::path p("/var/run/fluksod/sensor/");
+	std::map<int, std::string>::const_iterator it = _sensor_mapping.find(map_idx);
 
-	if ( exists(p) && is_directory(p) )
-	{
-		for ( bf::directory_iterator sensors(p); sensors != bf::directory_iterator(); sensors++ )
-		{
-			std::string filename = (*sensors).path().filename().string();
-			boost::regex hex32("^[0-9a-f]{32}$");
-			boost::match_results<std::string::const_iterator> what;
-			if ( !boost::regex_match(filename, what, hex32) ) {
-				_debug && std::cout << "Ignoring file: " << filename << std::endl;
-				continue;
-			}
-
-			_debug && std::cout << "Parsing file: " << filename << std::endl;
-
-			std::ifstream file;
-			file.open((*sensors).path().string().c_str());
-			if ( file.fail() )
-				continue;
-
-			std::string flukso_data;
-			file >> flukso_data;
-			file.close();
-			//extract last value != "nan" from the json array
-			boost::regex r("^\\[(?:\\[[[:digit:]]*,[[:digit:]]*\\],)*\\[[[:digit:]]*,([[:digit:]]*)\\](?:,\\[[[:digit:]]*,\"nan\"\\])*\\]$");
-
-			if ( boost::regex_search(flukso_data, what, r) ) {
-				try {
-					uint32_t value = boost::lexical_cast<uint32_t>(std::string(what[1].first, what[1].second));
-					_flukso_values[filename] = value;
-					_debug && std::cout << "Updating _flukso_values[" << filename << "] = " << value << std::endl;
-				} catch ( const boost::bad_lexical_cast & ) {
-					std::cerr << "Error parsing value " << std::string(what[1].first, what[1].second) << std::endl;
-				}
-			} else {
-        boost::regex r0("^\\[(?:\\[[[:digit:]]*,\"nan\"\\],)*\\[[[:digit:]]*,\"nan\"\\]\\]$");
-        if ( boost::regex_search(flukso_data, what, r0) ) {
-          _debug && std::cerr << "No Values " << filename << std::endl;
-					_flukso_values[filename] = 0;
-				} else {
-          std::cerr << "Error parsing " << filename << std::endl;
-          _debug && std::cout << "Content of " << filename << ": \'" << flukso_data << "\'" << std::endl;
-        }
-			}
-		}
-	}
+	return _flukso.value(it != _sensor_mapping.end() ? it->second : "");
 }
 
 void HexabusServer::loadSensorMapping()
@@ -245,6 +203,7 @@ void HexabusServer::loadSensorMapping()
 std::string HexabusServer::loadDeviceName()
 {
 	_debug && std::cout << "loading device name" << std::endl;
+	boost::mutex::scoped_lock lock(_name_mutex);
 	std::string name;
 #ifdef UCI_FOUND
 	uci_context *ctx = uci_alloc_context();
@@ -290,6 +249,7 @@ void HexabusServer::saveDeviceName(const std::string& name)
 		return;
 	}
 
+	boost::mutex::scoped_lock lock(_name_mutex);
 #ifdef UCI_FOUND
 	uci_context *ctx = uci_alloc_context();
 	uci_package *flukso;
@@ -2,14 +2,17 @@
 #define _HEXABUS_SERVER_HPP
 
 #include <boost/asio/io_service.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <libhexabus/device.hpp>
 
+#include "flukso_sensors.hpp"
+
 namespace hexadaemon {
 	class HexabusServer {
 		public:
 			typedef boost::shared_ptr<HexabusServer> Ptr;
-			HexabusServer(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval = 60, bool debug = false);
+			HexabusServer(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval = 60, bool debug = false, int deadband = -1, int heartbeat = 60);
 			virtual ~HexabusServer() {};
 
 			uint32_t get_sensor(int map_idx);
@@ -31,15 +34,20 @@ namespace hexadaemon {
 
 		private:
 			void _init();
+			void _addSensorEndpoint(const hexabus::EndpointFunctions::Ptr& ep);
+			uint32_t _sensor_value(int map_idx) const;
 
 		private:
 			hexabus::Device _device;
 			bool _debug;
-			std::map<std::string, uint32_t> _flukso_values;
+			// sensor values are broadcast on change if the deadband is not negative
+			int _deadband;
+			int _heartbeat;
+			FluksoSensors _flukso;
+			// not changed after _init, so endpoints can read it from any thread
 			std::map<int, std::string> _sensor_mapping;
-
-			int getFluksoValue();
-			void updateFluksoValues();
+			// serializes loading and saving the device name
+			boost::mutex _name_mutex;
 	};
 }
 
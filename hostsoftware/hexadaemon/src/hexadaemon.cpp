@@ -13,6 +13,7 @@
 #include <boost/asio/signal_set.hpp>
 #include <boost/bind.hpp>
 #include <boost/program_options.hpp>
+#include <boost/thread/thread.hpp>
 #include <iostream>
 #include <syslog.h>
 
@@ -30,8 +31,11 @@ int main(int argc, char** argv)
     ("debug,d", "enable debug mode")
     ("logfile,l", po::value<std::string>(), "set the logfile to use")
     ("interval,i", po::value<int>(), "set the broadcast interval")
+    ("deadband", po::value<int>(), "only broadcast sensor values that changed by more than this many watts")
+    ("heartbeat", po::value<int>()->default_value(60), "with --deadband, broadcast unchanged values after this many seconds")
     ("interface,I", po::value<std::vector<std::string> >(), "interface to use for multicast")
     ("address,a", po::value<std::vector<std::string> >(), "address to listen on")
+    ("threads,t", po::value<int>()->default_value(1), "number of threads handling packets and broadcasts")
     ;
   po::variables_map vm;
 
@@ -48,6 +52,7 @@ int main(int argc, char** argv)
   bool debug = false;
   std::string logfile = "/tmp/hexadaemon.log";
   int interval = 2;
+  int deadband = -1;
   std::vector<std::string> interfaces;
   std::vector<std::string> addresses;
 
@@ -71,6 +76,11 @@ int main(int argc, char** argv)
     std::cout << "interval: " << interval << std::endl;
   }
 
+  if (vm.count("deadband")) {
+    deadband = vm["deadband"].as<int>();
+    std::cout << "deadband: " << deadband << std::endl;
+  }
+
   if (vm.count("interface")) {
     interfaces = vm["interface"].as<std::vector<std::string> >();
     for (std::vector<std::string>::iterator it = interfaces.begin(); it != interfaces.end(); ++it)
@@ -99,7 +109,8 @@ int main(int argc, char** argv)
     // user.
     //udp_daytime_server server(io_service);
     hexadaemon::HexabusServer *server;
-    server = new hexadaemon::HexabusServer(io_service, interfaces, addresses, interval, debug);
+    server = new hexadaemon::HexabusServer(io_service, interfaces, addresses, interval, debug,
+        deadband, vm["heartbeat"].as<int>());
 
     // Register signal handlers so that the daemon may be shut down. You may
     // also want to register for other signals, such as SIGHUP to trigger a
@@ -212,7 +223,12 @@ int main(int argc, char** argv)
       // The io_service can now be used normally.
       syslog(LOG_INFO | LOG_USER, "HexabusDaemon started");
     }
+    // the main thread is one of the workers
+    boost::thread_group workers;
+    for (int i = 1; i < vm["threads"].as<int>(); i++)
+      workers.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
     io_service.run();
+    workers.join_all();
     if ( !debug )
       syslog(LOG_INFO | LOG_USER, "HexabusDaemon stopped");
   }
@@ -0,0 +1,55 @@
+#define BOOST_TEST_MODULE flukso_sensors_test
+#include <boost/test/unit_test.hpp>
+#include "flukso_sensors.hpp"
+
+using hexadaemon::FluksoSensors;
+
+static FluksoSensors::parse_result parse(const std::string& data, uint32_t& value)
+{
+	value = 0;
+	return FluksoSensors::parse(data, value);
+}
+
+BOOST_AUTO_TEST_CASE ( check_parse_values ) {
+	uint32_t value;
+
+	BOOST_CHECK_EQUAL(parse("[[1400000000,17]]", value), FluksoSensors::PARSE_VALUE);
+	BOOST_CHECK_EQUAL(value, 17u);
+
+	// the last value that is not "nan" is taken
+	BOOST_CHECK_EQUAL(parse("[[1,5],[2,7],[3,\"nan\"]]", value), FluksoSensors::PARSE_VALUE);
+	BOOST_CHECK_EQUAL(value, 7u);
+	BOOST_CHECK_EQUAL(parse("[[1,\"nan\"],[2,5],[3,\"nan\"]]", value), FluksoSensors::PARSE_VALUE);
+	BOOST_CHECK_EQUAL(value, 5u);
+
+	BOOST_CHECK_EQUAL(parse("[[1,4294967295]]", value), FluksoSensors::PARSE_VALUE);
+	BOOST_CHECK_EQUAL(value, 4294967295u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_parse_no_value ) {
+	uint32_t value;
+
+	BOOST_CHECK_EQUAL(parse("[[1,\"nan\"]]", value), FluksoSensors::PARSE_NO_VALUE);
+	BOOST_CHECK_EQUAL(parse("[[1,\"nan\"],[2,\"nan\"],[3,\"nan\"]]", value), FluksoSensors::PARSE_NO_VALUE);
+}
+
+BOOST_AUTO_TEST_CASE ( check_parse_errors ) {
+	uint32_t value;
+
+	BOOST_CHECK_EQUAL(parse("", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,]]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,5],[2,]]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,nan]]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,-5]]", value), FluksoSensors::PARSE_ERROR);
+
+	// values do not wrap around
+	BOOST_CHECK_EQUAL(parse("[[1,4294967296]]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,99999999999999999999999]]", value), FluksoSensors::PARSE_ERROR);
+
+	BOOST_CHECK_EQUAL(parse("[[1,5]]x", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,5]],", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,5]x]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,5]", value), FluksoSensors::PARSE_ERROR);
+	BOOST_CHECK_EQUAL(parse("[[1,5],]", value), FluksoSensors::PARSE_ERROR);
+}
@@ -1,37 +1,70 @@
 #include "historian.hpp"
 #include "../../../../shared/endpoints.h"
-#include <numeric>
-#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
 
 using namespace hexanode;
 
-int add_to_totals(int total, const devices_t::value_type& data) {
-  return total + data.second;
+Historian::Historian(
+    boost::asio::io_service& io,
+    hexabus::Socket* send_socket,
+    boost::posix_time::time_duration update_interval)
+  : _total_consumption(0)
+  , _total_production(0)
+  , _timer(io)
+  , _update_interval(update_interval)
+  , _send_socket(send_socket)
+{
+}
+
+Historian::shard& Historian::shard_for(const device_t& device) {
+  boost::asio::ip::address_v6::bytes_type bytes = device.first.to_bytes();
+  size_t hash = boost::hash_range(bytes.begin(), bytes.end());
+  boost::hash_combine(hash, device.second);
+
+  return _shards[hash % SHARDS];
+}
+
+int64_t Historian::power_balance() const {
+  return __atomic_load_n(&_total_consumption, __ATOMIC_RELAXED)
+    - __atomic_load_n(&_total_production, __ATOMIC_RELAXED);
 }
 
 void Historian::send_power_balance() {
-  boost::mutex::scoped_lock lock(_guard);
-  uint32_t total_consumption = std::accumulate(
-      _power_consumptions.begin(), _power_consumptions.end(), 
-      0, add_to_totals);
-  uint32_t total_production = std::accumulate(
-      _power_productions.begin(), _power_productions.end(), 
-      0, add_to_totals);
-  int32_t power_balance =  total_consumption - total_production;
-  std::cout << "Sending power balance: " << power_balance << std::endl;
+  int64_t power_balance = this->power_balance();
+  LOG("Sending power balance: " << power_balance);
+  // the packet carries a float, which holds any total with reduced precision
   _send_socket->send(
-      hexabus::InfoPacket<float>(EP_POWER_BALANCE, power_balance));
+      hexabus::InfoPacket<float>(EP_POWER_BALANCE, float(power_balance)));
+}
+
+void Historian::set_power(
+    const boost::asio::ip::udp::endpoint& endpoint,
+    const uint32_t& eid,
+    uint32_t power_t::* field,
+    int64_t& total,
+    uint32_t value)
+{
+  device_t device(endpoint.address().to_v6(), eid);
+  shard& s = shard_for(device);
+  int64_t delta;
+
+  {
+    boost::mutex::scoped_lock lock(s.guard);
+    power_t& power = s.devices[device];
+    delta = int64_t(value) - power.*field;
+    power.*field = value;
+  }
+
+  // deltas of concurrent updates add up to the same total in any order
+  __atomic_add_fetch(&total, delta, __ATOMIC_RELAXED);
 }
 
 void Historian::add_production(
     const boost::asio::ip::udp::endpoint& endpoint,
           const uint32_t& eid,
     const uint32_t current_production) {
-  boost::mutex::scoped_lock lock(_guard);
-  std::cout << "Adding production of " << current_production
-    << " Watts of device " << endpoint.address() << std::endl;
-  std::string device=endpoint_eid2device(endpoint, eid);
-  _power_productions[device] = current_production;
+  set_power(endpoint, eid, &power_t::production, _total_production, current_production);
 }
 
 void Historian::add_consumption(
@@ -39,48 +72,49 @@ void Historian::add_consumption(
           const uint32_t& eid,
     const uint32_t consumption) 
 {
-  boost::mutex::scoped_lock lock(_guard);
-  std::cout << "Adding consumption of " << consumption
-    << " Watts of device " << endpoint.address() << std::endl;
-  std::string device=endpoint_eid2device(endpoint, eid);
-  _power_consumptions[device] = consumption;
+  set_power(endpoint, eid, &power_t::consumption, _total_consumption, consumption);
 }
 
 void Historian::remove_device(
     const boost::asio::ip::udp::endpoint& endpoint,
     const uint32_t& eid)
 {
-  boost::mutex::scoped_lock lock(_guard);
-  std::string device=endpoint_eid2device(endpoint, eid);
-  std::cout << "Clearing device " << device << std::endl;
-  _power_consumptions.erase(device);
-  _power_productions.erase(device);
+  device_t device(endpoint.address().to_v6(), eid);
+  shard& s = shard_for(device);
+  power_t power;
+
+  {
+    boost::mutex::scoped_lock lock(s.guard);
+    devices_t::iterator it = s.devices.find(device);
+    if (it == s.devices.end())
+      return;
+    power = it->second;
+    s.devices.erase(it);
+  }
+
+  __atomic_sub_fetch(&_total_consumption, int64_t(power.consumption), __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&_total_production, int64_t(power.production), __ATOMIC_RELAXED);
 }
 
 void Historian::run() {
-  _t = boost::thread(
-      boost::bind(&Historian::loop, this)
-      );
+  tick(boost::system::error_code());
+}
+
+void Historian::shutdown() {
+  _timer.cancel();
 }
 
-// Add consumption
-//boost::mutex::scoped_lock lock(_comsumptions_guard);
-//_power_consumptions.push_back(value);
+void Historian::tick(const boost::system::error_code& err) {
+  if (err)
+    return;
 
-void Historian::loop() {
-  while (! _terminate_loop) {
+  try {
     send_power_balance();
-    boost::this_thread::sleep(boost::posix_time::seconds(_update_seconds));
+  } catch (const hexabus::NetworkException& e) {
+    std::cerr << "Could not send power balance: " << e.code().message() << std::endl;
   }
-}
-
 
-const std::string Historian::endpoint_eid2device(
-    const boost::asio::ip::udp::endpoint& endpoint,
-    const uint32_t& eid)
-{
-  std::ostringstream oss;
-  oss << endpoint.address() << "%" << eid;
-  return oss.str();
+  _timer.expires_from_now(_update_interval);
+  _timer.async_wait(boost::bind(&Historian::tick, this, _1));
 }
 
@@ -3,27 +3,30 @@
 
 #include <libhexanode/common.hpp>
 #include <libhexabus/socket.hpp>
-#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/asio.hpp>
 #include <map>
 
 namespace hexanode {
-  typedef std::map<std::string, uint32_t> devices_t;
+  /**
+   * Keeps the current consumption and production of device endpoints and
+   * periodically sends the power balance of all of them.
+   *
+   * Updates move running totals by the change they make, so neither an
+   * update nor a balance depends on the number of endpoints. Endpoints are
+   * spread over shards with a lock each, the totals are updated and read
+   * atomically without any lock.
+   */
   class Historian {
     public:
       typedef boost::shared_ptr<Historian> Ptr;
       Historian(
+          boost::asio::io_service& io,
           hexabus::Socket* send_socket,
-          uint32_t update_seconds) 
-        : _power_consumptions()
-        , _power_productions()
-        , _t()
-        , _terminate_loop(false)
-        , _update_seconds(update_seconds)
-        , _send_socket(send_socket)
-        {};
-      virtual ~Historian() {}; 
+          boost::posix_time::time_duration update_interval);
+      virtual ~Historian() {};
       void send_power_balance();
+      int64_t power_balance() const;
       void add_production(
           const boost::asio::ip::udp::endpoint& endpoint,
           const uint32_t& eid,
@@ -35,23 +38,40 @@ namespace hexanode {
       void remove_device(
           const boost::asio::ip::udp::endpoint& endpoint,
           const uint32_t& eid);
+      // sends the balance every update_interval from the io_service
       void run();
       void shutdown();
 
     private:
       Historian (const Historian& original);
       Historian& operator= (const Historian& rhs);
-      void loop();
-      const std::string endpoint_eid2device(
+
+      typedef std::pair<boost::asio::ip::address_v6, uint32_t> device_t;
+      struct power_t {
+        uint32_t consumption;
+        uint32_t production;
+      };
+      typedef std::map<device_t, power_t> devices_t;
+      struct shard {
+        boost::mutex guard;
+        devices_t devices;
+      };
+      enum { SHARDS = 16 };
+
+      shard& shard_for(const device_t& device);
+      void set_power(
           const boost::asio::ip::udp::endpoint& endpoint,
-          const uint32_t& eid);
+          const uint32_t& eid,
+          uint32_t power_t::* field,
+          int64_t& total,
+          uint32_t value);
+      void tick(const boost::system::error_code& err);
 
-      boost::mutex _guard;
-      devices_t _power_consumptions;
-      devices_t _power_productions;
-      boost::thread _t;
-      bool _terminate_loop;
-      uint32_t _update_seconds;
+      shard _shards[SHARDS];
+      int64_t _total_consumption;
+      int64_t _total_production;
+      boost::asio::deadline_timer _timer;
+      boost::posix_time::time_duration _update_interval;
       hexabus::Socket* _send_socket;
 
   };
@@ -0,0 +1,270 @@
+#include "http_connection.hpp"
+#include <libhexanode/error.hpp>
+#include <boost/bind.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/next_prior.hpp>
+#include <sstream>
+#include <cstdlib>
+#include <poll.h>
+
+using namespace hexanode;
+
+HttpConnection::HttpConnection(const std::string& host, const std::string& port,
+		boost::posix_time::time_duration timeout)
+	: _host(host), _port(port), _timeout(timeout), _socket(_io), _done(false), _sent(0)
+{
+}
+
+void HttpConnection::completed(const boost::system::error_code& err)
+{
+	_result = err;
+	_done = true;
+}
+
+void HttpConnection::written(const boost::system::error_code& err, size_t bytes)
+{
+	_sent += bytes;
+	completed(err);
+}
+
+void HttpConnection::timed_out(const boost::system::error_code& err)
+{
+	// the timer may expire after the operation completed, but before it was cancelled
+	if (!err && !_done) {
+		boost::system::error_code ignored;
+		_socket.close(ignored);
+	}
+}
+
+/*
+ * Runs the asynchronous operation started last until it completes or the
+ * timeout expires, which closes the socket and aborts the operation.
+ */
+void HttpConnection::wait()
+{
+	boost::asio::deadline_timer timer(_io, _timeout);
+	timer.async_wait(boost::bind(&HttpConnection::timed_out, this, boost::asio::placeholders::error));
+
+	_io.reset();
+	while (!_done)
+		_io.run_one();
+
+	timer.cancel();
+	_io.run();
+	_done = false;
+
+	if (_result) {
+		std::string reason = _result == boost::asio::error::operation_aborted
+			? "timed out"
+			: _result.message();
+		throw CommunicationException("HTTP connection to " + _host + ":" + _port + " failed: " + reason);
+	}
+}
+
+void HttpConnection::connect()
+{
+	using boost::asio::ip::tcp;
+
+	tcp::resolver resolver(_io);
+	boost::system::error_code err;
+	tcp::resolver::iterator it = resolver.resolve(tcp::resolver::query(_host, _port), err), end;
+	if (err)
+		throw CommunicationException("Could not resolve " + _host + ": " + err.message());
+
+	for (; it != end; ++it) {
+		_socket.close();
+		_socket.async_connect(*it, boost::bind(&HttpConnection::completed, this, boost::asio::placeholders::error));
+
+		try {
+			wait();
+		} catch (const CommunicationException&) {
+			if (boost::next(it) == end)
+				throw;
+			continue;
+		}
+
+		_socket.set_option(tcp::no_delay(true));
+		_buffer.consume(_buffer.size());
+		return;
+	}
+
+	throw CommunicationException("Could not resolve " + _host);
+}
+
+void HttpConnection::disconnect()
+{
+	boost::system::error_code err;
+
+	_socket.close(err);
+	_buffer.consume(_buffer.size());
+}
+
+/*
+ * An idle connection has nothing to read until a request is sent on it.
+ * If it becomes readable, the server has closed it (or sent an error like
+ * 408 before closing it).
+ */
+bool HttpConnection::closed_by_peer()
+{
+	struct pollfd pfd = { _socket.native_handle(), POLLIN, 0 };
+
+	return ::poll(&pfd, 1, 0) != 0;
+}
+
+void HttpConnection::write(const std::string& data)
+{
+	boost::asio::async_write(_socket, boost::asio::buffer(data),
+			boost::bind(&HttpConnection::written, this,
+				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+	wait();
+}
+
+std::string HttpConnection::read_line()
+{
+	boost::asio::async_read_until(_socket, _buffer, "\r\n",
+			boost::bind(&HttpConnection::completed, this, boost::asio::placeholders::error));
+	wait();
+
+	std::string line;
+	std::istream in(&_buffer);
+	std::getline(in, line);
+	if (!line.empty() && line[line.size() - 1] == '\r')
+		line.erase(line.size() - 1);
+
+	return line;
+}
+
+std::string HttpConnection::read_exactly(size_t size)
+{
+	if (_buffer.size() < size) {
+		boost::asio::async_read(_socket, _buffer, boost::asio::transfer_at_least(size - _buffer.size()),
+				boost::bind(&HttpConnection::completed, this, boost::asio::placeholders::error));
+		wait();
+	}
+
+	std::string data(boost::asio::buffers_begin(_buffer.data()), boost::asio::buffers_begin(_buffer.data()) + size);
+	_buffer.consume(size);
+
+	return data;
+}
+
+std::string HttpConnection::read_to_end()
+{
+	boost::asio::async_read(_socket, _buffer, boost::asio::transfer_all(),
+			boost::bind(&HttpConnection::completed, this, boost::asio::placeholders::error));
+
+	try {
+		wait();
+	} catch (const CommunicationException&) {
+		if (_result != boost::asio::error::eof)
+			throw;
+	}
+
+	return read_exactly(_buffer.size());
+}
+
+HttpConnection::Response HttpConnection::exchange(const std::string& request, bool& keep_alive)
+{
+	write(request);
+
+	Response response;
+	bool chunked, has_length;
+	size_t length;
+
+	// interim responses like 100 Continue have no body and precede the final one
+	do {
+		std::string version;
+		std::istringstream status_line(read_line());
+		if (!(status_line >> version >> response.status) || version.compare(0, 5, "HTTP/"))
+			throw CommunicationException("Invalid HTTP response from " + _host);
+		if (response.status == 101)
+			throw CommunicationException("Unexpected protocol switch by " + _host);
+
+		keep_alive = version != "HTTP/1.0";
+		chunked = false;
+		has_length = false;
+		length = 0;
+
+		for (std::string header = read_line(); !header.empty(); header = read_line()) {
+			size_t colon = header.find(':');
+			if (colon == std::string::npos)
+				continue;
+
+			std::string name = boost::algorithm::to_lower_copy(header.substr(0, colon));
+			std::string value = boost::algorithm::trim_copy(header.substr(colon + 1));
+
+			if (name == "content-length") {
+				has_length = true;
+				length = strtoul(value.c_str(), 0, 10);
+			} else if (name == "transfer-encoding") {
+				chunked = boost::algorithm::iequals(value, "chunked");
+			} else if (name == "connection") {
+				keep_alive = boost::algorithm::iequals(value, "keep-alive")
+					|| (keep_alive && !boost::algorithm::iequals(value, "close"));
+			}
+		}
+	} while (response.status / 100 == 1);
+
+	if (response.status == 204 || response.status == 304) {
+		// no body
+	} else if (chunked) {
+		for (;;) {
+			size_t size = strtoul(read_line().c_str(), 0, 16);
+			if (!size)
+				break;
+
+			response.body += read_exactly(size);
+			read_line();
+		}
+		// trailers
+		while (!read_line().empty())
+			;
+	} else if (has_length) {
+		response.body = read_exactly(length);
+	} else {
+		response.body = read_to_end();
+		keep_alive = false;
+	}
+
+	return response;
+}
+
+HttpConnection::Response HttpConnection::request(const std::string& method, const std::string& path,
+		const std::string& content_type, const std::string& body)
+{
+	std::ostringstream request;
+	request << method << " " << path << " HTTP/1.1\r\n"
+		<< "Host: " << _host << (_port != "80" ? ":" + _port : "") << "\r\n"
+		<< "Content-Type: " << content_type << "\r\n"
+		<< "Content-Length: " << body.size() << "\r\n"
+		<< "Connection: keep-alive\r\n"
+		<< "\r\n"
+		<< body;
+
+	if (_socket.is_open() && closed_by_peer())
+		disconnect();
+
+	bool reused = _socket.is_open();
+	for (;;) {
+		if (!_socket.is_open())
+			connect();
+
+		try {
+			bool keep_alive;
+
+			_sent = 0;
+			Response response = exchange(request.str(), keep_alive);
+			if (!keep_alive)
+				disconnect();
+
+			return response;
+		} catch (const CommunicationException&) {
+			disconnect();
+			// the server may have received the request and acted on it, so it
+			// is only sent again if the old connection took none of it
+			if (!reused || _sent)
+				throw;
+			reused = false;
+		}
+	}
+}
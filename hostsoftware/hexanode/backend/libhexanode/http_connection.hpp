@@ -0,0 +1,70 @@
+#ifndef LIBHEXANODE_HTTP_CONNECTION_HPP
+#define LIBHEXANODE_HTTP_CONNECTION_HPP 1
+
+#include <libhexanode/common.hpp>
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace hexanode {
+
+	/**
+	 * Blocking HTTP/1.1 client that keeps its connection open between
+	 * requests. A connection the server closed while it was idle is replaced
+	 * before the request is sent. Requests may not be idempotent, so one that
+	 * fails after any of it was written is not sent again. Interim responses
+	 * (1xx) are skipped.
+	 *
+	 * Errors are reported as CommunicationException, a connection must only
+	 * be used by one thread at a time.
+	 */
+	class HttpConnection : private boost::noncopyable {
+		public:
+			struct Response {
+				unsigned status;
+				std::string body;
+			};
+
+			HttpConnection(const std::string& host, const std::string& port,
+					boost::posix_time::time_duration timeout = boost::posix_time::seconds(30));
+
+			Response request(const std::string& method, const std::string& path,
+					const std::string& content_type, const std::string& body);
+
+			const std::string& host() const { return _host; }
+			const std::string& port() const { return _port; }
+
+		private:
+			std::string _host;
+			std::string _port;
+			boost::posix_time::time_duration _timeout;
+
+			boost::asio::io_service _io;
+			boost::asio::ip::tcp::socket _socket;
+			boost::asio::streambuf _buffer;
+
+			// result of the operation run by wait()
+			bool _done;
+			boost::system::error_code _result;
+			// bytes of the current request written to the socket
+			size_t _sent;
+
+			void connect();
+			void disconnect();
+			bool closed_by_peer();
+			Response exchange(const std::string& request, bool& keep_alive);
+
+			void wait();
+			void completed(const boost::system::error_code& err);
+			void written(const boost::system::error_code& err, size_t bytes);
+			void timed_out(const boost::system::error_code& err);
+
+			void write(const std::string& data);
+			std::string read_line();
+			std::string read_exactly(size_t size);
+			std::string read_to_end();
+	};
+
+}
+
+#endif /* LIBHEXANODE_HTTP_CONNECTION_HPP */
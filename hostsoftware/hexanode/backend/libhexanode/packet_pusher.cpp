@@ -14,6 +14,7 @@ void PacketPusher::deviceInfoReceived(const boost::asio::ip::address_v6& device,
 
 	typedef std::map<uint32_t, std::string>::const_iterator iter;
 	std::map<uint32_t, std::string> eids = _unidentified_devices[device];
+	hexabus::EndpointRegistry registry = _ep_registry.snapshot();
 
 	for (iter it = eids.begin(), end = eids.end(); it != end; ++it) {
 		std::string sensor_id = sensorID(device, it->first);
@@ -31,8 +32,8 @@ void PacketPusher::deviceInfoReceived(const boost::asio::ip::address_v6& device,
 			case EP_HUMIDITY: min_value = 0; max_value = 100; break;
 			case EP_PRESSURE: min_value = 900; max_value = 1050; break;
 		}
-		hexabus::EndpointRegistry::const_iterator ep_it = _ep_registry.find(it->first);
-		const hexabus::EndpointDescriptor& desc = ep_it != _ep_registry.end()
+		hexabus::EndpointRegistry::const_iterator ep_it = registry.find(it->first);
+		const hexabus::EndpointDescriptor& desc = ep_it != registry.end()
 			? ep_it->second
 			: hexabus::EndpointDescriptor(it->first, "", boost::none, hexabus::HXB_DTYPE_FLOAT, hexabus::EndpointDescriptor::read, hexabus::EndpointDescriptor::sensor);
 		hexanode::Sensor new_sensor(device,
@@ -41,11 +42,7 @@ void PacketPusher::deviceInfoReceived(const boost::asio::ip::address_v6& device,
 				min_value, max_value,
 				desc.type());
 		_sensors.insert(std::make_pair(sensor_id, new_sensor));
-		try {
-			new_sensor.put(_client, _api_uri, it->second); 
-		} catch (const std::exception& e) {
-			target << "Error defining sensor " << device << "(" << it->first << "): " << e.what() << std::endl;
-		}
+		_pipeline.define(new_sensor, it->second);
 	}
 
 	_unidentified_devices.erase(device);
@@ -96,7 +93,7 @@ void PacketPusher::defineSensor(const std::string& sensor_id, uint32_t eid, cons
 						hexabus::HXB_DTYPE_FLOAT
 						);
 				_sensors.insert(std::make_pair(sensor_id, new_sensor));
-				new_sensor.put(_client, _api_uri, value);
+				_pipeline.define(new_sensor, value);
 			}
 			break;
 
@@ -116,23 +113,30 @@ void PacketPusher::defineSensor(const std::string& sensor_id, uint32_t eid, cons
 	}
 }
 
+void PacketPusher::forgetMissingSensors()
+{
+	// the frontend does not know these (anymore), define them again with
+	// their next value
+	std::vector<PushPipeline::sensor_key_t> missing = _pipeline.take_missing();
+	for (std::vector<PushPipeline::sensor_key_t>::const_iterator it = missing.begin(), end = missing.end(); it != end; ++it) {
+		if (_sensors.erase(sensorID(it->first, it->second)))
+			target << "Removed sensor " << sensorID(it->first, it->second) << " from cache" << std::endl;
+	}
+}
+
 void PacketPusher::push_value(uint32_t eid, const std::string& value)
 {
+	forgetMissingSensors();
+
   std::string sensor_id = sensorID(_endpoint.address().to_v6(), eid);
 	try {
 		std::map<std::string, hexanode::Sensor>::iterator sensor = _sensors.find(sensor_id);
 		if (sensor != _sensors.end()) {
-			sensor->second.post_value(_client, _api_uri, value);
+			_pipeline.push(_endpoint.address().to_v6(), eid, value);
 		} else {
 			target << "Sensor " << sensor_id << " not found, defining" << std::endl;
 			defineSensor(sensor_id, eid, value);
 		}
-	} catch (const hexanode::CommunicationException& e) {
-		// An error occured during network communication.
-		// remove local copy of the sensor and redefine
-		_sensors.erase(sensor_id);
-		defineSensor(sensor_id, eid, value);
-		target << "Removed sensor " << sensor_id << " from cache" << std::endl;
 	} catch (const std::exception& e) {
 		target << "Attempting to recover from error: " << e.what() << std::endl;
 	}
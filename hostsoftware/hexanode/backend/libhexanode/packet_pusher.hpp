@@ -4,12 +4,12 @@
 #include <libhexanode/common.hpp>
 #include <libhexanode/error.hpp>
 #include <libhexanode/sensor.hpp>
+#include <libhexanode/push_pipeline.hpp>
 #include <libhexabus/packet.hpp>
 #include <libhexabus/socket.hpp>
 #include <libhexabus/device_interrogator.hpp>
 #include <libhexabus/endpoint_registry.hpp>
-#include <boost/network/protocol/http/client.hpp>
-#include <boost/network/uri.hpp>
+#include <libhexabus/registry_watcher.hpp>
 #include <sstream>
 #include <map>
 #include <set>
@@ -19,12 +19,11 @@ namespace hexanode {
   class PacketPusher : public hexabus::PacketVisitor {
     public:
       PacketPusher(hexabus::Socket& socket,
-          boost::network::http::client client,
-          const boost::network::uri::uri& api_uri,
+          PushPipeline& pipeline,
           std::ostream& target)
         : _info(socket)
-        , _client(client)
-        , _api_uri(api_uri)
+        , _ep_watcher(socket.ioService(), _ep_registry)
+        , _pipeline(pipeline)
         , target(target) {}
       virtual ~PacketPusher() {}
 
@@ -37,10 +36,10 @@ namespace hexanode {
     private:
 			hexabus::DeviceInterrogator _info;
 			hexabus::EndpointRegistry _ep_registry;
+			hexabus::RegistryWatcher _ep_watcher;
       boost::asio::ip::udp::endpoint _endpoint;
 			std::map<std::string, hexanode::Sensor> _sensors;
-      boost::network::http::client _client;
-      boost::network::uri::uri _api_uri;
+      PushPipeline& _pipeline;
       std::ostream& target;
 			std::map<boost::asio::ip::address_v6, std::map<uint32_t, std::string> > _unidentified_devices;
 
@@ -55,6 +54,7 @@ namespace hexanode {
 			}
 
 			void defineSensor(const std::string& sensor_id, uint32_t eid, const std::string& value);
+			void forgetMissingSensors();
 
       void push_value(uint32_t eid, const std::string& value);
 
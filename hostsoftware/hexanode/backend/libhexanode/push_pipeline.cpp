@@ -0,0 +1,337 @@
+#include "push_pipeline.hpp"
+#include <libhexanode/error.hpp>
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace rapidjson;
+
+using namespace hexanode;
+
+PushPipeline::PushPipeline(const std::string& api_uri,
+		size_t connections,
+		size_t queue_size,
+		size_t batch_size,
+		boost::posix_time::time_duration min_interval,
+		std::ostream& target)
+	: _port("80"), _batch_size(std::max<size_t>(batch_size, 1)), _min_interval(min_interval), _target(target)
+{
+	std::string rest(api_uri);
+	if (rest.compare(0, 7, "http://") == 0) {
+		rest.erase(0, 7);
+	} else if (rest.find("://") != std::string::npos) {
+		throw GenericException("Only http URIs are supported: " + api_uri);
+	}
+
+	size_t slash = rest.find('/');
+	std::string authority = rest.substr(0, slash);
+	if (slash != std::string::npos)
+		_path = rest.substr(slash);
+	while (!_path.empty() && _path[_path.size() - 1] == '/')
+		_path.erase(_path.size() - 1);
+
+	size_t port_sep = authority.rfind(':');
+	if (!authority.empty() && authority[0] == '[') {
+		size_t close = authority.find(']');
+		if (close == std::string::npos)
+			throw GenericException("Invalid URI: " + api_uri);
+		_host = authority.substr(1, close - 1);
+		if (close + 1 < authority.size() && authority[close + 1] == ':')
+			_port = authority.substr(close + 2);
+	} else if (port_sep != std::string::npos) {
+		_host = authority.substr(0, port_sep);
+		_port = authority.substr(port_sep + 1);
+	} else {
+		_host = authority;
+	}
+
+	connections = std::max<size_t>(connections, 1);
+	_queue_size = std::max<size_t>(queue_size / connections, 1);
+
+	_stats.queued = _stats.coalesced = _stats.sent = _stats.failed = _stats.dropped = _stats.requests = 0;
+
+	for (size_t i = 0; i < connections; i++) {
+		worker* w = new worker;
+		_workers.push_back(w);
+		w->thread = boost::thread(boost::bind(&PushPipeline::run, this, boost::ref(*w)));
+	}
+}
+
+PushPipeline::~PushPipeline()
+{
+	for (std::vector<worker*>::iterator it = _workers.begin(), end = _workers.end(); it != end; ++it) {
+		boost::mutex::scoped_lock lock((*it)->mutex);
+		(*it)->stopping = true;
+		(*it)->wakeup.notify_one();
+	}
+
+	for (std::vector<worker*>::iterator it = _workers.begin(), end = _workers.end(); it != end; ++it) {
+		(*it)->thread.join();
+		delete *it;
+	}
+}
+
+PushPipeline::worker& PushPipeline::worker_for(const boost::asio::ip::address_v6& address, uint32_t eid)
+{
+	boost::asio::ip::address_v6::bytes_type bytes = address.to_bytes();
+	size_t hash = boost::hash_range(bytes.begin(), bytes.end());
+	boost::hash_combine(hash, eid);
+
+	return *_workers[hash % _workers.size()];
+}
+
+void PushPipeline::define(const Sensor& sensor, const std::string& value)
+{
+	job j = { sensor.address(), sensor.eid(), true, sensor.definition(value) };
+	worker& w = worker_for(j.address, j.eid);
+
+	boost::mutex::scoped_lock lock(w.mutex);
+	w.definitions.push_back(j);
+	w.wakeup.notify_one();
+}
+
+bool PushPipeline::push(const boost::asio::ip::address_v6& address, uint32_t eid, const std::string& value)
+{
+	worker& w = worker_for(address, eid);
+	sensor_key_t key(address, eid);
+	bool coalesced;
+
+	{
+		boost::mutex::scoped_lock lock(w.mutex);
+		slot& s = w.slots[key];
+
+		coalesced = s.pending;
+		if (!s.pending) {
+			if (w.pending.size() >= _queue_size) {
+				lock.unlock();
+
+				boost::mutex::scoped_lock stats_lock(_mutex);
+				_stats.dropped++;
+				return false;
+			}
+
+			s.pending = true;
+			w.pending.push_back(key);
+			w.wakeup.notify_one();
+		}
+		s.value = value;
+	}
+
+	boost::mutex::scoped_lock lock(_mutex);
+	_stats.queued++;
+	if (coalesced)
+		_stats.coalesced++;
+	return true;
+}
+
+std::vector<PushPipeline::sensor_key_t> PushPipeline::take_missing()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	std::vector<sensor_key_t> result;
+
+	result.swap(_missing);
+	return result;
+}
+
+PushPipeline::Statistics PushPipeline::statistics()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	return _stats;
+}
+
+std::string PushPipeline::sensor_path(const boost::asio::ip::address_v6& address, uint32_t eid) const
+{
+	return _path + "/sensor/" + address.to_string() + "/" + boost::lexical_cast<std::string>(eid);
+}
+
+void PushPipeline::report(const std::string& what, size_t values, const std::exception& e)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	_stats.failed += values;
+	_target << "Failed to " << what << ": " << e.what() << std::endl;
+}
+
+/*
+ * Takes up to batch_size values whose sensors may be pushed again, or all
+ * of them when stopping. Returns when the next of the remaining values may
+ * be pushed.
+ */
+boost::system_time PushPipeline::take_values(worker& w, std::vector<job>& values)
+{
+	boost::system_time now = boost::get_system_time();
+	boost::system_time next_push(boost::posix_time::pos_infin);
+
+	for (size_t i = 0, count = w.pending.size(); i < count; i++) {
+		sensor_key_t key = w.pending.front();
+		slot& s = w.slots[key];
+		w.pending.pop_front();
+
+		if (values.size() < _batch_size && (w.stopping || s.next_push <= now)) {
+			job j = { key.first, key.second, false, s.value };
+			values.push_back(j);
+			s.pending = false;
+			s.next_push = now + _min_interval;
+		} else {
+			w.pending.push_back(key);
+			next_push = std::min(next_push, s.next_push);
+		}
+	}
+
+	return next_push;
+}
+
+void PushPipeline::run(worker& w)
+{
+	HttpConnection connection(_host, _port);
+	std::vector<job> definitions, values;
+
+	for (;;) {
+		{
+			boost::mutex::scoped_lock lock(w.mutex);
+
+			for (;;) {
+				boost::system_time next_push = take_values(w, values);
+				if (!w.definitions.empty() || !values.empty() || (w.stopping && w.pending.empty()))
+					break;
+
+				if (next_push.is_pos_infinity())
+					w.wakeup.wait(lock);
+				else
+					w.wakeup.timed_wait(lock, next_push);
+			}
+
+			if (w.definitions.empty() && values.empty())
+				break;
+
+			definitions.assign(w.definitions.begin(), w.definitions.end());
+			w.definitions.clear();
+		}
+
+		for (std::vector<job>::const_iterator it = definitions.begin(), end = definitions.end(); it != end; ++it)
+			send_definition(connection, *it);
+
+		if (_batch_size == 1) {
+			for (std::vector<job>::const_iterator it = values.begin(), end = values.end(); it != end; ++it)
+				send_value(connection, *it);
+		} else if (!values.empty()) {
+			send_values(connection, values);
+		}
+
+		definitions.clear();
+		values.clear();
+	}
+}
+
+static void check_status(const HttpConnection::Response& response)
+{
+	if (response.status != 200) {
+		std::ostringstream oss;
+		oss << response.status << ": " << response.body;
+		throw CommunicationException(oss.str());
+	}
+}
+
+void PushPipeline::send_definition(HttpConnection& connection, const job& j)
+{
+	try {
+		check_status(connection.request("PUT", sensor_path(j.address, j.eid), "application/json", j.body));
+
+		boost::mutex::scoped_lock lock(_mutex);
+		_stats.requests++;
+	} catch (const std::exception& e) {
+		report("define sensor " + j.address.to_string() + "(" + boost::lexical_cast<std::string>(j.eid) + ")", 0, e);
+	}
+}
+
+void PushPipeline::send_value(HttpConnection& connection, const job& j)
+{
+	StringBuffer b;
+	Writer<StringBuffer> writer(b);
+	writer.StartObject();
+	writer.String("value");
+	writer.String(j.body.c_str(), j.body.size());
+	writer.EndObject();
+
+	try {
+		HttpConnection::Response response = connection.request("POST", sensor_path(j.address, j.eid),
+				"application/json", b.GetString());
+
+		boost::mutex::scoped_lock lock(_mutex);
+		_stats.requests++;
+		if (response.status == 404) {
+			_missing.push_back(sensor_key_t(j.address, j.eid));
+			_stats.failed++;
+			return;
+		}
+		lock.unlock();
+
+		check_status(response);
+
+		lock.lock();
+		_stats.sent++;
+	} catch (const std::exception& e) {
+		report("push value to " + j.address.to_string() + "(" + boost::lexical_cast<std::string>(j.eid) + ")", 1, e);
+	}
+}
+
+void PushPipeline::send_values(HttpConnection& connection, const std::vector<job>& values)
+{
+	StringBuffer b;
+	Writer<StringBuffer> writer(b);
+	writer.StartObject();
+	writer.String("values");
+	writer.StartArray();
+	for (std::vector<job>::const_iterator it = values.begin(), end = values.end(); it != end; ++it) {
+		std::string ip = it->address.to_string();
+
+		writer.StartObject();
+		writer.String("ip");
+		writer.String(ip.c_str(), ip.size());
+		writer.String("eid");
+		writer.Uint(it->eid);
+		writer.String("value");
+		writer.String(it->body.c_str(), it->body.size());
+		writer.EndObject();
+	}
+	writer.EndArray();
+	writer.EndObject();
+
+	try {
+		HttpConnection::Response response = connection.request("POST", _path + "/sensor/values",
+				"application/json", b.GetString());
+		check_status(response);
+
+		// values of sensors the frontend does not know are reported back
+		std::vector<sensor_key_t> missing;
+		Document reply;
+		reply.Parse<0>(response.body.c_str());
+		if (!reply.HasParseError() && reply.IsObject() && reply.HasMember("missing") && reply["missing"].IsArray()) {
+			const Value& list = reply["missing"];
+			for (SizeType i = 0; i < list.Size(); i++) {
+				const Value& item = list[i];
+				if (!item.IsObject() || !item.HasMember("ip") || !item["ip"].IsString()
+						|| !item.HasMember("eid") || !item["eid"].IsUint())
+					continue;
+
+				boost::system::error_code err;
+				boost::asio::ip::address_v6 address = boost::asio::ip::address_v6::from_string(item["ip"].GetString(), err);
+				if (!err)
+					missing.push_back(sensor_key_t(address, item["eid"].GetUint()));
+			}
+		}
+
+		boost::mutex::scoped_lock lock(_mutex);
+		_stats.requests++;
+		_stats.sent += values.size() - std::min(values.size(), missing.size());
+		_stats.failed += std::min(values.size(), missing.size());
+		_missing.insert(_missing.end(), missing.begin(), missing.end());
+	} catch (const std::exception& e) {
+		report("push " + boost::lexical_cast<std::string>(values.size()) + " values", values.size(), e);
+	}
+}
@@ -0,0 +1,129 @@
+#ifndef LIBHEXANODE_PUSH_PIPELINE_HPP
+#define LIBHEXANODE_PUSH_PIPELINE_HPP 1
+
+#include <libhexanode/common.hpp>
+#include <libhexanode/sensor.hpp>
+#include <libhexanode/http_connection.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <ostream>
+
+namespace hexanode {
+
+	/**
+	 * Pushes sensor definitions and values to the frontend API from worker
+	 * threads, so that packet reception never waits for HTTP round trips.
+	 *
+	 * Each worker owns one keep-alive connection. Sensors are assigned to
+	 * workers by address and EID, so the values of a sensor never arrive
+	 * before its definition. A worker sends all definitions it has queued,
+	 * then up to batch_size values in a single request to /sensor/values.
+	 * With a batch_size of 1 every value is posted to /sensor/<ip>/<eid> on
+	 * its own, for frontends without batch support.
+	 *
+	 * Only the latest value of a sensor is kept: a value pushed while the
+	 * previous one is still waiting replaces it. Values of a sensor are sent
+	 * at most once per min_interval, so the load on the frontend depends on
+	 * the number of sensors, not on how often they report. Values of new
+	 * sensors are dropped while queue_size sensors are waiting.
+	 *
+	 * Sensors the frontend reports as unknown are collected and can be picked
+	 * up with take_missing() to define them again.
+	 */
+	class PushPipeline : private boost::noncopyable {
+		public:
+			typedef std::pair<boost::asio::ip::address_v6, uint32_t> sensor_key_t;
+
+			struct Statistics {
+				uint64_t queued;
+				uint64_t coalesced;
+				uint64_t sent;
+				uint64_t failed;
+				uint64_t dropped;
+				uint64_t requests;
+			};
+
+			/**
+			 * api_uri is the base URI of the frontend API, e.g.
+			 * http://localhost:3000/api
+			 */
+			PushPipeline(const std::string& api_uri,
+					size_t connections,
+					size_t queue_size,
+					size_t batch_size,
+					boost::posix_time::time_duration min_interval,
+					std::ostream& target);
+			// sends everything queued so far, then stops the workers
+			~PushPipeline();
+
+			void define(const Sensor& sensor, const std::string& value);
+			bool push(const boost::asio::ip::address_v6& address, uint32_t eid, const std::string& value);
+
+			std::vector<sensor_key_t> take_missing();
+
+			Statistics statistics();
+
+		private:
+			struct job {
+				boost::asio::ip::address_v6 address;
+				uint32_t eid;
+				// sensor definition if set, value otherwise
+				bool definition;
+				std::string body;
+			};
+
+			struct slot {
+				std::string value;
+				bool pending;
+				boost::system_time next_push;
+
+				slot() : pending(false), next_push(boost::posix_time::neg_infin) {}
+			};
+
+			struct worker {
+				boost::mutex mutex;
+				boost::condition_variable wakeup;
+				std::deque<job> definitions;
+				std::map<sensor_key_t, slot> slots;
+				// sensors with a value waiting, oldest first
+				std::deque<sensor_key_t> pending;
+				bool stopping;
+				boost::thread thread;
+
+				worker() : stopping(false) {}
+			};
+
+			std::string _host;
+			std::string _port;
+			std::string _path;
+			size_t _queue_size;
+			size_t _batch_size;
+			boost::posix_time::time_duration _min_interval;
+			std::ostream& _target;
+			std::vector<worker*> _workers;
+
+			// protects all fields below
+			boost::mutex _mutex;
+			std::vector<sensor_key_t> _missing;
+			Statistics _stats;
+
+			worker& worker_for(const boost::asio::ip::address_v6& address, uint32_t eid);
+
+			void run(worker& w);
+			boost::system_time take_values(worker& w, std::vector<job>& values);
+			void send_definition(HttpConnection& connection, const job& j);
+			void send_values(HttpConnection& connection, const std::vector<job>& values);
+			void send_value(HttpConnection& connection, const job& j);
+
+			std::string sensor_path(const boost::asio::ip::address_v6& address, uint32_t eid) const;
+			void report(const std::string& what, size_t values, const std::exception& e);
+	};
+
+}
+
+#endif /* LIBHEXANODE_PUSH_PIPELINE_HPP */
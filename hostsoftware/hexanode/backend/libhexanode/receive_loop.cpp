@@ -0,0 +1,43 @@
+#include "receive_loop.hpp"
+#include <boost/bind.hpp>
+#include <iostream>
+
+using namespace hexanode;
+
+static void receive_failed(boost::asio::io_service& io, const hexabus::GenericException& e)
+{
+  const hexabus::NetworkException* nerror;
+  if ((nerror = dynamic_cast<const hexabus::NetworkException*>(&e))) {
+    std::cerr << "Error receiving packet: " << nerror->code().message() << std::endl;
+  } else {
+    std::cerr << "Error receiving packet: " << e.what() << std::endl;
+  }
+  io.stop();
+}
+
+static void stop_on_signal(boost::asio::io_service& io, bool& terminated)
+{
+  terminated = true;
+  io.stop();
+}
+
+void hexanode::run_receive_loop(
+    boost::asio::io_service& io,
+    hexabus::SocketBase& socket,
+    const boost::function<hexabus::connection ()>& subscribe)
+{
+  bool terminated = false;
+  boost::asio::signal_set terminate_handler(io, SIGTERM, SIGINT);
+  terminate_handler.async_wait(boost::bind(stop_on_signal, boost::ref(io), boost::ref(terminated)));
+
+  hexabus::scoped_connection error_handler(
+      socket.onAsyncError(boost::bind(receive_failed, boost::ref(io), _1)));
+
+  while (!terminated) {
+    // subscribing starts receiving again after an error stopped it
+    hexabus::scoped_connection receiver(subscribe());
+
+    io.reset();
+    io.run();
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef LIBHEXANODE_RECEIVE_LOOP_HPP
+#define LIBHEXANODE_RECEIVE_LOOP_HPP 1
+
+#include <libhexanode/common.hpp>
+#include <libhexabus/socket.hpp>
+#include <boost/function.hpp>
+
+namespace hexanode {
+  /**
+   * Runs io until SIGTERM or SIGINT is received. Receive errors of socket
+   * are printed and stop io, after which subscribe is called again to
+   * connect the packet callbacks and start receiving anew.
+   */
+  void run_receive_loop(
+      boost::asio::io_service& io,
+      hexabus::SocketBase& socket,
+      const boost::function<hexabus::connection ()>& subscribe);
+};
+
+#endif /* LIBHEXANODE_RECEIVE_LOOP_HPP */
@@ -1,25 +1,23 @@
 #include "sensor.hpp"
-#include <boost/network/uri/uri_io.hpp>
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
-#include <rapidjson/prettywriter.h>
+#include <rapidjson/writer.h>
 #include <libhexanode/error.hpp>
 
-using namespace boost::network;
 using namespace rapidjson;
 
 using namespace hexanode;
 
 namespace {
 
-void jstring(PrettyWriter<StringBuffer>& target, const char* key, const std::string& value)
+void jstring(Writer<StringBuffer>& target, const char* key, const std::string& value)
 {
 	target.String(key);
 	target.String(value.c_str(), value.size());
 }
 
-void jint(PrettyWriter<StringBuffer>& target, const char* key, int value)
+void jint(Writer<StringBuffer>& target, const char* key, int value)
 {
 	target.String(key);
 	target.Int(value);
@@ -27,14 +25,10 @@ void jint(PrettyWriter<StringBuffer>& target, const char* key, int value)
 
 }
 
-void Sensor::put(
-    http::client client,
-    const uri::uri& api_uri, 
-    const std::string& reading)
+std::string Sensor::definition(const std::string& reading) const
 {
-  std::cout << "Creating sensor " << _sensor_name << std::endl;
-    StringBuffer b;
-  PrettyWriter<StringBuffer> writer(b);
+  StringBuffer b;
+  Writer<StringBuffer> writer(b);
   writer.StartObject();
 	jstring(writer, "name", _sensor_name);
 	jstring(writer, "unit", _ep_info.unit().get_value_or(""));
@@ -60,63 +54,6 @@ void Sensor::put(
 	jint(writer, "maxvalue", _max_value);
 	jint(writer, "type", _type);
   writer.EndObject();
-  std::string json_body(b.GetString());
-
-  uri::uri create;
-  create << api_uri 
-    << uri::path("/sensor/") 
-		<< uri::path(uri::encoded(_sensor_ip.to_string()))
-		<< uri::path("/")
-		<< uri::path(uri::encoded(boost::lexical_cast<std::string>(_ep_info.eid())));
-  http::client::request request(create);
-  request << header("Content-Type", "application/json");
-  std::ostringstream converter;
-  converter << json_body.length();
-  request << header("Content-Length", converter.str());
-  request << body(json_body);
-  http::client::response response = client.put(request);
-  if (response.status() != 200) {
-    std::ostringstream oss;
-    oss << response.status() 
-    << " " << response.status_message() 
-    << ": " << response.body();
-    throw hexanode::CommunicationException(oss.str());
-  }
-
-}
-
-void Sensor::post_value(
-    http::client client,
-    const uri::uri& api_uri, 
-    const std::string& reading)
-{
-  //std::cout << "Pushing value "<< reading 
-  //  << " to sensor " << sensor_id << std::endl;
-  StringBuffer b;
-  PrettyWriter<StringBuffer> writer(b);
-  writer.StartObject();
-	jstring(writer, "value", reading);
-  writer.EndObject();
-  std::string json_body(b.GetString());
 
-  uri::uri create;
-  create << api_uri 
-    << uri::path("/sensor/") 
-		<< uri::path(uri::encoded(_sensor_ip.to_string()))
-		<< uri::path("/")
-		<< uri::path(uri::encoded(boost::lexical_cast<std::string>(_ep_info.eid())));
-  http::client::request request(create);
-  request << header("Content-Type", "application/json");
-  std::ostringstream converter;
-  converter << json_body.length();
-  request << header("Content-Length", converter.str());
-  request << body(json_body);
-  http::client::response response = client.post(request);
-  if (response.status() != 200) {
-    std::ostringstream oss;
-    oss << response.status() 
-    << " " << response.status_message() 
-    << ": " << response.body();
-    throw hexanode::CommunicationException(oss.str());
-  }
+  return b.GetString();
 }
@@ -2,11 +2,8 @@
 #define LIBHEXANODE_SENSOR_HPP 1
 
 #include <libhexanode/common.hpp>
-#include <boost/network/protocol/http/client.hpp>
-#include <boost/network/uri.hpp>
 #include <libhexabus/endpoint_registry.hpp>
-
-using namespace boost::network;
+#include <boost/asio/ip/address_v6.hpp>
 
 namespace hexanode {
   class Sensor {
@@ -27,12 +24,11 @@ namespace hexanode {
       {};
       virtual ~Sensor() {};
 
-      void put( http::client client,
-          const uri::uri& api_uri,
-          const std::string& reading);
-      void post_value(http::client client,
-          const uri::uri& api_uri, 
-          const std::string& reading);
+      const boost::asio::ip::address_v6& address() const { return _sensor_ip; }
+      uint32_t eid() const { return _ep_info.eid(); }
+
+      // JSON body that defines the sensor with its first reading
+      std::string definition(const std::string& reading) const;
 
     private:
 			boost::asio::ip::address_v6 _sensor_ip;
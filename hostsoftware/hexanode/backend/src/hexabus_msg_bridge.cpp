@@ -19,6 +19,8 @@
 #include <libhexabus/packet.hpp>
 #include <libhexabus/socket.hpp>
 #include <libhexabus/endpoint_registry.hpp>
+#include <libhexabus/registry_watcher.hpp>
+#include <libhexabus/reading_spool.hpp>
 
 #include <libhexabus/logger/logger.hpp>
 
@@ -26,6 +28,132 @@
 
 namespace po = boost::program_options;
 
+/*
+ * Uploads spooled readings to mySmartGrid. Readings are only removed from the
+ * spool once the store has accepted them; while the upstream is unreachable,
+ * uploads are retried with exponential backoff. After an outage the spool is
+ * drained one batch after the other without waiting for the upload interval.
+ */
+class SpoolUploader {
+	private:
+		klio::MSGStore::Ptr store;
+		hexabus::ReadingSpool& spool;
+		size_t batch_size;
+		boost::posix_time::time_duration interval;
+		boost::posix_time::time_duration backoff;
+		boost::asio::deadline_timer timer;
+
+		std::map<std::string, klio::Sensor::Ptr> sensors;
+		// created locally, not yet added to the store
+		std::map<std::string, klio::Sensor::Ptr> new_sensors;
+
+		static const boost::posix_time::time_duration MaxBackoff;
+
+		void schedule(boost::posix_time::time_duration delay)
+		{
+			timer.expires_from_now(delay);
+			timer.async_wait(boost::bind(&SpoolUploader::upload, this, _1));
+		}
+
+		void register_sensors()
+		{
+			while (!new_sensors.empty()) {
+				klio::Sensor::Ptr sensor = new_sensors.begin()->second;
+
+				store->add_sensor(sensor);
+				sensors[sensor->external_id()] = sensor;
+				new_sensors.erase(new_sensors.begin());
+				std::cout << "Created new sensor: " << sensor->str() << std::endl;
+			}
+		}
+
+		klio::Sensor::Ptr find_sensor(const std::string& id)
+		{
+			std::map<std::string, klio::Sensor::Ptr>::const_iterator it = sensors.find(id);
+			if (it != sensors.end())
+				return it->second;
+
+			// spooled before the last restart
+			std::vector<klio::Sensor::Ptr> found = store->get_sensors_by_external_id(id);
+			if (found.empty())
+				return klio::Sensor::Ptr();
+
+			sensors[id] = found[0];
+			return found[0];
+		}
+
+		void upload(const boost::system::error_code& err)
+		{
+			if (err)
+				return;
+
+			hexabus::ReadingSpool::readings_t batch;
+
+			try {
+				spool.sync();
+				register_sensors();
+
+				if (!spool.peek(batch_size, batch)) {
+					schedule(interval);
+					return;
+				}
+
+				std::map<klio::Sensor::Ptr, klio::readings_t> readings;
+				size_t unknown = 0;
+				for (hexabus::ReadingSpool::readings_t::const_iterator it = batch.begin(), end = batch.end(); it != end; ++it) {
+					klio::Sensor::Ptr sensor = find_sensor(it->sensor);
+
+					if (sensor)
+						readings[sensor][it->ts] = it->value;
+					else
+						unknown++;
+				}
+
+				for (std::map<klio::Sensor::Ptr, klio::readings_t>::const_iterator it = readings.begin(), end = readings.end();
+						it != end;
+						++it) {
+					store->add_readings(it->first, it->second);
+				}
+				store->flush();
+				spool.consume();
+
+				if (unknown)
+					std::cerr << "Dropped " << unknown << " spooled readings of unknown sensors" << std::endl;
+
+				backoff = interval;
+				schedule(batch.size() == batch_size ? boost::posix_time::seconds(0) : interval);
+			} catch (const std::exception& e) {
+				std::cerr << "Upload failed, " << spool.pending() << " readings spooled: " << e.what() << std::endl;
+
+				backoff = std::min(backoff * 2, MaxBackoff);
+				schedule(backoff);
+			}
+		}
+
+	public:
+		SpoolUploader(boost::asio::io_service& io,
+			klio::MSGStore::Ptr store,
+			hexabus::ReadingSpool& spool,
+			size_t batch_size,
+			boost::posix_time::time_duration interval)
+			: store(store), spool(spool), batch_size(std::max<size_t>(batch_size, 1)),
+			  interval(interval), backoff(interval), timer(io)
+		{
+			schedule(interval);
+		}
+
+		void sensor_found(const klio::Sensor::Ptr& sensor)
+		{
+			sensors[sensor->external_id()] = sensor;
+		}
+
+		void new_sensor_found(const klio::Sensor::Ptr& sensor)
+		{
+			new_sensors[sensor->external_id()] = sensor;
+		}
+};
+const boost::posix_time::time_duration SpoolUploader::MaxBackoff = boost::posix_time::minutes(10);
+
 struct ReadingLogger : public hexabus::Logger {
 	private:
 		struct SensorInfo {
@@ -35,6 +163,9 @@ struct ReadingLogger : public hexabus::Logger {
 		};
 
 		klio::MSGStore::Ptr store;
+		hexabus::ReadingSpool& spool;
+		SpoolUploader& uploader;
+		boost::posix_time::time_duration sync_interval;
 		std::map<klio::Sensor::Ptr, SensorInfo> sensor_infos;
 		boost::asio::deadline_timer info_timer;
 		boost::asio::deadline_timer flush_timer;
@@ -57,7 +188,7 @@ struct ReadingLogger : public hexabus::Logger {
 			return id.str();
 		}
 
-		const char* eid_to_unit(uint32_t eid)
+		std::string eid_to_unit(uint32_t eid)
 		{
 			std::string unit(hexabus::Logger::eid_to_unit(eid));
 
@@ -100,6 +231,7 @@ struct ReadingLogger : public hexabus::Logger {
 				boost::asio::ip::address_v6::from_string(addr_str)
 			};
 			sensor_infos.insert(std::make_pair(ptr, info));
+			uploader.sensor_found(ptr);
 			return ptr;
 		}
 
@@ -108,14 +240,13 @@ struct ReadingLogger : public hexabus::Logger {
 			if (sensor->unit() == UNKNOWN_UNIT)
 				return;
 
-			store->add_sensor(sensor);
+			uploader.new_sensor_found(sensor);
 			SensorInfo info = {
 				boost::posix_time::second_clock::local_time(),
 				boost::posix_time::second_clock::local_time(),
 				address
 			};
 			sensor_infos.insert(std::make_pair(sensor, info));
-			std::cout << "Created new sensor: " << sensor->str() << std::endl;
 		}
 
 		void record_reading(klio::Sensor::Ptr sensor, klio::timestamp_t ts, double value)
@@ -126,10 +257,9 @@ struct ReadingLogger : public hexabus::Logger {
 			sensor_infos[sensor].last_value_received_at = boost::posix_time::second_clock::local_time();
 
 			try {
-				store->add_reading(sensor, ts, value);
-			} catch (std::exception const& ex) {
-				std::cout << "Failed to record reading: " << ex.what() << std::endl;
-				throw;
+				spool.append(sensor->external_id(), ts, value);
+			} catch (const std::exception& ex) {
+				std::cerr << "Failed to spool reading: " << ex.what() << std::endl;
 			}
 		}
 
@@ -175,7 +305,11 @@ struct ReadingLogger : public hexabus::Logger {
 		void on_sensor_name_received(const klio::Sensor::Ptr& sensor, const hexabus::Packet& ep_info)
 		{
 			sensor->name(static_cast<const hexabus::EndpointInfoPacket&>(ep_info).value());
-			store->update_sensor(sensor);
+			try {
+				store->update_sensor(sensor);
+			} catch (const std::exception& e) {
+				std::cerr << "Failed to update sensor " << sensor->external_id() << ": " << e.what() << std::endl;
+			}
 		}
 
 		void on_sensor_error(const klio::Sensor::Ptr& sensor, const hexabus::GenericException& err)
@@ -184,7 +318,7 @@ struct ReadingLogger : public hexabus::Logger {
 
 		void schedule_flush()
 		{
-			flush_timer.expires_from_now(boost::posix_time::minutes(5));
+			flush_timer.expires_from_now(sync_interval);
 			flush_timer.async_wait(boost::bind(&ReadingLogger::force_flush, this, _1));
 		}
 
@@ -193,7 +327,11 @@ struct ReadingLogger : public hexabus::Logger {
 			schedule_flush();
 
 			if (!err) {
-				store->flush();
+				try {
+					spool.sync();
+				} catch (const std::exception& e) {
+					std::cerr << "Failed to sync spool: " << e.what() << std::endl;
+				}
 			}
 		}
 
@@ -204,8 +342,12 @@ struct ReadingLogger : public hexabus::Logger {
 			const std::string& sensor_timezone,
 			hexabus::DeviceInterrogator& interrogator,
 			hexabus::EndpointRegistry& registry,
-			klio::MSGStore::Ptr store)
+			klio::MSGStore::Ptr store,
+			hexabus::ReadingSpool& spool,
+			SpoolUploader& uploader,
+			boost::posix_time::time_duration sync_interval)
 			: Logger(tc, sensor_factory, sensor_timezone, interrogator, registry), store(store),
+			  spool(spool), uploader(uploader), sync_interval(sync_interval),
 			  info_timer(io), flush_timer(io)
 		{
 			schedule_info_update();
@@ -326,6 +468,11 @@ int main(int argc, char** argv)
 		("config,c", po::value<std::string>()->default_value("/etc/hexabus_msg_bridge.conf"), "path to bridge configuration file (will be created if not present)")
 		("timezone,t", po::value<std::string>(), "the timezone to use for new sensors")
 		("listen,L", po::value<std::vector<std::string> >(), "listen on this interface and post measurements to mySmartGrid")
+		("spool", po::value<std::string>()->default_value("/var/spool/hexabus_msg_bridge"), "directory to keep readings in until they are uploaded")
+		("spool-size", po::value<unsigned>()->default_value(64), "maximum size of the spool in MiB, the oldest readings are dropped beyond that")
+		("sync-interval", po::value<unsigned>()->default_value(5), "interval in seconds at which spooled readings are synced to disk")
+		("upload-interval", po::value<unsigned>()->default_value(60), "interval in seconds at which spooled readings are uploaded")
+		("batch-size", po::value<size_t>()->default_value(10000), "maximum number of readings per upload")
 		("create,C", po::value<std::string>()->implicit_value(""), "create a configuration and register the device to mySmartGrid")
 		("activationcode,A", "print activation code for the mySmartGrid store")
 		("heartbeat,H", "perform heartbeat and possibly firmware upgrade");
@@ -429,11 +576,29 @@ int main(int argc, char** argv)
 
 				hexabus::DeviceInterrogator interrogator(socket);
 				hexabus::EndpointRegistry registry;
-				ReadingLogger logger(io, *tc, *sensor_factory, timezone, interrogator, registry, store);
+				hexabus::RegistryWatcher registry_watcher(io, registry);
+				hexabus::ReadingSpool spool(vm["spool"].as<std::string>(),
+						uint64_t(vm["spool-size"].as<unsigned>()) * 1024 * 1024);
+				if (spool.pending())
+					std::cout << spool.pending() << " readings spooled from previous runs" << std::endl;
 
-				listener.onPacketReceived(boost::ref(logger));
+				SpoolUploader uploader(io, store, spool,
+						vm["batch-size"].as<size_t>(),
+						boost::posix_time::seconds(vm["upload-interval"].as<unsigned>()));
+				ReadingLogger logger(io, *tc, *sensor_factory, timezone, interrogator, registry, store,
+						spool, uploader, boost::posix_time::seconds(vm["sync-interval"].as<unsigned>()));
+
+				listener.setReceiveBatchSize(32);
+				listener.onPacketViewReceived(boost::ref(logger));
+
+				boost::asio::signal_set terminate_handler(io, SIGTERM, SIGINT);
+				terminate_handler.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
 
 				io.run();
+
+				spool.sync();
+				if (spool.dropped())
+					std::cerr << spool.dropped() << " readings dropped because the spool was full" << std::endl;
 			} catch (const hexabus::NetworkException& e) {
 				std::cerr << "Network error: " << e.code().message() << std::endl;
 				return ERR_NETWORK;
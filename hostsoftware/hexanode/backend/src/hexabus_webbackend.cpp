@@ -2,20 +2,30 @@
 #include <libhexanode/packet_pusher.hpp>
 #include <libhexabus/liveness.hpp>
 #include <libhexabus/socket.hpp>
-#include <libhexanode/sensor.hpp>
-#include <boost/network/protocol/http/client.hpp>
-#include <boost/network/uri.hpp>
-#include <boost/network/uri/uri_io.hpp>
+#include <libhexabus/filtering.hpp>
+#include <libhexanode/push_pipeline.hpp>
+#include <libhexanode/receive_loop.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/positional_options.hpp>
 namespace po = boost::program_options;
 #include <iostream>
 
-using namespace boost::network;
+static void push_packet(hexanode::PacketPusher& pp, const hexabus::Packet& packet,
+		const boost::asio::ip::udp::endpoint& from)
+{
+	try {
+		pp.push(from, packet);
+	} catch (const std::exception& e) {
+		std::cerr << "Unexcepted condition: " << e.what() << std::endl;
+		std::cerr << "Discarding and resuming operation." << std::endl;
+	}
+}
 
-bool is_info(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint&)
+static hexabus::connection subscribe(hexabus::Listener& listener, hexanode::PacketPusher& pp)
 {
-	return packet.type() == hexabus::HXB_PTYPE_INFO;
+	return listener.onPacketReceived(
+			boost::bind(push_packet, boost::ref(pp), _1, _2),
+			hexabus::filtering::isAnyInfo());
 }
 
 int main (int argc, char const* argv[]) {
@@ -27,6 +37,10 @@ int main (int argc, char const* argv[]) {
     ("version", "print libhexanode version and exit")
     ("frontendurl,u", po::value<std::string>(), "URL of frontend API")
     ("interface,i", po::value<std::vector<std::string> >(), "name of an interface to listen on (e.g. eth0)")
+    ("connections", po::value<size_t>()->default_value(2), "number of connections to the frontend")
+    ("batch-size", po::value<size_t>()->default_value(100), "maximum number of values per request, 1 to post every value on its own")
+    ("queue-size", po::value<size_t>()->default_value(4096), "number of sensors with values waiting while the frontend is busy")
+    ("max-rate", po::value<double>()->default_value(1), "maximum number of values pushed per second and sensor, 0 for no limit")
     ;
   po::positional_options_description p;
   p.add("frontendurl", 1);
@@ -53,15 +67,13 @@ int main (int argc, char const* argv[]) {
     return 0;
   }
 
-  uri::uri base_uri;
+  std::string base_uri;
 
   if (vm.count("frontendurl") != 1) {
     std::cerr << "No frontend URL given - exiting." << std::endl;
     return 1;
   } else {
-    base_uri << uri::scheme("http") 
-      << uri::host(vm["frontendurl"].as<std::string>())
-      << uri::path("/api");
+    base_uri = "http://" + vm["frontendurl"].as<std::string>() + "/api";
   }
 
   std::cout << "Using frontend url " << base_uri << std::endl;
@@ -78,37 +90,21 @@ int main (int argc, char const* argv[]) {
 	}
 	std::for_each(ifaces.begin(), ifaces.end(), boost::bind(&hexabus::Listener::listen, &listener, _1));
 
-  http::client client;
+	// only the latest value of a sensor is pushed if it reports faster than that
+	double max_rate = vm["max-rate"].as<double>();
+	boost::posix_time::time_duration min_interval = max_rate > 0
+		? boost::posix_time::microseconds(static_cast<long>(1000000 / max_rate))
+		: boost::posix_time::time_duration();
 
-	hexanode::PacketPusher pp(socket, client, base_uri, std::cout);
-  
-  while (true) {
-    try {
-      std::pair<hexabus::Packet::Ptr, boost::asio::ip::udp::endpoint> pair;
-      try {
-        pair = listener.receive(is_info);
-      } catch (const hexabus::GenericException& e) {
-        const hexabus::NetworkException* nerror;
-        if ((nerror = dynamic_cast<const hexabus::NetworkException*>(&e))) {
-          std::cerr << "Error receiving packet: " << nerror->code().message() << std::endl;
-        } else {
-          std::cerr << "Error receiving packet: " << e.what() << std::endl;
-        }
-        continue;
-      }
+	hexanode::PushPipeline pipeline(base_uri,
+			vm["connections"].as<size_t>(),
+			vm["queue-size"].as<size_t>(),
+			vm["batch-size"].as<size_t>(),
+			min_interval,
+			std::cout);
+	hexanode::PacketPusher pp(socket, pipeline, std::cout);
 
-      if (pair.first == NULL) {
-        std::cerr << "Received invalid packet - please check libhexabus version!" << std::endl;
-      } else {
-        pp.push(pair.second, *pair.first);
-      }
+	hexanode::run_receive_loop(io, listener, boost::bind(subscribe, boost::ref(listener), boost::ref(pp)));
 
-    } catch (const std::exception& e) {
-      std::cerr << "Unexcepted condition: " << e.what() << std::endl;
-      std::cerr << "Discarding and resuming operation." << std::endl;
-    }
-  }
-
-  return 0;
+	return 0;
 }
-
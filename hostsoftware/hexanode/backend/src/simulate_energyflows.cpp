@@ -5,6 +5,7 @@
 #include <libhexabus/filtering.hpp>
 #include <libhexanode/solar_calculator.hpp>
 #include <libhexanode/historian.hpp>
+#include <libhexanode/receive_loop.hpp>
 #include <boost/network/protocol/http/client.hpp>
 #include <boost/network/uri.hpp>
 #include <boost/network/uri/uri_io.hpp>
@@ -19,6 +20,38 @@ namespace po = boost::program_options;
 using namespace boost::network;
 namespace hf = hexabus::filtering;
 
+struct SolarUpdater {
+  hexabus::Listener* listen_network;
+  hexabus::Socket* send_network;
+  uint32_t pv_production_eid;
+  uint32_t pv_peak_watt;
+  uint32_t battery_eid;
+  uint32_t battery_peak_watt;
+  hexanode::Historian::Ptr historian;
+
+  void operator()(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint& from) const
+  {
+    try {
+      std::cout << "Received update from " << from << std::endl;
+      hexanode::SolarCalculator sc(listen_network, send_network, from,
+          pv_production_eid, pv_peak_watt, battery_eid, battery_peak_watt, historian);
+      sc.visitPacket(packet);
+    } catch (const std::exception& e) {
+      std::cerr << "Unexcepted condition: " << e.what() << std::endl;
+      std::cerr << "Discarding and resuming operation." << std::endl;
+    }
+  }
+};
+
+static hexabus::connection subscribe(hexabus::Listener* listen_network, const SolarUpdater& updater,
+    uint32_t pv_production_eid, uint32_t battery_eid)
+{
+  return listen_network->onPacketReceived(updater,
+      (hf::eid() == pv_production_eid)
+      | (hf::eid() == battery_eid)
+      | (hf::eid() == EP_POWER_METER));
+}
+
 
 int main (int argc, char const* argv[]) {
   std::ostringstream oss;
@@ -67,7 +100,7 @@ int main (int argc, char const* argv[]) {
     std::cout << "Using this configuration:" << std::endl;
     std::cout << "* General configuration" << std::endl;
     std::cout << "   Send IPv6: " << config_tree.get<std::string>("general.send_ipv6") << std::endl;
-    std::cout << "   Update interval: " << config_tree.get<uint32_t>("general.update_interval") << std::endl;
+    std::cout << "   Update interval: " << config_tree.get<double>("general.update_interval") << std::endl;
     std::cout << "* Photovoltaik production" << std::endl;
     //std::cout << "   Dial IPv6: " << config_tree.get<std::string>("photovoltaik.dial_ipv6") << std::endl;
     std::cout << "   Dial EID: " << config_tree.get<std::string>("photovoltaik.dial_eid") << std::endl;
@@ -84,7 +117,9 @@ int main (int argc, char const* argv[]) {
   boost::asio::ip::address_v6 send_ipv6 = 
     boost::asio::ip::address_v6::from_string(
         config_tree.get<std::string>("general.send_ipv6"));
-  uint32_t update_interval = config_tree.get<uint32_t>("general.update_interval");
+  // in seconds, fractions allowed
+  boost::posix_time::time_duration update_interval = boost::posix_time::milliseconds(
+      static_cast<long>(config_tree.get<double>("general.update_interval") * 1000));
   //boost::asio::ip::address_v6 pv_dial_ipv6 = 
   //  boost::asio::ip::address_v6::from_string(
   //      config_tree.get<std::string>("photovoltaik.dial_ipv6") 
@@ -123,45 +158,16 @@ int main (int argc, char const* argv[]) {
   send_network->bind(send_ipv6);
   send_network2->bind(send_ipv6);
 
-  hexanode::Historian::Ptr h(new hexanode::Historian(send_network2, update_interval));
+  hexanode::Historian::Ptr h(new hexanode::Historian(listen_io, send_network2, update_interval));
   h->run();
 
-  while (true) {
-    try {
-      std::pair<hexabus::Packet::Ptr, boost::asio::ip::udp::endpoint> pair;
-      try {
-        pair = listen_network->receive(
-            (hf::eid() == pv_production_eid) 
-            | (hf::eid() == battery_eid)
-            | (hf::eid() == EP_POWER_METER)
-            );
-      } catch (const hexabus::GenericException& e) {
-        const hexabus::NetworkException* nerror;
-        if ((nerror = dynamic_cast<const hexabus::NetworkException*>(&e))) {
-          std::cerr << "Error receiving packet: " << nerror->code().message() << std::endl;
-        } else {
-          std::cerr << "Error receiving packet: " << e.what() << std::endl;
-        }
-        continue;
-      }
-
-      std::cout << "Received update from " << pair.second << std::endl;
-      hexanode::SolarCalculator sc(listen_network, send_network, pair.second, 
-          pv_production_eid, pv_peak_watt, battery_eid, battery_peak_watt, h);
-      if (pair.first == NULL) {
-        std::cerr << "Received invalid packet - please check libhexabus version!" << std::endl;
-      } else {
-        sc.visitPacket(*pair.first);
-      }
+  SolarUpdater updater = { listen_network, send_network,
+    pv_production_eid, pv_peak_watt, battery_eid, battery_peak_watt, h };
 
-    } catch (const std::exception& e) {
-      std::cerr << "Unexcepted condition: " << e.what() << std::endl;
-      std::cerr << "Discarding and resuming operation." << std::endl;
-    }
-  }
+  hexanode::run_receive_loop(listen_io, *listen_network,
+      boost::bind(subscribe, listen_network, boost::cref(updater), pv_production_eid, battery_eid));
 
   h->shutdown();
 
   return 0;
 }
-
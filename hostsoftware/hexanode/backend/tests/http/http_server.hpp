@@ -0,0 +1,189 @@
+#ifndef TESTS_HTTP_SERVER_HPP
+#define TESTS_HTTP_SERVER_HPP 1
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/thread.hpp>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <poll.h>
+
+/**
+ * HTTP server on the loopback interface that answers the requests of a
+ * client with the responses of a script, one list of responses per
+ * connection. The script is built with connection() and respond() before
+ * the server is started. A connection is closed once its responses are used up, or
+ * when the client closes it. An empty response closes the connection after
+ * the head of the request was read, before its body.
+ *
+ * Connections are served one after another by a thread that is done when
+ * all connections of the script were served, or when no client connects
+ * within five seconds.
+ */
+class HttpServer {
+	public:
+		struct Request {
+			std::string method;
+			std::string path;
+			std::string body;
+		};
+
+		HttpServer()
+			: _acceptor(_io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+			_accepted(0), _timed_out(false)
+		{
+		}
+
+		~HttpServer()
+		{
+			join();
+		}
+
+		std::string port() const
+		{
+			return boost::lexical_cast<std::string>(_acceptor.local_endpoint().port());
+		}
+
+		// starts the script of the next connection
+		HttpServer& connection()
+		{
+			_script.push_back(responses_t());
+			return *this;
+		}
+
+		// answers the next request of the connection with response
+		HttpServer& respond(const std::string& response)
+		{
+			_script.back().push_back(response);
+			return *this;
+		}
+
+		void start()
+		{
+			_thread = boost::thread(boost::bind(&HttpServer::run, this));
+		}
+
+		// waits until the script was served
+		void join()
+		{
+			if (_thread.joinable())
+				_thread.join();
+		}
+
+		// waits until count requests were received, at most five seconds
+		bool wait_for(size_t count)
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+			boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(5);
+
+			while (_requests.size() < count)
+				if (!_received.timed_wait(lock, deadline))
+					return false;
+			return true;
+		}
+
+		std::vector<Request> requests()
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+			return _requests;
+		}
+
+		// call after join()
+		size_t accepted() const { return _accepted; }
+		bool timed_out() const { return _timed_out; }
+
+		// whether a client has connected since the script was served, call after join()
+		bool connection_pending()
+		{
+			struct pollfd pfd = { _acceptor.native_handle(), POLLIN, 0 };
+
+			return ::poll(&pfd, 1, 0) > 0;
+		}
+
+	private:
+		typedef std::vector<std::string> responses_t;
+
+		std::vector<responses_t> _script;
+		boost::asio::io_service _io;
+		boost::asio::ip::tcp::acceptor _acceptor;
+		size_t _accepted;
+		bool _timed_out;
+
+		boost::mutex _mutex;
+		boost::condition_variable _received;
+		std::vector<Request> _requests;
+
+		boost::thread _thread;
+
+		void run()
+		{
+			for (size_t i = 0; i < _script.size(); i++) {
+				struct pollfd pfd = { _acceptor.native_handle(), POLLIN, 0 };
+				if (::poll(&pfd, 1, 5000) <= 0) {
+					_timed_out = true;
+					return;
+				}
+
+				boost::asio::ip::tcp::socket socket(_io);
+				_acceptor.accept(socket);
+				_accepted++;
+				serve(socket, _script[i]);
+			}
+		}
+
+		void serve(boost::asio::ip::tcp::socket& socket, const responses_t& responses)
+		{
+			boost::asio::streambuf buffer;
+			boost::system::error_code err;
+
+			for (responses_t::const_iterator it = responses.begin(), end = responses.end(); it != end; ++it) {
+				size_t head_size = boost::asio::read_until(socket, buffer, "\r\n\r\n", err);
+				if (err)
+					return;
+
+				std::string head(boost::asio::buffers_begin(buffer.data()), boost::asio::buffers_begin(buffer.data()) + head_size);
+				buffer.consume(head_size);
+
+				Request request;
+				std::istringstream request_line(head);
+				request_line >> request.method >> request.path;
+
+				if (!it->empty()) {
+					size_t length = content_length(head);
+					if (buffer.size() < length)
+						boost::asio::read(socket, buffer, boost::asio::transfer_at_least(length - buffer.size()), err);
+					if (err)
+						return;
+
+					request.body.assign(boost::asio::buffers_begin(buffer.data()), boost::asio::buffers_begin(buffer.data()) + length);
+					buffer.consume(length);
+				}
+
+				{
+					boost::mutex::scoped_lock lock(_mutex);
+					_requests.push_back(request);
+					_received.notify_all();
+				}
+
+				if (it->empty())
+					return;
+				boost::asio::write(socket, boost::asio::buffer(*it), err);
+				if (err)
+					return;
+			}
+		}
+
+		static size_t content_length(const std::string& head)
+		{
+			std::string lower = boost::algorithm::to_lower_copy(head);
+			size_t pos = lower.find("\r\ncontent-length:");
+
+			return pos == std::string::npos ? 0 : strtoul(lower.c_str() + pos + 17, 0, 10);
+		}
+};
+
+#endif
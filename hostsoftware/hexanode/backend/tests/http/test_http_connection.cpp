@@ -0,0 +1,115 @@
+#define BOOST_TEST_MODULE http_connection_test
+#include <boost/test/unit_test.hpp>
+#include <libhexanode/http_connection.hpp>
+#include <libhexanode/error.hpp>
+#include "http_server.hpp"
+
+typedef hexanode::HttpConnection::Response response_t;
+
+static const boost::posix_time::time_duration Timeout = boost::posix_time::seconds(2);
+
+BOOST_AUTO_TEST_CASE ( check_content_length ) {
+	HttpServer server;
+	server.connection()
+		.respond("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello")
+		.respond("HTTP/1.1 201 Created\r\ncontent-length: 0\r\n\r\n");
+	server.start();
+	hexanode::HttpConnection connection("127.0.0.1", server.port(), Timeout);
+
+	response_t first = connection.request("PUT", "/sensor/1", "application/json", "{\"a\":1}");
+	BOOST_CHECK_EQUAL(first.status, 200u);
+	BOOST_CHECK_EQUAL(first.body, "hello");
+
+	// the keep-alive connection is used again
+	response_t second = connection.request("POST", "/sensor/2", "text/plain", "");
+	BOOST_CHECK_EQUAL(second.status, 201u);
+	BOOST_CHECK_EQUAL(second.body, "");
+
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+
+	std::vector<HttpServer::Request> requests = server.requests();
+	BOOST_REQUIRE_EQUAL(requests.size(), 2u);
+	BOOST_CHECK_EQUAL(requests[0].method, "PUT");
+	BOOST_CHECK_EQUAL(requests[0].path, "/sensor/1");
+	BOOST_CHECK_EQUAL(requests[0].body, "{\"a\":1}");
+	BOOST_CHECK_EQUAL(requests[1].method, "POST");
+	BOOST_CHECK_EQUAL(requests[1].path, "/sensor/2");
+}
+
+BOOST_AUTO_TEST_CASE ( check_chunked ) {
+	HttpServer server;
+	server.connection()
+		.respond("HTTP/1.1 200 OK\r\nTransfer-Encoding: Chunked\r\n\r\n"
+			"5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\nX-Trailer: 1\r\n\r\n")
+		.respond("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+	server.start();
+	hexanode::HttpConnection connection("127.0.0.1", server.port(), Timeout);
+
+	BOOST_CHECK_EQUAL(connection.request("GET", "/", "text/plain", "").body, "hello, world");
+	// the trailers were read, the next response starts behind them
+	BOOST_CHECK_EQUAL(connection.request("GET", "/", "text/plain", "").body, "ok");
+
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_interim_responses ) {
+	HttpServer server;
+	server.connection()
+		.respond("HTTP/1.1 100 Continue\r\n\r\n"
+			"HTTP/1.1 102 Processing\r\nX-Interim: 1\r\n\r\n"
+			"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok")
+		.respond("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 204 No Content\r\n\r\n");
+	server.start();
+	hexanode::HttpConnection connection("127.0.0.1", server.port(), Timeout);
+
+	response_t first = connection.request("POST", "/", "text/plain", "value");
+	BOOST_CHECK_EQUAL(first.status, 200u);
+	BOOST_CHECK_EQUAL(first.body, "ok");
+
+	response_t second = connection.request("POST", "/", "text/plain", "value");
+	BOOST_CHECK_EQUAL(second.status, 204u);
+	BOOST_CHECK_EQUAL(second.body, "");
+
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_connection_close ) {
+	HttpServer server;
+	server.connection().respond("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nfirst");
+	server.connection().respond("HTTP/1.0 200 OK\r\nContent-Length: 6\r\n\r\nsecond");
+	server.connection().respond("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nthird");
+	server.start();
+	hexanode::HttpConnection connection("127.0.0.1", server.port(), Timeout);
+
+	// without a length, the body ends with the connection
+	BOOST_CHECK_EQUAL(connection.request("GET", "/", "text/plain", "").body, "first");
+	// HTTP/1.0 connections are not kept alive
+	BOOST_CHECK_EQUAL(connection.request("GET", "/", "text/plain", "").body, "second");
+	BOOST_CHECK_EQUAL(connection.request("GET", "/", "text/plain", "").body, "third");
+
+	server.join();
+	BOOST_CHECK(!server.timed_out());
+	BOOST_CHECK_EQUAL(server.accepted(), 3u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_no_resend_after_partial_write ) {
+	// the server closes the connection while the body of the second request is sent
+	HttpServer server;
+	server.connection()
+		.respond("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+		.respond("");
+	server.start();
+	hexanode::HttpConnection connection("127.0.0.1", server.port(), Timeout);
+
+	BOOST_CHECK_EQUAL(connection.request("POST", "/", "text/plain", "small").status, 200u);
+	BOOST_CHECK_THROW(connection.request("POST", "/", "text/plain", std::string(32 << 20, 'x')),
+			hexanode::CommunicationException);
+
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+	BOOST_CHECK_EQUAL(server.requests().size(), 2u);
+	BOOST_CHECK(!server.connection_pending());
+}
@@ -0,0 +1,86 @@
+#define BOOST_TEST_MODULE push_pipeline_test
+#include <boost/test/unit_test.hpp>
+#include <libhexanode/push_pipeline.hpp>
+#include <sstream>
+#include "http_server.hpp"
+
+namespace ip = boost::asio::ip;
+
+static const char* const Ok = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}";
+
+static std::string api_uri(const HttpServer& server)
+{
+	return "http://127.0.0.1:" + server.port() + "/api";
+}
+
+static bool contains(const std::string& s, const std::string& part)
+{
+	return s.find(part) != std::string::npos;
+}
+
+BOOST_AUTO_TEST_CASE ( check_coalescing ) {
+	HttpServer server;
+	server.connection().respond(Ok).respond(Ok);
+	server.start();
+
+	ip::address_v6 device = ip::address_v6::from_string("fd00::1");
+	std::ostringstream log;
+
+	{
+		hexanode::PushPipeline pipeline(api_uri(server), 1, 16, 16, boost::posix_time::hours(1), log);
+
+		BOOST_CHECK(pipeline.push(device, 2, "1"));
+		BOOST_REQUIRE(server.wait_for(1));
+
+		// the sensor may not be pushed again for an hour, the second value is replaced
+		BOOST_CHECK(pipeline.push(device, 2, "2"));
+		BOOST_CHECK(pipeline.push(device, 2, "3"));
+
+		hexanode::PushPipeline::Statistics stats = pipeline.statistics();
+		BOOST_CHECK_EQUAL(stats.queued, 3u);
+		BOOST_CHECK_EQUAL(stats.coalesced, 1u);
+		BOOST_CHECK_EQUAL(stats.dropped, 0u);
+	}
+
+	// values still waiting are sent when the pipeline stops
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+
+	std::vector<HttpServer::Request> requests = server.requests();
+	BOOST_REQUIRE_EQUAL(requests.size(), 2u);
+	BOOST_CHECK_EQUAL(requests[0].path, "/api/sensor/values");
+	BOOST_CHECK(contains(requests[0].body, "\"value\":\"1\""));
+	BOOST_CHECK_EQUAL(requests[1].path, "/api/sensor/values");
+	BOOST_CHECK(contains(requests[1].body, "\"value\":\"3\""));
+	BOOST_CHECK(!contains(requests[1].body, "\"value\":\"2\""));
+	BOOST_CHECK(log.str().empty());
+}
+
+BOOST_AUTO_TEST_CASE ( check_no_resend ) {
+	// the connection breaks after the server has received the second request
+	HttpServer server;
+	server.connection().respond(Ok).respond("");
+	server.start();
+
+	ip::address_v6 device = ip::address_v6::from_string("fd00::1");
+	std::ostringstream log;
+
+	{
+		hexanode::PushPipeline pipeline(api_uri(server), 1, 16, 1, boost::posix_time::hours(1), log);
+
+		BOOST_CHECK(pipeline.push(device, 2, "1"));
+		BOOST_REQUIRE(server.wait_for(1));
+		BOOST_CHECK(pipeline.push(device, 3, "2"));
+		BOOST_REQUIRE(server.wait_for(2));
+	}
+
+	server.join();
+	BOOST_CHECK_EQUAL(server.accepted(), 1u);
+	BOOST_CHECK(!server.connection_pending());
+
+	std::vector<HttpServer::Request> requests = server.requests();
+	BOOST_REQUIRE_EQUAL(requests.size(), 2u);
+	BOOST_CHECK_EQUAL(requests[0].path, "/api/sensor/fd00::1/2");
+	BOOST_CHECK_EQUAL(requests[1].path, "/api/sensor/fd00::1/3");
+	BOOST_CHECK(contains(log.str(), "Failed to push value to fd00::1(3)"));
+}
@@ -179,6 +179,33 @@ app.put('/api/sensor/:ip/:eid', function(req, res) {
 	}
 });
 
+app.post('/api/sensor/values', function(req, res) {
+	if (!Array.isArray(req.body.values)) {
+		res.send("No values given", 400);
+		return;
+	}
+	var now = Math.round(Date.now() / 1000);
+	var missing = [];
+	req.body.values.forEach(function(item) {
+		if (ignore_endpoint(item.ip, item.eid)) {
+			return;
+		}
+		var device = devicetree.devices[item.ip];
+		if (!device || !device.endpoints[item.eid]) {
+			missing.push({ ip: item.ip, eid: item.eid });
+			return;
+		}
+		var value = parseFloat(item.value);
+		if (!isNaN(value)) {
+			device.endpoints[item.eid].last_value = {
+				unix_ts: now,
+				value: value
+			};
+		}
+	});
+	res.json({ missing: missing });
+});
+
 app.post('/api/sensor/:ip/:eid', function(req, res) {
 	if (ignore_endpoint(req.params.ip, req.params.eid)) {
 		res.send("Ignored", 200);
@@ -7,6 +7,8 @@
 #include <libhexabus/packet.hpp>
 #include <libhexabus/error.hpp>
 #include <libhexabus/socket.hpp>
+#include <libhexabus/device_interrogator.hpp>
+#include <libhexabus/filtering.hpp>
 #include <libhexabus/endpoint_registry.hpp>
 
 #include <libhbc/ast_datatypes.hpp>
@@ -50,47 +52,209 @@ struct ReceiveCallback { // callback for device discovery
 	}
 };
 
-struct InfoCallback { // callback for populating data structures
-	device_descriptor* device;
-	std::set<endpoint_descriptor>* endpoints;
-	bool* received;
-	void operator()(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint asio_ep)
-	{
-		const hexabus::EndpointInfoPacket* endpointInfo = dynamic_cast<const hexabus::EndpointInfoPacket*>(&packet);
-		const hexabus::InfoPacket<uint32_t>* info = dynamic_cast<const hexabus::InfoPacket<uint32_t>*>(&packet);
-		if(endpointInfo != NULL)
+/*
+ * Enumerates devices concurrently: every reply immediately triggers the
+ * queries that depend on it, and the interrogator keeps as many of them in
+ * flight as the network allows.
+ */
+class DeviceEnumerator {
+	public:
+		struct device_state {
+			device_descriptor device;
+			boost::posix_time::ptime started;
+			boost::posix_time::time_duration latency;
+			unsigned pending;
+			// queries that got no reply
+			unsigned failed;
+			// set once the device is complete or was given up on
+			bool finished;
+			bool timed_out;
+			std::tr1::shared_ptr<boost::asio::deadline_timer> deadline;
+		};
+
+		typedef std::map<boost::asio::ip::address_v6, device_state> devices_t;
+
+	private:
+		hexabus::DeviceInterrogator& interrogator;
+		boost::asio::io_service& io;
+		std::set<endpoint_descriptor>& endpoints;
+		unsigned max_tries;
+		boost::posix_time::time_duration device_time;
+		bool verbose;
+
+		devices_t devices;
+		size_t running;
+
+		static boost::posix_time::ptime now()
 		{
-			if(endpointInfo->eid() == EP_DEVICE_DESCRIPTOR) // If it's endpoint 0 (device descriptor), it contains the device name.
-			{
-				device->name = endpointInfo->value();
-			} else { // otherwise it contains information about an endpoint, so build an endpoint_descriptor and add it to the list
-				endpoint_descriptor ep;
-				ep.eid = endpointInfo->eid();
-				ep.datatype = endpointInfo->datatype();
-				ep.name = endpointInfo->value();
-
-				endpoints->insert(ep);
+			return boost::posix_time::microsec_clock::universal_time();
+		}
+
+		template<typename Packet, typename Filter>
+		void query(device_state* state, const Packet& packet, const Filter& filter,
+				const boost::function<void (const hexabus::Packet&)>& response)
+		{
+			if (verbose)
+				std::cout << "Querying EID " << packet.eid() << " of " << state->device.ipv6_address << "." << std::endl;
+
+			state->pending++;
+			interrogator.send_request(
+					state->device.ipv6_address,
+					packet,
+					filter,
+					response,
+					boost::bind(&DeviceEnumerator::on_failure, this, state, packet.eid(), _1),
+					max_tries);
+		}
+
+		void finish(device_state* state)
+		{
+			state->finished = true;
+			state->deadline->cancel();
+			state->latency = now() - state->started;
+
+			if (!--running)
+				io.stop();
+		}
+
+		void complete(device_state* state)
+		{
+			if (--state->pending)
+				return;
+
+			if (verbose)
+				std::cout << "Finished device " << state->device.ipv6_address << "." << std::endl;
+			finish(state);
+		}
+
+		void on_deadline(device_state* state, const boost::system::error_code& error)
+		{
+			if (error || state->finished)
+				return;
+
+			// the time a device gets only runs once its queries are actually sent
+			boost::posix_time::ptime first_sent = interrogator.first_sent(state->device.ipv6_address);
+			if (first_sent.is_not_a_date_time() || first_sent + device_time > now()) {
+				state->deadline->expires_at(first_sent.is_not_a_date_time() ? now() + device_time : first_sent + device_time);
+				state->deadline->async_wait(boost::bind(&DeviceEnumerator::on_deadline, this, state, _1));
+				return;
 			}
-			*received = true;
+
+			if (verbose)
+				std::cout << "Giving up on device " << state->device.ipv6_address << "." << std::endl;
+			state->timed_out = true;
+			finish(state);
+			// the failures of the cancelled queries are ignored
+			interrogator.cancel(state->device.ipv6_address);
 		}
 
-		if(info != NULL)
+		void on_failure(device_state* state, uint32_t eid, const hexabus::GenericException& error)
 		{
-			if ((info->eid() % 32) == 0) // we only care for the device descriptors
-			{
-				uint32_t val = info->value() >> 1; // skip device descriptor
-				for(int i = 1; i < 32; ++i)
-				{
-					if(val & 1) // find out whether LSB is set
-						device->endpoint_ids.insert(info->eid() + i); // if it's set, store the EID (the bit's position in the device descriptor).
+			if (state->finished)
+				return;
 
-					val >>= 1; // right-shift in order to have the next EID in the LSB
+			if (verbose)
+				std::cout << "No reply on query for EID " << eid << " from " << state->device.ipv6_address << std::endl;
+
+			state->failed++;
+			complete(state);
+		}
+
+		void on_name(device_state* state, const hexabus::Packet& packet)
+		{
+			if (state->finished)
+				return;
+
+			state->device.name = static_cast<const hexabus::EndpointInfoPacket&>(packet).value();
+			complete(state);
+		}
+
+		void on_descriptor(device_state* state, const hexabus::Packet& packet)
+		{
+			if (state->finished)
+				return;
+
+			const hexabus::InfoPacket<uint32_t>& info = static_cast<const hexabus::InfoPacket<uint32_t>&>(packet);
+
+			uint32_t val = info.value() >> 1; // skip device descriptor
+			for (uint32_t i = 1; i < 32; ++i, val >>= 1) {
+				uint32_t eid = info.eid() + i;
+
+				// if the bit is set, the device has the endpoint; query each one only once
+				if ((val & 1) && state->device.endpoint_ids.insert(eid).second) {
+					query(state,
+							hexabus::EndpointQueryPacket(eid),
+							hexabus::filtering::isEndpointInfo() && hexabus::filtering::eid() == eid,
+							boost::bind(&DeviceEnumerator::on_endpoint, this, state, _1));
 				}
 			}
-			*received = true;
+
+			complete(state);
 		}
 
-	}
+		void on_endpoint(device_state* state, const hexabus::Packet& packet)
+		{
+			if (state->finished)
+				return;
+
+			const hexabus::EndpointInfoPacket& info = static_cast<const hexabus::EndpointInfoPacket&>(packet);
+
+			endpoint_descriptor ep;
+			ep.eid = info.eid();
+			ep.datatype = info.datatype();
+			ep.name = info.value();
+			endpoints.insert(ep);
+
+			complete(state);
+		}
+
+	public:
+		/**
+		 * Each device is given up on device_time after its first query was
+		 * sent, its remaining queries are cancelled.
+		 */
+		DeviceEnumerator(hexabus::DeviceInterrogator& interrogator, boost::asio::io_service& io,
+				std::set<endpoint_descriptor>& endpoints, unsigned max_tries,
+				const boost::posix_time::time_duration& device_time, bool verbose)
+			: interrogator(interrogator), io(io), endpoints(endpoints), max_tries(max_tries), device_time(device_time),
+				verbose(verbose), running(0)
+		{}
+
+		void start(const boost::asio::ip::address_v6& address)
+		{
+			device_state* state = &devices[address];
+			state->device.ipv6_address = address;
+			state->started = now();
+			// held until all initial queries are sent, failures may be reported immediately
+			state->pending = 1;
+			state->failed = 0;
+			state->finished = false;
+			state->timed_out = false;
+			running++;
+
+			state->deadline.reset(new boost::asio::deadline_timer(io, device_time));
+			state->deadline->async_wait(boost::bind(&DeviceEnumerator::on_deadline, this, state, _1));
+
+			// epquery the dev.descriptor, to get the name of the device
+			query(state,
+					hexabus::EndpointQueryPacket(EP_DEVICE_DESCRIPTOR),
+					hexabus::filtering::isEndpointInfo() && hexabus::filtering::eid() == EP_DEVICE_DESCRIPTOR,
+					boost::bind(&DeviceEnumerator::on_name, this, state, _1));
+
+			// query all dev.descriptors, to build a list of endpoints
+			for (uint32_t ep_desc = 0; ep_desc < 256; ep_desc += 32) {
+				query(state,
+						hexabus::QueryPacket(ep_desc),
+						hexabus::filtering::isInfo<uint32_t>() && hexabus::filtering::eid() == ep_desc,
+						boost::bind(&DeviceEnumerator::on_descriptor, this, state, _1));
+			}
+
+			complete(state);
+		}
+
+		bool done() const { return running == 0; }
+
+		const devices_t& results() const { return devices; }
 };
 
 struct ErrorCallback {
@@ -379,6 +543,7 @@ int main(int argc, char** argv)
 		("devfile,d", po::value<std::string>(), "name of Hexabus Compiler header file to write the device definition to")
 		("json,j", "use JSON as output format")
 		("verbose,V", "print more status information")
+		("timing,t", "print the time taken to enumerate each device, and in total")
 		;
 
 	po::positional_options_description p;
@@ -431,6 +596,11 @@ int main(int argc, char** argv)
 	network->bind(bind_addr);
 	
 	const unsigned int NUM_RETRIES = 5;
+	// a query is sent up to five times with at most the old fixed timeout in between,
+	// a device is given up on after the descriptor and the endpoint queries could have taken that long
+	const boost::posix_time::time_duration QUERY_TIMEOUT = boost::posix_time::milliseconds(350);
+	const boost::posix_time::time_duration QUERY_TIME = QUERY_TIMEOUT * NUM_RETRIES;
+	const boost::posix_time::time_duration DEVICE_TIME = QUERY_TIME * 2;
 	// sets for storing the received data
 	std::set<device_descriptor> devices;
 	std::set<endpoint_descriptor> endpoints;
@@ -456,8 +626,8 @@ int main(int argc, char** argv)
 		ErrorCallback errorCallback;
 
 		// use connections so that callback handlers get deleted (.disconnect())
-		boost::signals2::connection c1 = network->onAsyncError(errorCallback);
-		boost::signals2::connection c2 = network->onPacketReceived(receiveCallback, hexabus::filtering::isInfo<uint32_t>() && (hexabus::filtering::eid() == EP_DEVICE_DESCRIPTOR));
+		hexabus::connection c1 = network->onAsyncError(errorCallback);
+		hexabus::connection c2 = network->onPacketReceived(receiveCallback, hexabus::filtering::isInfo<uint32_t>() && (hexabus::filtering::eid() == EP_DEVICE_DESCRIPTOR));
 
 		// timer that cancels receiving after n seconds
 		boost::asio::deadline_timer timer(network->ioService());
@@ -492,123 +662,78 @@ int main(int argc, char** argv)
 		exit(1);
 	}
 
+	// query all devices at once
+	hexabus::DeviceInterrogator interrogator(*network);
+	interrogator.set_timeouts(QUERY_TIMEOUT, QUERY_TIME);
+	DeviceEnumerator enumerator(interrogator, io, endpoints, NUM_RETRIES, DEVICE_TIME, verbose);
+	ErrorCallback errorCallback;
+	hexabus::connection c1 = network->onAsyncError(errorCallback);
+
+	boost::posix_time::ptime enumeration_start = boost::posix_time::microsec_clock::universal_time();
+
 	for(std::set<boost::asio::ip::address_v6>::iterator address_it = addresses.begin(); address_it != addresses.end(); ++address_it)
 	{
-		device_descriptor device;
-		boost::asio::ip::address_v6 target_ip = *address_it;
-		device.ipv6_address = target_ip;
-
 		if(verbose)
-			std::cout << "Querying device " << target_ip.to_string() << "..." << std::endl;
-
-		// callback handler for incoming (ep)info packets
-		bool received = false;
-		InfoCallback infoCallback = { &device, &endpoints, &received };
-		ErrorCallback errorCallback;
-		boost::signals2::connection c1 = network->onAsyncError(errorCallback);
-		boost::signals2::connection c2 = network->onPacketReceived(infoCallback,
-			(hexabus::filtering::isInfo<uint32_t>() && (hexabus::filtering::eid() % 32 == 0))
-			|| hexabus::filtering::isEndpointInfo());
-
-		unsigned int retries = 0;
-
-		// epquery the dev.descriptor, to get the name of the device
-		while(!received && retries < NUM_RETRIES)
-		{
-			// send the device name query packet and listen for the reply
-			if(verbose)
-				std::cout << "Sending EPQuery." << std::endl;
-			send_packet(network, target_ip, hexabus::EndpointQueryPacket(EP_DEVICE_DESCRIPTOR));
+			std::cout << "Querying device " << address_it->to_string() << "..." << std::endl;
 
-			boost::asio::deadline_timer timer(network->ioService()); // wait for a second
-			timer.expires_from_now(boost::posix_time::milliseconds(350));
-			timer.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
-
-			network->ioService().reset();
-			network->ioService().run();
-
-			retries++;
-		}
-
-		if(!received && verbose)
-			std::cout << "No reply on device descriptor EPQuery from " << target_ip.to_string() << std::endl;
-
-		for (uint32_t ep_desc = 0; ep_desc < 256; ep_desc += 32) {
-			received = false;
-			retries = 0;
-
-			// query the dev.descriptor, to build a list of endpoints
-			while (!received && retries < NUM_RETRIES) {
-				if (verbose)
-					std::cout << "Sending descriptor query for " << ep_desc << "." << std::endl;
-				// send the device descriptor (endpoint list) query packet and listen for the reply
-				send_packet(network, target_ip, hexabus::QueryPacket(ep_desc));
-
-				boost::asio::deadline_timer timer(network->ioService()); // wait for a second
-				timer.expires_from_now(boost::posix_time::milliseconds(350));
-				timer.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+		enumerator.start(*address_it);
+	}
 
-				network->ioService().reset();
-				network->ioService().run();
+	if(!enumerator.done())
+	{
+		network->ioService().reset();
+		network->ioService().run();
+	}
 
-				retries++;
-			}
+	boost::posix_time::time_duration enumeration_time = boost::posix_time::microsec_clock::universal_time() - enumeration_start;
 
-			if(!received && verbose)
-				std::cout << "No reply on device descriptor Query from " << target_ip.to_string() << std::endl;
-		}
+	c1.disconnect();
 
-		// step 1: Make a set of endpoints to query.
-		std::multiset<uint32_t> eps_to_query;
-		BOOST_FOREACH(uint32_t endpoint_id, device.endpoint_ids)
-		{
-			// put each EP into this list three times, so that it is queried at maximum three times
-			for(unsigned int i = 0; i < NUM_RETRIES; i++)
-				eps_to_query.insert(endpoint_id);
-		}
+	// endpoints of devices that were enumerated completely
+	std::set<uint32_t> complete_eids;
+	for(DeviceEnumerator::devices_t::const_iterator it = enumerator.results().begin(); it != enumerator.results().end(); ++it)
+	{
+		const device_descriptor& device = it->second.device;
 
-		// step 2: Query each entry of the set, and remove it.
-		while(eps_to_query.size())
+		// the endpoint list of a device that did not answer everything is incomplete
+		if(it->second.timed_out || it->second.failed)
 		{
-			received = false;
-			uint32_t eid = *eps_to_query.begin();
-			eps_to_query.erase(eps_to_query.begin());
-
-			if(verbose)
-				std::cout << "Sending EPQuery to EID " << eid << std::endl;
-
-			send_packet(network, target_ip, hexabus::EndpointQueryPacket(eid));
-
-			boost::asio::deadline_timer timer(network->ioService()); // wait for a second
-			timer.expires_from_now(boost::posix_time::milliseconds(350));
-			timer.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
-
-			network->ioService().reset();
-			network->ioService().run();
-
-			// step 2a: If a reply is received for this EP, remove it completely from the set.
-			if(received)
-				eps_to_query.erase(eid);
+			std::cerr << "Warning: device " << device.ipv6_address.to_string()
+				<< " did not answer all queries, it is left out of the output." << std::endl;
+			continue;
 		}
 
-		c1.disconnect();
-		c2.disconnect();
-
-		// step 3: Now we have a set of endpoint descriptors.
+		complete_eids.insert(device.endpoint_ids.begin(), device.endpoint_ids.end());
 
 		if(vm.count("print"))
 		{
 			// print the information onto the command line
 			print_dev_info(device);
 			std::cout << std::endl;
-			for(std::set<endpoint_descriptor>::iterator it = endpoints.begin(); it != endpoints.end(); ++it)
-				if (device.endpoint_ids.count(it->eid))
-					print_ep_info(*it);
+			for(std::set<endpoint_descriptor>::iterator ep = endpoints.begin(); ep != endpoints.end(); ++ep)
+				if (device.endpoint_ids.count(ep->eid))
+					print_ep_info(*ep);
 		}
 
 		devices.insert(device);
 	}
 
+	if(vm.count("timing"))
+	{
+		std::cout << "Enumeration timing:" << std::endl;
+		for(DeviceEnumerator::devices_t::const_iterator it = enumerator.results().begin(); it != enumerator.results().end(); ++it)
+		{
+			std::cout << "	" << it->first.to_string() << ":	" << it->second.latency.total_milliseconds() << " ms";
+			if(it->second.failed)
+				std::cout << ", " << it->second.failed << " queries unanswered";
+			if(it->second.timed_out)
+				std::cout << ", gave up";
+			std::cout << std::endl;
+		}
+		std::cout << "	Total:	" << enumeration_time.total_milliseconds() << " ms for "
+			<< enumerator.results().size() << " devices" << std::endl;
+	}
+
 	if(vm.count("epfile"))
 	{
 		// read in HBC file
@@ -651,7 +776,7 @@ int main(int argc, char** argv)
 
 		for(std::set<endpoint_descriptor>::iterator it = endpoints.begin(); it != endpoints.end(); ++it)
 		{
-			if(!existing_eids.count(it->eid))
+			if(!existing_eids.count(it->eid) && complete_eids.count(it->eid))
 				write_ep_desc(*it, ofs);
 		}
 	}
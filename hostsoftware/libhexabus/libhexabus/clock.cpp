@@ -0,0 +1,185 @@
+#include "clock.hpp"
+
+#include <boost/bind.hpp>
+
+using namespace hexabus;
+
+boost::asio::io_service::id Clock::id;
+
+Clock::Clock(boost::asio::io_service& io)
+	: boost::asio::io_service::service(io), io(io)
+{
+}
+
+boost::posix_time::ptime Clock::now()
+{
+	return boost::asio::deadline_timer::traits_type::now();
+}
+
+static void scheduled_wait_done(const std::tr1::shared_ptr<boost::asio::deadline_timer>&,
+		const Clock::handler_t& handler, const boost::system::error_code& error)
+{
+	handler(error);
+}
+
+void Clock::schedule(const boost::posix_time::ptime& when, const handler_t& handler)
+{
+	std::tr1::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(io, when));
+
+	timer->async_wait(boost::bind(scheduled_wait_done, timer, handler, _1));
+}
+
+
+
+VirtualClock::VirtualClock(boost::asio::io_service& io, const boost::posix_time::ptime& start)
+	: Clock(io), _now(start), _next_id(0)
+{
+}
+
+VirtualClock& VirtualClock::install(boost::asio::io_service& io, const boost::posix_time::ptime& start)
+{
+	VirtualClock* clock = new VirtualClock(io, start);
+
+	boost::asio::add_service<Clock>(io, clock);
+	return *clock;
+}
+
+boost::posix_time::ptime VirtualClock::now()
+{
+	return _now;
+}
+
+void VirtualClock::schedule(const boost::posix_time::ptime& when, const handler_t& handler)
+{
+	scheduleWait(when, handler);
+}
+
+VirtualClock::wait_id VirtualClock::scheduleWait(const boost::posix_time::ptime& when, const handler_t& handler)
+{
+	wait_id wait = _next_id++;
+
+	_waits.insert(std::make_pair(std::make_pair(when, wait), handler));
+	_wait_times.insert(std::make_pair(wait, when));
+	return wait;
+}
+
+bool VirtualClock::cancel(wait_id wait)
+{
+	std::map<wait_id, boost::posix_time::ptime>::iterator it = _wait_times.find(wait);
+	if (it == _wait_times.end())
+		return false;
+
+	waits_t::iterator w = _waits.find(std::make_pair(it->second, wait));
+	io.post(boost::bind(w->second, boost::system::error_code(boost::asio::error::operation_aborted)));
+
+	_waits.erase(w);
+	_wait_times.erase(it);
+	return true;
+}
+
+size_t VirtualClock::run()
+{
+	return runUntil(boost::posix_time::ptime(boost::posix_time::pos_infin));
+}
+
+size_t VirtualClock::runFor(const boost::posix_time::time_duration& duration)
+{
+	return runUntil(_now + duration);
+}
+
+size_t VirtualClock::runUntil(const boost::posix_time::ptime& until)
+{
+	// keeps the io_service from stopping when it runs out of handlers, so
+	// stopped() only reports calls to stop(). Releasing it stops the
+	// io_service, which is why every run starts with a reset.
+	io.reset();
+	boost::asio::io_service::work work(io);
+	size_t handlers = 0;
+
+	for (;;) {
+		handlers += io.poll();
+		if (io.stopped() || _waits.empty() || _waits.begin()->first.first > until)
+			break;
+
+		_now = std::max(_now, _waits.begin()->first.first);
+		while (!_waits.empty() && _waits.begin()->first.first <= _now) {
+			io.post(boost::bind(_waits.begin()->second, boost::system::error_code()));
+			_wait_times.erase(_waits.begin()->first.second);
+			_waits.erase(_waits.begin());
+		}
+	}
+
+	if (!io.stopped() && !until.is_pos_infinity())
+		_now = std::max(_now, until);
+
+	return handlers;
+}
+
+
+
+Timer::Timer(boost::asio::io_service& io)
+	: _clock(boost::asio::use_service<Clock>(io)),
+	_virtual(dynamic_cast<VirtualClock*>(&_clock)),
+	_timer(io)
+{
+}
+
+Timer::Timer(boost::asio::io_service& io, const boost::posix_time::time_duration& expiry)
+	: _clock(boost::asio::use_service<Clock>(io)),
+	_virtual(dynamic_cast<VirtualClock*>(&_clock)),
+	_timer(io)
+{
+	expires_from_now(expiry);
+}
+
+Timer::~Timer()
+{
+	cancel();
+}
+
+size_t Timer::expires_at(const boost::posix_time::ptime& expiry)
+{
+	_expiry = expiry;
+	if (_virtual)
+		return cancel();
+	else
+		return _timer.expires_at(expiry);
+}
+
+size_t Timer::expires_from_now(const boost::posix_time::time_duration& expiry)
+{
+	return expires_at(now() + expiry);
+}
+
+void Timer::async_wait(const handler_t& handler)
+{
+	if (!_virtual) {
+		_timer.async_wait(handler);
+		return;
+	}
+
+	// forget waits that have completed since
+	size_t kept = 0;
+	for (size_t i = 0; i < _waits.size(); i++) {
+		if (_virtual->pending(_waits[i]))
+			_waits[kept++] = _waits[i];
+	}
+	_waits.resize(kept);
+
+	_waits.push_back(_virtual->scheduleWait(_expiry, handler));
+}
+
+size_t Timer::cancel()
+{
+	if (!_virtual)
+		return _timer.cancel();
+
+	size_t cancelled = 0;
+	for (size_t i = 0; i < _waits.size(); i++) {
+		if (_virtual->cancel(_waits[i]))
+			cancelled++;
+	}
+	_waits.clear();
+
+	return cancelled;
+}
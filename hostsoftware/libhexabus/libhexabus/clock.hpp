@@ -0,0 +1,129 @@
+#ifndef LIBHEXABUS_CLOCK_HPP
+#define LIBHEXABUS_CLOCK_HPP 1
+
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <libhexabus/common.hpp>
+#include <map>
+#include <vector>
+
+namespace hexabus {
+	/**
+	 * The io_service service that tells the time to all timers on an
+	 * io_service. This one uses the system clock, a VirtualClock replaces it
+	 * for simulations.
+	 */
+	class Clock : public boost::asio::io_service::service {
+		public:
+			typedef boost::function<void (const boost::system::error_code& error)> handler_t;
+
+			static boost::asio::io_service::id id;
+
+			explicit Clock(boost::asio::io_service& io);
+
+			virtual boost::posix_time::ptime now();
+
+			/**
+			 * Invoke handler through the io_service once when has passed.
+			 */
+			virtual void schedule(const boost::posix_time::ptime& when, const handler_t& handler);
+
+		protected:
+			boost::asio::io_service& io;
+
+		private:
+			void shutdown_service() {}
+	};
+
+	/**
+	 * Time that only passes when the io_service has nothing else to do.
+	 * run() executes ready handlers and then advances the clock to the next
+	 * timer that is due, so a simulation of hours takes as long as the
+	 * handlers do, and runs the same on every machine.
+	 *
+	 * The io_service must only be run through the clock, by a single thread.
+	 */
+	class VirtualClock : public Clock {
+		public:
+			typedef uint64_t wait_id;
+
+			/**
+			 * Make a VirtualClock starting at start the clock of io. This must
+			 * happen before any timer is created on io.
+			 */
+			static VirtualClock& install(boost::asio::io_service& io,
+					const boost::posix_time::ptime& start = boost::posix_time::ptime(boost::gregorian::date(2000, 1, 1)));
+
+			boost::posix_time::ptime now();
+
+			void schedule(const boost::posix_time::ptime& when, const handler_t& handler);
+
+			/**
+			 * Like schedule(), the returned id can be passed to cancel() while
+			 * the handler has not been invoked.
+			 */
+			wait_id scheduleWait(const boost::posix_time::ptime& when, const handler_t& handler);
+			// invoke the handler of a pending wait with operation_aborted
+			bool cancel(wait_id wait);
+			bool pending(wait_id wait) const { return _wait_times.count(wait); }
+
+			/**
+			 * Run the io_service until it has no more handlers and no timer is
+			 * left, or until it is stopped. Returns the number of handlers run.
+			 */
+			size_t run();
+			// like run(), but does not advance the clock past until
+			size_t runUntil(const boost::posix_time::ptime& until);
+			size_t runFor(const boost::posix_time::time_duration& duration);
+
+			// number of waits that have not been invoked yet
+			size_t pending() const { return _waits.size(); }
+
+		private:
+			typedef std::map<std::pair<boost::posix_time::ptime, wait_id>, handler_t> waits_t;
+
+			boost::posix_time::ptime _now;
+			wait_id _next_id;
+			// waits ordered by time, waits at the same time in the order they were scheduled
+			waits_t _waits;
+			std::map<wait_id, boost::posix_time::ptime> _wait_times;
+
+			VirtualClock(boost::asio::io_service& io, const boost::posix_time::ptime& start);
+	};
+
+	/**
+	 * Deadline timer that follows the Clock of its io_service. With the
+	 * system clock it is a boost::asio::deadline_timer, with a VirtualClock
+	 * its waits are scheduled on the virtual clock.
+	 */
+	class Timer : private boost::noncopyable {
+		public:
+			typedef Clock::handler_t handler_t;
+
+			explicit Timer(boost::asio::io_service& io);
+			Timer(boost::asio::io_service& io, const boost::posix_time::time_duration& expiry);
+			// pending waits are cancelled
+			~Timer();
+
+			boost::posix_time::ptime now() { return _clock.now(); }
+
+			boost::posix_time::ptime expires_at() const { return _expiry; }
+			// setting the expiry time cancels pending waits, returns their number
+			size_t expires_at(const boost::posix_time::ptime& expiry);
+			size_t expires_from_now(const boost::posix_time::time_duration& expiry);
+
+			void async_wait(const handler_t& handler);
+			size_t cancel();
+
+		private:
+			Clock& _clock;
+			VirtualClock* _virtual;
+			boost::asio::deadline_timer _timer;
+			boost::posix_time::ptime _expiry;
+			std::vector<VirtualClock::wait_id> _waits;
+	};
+}
+
+#endif
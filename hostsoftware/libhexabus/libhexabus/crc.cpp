@@ -1,13 +1,64 @@
 #include "crc.hpp"
-#include <boost/crc.hpp>
 
 namespace hexabus {
 
+/*
+ * CRC-16/KERMIT (poly 0x1021 reflected, init 0, no final xor), identical to
+ * boost::crc_optimal<16, 0x1021, 0x0000, 0, true, true>.
+ *
+ * Uses slicing-by-8: table[0] is the classic byte table, table[k] advances
+ * the crc of a byte by k more zero bytes, so eight input bytes are folded
+ * into the crc with eight independent lookups.
+ */
+namespace {
+
+struct CRCTable {
+	uint16_t table[8][256];
+
+	CRCTable()
+	{
+		for (unsigned b = 0; b < 256; b++) {
+			uint16_t crc = b;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+			table[0][b] = crc;
+		}
+
+		for (int k = 1; k < 8; k++) {
+			for (unsigned b = 0; b < 256; b++) {
+				uint16_t prev = table[k - 1][b];
+				table[k][b] = (prev >> 8) ^ table[0][prev & 0xff];
+			}
+		}
+	}
+};
+
+const CRCTable& crc_table()
+{
+	static const CRCTable table;
+	return table;
+}
+
+}
+
 uint16_t crc(const void* input, size_t size)
 {
-	boost::crc_optimal<16, 0x1021, 0x0000, 0, true, true> crc; 
-	crc.process_bytes(input, size);
-	return crc.checksum();
+	const uint16_t (*t)[256] = crc_table().table;
+	const uint8_t* p = static_cast<const uint8_t*>(input);
+	uint16_t crc = 0;
+
+	for (; size >= 8; size -= 8, p += 8) {
+		uint16_t c = crc ^ (p[0] | (p[1] << 8));
+		crc = t[7][c & 0xff] ^ t[6][c >> 8]
+			^ t[5][p[2]] ^ t[4][p[3]]
+			^ t[3][p[4]] ^ t[2][p[5]]
+			^ t[1][p[6]] ^ t[0][p[7]];
+	}
+
+	for (; size > 0; size--, p++)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+
+	return crc;
 }
 
 }
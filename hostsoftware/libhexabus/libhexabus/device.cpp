@@ -24,17 +24,14 @@
 
 #include <libhexabus/filtering.hpp>
 
+#include "private/serialization.hpp"
+
 #include "../../../shared/endpoints.h"
 #include "../../../shared/hexabus_types.h"
 #include "../../../shared/hexabus_definitions.h"
 
 using namespace hexabus;
 
-bool isWrite(const Packet& packet, const boost::asio::ip::udp::endpoint& from)
-{
-	return packet.type() == HXB_PTYPE_WRITE;
-}
-
 bool dummy_write_handler(const boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENGTH>& value)
 {
 	return true;
@@ -43,9 +40,15 @@ bool dummy_write_handler(const boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENG
 Device::Device(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval)
 	: _listener(io)
 	, _sockets()
-	, _timer(io)
 	, _interval(interval)
+	, _timer(io)
+	, _wheel(WHEEL_SLOTS)
+	, _wheel_pos(0)
+	, _wheel_entries(0)
+	, _timer_armed(false)
 	, _sm_state(0)
+	, _device_info_generation(0)
+	, _unknown_eid_wire(serialize(ErrorPacket(HXB_ERR_UNKNOWNEID)))
 {
 	try {
 		for (std::vector<std::string>::const_iterator it = interfaces.begin(), end = interfaces.end(); it != end; ++it) {
@@ -55,14 +58,14 @@ Device::Device(boost::asio::io_service& io, const std::vector<std::string>& inte
 			hexabus::Socket *socket = new hexabus::Socket(io);
 			socket->bind(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6::from_string(*it), 61616));
 			socket->onPacketReceived(boost::bind(&Device::_handle_query, this, socket, _1, _2), filtering::isQuery() && (filtering::eid() % 32 > 0));
-			socket->onPacketReceived(boost::bind(&Device::_handle_write, this, socket, _1, _2), isWrite && (filtering::eid() % 32 > 0));
+			socket->onPacketReceived(boost::bind(&Device::_handle_write, this, socket, _1, _2), filtering::isAnyWrite() && (filtering::eid() % 32 > 0));
 
 			socket->onPacketReceived(boost::bind(&Device::_handle_epquery, this, socket, _1, _2), filtering::isEndpointQuery() && (filtering::eid() % 32 > 0));
 
 			socket->onPacketReceived(boost::bind(&Device::_handle_descquery, this, socket, _1, _2), filtering::isQuery() && (filtering::eid() % 32 == 0));
 			socket->onPacketReceived(boost::bind(&Device::_handle_descepquery, this, socket, _1, _2), filtering::isEndpointQuery() && (filtering::eid() % 32 == 0));
 
-			socket->onPacketReceived(boost::bind(&Device::_handle_smupload, this, socket, _1, _2), isWrite && filtering::eid() == EP_SM_UP_RECEIVER);
+			socket->onPacketReceived(boost::bind(&Device::_handle_smupload, this, socket, _1, _2), filtering::isAnyWrite() && filtering::eid() == EP_SM_UP_RECEIVER);
 
 			socket->onAsyncError(boost::bind(&Device::_handle_errors, this, _1));
 			_sockets.push_back(socket);
@@ -75,8 +78,6 @@ Device::Device(boost::asio::io_service& io, const std::vector<std::string>& inte
 		exit(1);
 	}
 
-	_handle_broadcasts(boost::system::error_code());
-
 	TypedEndpointFunctions<uint8_t>::Ptr smcontrolEP(new TypedEndpointFunctions<uint8_t>(EP_SM_CONTROL, "Statemachine control"));
 	smcontrolEP->onRead(boost::bind(&Device::_handle_smcontrolquery, this));
 	smcontrolEP->onWrite(boost::bind(&Device::_handle_smcontrolwrite, this, _1));
@@ -87,39 +88,84 @@ Device::Device(boost::asio::io_service& io, const std::vector<std::string>& inte
 	addEndpoint(smupreceiverEP);
 }
 
-boost::signals2::connection Device::onReadName(const read_name_fn_t& callback)
+hexabus::connection Device::onReadName(const read_name_fn_t& callback)
 {
-	boost::signals2::connection result = _read.connect(callback);
+	hexabus::connection result = _read.connect(callback);
+	_invalidate_device_info();
 
 	return result;
 }
 
-boost::signals2::connection Device::onWriteName(const write_name_fn_t& callback)
+hexabus::connection Device::onWriteName(const write_name_fn_t& callback)
 {
-	boost::signals2::connection result = _write.connect(callback);
+	hexabus::connection result = _write.connect(callback);
+	_invalidate_device_info();
 
 	return result;
 }
 
 void Device::addEndpoint(const EndpointFunctions::Ptr ep)
 {
-	_endpoints.insert(std::pair<uint32_t, const EndpointFunctions::Ptr>(ep->eid(), ep));
+	{
+		boost::unique_lock<boost::shared_mutex> lock(_endpoints_mutex);
+		if ( !_endpoints.insert(std::pair<uint32_t, const EndpointFunctions::Ptr>(ep->eid(), ep)).second )
+			return;
+
+		_epinfo_wire[ep->eid()] = serialize(EndpointInfoPacket(ep->eid(), ep->datatype(), ep->name()));
+		_update_descriptor(ep->eid() - ep->eid() % 32);
+	}
+
+	boost::mutex::scoped_lock lock(_wheel_mutex);
+
+	// a random phase spreads the broadcasts of all endpoints over the interval
+	scheduled_broadcast broadcast = { ep, 0, boost::posix_time::ptime() };
+	_schedule_broadcast(broadcast, rand() % std::max(1, _interval * 1000 / WHEEL_TICK_MS));
+	_arm_broadcast_timer();
+}
+
+void Device::_update_descriptor(uint32_t group)
+{
+	uint32_t bitmap = 1;
+	for ( std::map<uint32_t, const EndpointFunctions::Ptr>::const_iterator it = _endpoints.lower_bound(group), end = _endpoints.end();
+			it != end && it->first - group < 32; ++it )
+	{
+		bitmap |= (1 << (it->first - group));
+	}
+
+	_descriptor_wire[group] = serialize(InfoPacket<uint32_t>(group, bitmap));
+}
+
+void Device::_invalidate_device_info()
+{
+	boost::unique_lock<boost::shared_mutex> lock(_endpoints_mutex);
+
+	_device_info_wire.clear();
+	_device_info_generation++;
+}
+
+EndpointFunctions::Ptr Device::_find_endpoint(uint32_t eid)
+{
+	boost::shared_lock<boost::shared_mutex> lock(_endpoints_mutex);
+	std::map<uint32_t, const EndpointFunctions::Ptr>::const_iterator it = _endpoints.find(eid);
+
+	return it != _endpoints.end() ? it->second : EndpointFunctions::Ptr();
 }
 
 void Device::_handle_query(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const QueryPacket* query = dynamic_cast<const QueryPacket*>(&p);
+	const QueryPacket* query = packet_cast<QueryPacket>(&p);
 	if ( !query ) {
 		//TODO: What to do?
 		return;
 	}
-	std::map<uint32_t, const EndpointFunctions::Ptr>::iterator it = _endpoints.find(query->eid());
+	// the endpoint is read without holding the lock, reads may take a while
+	EndpointFunctions::Ptr ep = _find_endpoint(query->eid());
 	try {
-		if ( it != _endpoints.end() ) {
-			socket->send(*(it->second->handle_query()), from);
+		if ( ep ) {
+			socket->send(*(ep->handle_query()), from);
 		} else {
 			std::cout << "unknown EID" << std::endl;
-			socket->send(ErrorPacket(HXB_ERR_UNKNOWNEID), from);
+			socket->send(_unknown_eid_wire, from);
 		}
 	} catch ( const NetworkException& error ) {
 		std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
@@ -128,50 +174,66 @@ void Device::_handle_query(hexabus::Socket* socket, const Packet& p, const boost
 
 void Device::_handle_write(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const EIDPacket* write = dynamic_cast<const EIDPacket*>(&p);
+	const EIDPacket* write = packet_cast<EIDPacket>(&p);
 	if ( !write ) {
 		//TODO: What to do?
 		return;
 	}
-	std::map<uint32_t, const EndpointFunctions::Ptr>::iterator it = _endpoints.find(write->eid());
+	EndpointFunctions::Ptr ep = _find_endpoint(write->eid());
 	try {
-		if ( it != _endpoints.end() ) {
-			uint8_t res = it->second->handle_write(p);
+		if ( ep ) {
+			uint8_t res = ep->handle_write(p);
 			if ( res != HXB_ERR_SUCCESS && res < HXB_ERR_INTERNAL ) {
 				std::cerr << "Error while writing " << write->eid() << std::endl;
 				socket->send(ErrorPacket(res), from);
 			}
 		} else {
 			std::cout << "unknown EID" << std::endl;
-			socket->send(ErrorPacket(HXB_ERR_UNKNOWNEID), from);
+			socket->send(_unknown_eid_wire, from);
 		}
 	} catch ( const NetworkException& error ) {
 		std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
 	}
 }
 
+/*
+ * Queries received by the listener are answered from every bound socket.
+ * Sockets must only be used on their own strand, so the answers are posted
+ * there.
+ */
 void Device::_handle_epquery(const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
+	if ( !query ) {
+		//TODO: What to do?
+		return;
+	}
 	for ( std::vector<hexabus::Socket*>::iterator it = _sockets.begin(), end = _sockets.end(); it != end; ++it )
 	{
-		_handle_epquery(*it, p, from);
+		(*it)->strand().post(boost::bind(&Device::_answer_epquery, this, *it, query->eid(), from));
 	}
 }
 
 void Device::_handle_epquery(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const EIDPacket* query = dynamic_cast<const EIDPacket*>(&p);
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
 	if ( !query ) {
 		//TODO: What to do?
 		return;
 	}
-	std::map<uint32_t, const EndpointFunctions::Ptr>::iterator it = _endpoints.find(query->eid());
+	_answer_epquery(socket, query->eid(), from);
+}
+
+void Device::_answer_epquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from)
+{
+	boost::shared_lock<boost::shared_mutex> lock(_endpoints_mutex);
+	wire_cache_t::const_iterator it = _epinfo_wire.find(eid);
 	try {
-		if ( it != _endpoints.end() ) {
-			socket->send(EndpointInfoPacket(query->eid(), it->second->datatype(), it->second->name()), from);
+		if ( it != _epinfo_wire.end() ) {
+			socket->send(it->second, from);
 		} else {
 			std::cout << "unknown EID" << std::endl;
-			socket->send(ErrorPacket(HXB_ERR_UNKNOWNEID), from);
+			socket->send(_unknown_eid_wire, from);
 		}
 	} catch ( const NetworkException& error ) {
 		std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
@@ -180,31 +242,37 @@ void Device::_handle_epquery(hexabus::Socket* socket, const Packet& p, const boo
 
 void Device::_handle_descquery(const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
+	if ( !query ) {
+		//TODO: What to do?
+		return;
+	}
 	for ( std::vector<hexabus::Socket*>::iterator it = _sockets.begin(), end = _sockets.end(); it != end; ++it )
 	{
-		_handle_descquery(*it, p, from);
+		(*it)->strand().post(boost::bind(&Device::_answer_descquery, this, *it, query->eid(), from));
 	}
 }
 
 void Device::_handle_descquery(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const EIDPacket* query = dynamic_cast<const EIDPacket*>(&p);
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
 	if ( !query ) {
 		//TODO: What to do?
 		return;
 	}
+	_answer_descquery(socket, query->eid(), from);
+}
 
-	uint32_t group = 1;
-	std::map<uint32_t, const EndpointFunctions::Ptr>::iterator it = _endpoints.begin();
-	while ( it->first < query->eid() && it != _endpoints.end() ) { it++; }
-	while ( it->first < ( query->eid() + 32 ) && it != _endpoints.end() )
-	{
-		group |= (1 << (it->first - query->eid()) );
-		it++;
-	}
-
+void Device::_answer_descquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from)
+{
+	boost::shared_lock<boost::shared_mutex> lock(_endpoints_mutex);
+	wire_cache_t::const_iterator it = _descriptor_wire.find(eid);
 	try {
-		socket->send(InfoPacket<uint32_t>(query->eid(), group), from);
+		if ( it != _descriptor_wire.end() ) {
+			socket->send(it->second, from);
+		} else {
+			socket->send(InfoPacket<uint32_t>(eid, 1), from);
+		}
 	} catch ( const NetworkException& error ) {
 		std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
 	}
@@ -212,26 +280,60 @@ void Device::_handle_descquery(hexabus::Socket* socket, const Packet& p, const b
 
 void Device::_handle_descepquery(const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
+	if ( !query ) {
+		//TODO: What to do?
+		return;
+	}
 	for ( std::vector<hexabus::Socket*>::iterator it = _sockets.begin(), end = _sockets.end(); it != end; ++it )
 	{
-		_handle_descepquery(*it, p, from);
+		(*it)->strand().post(boost::bind(&Device::_answer_descepquery, this, *it, query->eid(), from));
 	}
 }
 
 void Device::_handle_descepquery(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const EIDPacket* query = dynamic_cast<const EIDPacket*>(&p);
+	const EIDPacket* query = packet_cast<EIDPacket>(&p);
 	if ( !query ) {
 		//TODO: What to do?
 		return;
 	}
+	_answer_descepquery(socket, query->eid(), from);
+}
+
+void Device::_answer_descepquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from)
+{
+	std::vector<char> wire;
+	unsigned generation;
+	{
+		boost::shared_lock<boost::shared_mutex> lock(_endpoints_mutex);
+		wire_cache_t::const_iterator it = _device_info_wire.find(eid);
+		if ( it != _device_info_wire.end() ) {
+			try {
+				socket->send(it->second, from);
+			} catch ( const NetworkException& error ) {
+				std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
+			}
+			return;
+		}
+		generation = _device_info_generation;
+	}
 
 	std::string device_name = "";
 	if ( _read.num_slots() > 0 )
 		device_name = *_read();
+	wire = serialize(EndpointInfoPacket(eid, HXB_DTYPE_UINT32, device_name));
+
+	{
+		// only groups with endpoints are kept, so queries cannot grow the cache,
+		// and nothing is kept if the name changed while it was read
+		boost::unique_lock<boost::shared_mutex> lock(_endpoints_mutex);
+		if ( _descriptor_wire.count(eid) && generation == _device_info_generation )
+			_device_info_wire[eid] = wire;
+	}
 
 	try {
-		socket->send(EndpointInfoPacket(query->eid(), HXB_DTYPE_UINT32, device_name), from);
+		socket->send(wire, from);
 	} catch ( const NetworkException& error ) {
 		std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
 	}
@@ -239,18 +341,18 @@ void Device::_handle_descepquery(hexabus::Socket* socket, const Packet& p, const
 
 uint8_t Device::_handle_smcontrolquery()
 {
-	return _sm_state;
+	return __atomic_load_n(&_sm_state, __ATOMIC_RELAXED);
 }
 
 bool Device::_handle_smcontrolwrite(uint8_t value)
 {
-	_sm_state = value;
+	__atomic_store_n(&_sm_state, value, __ATOMIC_RELAXED);
 	return true;
 }
 
 void Device::_handle_smupload(hexabus::Socket* socket, const Packet& p, const boost::asio::ip::udp::endpoint& from)
 {
-	const WritePacket<boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENGTH> >* write = dynamic_cast<const WritePacket<boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENGTH> >*>(&p);
+	const WritePacket<boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENGTH> >* write = packet_cast<WritePacket<boost::array<char, HXB_65BYTES_PACKET_BUFFER_LENGTH> > >(&p);
 	if ( !write ) {
 		try {
 			socket->send(InfoPacket<bool>(EP_SM_UP_ACKNAK, false), from);
@@ -271,6 +373,7 @@ void Device::_handle_smupload(hexabus::Socket* socket, const Packet& p, const bo
 		if ( !name.empty() )
 		{
 			_write(name);
+			_invalidate_device_info();
 		}
 	}
 	try {
@@ -280,28 +383,131 @@ void Device::_handle_smupload(hexabus::Socket* socket, const Packet& p, const bo
 	}
 }
 
+void Device::_schedule_broadcast(const scheduled_broadcast& broadcast, uint32_t ticks)
+{
+	boost::posix_time::ptime now = _timer.now();
+	if ( _wheel_entries == 0 && (_wheel_time.is_not_a_date_time() || _wheel_time < now) )
+	{
+		// the wheel does not turn while it is empty, entries taken off by
+		// _handle_broadcasts keep the wheel time until they are rescheduled
+		_wheel_time = now;
+	}
+
+	scheduled_broadcast entry(broadcast);
+	entry.rounds = ticks / WHEEL_SLOTS;
+	_wheel[(_wheel_pos + ticks) % WHEEL_SLOTS].push_back(entry);
+	_wheel_entries++;
+}
+
+void Device::_arm_broadcast_timer()
+{
+	if ( _wheel_entries == 0 )
+		return;
+
+	size_t ticks = 0;
+	while ( _wheel[(_wheel_pos + ticks) % WHEEL_SLOTS].empty() )
+		ticks++;
+
+	boost::posix_time::ptime due = _wheel_time + boost::posix_time::milliseconds(long(ticks * WHEEL_TICK_MS));
+	if ( _timer_armed && _timer.expires_at() <= due )
+		return;
+
+	_timer.expires_at(due);
+	_timer.async_wait(boost::bind(&Device::_handle_broadcasts, this, _1));
+	_timer_armed = true;
+}
+
+/*
+ * Due entries are taken off the wheel and their endpoints read without
+ * holding the wheel lock, so slow reads do not block addEndpoint. Each
+ * entry is on the wheel only once, so no endpoint is read by two threads
+ * at the same time.
+ */
 void Device::_handle_broadcasts(const boost::system::error_code& error)
 {
-	if ( !error )
+	if ( error )
+		return;
+
+	boost::posix_time::ptime now = _timer.now();
+	uint32_t interval_ticks = std::max(1, _interval * 1000 / WHEEL_TICK_MS);
+	wheel_slot_t due;
+
 	{
-		for ( std::map<uint32_t, const EndpointFunctions::Ptr>::iterator it = _endpoints.begin(), end = _endpoints.end(); it != end; ++it )
+		boost::mutex::scoped_lock lock(_wheel_mutex);
+		_timer_armed = false;
+
+		while ( _wheel_time <= now )
 		{
-			Packet::Ptr p = it->second->handle_query();
-			if ( p && p->type() != HXB_PTYPE_ERROR )
+			wheel_slot_t slot;
+			slot.swap(_wheel[_wheel_pos]);
+			size_t slot_pos = _wheel_pos;
+
+			_wheel_pos = (_wheel_pos + 1) % WHEEL_SLOTS;
+			_wheel_time += boost::posix_time::milliseconds(long(WHEEL_TICK_MS));
+
+			for ( wheel_slot_t::iterator it = slot.begin(), end = slot.end(); it != end; ++it )
 			{
-				for ( std::vector<hexabus::Socket*>::const_iterator it = _sockets.begin(), end = _sockets.end(); it != end; ++it )
+				if ( it->rounds > 0 )
 				{
-					try {
-						(*it)->send(*p);
-					} catch ( const NetworkException& error ) {
-						std::cerr << "An error occured during " << error.reason() << ": " << error.code().message() << std::endl;
-					}
+					it->rounds--;
+					_wheel[slot_pos].push_back(*it);
+				} else {
+					due.push_back(*it);
+					_wheel_entries--;
 				}
 			}
 		}
+	}
 
-		_timer.expires_from_now(boost::posix_time::seconds(_interval+(rand()%_interval)));
-		_timer.async_wait(boost::bind(&Device::_handle_broadcasts, this, _1));
+	std::vector<Packet::Ptr> packets;
+	for ( wheel_slot_t::iterator it = due.begin(), end = due.end(); it != end; ++it )
+	{
+		const EndpointFunctions& ep = *it->endpoint;
+		bool heartbeat = !ep.broadcastsOnChange()
+			|| it->last_sent.is_not_a_date_time()
+			|| now - it->last_sent >= ep.maxSilence();
+
+		Packet::Ptr p = it->endpoint->handle_broadcast(heartbeat);
+		if ( p && p->type() != HXB_PTYPE_ERROR )
+		{
+			packets.push_back(p);
+			it->last_sent = now;
+		}
+	}
+
+	if ( !packets.empty() )
+	{
+		for ( std::vector<hexabus::Socket*>::const_iterator it = _sockets.begin(), end = _sockets.end(); it != end; ++it )
+		{
+			(*it)->strand().post(boost::bind(&Device::_send_broadcasts, this, *it, packets));
+		}
+	}
+
+	boost::mutex::scoped_lock lock(_wheel_mutex);
+	for ( wheel_slot_t::iterator it = due.begin(), end = due.end(); it != end; ++it )
+	{
+		// on-change endpoints are checked every interval, the others keep
+		// the jitter of one interval at most
+		uint32_t ticks = it->endpoint->broadcastsOnChange()
+			? interval_ticks
+			: interval_ticks + rand() % interval_ticks;
+		_schedule_broadcast(*it, ticks - 1);
+	}
+
+	_arm_broadcast_timer();
+}
+
+void Device::_send_broadcasts(hexabus::Socket* socket, const std::vector<Packet::Ptr>& packets)
+{
+	for ( std::vector<Packet::Ptr>::const_iterator it = packets.begin(), end = packets.end(); it != end; ++it )
+	{
+		socket->queue(**it);
+	}
+
+	Socket::send_errors_t errors = socket->flush();
+	for ( Socket::send_errors_t::const_iterator err = errors.begin(), end = errors.end(); err != end; ++err )
+	{
+		std::cerr << "An error occured during send to " << err->first << ": " << err->second.message() << std::endl;
 	}
 }
 
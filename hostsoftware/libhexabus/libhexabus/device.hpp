@@ -21,13 +21,41 @@
 #define LIBHEXABUS_DEVICE_HPP 1
 
 #include <boost/asio/io_service.hpp>
-#include <boost/asio/deadline_timer.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <cmath>
 
+#include <libhexabus/clock.hpp>
 #include <libhexabus/endpoint_registry.hpp>
 #include <libhexabus/packet.hpp>
 #include <libhexabus/socket.hpp>
 
 namespace hexabus {
+	namespace detail {
+		// non-numeric values leave the deadband with any change
+		template<typename TValue>
+		inline bool exceeds_deadband(const TValue& last, const TValue& value, double)
+		{
+			return !(last == value);
+		}
+
+		inline bool exceeds_deadband(uint8_t last, uint8_t value, double deadband)
+		{
+			return std::fabs(double(value) - double(last)) > deadband;
+		}
+
+		inline bool exceeds_deadband(uint32_t last, uint32_t value, double deadband)
+		{
+			return std::fabs(double(value) - double(last)) > deadband;
+		}
+
+		inline bool exceeds_deadband(float last, float value, double deadband)
+		{
+			return std::fabs(double(value) - double(last)) > deadband;
+		}
+	}
+
 	class EndpointFunctions {
 		public:
 			typedef std::tr1::shared_ptr<EndpointFunctions> Ptr;
@@ -35,20 +63,48 @@ namespace hexabus {
 			std::string name() const { return _name; }
 			uint8_t datatype() const { return _datatype; }
 
+			/**
+			 * By default, the value of an endpoint is broadcast once per
+			 * broadcast interval of the device. In on-change mode the value is
+			 * read every interval, but only broadcast if it moved more than
+			 * deadband away from the value broadcast last, or if nothing was
+			 * broadcast for max_silence.
+			 */
+			void broadcastOnChange(double deadband, boost::posix_time::time_duration max_silence)
+			{
+				_on_change = true;
+				_deadband = deadband;
+				_max_silence = max_silence;
+			}
+			bool broadcastsOnChange() const { return _on_change; }
+			double deadband() const { return _deadband; }
+			boost::posix_time::time_duration maxSilence() const { return _max_silence; }
+
 			virtual hexabus::Packet::Ptr handle_query() const = 0;
 			virtual uint8_t handle_write(const hexabus::Packet& p) const = 0;
+			/**
+			 * Returns the packet to broadcast for the current value, or nothing
+			 * if there is no value or it is still within the deadband. A
+			 * heartbeat is broadcast in any case.
+			 */
+			virtual hexabus::Packet::Ptr handle_broadcast(bool heartbeat) = 0;
 
 		protected:
 			EndpointFunctions(uint32_t eid, const std::string& name, uint8_t datatype)
 				: _eid(eid)
 				, _name(name)
 				, _datatype(datatype)
+				, _on_change(false)
+				, _deadband(0)
 			{}
 
 		private:
 			uint32_t _eid;
 			std::string _name;
 			uint8_t _datatype;
+			bool _on_change;
+			double _deadband;
+			boost::posix_time::time_duration _max_silence;
 	};
 
 	template<typename TValue>
@@ -58,18 +114,18 @@ namespace hexabus {
 			typedef boost::function<TValue ()> endpoint_read_fn_t;
 			typedef boost::function<bool (const TValue& value)> endpoint_write_fn_t;
 			TypedEndpointFunctions(uint32_t eid, const std::string& name)
-				: EndpointFunctions(eid, name, calculateDatatype())
+				: EndpointFunctions(eid, name, datatype_of<TValue>::value)
 			{}
 
-			boost::signals2::connection onRead(
+			hexabus::connection onRead(
 					const endpoint_read_fn_t& callback) {
-				boost::signals2::connection result = _read.connect(callback);
+				hexabus::connection result = _read.connect(callback);
 
 				return result;
 			}
-			boost::signals2::connection onWrite(
+			hexabus::connection onWrite(
 					const endpoint_write_fn_t& callback) {
-				boost::signals2::connection result = _write.connect(callback);
+				hexabus::connection result = _write.connect(callback);
 
 				return result;
 			}
@@ -86,7 +142,7 @@ namespace hexabus {
 				}
 			}
 			virtual uint8_t handle_write(const hexabus::Packet& p) const {
-				const WritePacket<TValue>* write = dynamic_cast<const WritePacket<TValue>*>(&p);
+				const WritePacket<TValue>* write = packet_cast<WritePacket<TValue> >(&p);
 				if ( write != NULL ) {
 					if ( _write.num_slots() < 1 ) {
 						return HXB_ERR_WRITEREADONLY;
@@ -100,6 +156,21 @@ namespace hexabus {
 
 				return HXB_ERR_INTERNAL;
 			}
+			virtual hexabus::Packet::Ptr handle_broadcast(bool heartbeat) {
+				if ( _read.num_slots() < 1 )
+					return Packet::Ptr();
+
+				boost::optional<TValue> value = _read();
+				if ( !value )
+					return Packet::Ptr();
+
+				if ( broadcastsOnChange() && !heartbeat && _last_broadcast
+						&& !detail::exceeds_deadband(*_last_broadcast, *value, deadband()) )
+					return Packet::Ptr();
+
+				_last_broadcast = value;
+				return Packet::Ptr(new InfoPacket<TValue>(eid(), *value));
+			}
 
 			static typename TypedEndpointFunctions<TValue>::Ptr fromEndpointDescriptor(const EndpointDescriptor& ep) {
 				typename TypedEndpointFunctions<TValue>::Ptr result(new TypedEndpointFunctions<TValue>(ep.eid(), ep.description()));
@@ -111,8 +182,9 @@ namespace hexabus {
 			}
 
 		private:
-			boost::signals2::signal<TValue ()> _read;
-			boost::signals2::signal<bool (const TValue&)> _write;
+			hexabus::signal<TValue ()> _read;
+			hexabus::signal<bool (const TValue&)> _write;
+			boost::optional<TValue> _last_broadcast;
 
 			BOOST_STATIC_ASSERT_MSG((
 				boost::is_same<TValue, bool>::value
@@ -125,24 +197,15 @@ namespace hexabus {
 					|| boost::is_same<TValue, boost::array<char, 16> >::value
 					|| boost::is_same<TValue, boost::array<char, 65> >::value),
 				"I don't know how to handle that type");
-
-			static uint8_t calculateDatatype()
-			{
-				return boost::is_same<TValue, bool>::value ? HXB_DTYPE_BOOL :
-					boost::is_same<TValue, uint8_t>::value ? HXB_DTYPE_UINT8 :
-					boost::is_same<TValue, uint32_t>::value ? HXB_DTYPE_UINT32 :
-					boost::is_same<TValue, float>::value ? HXB_DTYPE_FLOAT :
-					boost::is_same<TValue, std::string>::value ? HXB_DTYPE_128STRING :
-					boost::is_same<TValue, boost::posix_time::ptime>::value ? HXB_DTYPE_DATETIME :
-					boost::is_same<TValue, boost::posix_time::time_duration>::value ? HXB_DTYPE_TIMESTAMP :
-					boost::is_same<TValue, boost::array<char, 16> >::value
-						? HXB_DTYPE_16BYTES :
-					boost::is_same<TValue, boost::array<char, 65> >::value
-						? HXB_DTYPE_65BYTES :
-					(throw "BUG: Unknown datatype!", HXB_DTYPE_UNDEFINED);
-			}
 	};
 
+	/*
+	 * The io_service a Device runs on may be run by several threads. Packets
+	 * received on a bound socket are handled on the strand of that socket,
+	 * endpoint callbacks can be invoked from any of the threads and must
+	 * protect their own state. Devices need synchronized signals, do not
+	 * build with UNSYNCHRONIZED_SIGNALS when running more than one thread.
+	 */
 	class Device {
 		public:
 			typedef boost::function<std::string ()> read_name_fn_t;
@@ -150,9 +213,9 @@ namespace hexabus {
 			Device(boost::asio::io_service& io, const std::vector<std::string>& interfaces, const std::vector<std::string>& addresses, int interval = 60);
 			void addEndpoint(const EndpointFunctions::Ptr ep);
 
-			boost::signals2::connection onReadName(
+			hexabus::connection onReadName(
 					const read_name_fn_t& callback);
-			boost::signals2::connection onWriteName(
+			hexabus::connection onWriteName(
 					const write_name_fn_t& callback);
 		protected:
 			void _handle_query(hexabus::Socket* socket, const hexabus::Packet& p, const boost::asio::ip::udp::endpoint& from);
@@ -163,22 +226,65 @@ namespace hexabus {
 			void _handle_epquery(hexabus::Socket* socket, const hexabus::Packet& p, const boost::asio::ip::udp::endpoint& from);
 			void _handle_descquery(hexabus::Socket* socket, const hexabus::Packet& p, const boost::asio::ip::udp::endpoint& from);
 			void _handle_descepquery(hexabus::Socket* socket, const hexabus::Packet& p, const boost::asio::ip::udp::endpoint& from);
+			void _answer_epquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from);
+			void _answer_descquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from);
+			void _answer_descepquery(hexabus::Socket* socket, uint32_t eid, const boost::asio::ip::udp::endpoint& from);
 			uint8_t _handle_smcontrolquery();
 			bool _handle_smcontrolwrite(uint8_t);
 			void _handle_smupload(hexabus::Socket* socket, const hexabus::Packet& p, const boost::asio::ip::udp::endpoint& from);
 		private:
+			typedef std::map<uint32_t, std::vector<char> > wire_cache_t;
+
+			/*
+			 * Endpoint broadcasts are kept in a timing wheel of WHEEL_SLOTS
+			 * slots, one per WHEEL_TICK_MS milliseconds. Broadcasts further
+			 * away than one turn wait for the given number of rounds.
+			 */
+			enum { WHEEL_SLOTS = 256, WHEEL_TICK_MS = 250 };
+			struct scheduled_broadcast {
+				EndpointFunctions::Ptr endpoint;
+				uint32_t rounds;
+				boost::posix_time::ptime last_sent;
+			};
+			typedef std::vector<scheduled_broadcast> wheel_slot_t;
+
+			void _schedule_broadcast(const scheduled_broadcast& broadcast, uint32_t ticks);
+			void _arm_broadcast_timer();
 			void _handle_broadcasts(const boost::system::error_code& error);
+			void _send_broadcasts(hexabus::Socket* socket, const std::vector<Packet::Ptr>& packets);
 			void _handle_errors(const hexabus::GenericException& error);
+			void _update_descriptor(uint32_t group);
+			void _invalidate_device_info();
+			EndpointFunctions::Ptr _find_endpoint(uint32_t eid);
 
-			boost::signals2::signal<std::string ()> _read;
-			boost::signals2::signal<void (const std::string&)> _write;
+			hexabus::signal<std::string ()> _read;
+			hexabus::signal<void (const std::string&)> _write;
 
 			hexabus::Listener _listener;
 			std::vector<hexabus::Socket*> _sockets;
-			boost::asio::deadline_timer _timer;
 			int _interval;
-			std::map<uint32_t, const EndpointFunctions::Ptr> _endpoints;
+
+			// protects the wheel and the timer
+			boost::mutex _wheel_mutex;
+			hexabus::Timer _timer;
+			std::vector<wheel_slot_t> _wheel;
+			size_t _wheel_pos;
+			// time the slot at _wheel_pos is due
+			boost::posix_time::ptime _wheel_time;
+			size_t _wheel_entries;
+			bool _timer_armed;
 			uint8_t _sm_state;
+
+			// protects the endpoints and the serialized answers to discovery
+			// queries, which are rebuilt when endpoints are added or the
+			// device name changes
+			boost::shared_mutex _endpoints_mutex;
+			std::map<uint32_t, const EndpointFunctions::Ptr> _endpoints;
+			wire_cache_t _epinfo_wire;
+			wire_cache_t _descriptor_wire;
+			wire_cache_t _device_info_wire;
+			unsigned _device_info_generation;
+			std::vector<char> _unknown_eid_wire;
 	};
 }
 
@@ -5,90 +5,396 @@
 #include <boost/scope_exit.hpp>
 
 #include "filtering.hpp"
+#include "private/serialization.hpp"
 #include "../../../shared/endpoints.h"
 
 using namespace hexabus;
 
-DeviceInterrogator::DeviceInterrogator(hexabus::Socket& socket)
+const size_t DeviceInterrogator::HeapArity;
+
+// RFC 6298 recommends a minimum of one second, which is much too slow for
+// the local links hexabus devices sit on
+const boost::posix_time::time_duration DeviceInterrogator::InitialTimeout = boost::posix_time::seconds(1);
+const boost::posix_time::time_duration DeviceInterrogator::MinTimeout = boost::posix_time::milliseconds(200);
+const boost::posix_time::time_duration DeviceInterrogator::MaxTimeout = boost::posix_time::seconds(60);
+// twice what the fixed one second timeout took for five tries
+const boost::posix_time::time_duration DeviceInterrogator::MaxRequestTime = boost::posix_time::seconds(10);
+
+DeviceInterrogator::DeviceInterrogator(hexabus::Socket& socket, size_t window, size_t device_window)
 	: socket(socket),
 		timer(socket.ioService()),
 		on_reply(
 				socket.onPacketReceived(
-					boost::bind(&DeviceInterrogator::packet_received, this, _1, _2)))
+					boost::bind(&DeviceInterrogator::packet_received, this, _1, _2))),
+		_window(std::max<size_t>(window, 1)),
+		_device_window(std::max<size_t>(device_window, 1)),
+		_max_timeout(MaxTimeout),
+		_max_request_time(MaxRequestTime),
+		in_flight(0),
+		pumping(false)
 {
 }
 
-void DeviceInterrogator::packet_received(const Packet& packet, const boost::asio::ip::udp::endpoint& from)
+void DeviceInterrogator::set_window(size_t window, size_t device_window)
 {
-	running_queries_t::iterator it = running_queries.begin();
-	bool order_destroyed = false;
-	DeviceInterrogator* _this = this;
+	_window = std::max<size_t>(window, 1);
+	_device_window = std::max<size_t>(device_window, 1);
+
+	for (devices_t::const_iterator it = devices.begin(), end = devices.end(); it != end; ++it)
+		schedule(it->second);
+
+	pump();
+	reschedule_timer();
+}
+
+void DeviceInterrogator::set_timeouts(const boost::posix_time::time_duration& max_timeout,
+		const boost::posix_time::time_duration& max_request_time)
+{
+	_max_timeout = std::min(MaxTimeout, std::max(MinTimeout, max_timeout));
+	_max_request_time = max_request_time;
+
+	// requests in flight keep their deadlines
+	for (devices_t::const_iterator it = devices.begin(), end = devices.end(); it != end; ++it)
+		it->second->rto = std::min(_max_timeout, it->second->rto);
+}
+
+void DeviceInterrogator::heap_place(size_t index, const request_ptr& req)
+{
+	deadlines[index] = req;
+	req->heap_index = index;
+}
+
+void DeviceInterrogator::heap_sift_up(size_t index)
+{
+	request_ptr req = deadlines[index];
+
+	while (index > 0) {
+		size_t parent = (index - 1) / HeapArity;
+		if (!(req->deadline < deadlines[parent]->deadline))
+			break;
+
+		heap_place(index, deadlines[parent]);
+		index = parent;
+	}
+
+	heap_place(index, req);
+}
+
+void DeviceInterrogator::heap_sift_down(size_t index)
+{
+	request_ptr req = deadlines[index];
+	size_t size = deadlines.size();
 
-	BOOST_SCOPE_EXIT((&running_queries) (&order_destroyed) (_this)) {
-		if (order_destroyed) {
-			std::make_heap(running_queries.begin(), running_queries.end());
+	for (;;) {
+		size_t first = index * HeapArity + 1;
+		if (first >= size)
+			break;
+
+		size_t min = first;
+		for (size_t child = first + 1; child < std::min(first + HeapArity, size); child++) {
+			if (deadlines[child]->deadline < deadlines[min]->deadline)
+				min = child;
 		}
+
+		if (!(deadlines[min]->deadline < req->deadline))
+			break;
+
+		heap_place(index, deadlines[min]);
+		index = min;
+	}
+
+	heap_place(index, req);
+}
+
+void DeviceInterrogator::heap_remove(size_t index)
+{
+	request_ptr last = deadlines.back();
+	deadlines.pop_back();
+
+	if (index < deadlines.size()) {
+		heap_place(index, last);
+		heap_sift_up(index);
+		heap_sift_down(last->heap_index);
+	}
+}
+
+DeviceInterrogator::device_ptr DeviceInterrogator::device(const boost::asio::ip::address_v6& address)
+{
+	device_ptr& dev = devices[address.to_bytes()];
+
+	if (!dev) {
+		dev.reset(new device_state);
+		dev->address = address;
+		dev->has_rtt = false;
+		dev->rto = std::min(_max_timeout, InitialTimeout);
+		dev->in_flight = 0;
+		dev->scheduled = false;
+	}
+
+	return dev;
+}
+
+void DeviceInterrogator::schedule(const device_ptr& dev)
+{
+	if (!dev->scheduled && !dev->waiting.empty() && dev->in_flight < _device_window) {
+		dev->scheduled = true;
+		ready.push_back(dev);
+	}
+}
+
+void DeviceInterrogator::pump()
+{
+	// failure callbacks of requests started here may queue new requests
+	if (pumping)
+		return;
+
+	pumping = true;
+	BOOST_SCOPE_EXIT((&pumping)) {
+		pumping = false;
+	} BOOST_SCOPE_EXIT_END
+
+	while (in_flight < _window && !ready.empty()) {
+		device_ptr dev = ready.front();
+		ready.pop_front();
+		dev->scheduled = false;
+
+		// requests answered by unsolicited packets are left in the queue
+		while (!dev->waiting.empty() && dev->waiting.front()->done)
+			dev->waiting.pop_front();
+
+		if (dev->waiting.empty() || dev->in_flight >= _device_window)
+			continue;
+
+		request_ptr req = dev->waiting.front();
+		dev->waiting.pop_front();
+
+		schedule(dev);
+		start(req);
+	}
+}
+
+void DeviceInterrogator::start(const request_ptr& req)
+{
+	try {
+		socket.send(*req->packet, req->device->address);
+	} catch (const GenericException& e) {
+		fail(req, e);
+		return;
+	}
+
+	boost::posix_time::ptime now = timer.now();
+
+	if (req->device->first_sent.is_not_a_date_time())
+		req->device->first_sent = now;
+
+	req->in_flight = true;
+	req->sent_at = now;
+	req->timeout = req->device->rto;
+	req->give_up_at = now + _max_request_time;
+	req->deadline = std::min(now + req->timeout, req->give_up_at);
+	req->device->in_flight++;
+	in_flight++;
+
+	deadlines.push_back(req);
+	heap_sift_up(deadlines.size() - 1);
+}
+
+void DeviceInterrogator::finish(const request_ptr& req)
+{
+	if (req->in_flight) {
+		heap_remove(req->heap_index);
+		req->in_flight = false;
+		req->device->in_flight--;
+		in_flight--;
+	}
+
+	req->done = true;
+	requests.erase(req->key);
+	schedule(req->device);
+}
+
+void DeviceInterrogator::fail(const request_ptr& req, const GenericException& error)
+{
+	finish(req);
+
+	std::vector<query_ptr> queries = req->queries;
+	for (std::vector<query_ptr>::const_iterator it = queries.begin(), end = queries.end(); it != end; ++it)
+		detach_query(*it);
+
+	for (std::vector<query_ptr>::const_iterator it = queries.begin(), end = queries.end(); it != end; ++it)
+		(*it)->failure(error);
+}
+
+void DeviceInterrogator::sample_rtt(device_state& dev, boost::posix_time::time_duration rtt)
+{
+	if (!dev.has_rtt) {
+		dev.srtt = rtt;
+		dev.rttvar = rtt / 2;
+		dev.has_rtt = true;
+	} else {
+		boost::posix_time::time_duration delta = dev.srtt - rtt;
+		if (delta.is_negative())
+			delta = delta.invert_sign();
+
+		dev.rttvar = (dev.rttvar * 3 + delta) / 4;
+		dev.srtt = (dev.srtt * 7 + rtt) / 8;
+	}
+
+	dev.rto = std::min(_max_timeout, std::max(MinTimeout, dev.srtt + dev.rttvar * 4));
+}
+
+void DeviceInterrogator::detach_query(const query_ptr& query)
+{
+	running_queries_t::iterator it = running_queries.find(query_key(query->req->device->address, query->eid));
+	std::vector<query_ptr>& bucket = it->second;
+
+	bucket.erase(std::find(bucket.begin(), bucket.end(), query));
+	if (bucket.empty())
+		running_queries.erase(it);
+
+	std::vector<query_ptr>& queries = query->req->queries;
+	queries.erase(std::find(queries.begin(), queries.end(), query));
+
+	query->req.reset();
+}
+
+void DeviceInterrogator::collect_matches(const query_key& key, const Packet& packet,
+		const boost::asio::ip::udp::endpoint& from, std::vector<query_ptr>& matches)
+{
+	running_queries_t::const_iterator it = running_queries.find(key);
+	if (it == running_queries.end())
+		return;
+
+	for (std::vector<query_ptr>::const_iterator q = it->second.begin(), end = it->second.end(); q != end; ++q) {
+		if (((*q)->classes & packet.packetClass()) && (*q)->filter(packet, from))
+			matches.push_back(*q);
+	}
+}
+
+void DeviceInterrogator::packet_received(const Packet& packet, const boost::asio::ip::udp::endpoint& from)
+{
+	if (running_queries.empty() || !from.address().is_v6())
+		return;
+
+	boost::asio::ip::address_v6 source = from.address().to_v6();
+	std::vector<query_ptr> matches;
+
+	const EIDPacket* eidPacket = packet_cast<EIDPacket>(&packet);
+	if (eidPacket)
+		collect_matches(query_key(source, eidPacket->eid()), packet, from, matches);
+	collect_matches(query_key(source, boost::none), packet, from, matches);
+
+	if (matches.empty())
+		return;
+
+	DeviceInterrogator* _this = this;
+	BOOST_SCOPE_EXIT((_this)) {
+		_this->pump();
 		_this->reschedule_timer();
 	} BOOST_SCOPE_EXIT_END
 
-	while (it != running_queries.end()) {
-		base_query& q = *it;
+	boost::posix_time::ptime now = timer.now();
 
-		if (q.filter(packet, from)) {
-			BOOST_SCOPE_EXIT((&running_queries) (&order_destroyed) (&it)) {
-				running_queries.erase(it);
-				order_destroyed = true;
-			} BOOST_SCOPE_EXIT_END
+	for (std::vector<query_ptr>::const_iterator it = matches.begin(), end = matches.end(); it != end; ++it) {
+		request_ptr req = (*it)->req;
+		if (!req)
+			continue;
 
-			q.response(packet);
-		} else {
-			it++;
+		detach_query(*it);
+		if (req->queries.empty()) {
+			// Karn's algorithm: the reply may belong to any transmission
+			if (req->in_flight && req->retries == 0)
+				sample_rtt(*req->device, now - req->sent_at);
+			finish(req);
 		}
+
+		(*it)->response(packet);
 	}
 }
 
 void DeviceInterrogator::timeout(const boost::system::error_code& err)
 {
-	if (!err && running_queries.size()) {
-		boost::posix_time::ptime now = boost::asio::deadline_timer::traits_type::now();
+	if (err)
+		return;
+
+	timer_deadline = boost::posix_time::ptime();
 
-		std::pop_heap(running_queries.begin(), running_queries.end());
-		base_query& back = running_queries.back();
+	DeviceInterrogator* _this = this;
+	BOOST_SCOPE_EXIT((_this)) {
+		_this->pump();
+		_this->reschedule_timer();
+	} BOOST_SCOPE_EXIT_END
 
-		DeviceInterrogator* _this = this;
-		BOOST_SCOPE_EXIT((_this)) {
-			_this->reschedule_timer();
-		} BOOST_SCOPE_EXIT_END
+	boost::posix_time::ptime now = timer.now();
 
-		if (back.retries++ == back.max_retries) {
-			BOOST_SCOPE_EXIT((&running_queries)) {
-				running_queries.pop_back();
-			} BOOST_SCOPE_EXIT_END
+	while (deadlines.size() && deadlines[0]->deadline <= now) {
+		request_ptr req = deadlines[0];
+		device_state& dev = *req->device;
 
-			back.failure(NetworkException("Device not responding",
+		// requests sent before the timeout was last doubled expire at about
+		// the same time, they belong to the timeout event that doubled it
+		if (req->timeout >= dev.rto)
+			dev.rto = std::min(_max_timeout, dev.rto * 2);
+
+		if (req->retries++ == req->max_retries || req->deadline >= req->give_up_at) {
+			fail(req, NetworkException("Device not responding",
 						boost::system::error_code(boost::system::errc::timed_out, boost::system::generic_category())));
-		} else {
-			try {
-				socket.send(*back.packet, back.device);
-			} catch (const GenericException& e) {
-				back.failure(e);
-				running_queries.pop_back();
-				return;
-			} catch (...) {
-				running_queries.pop_back();
-				throw;
-			}
-
-			back.deadline += boost::posix_time::seconds(1);
-			std::push_heap(running_queries.begin(), running_queries.end());
+			continue;
+		}
+
+		try {
+			socket.send(*req->packet, dev.address);
+		} catch (const GenericException& e) {
+			fail(req, e);
+			continue;
 		}
+
+		req->timeout = dev.rto;
+		req->deadline = std::min(now + req->timeout, req->give_up_at);
+		heap_sift_down(0);
+	}
+}
+
+boost::posix_time::ptime DeviceInterrogator::first_sent(const boost::asio::ip::address_v6& device) const
+{
+	devices_t::const_iterator it = devices.find(device.to_bytes());
+	if (it == devices.end())
+		return boost::posix_time::ptime();
+
+	return it->second->first_sent;
+}
+
+void DeviceInterrogator::cancel(const boost::asio::ip::address_v6& device)
+{
+	devices_t::const_iterator dev = devices.find(device.to_bytes());
+	if (dev == devices.end())
+		return;
+
+	DeviceInterrogator* _this = this;
+	BOOST_SCOPE_EXIT((_this)) {
+		_this->pump();
+		_this->reschedule_timer();
+	} BOOST_SCOPE_EXIT_END
+
+	std::vector<request_ptr> cancelled;
+	for (requests_t::const_iterator it = requests.begin(), end = requests.end(); it != end; ++it) {
+		if (it->second->device == dev->second)
+			cancelled.push_back(it->second);
+	}
+
+	// failure callbacks may queue new requests to the device, those are kept
+	for (std::vector<request_ptr>::const_iterator it = cancelled.begin(), end = cancelled.end(); it != end; ++it) {
+		if (!(*it)->done)
+			fail(*it, NetworkException("Request cancelled",
+						boost::system::error_code(boost::asio::error::operation_aborted)));
 	}
 }
 
 void DeviceInterrogator::reschedule_timer()
 {
-	if (running_queries.size()) {
-		timer.expires_at(running_queries[0].deadline);
+	if (deadlines.size() && deadlines[0]->deadline != timer_deadline) {
+		timer_deadline = deadlines[0]->deadline;
+		timer.expires_at(timer_deadline);
 		timer.async_wait(boost::bind(&DeviceInterrogator::timeout, this, _1));
 	}
 }
@@ -97,31 +403,48 @@ void DeviceInterrogator::queue_query(
 		const boost::asio::ip::address_v6& device,
 		const Packet::Ptr& packet,
 		const Socket::filter_t& filter,
+		const filtering::Constraints& constraints,
 		const boost::function<void (const Packet&)>& response_cb,
 		const boost::function<void (const GenericException&)>& failure_cb,
 		int max_tries)
 {
-	base_query query;
-	query.retries = 0;
-	query.max_retries = max_tries - 1;
-	query.device = device;
-	query.deadline = boost::asio::deadline_timer::traits_type::now() + boost::posix_time::seconds(1);
-	query.filter = filter;
-	query.packet = packet;
-	query.response = response_cb;
-	query.failure = failure_cb;
+	DeviceInterrogator* _this = this;
+	BOOST_SCOPE_EXIT((_this)) {
+		_this->pump();
+		_this->reschedule_timer();
+	} BOOST_SCOPE_EXIT_END
 
-	try {
-		socket.send(*query.packet, query.device);
-	} catch (const GenericException& e) {
-		failure_cb(e);
-		return;
-	}
+	boost::asio::ip::address_v6::bytes_type address = device.to_bytes();
+	std::vector<char> wire = serialize(*packet);
+
+	std::string key(address.begin(), address.end());
+	key.append(wire.begin(), wire.end());
 
-	running_queries.push_back(query);
-	std::push_heap(running_queries.begin(), running_queries.end());
+	request_ptr& req = requests[key];
+	if (req) {
+		req->max_retries = std::max(req->max_retries, max_tries - 1);
+	} else {
+		req.reset(new request);
+		req->device = this->device(device);
+		req->packet = packet;
+		req->key = key;
+		req->retries = 0;
+		req->max_retries = max_tries - 1;
+		req->in_flight = false;
+		req->done = false;
 
-	if (running_queries.size() == 1) {
-		reschedule_timer();
+		req->device->waiting.push_back(req);
+		schedule(req->device);
 	}
+
+	query_ptr query(new base_query);
+	query->filter = filter;
+	query->classes = constraints.classes;
+	query->eid = constraints.eid;
+	query->response = response_cb;
+	query->failure = failure_cb;
+	query->req = req;
+
+	req->queries.push_back(query);
+	running_queries[query_key(device, query->eid)].push_back(query);
 }
@@ -1,6 +1,7 @@
 #ifndef LIBHEXABUS_DEVICE__INTERROGATOR_HPP
 #define LIBHEXABUS_DEVICE__INTERROGATOR_HPP 1
 
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -9,53 +10,210 @@
 #include <boost/smart_ptr.hpp>
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
-#include <boost/signals2.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/optional.hpp>
+#include <boost/unordered_map.hpp>
+#include <libhexabus/clock.hpp>
+#include <libhexabus/signals.hpp>
 #include <libhexabus/socket.hpp>
+#include <libhexabus/filtering.hpp>
 
 namespace hexabus {
 
+/**
+ * Sends requests to devices and retries them until a matching reply arrives.
+ *
+ * Requests are not sent all at once: at most window() requests are in flight
+ * in total, and at most device_window() to a single device. Requests beyond
+ * that wait in a per-device queue, devices with waiting requests are served
+ * round-robin. Identical requests to the same device that are waiting or in
+ * flight are coalesced into a single packet.
+ *
+ * The retransmission timeout is estimated per device from the round trip
+ * times of answered requests as in RFC 6298. Round trips of retransmitted
+ * requests are never sampled. When requests to a device time out, its
+ * timeout is doubled once, requests that were sent before the last doubling
+ * are retransmitted without doubling it again. A request fails after
+ * max_tries transmissions or max_request_time() after it was first sent,
+ * whichever comes first.
+ */
 class DeviceInterrogator {
 	private:
-		struct base_query {
+		struct device_state;
+		struct request;
+		struct base_query;
+
+		typedef std::tr1::shared_ptr<device_state> device_ptr;
+		typedef std::tr1::shared_ptr<request> request_ptr;
+		typedef std::tr1::shared_ptr<base_query> query_ptr;
+
+		struct device_state {
+			boost::asio::ip::address_v6 address;
+
+			bool has_rtt;
+			boost::posix_time::time_duration srtt;
+			boost::posix_time::time_duration rttvar;
+			boost::posix_time::time_duration rto;
+
+			size_t in_flight;
+			// when the first request to the device was sent
+			boost::posix_time::ptime first_sent;
+			// set while the device is in the ready queue
+			bool scheduled;
+			std::deque<request_ptr> waiting;
+		};
+
+		// a packet sent to a device, shared by all queries waiting for it
+		struct request {
+			device_ptr device;
+			Packet::Ptr packet;
+			std::string key;
+
 			int retries;
 			int max_retries;
-			boost::asio::ip::address_v6 device;
+			// timeout of the device when the request was last sent
+			boost::posix_time::time_duration timeout;
+			boost::posix_time::ptime give_up_at;
 
+			bool in_flight;
+			bool done;
+			boost::posix_time::ptime sent_at;
 			boost::posix_time::ptime deadline;
+			// position in the deadline heap while in flight
+			size_t heap_index;
 
-			Packet::Ptr packet;
+			std::vector<query_ptr> queries;
+		};
+
+		struct base_query {
 			Socket::filter_t filter;
+			// packet classes the filter can match
+			packet_class_mask classes;
+			// EID the filter requires, if any
+			boost::optional<uint32_t> eid;
 
 			boost::function<void (const Packet&)> response;
 			boost::function<void (const GenericException&)> failure;
 
-			bool operator<(const base_query& other) { return other.deadline < deadline; }
+			// request the query waits on, reset once the query is finished
+			request_ptr req;
+		};
+
+		/*
+		 * Running queries are indexed by the device they were sent to and the EID
+		 * their reply must carry (if the filter of the query requires one), so a
+		 * reply is only matched against the queries it may answer.
+		 */
+		struct query_key {
+			boost::asio::ip::address_v6::bytes_type device;
+			uint32_t eid;
+			bool any_eid;
+
+			query_key(const boost::asio::ip::address_v6& device, const boost::optional<uint32_t>& eid)
+				: device(device.to_bytes()), eid(eid ? *eid : 0), any_eid(!eid)
+			{}
+
+			bool operator==(const query_key& other) const
+			{
+				return eid == other.eid && any_eid == other.any_eid && device == other.device;
+			}
+
+			friend size_t hash_value(const query_key& key)
+			{
+				size_t seed = boost::hash_range(key.device.begin(), key.device.end());
+				boost::hash_combine(seed, key.eid);
+				boost::hash_combine(seed, key.any_eid);
+				return seed;
+			}
 		};
 
-		typedef std::vector<base_query> running_queries_t;
+		typedef boost::unordered_map<query_key, std::vector<query_ptr> > running_queries_t;
+		typedef boost::unordered_map<boost::asio::ip::address_v6::bytes_type, device_ptr> devices_t;
+		// requests that are waiting or in flight, by device and wire format
+		typedef boost::unordered_map<std::string, request_ptr> requests_t;
+
+		// arity of the deadline heap
+		static const size_t HeapArity = 4;
 
 	private:
 		hexabus::Socket& socket;
-		boost::asio::deadline_timer timer;
-		boost::signals2::scoped_connection on_reply;
+		hexabus::Timer timer;
+		boost::posix_time::ptime timer_deadline;
+		hexabus::scoped_connection on_reply;
+
+		size_t _window;
+		size_t _device_window;
+		boost::posix_time::time_duration _max_timeout;
+		boost::posix_time::time_duration _max_request_time;
+		size_t in_flight;
+		bool pumping;
 
 		running_queries_t running_queries;
+		devices_t devices;
+		requests_t requests;
+		// devices with waiting requests and room in their window
+		std::deque<device_ptr> ready;
+		// requests in flight ordered by deadline, each knows its heap_index
+		std::vector<request_ptr> deadlines;
 
 		void packet_received(const Packet& packet, const boost::asio::ip::udp::endpoint& from);
 		void timeout(const boost::system::error_code& err);
 
 		void reschedule_timer();
 
+		void heap_place(size_t index, const request_ptr& req);
+		void heap_sift_up(size_t index);
+		void heap_sift_down(size_t index);
+		void heap_remove(size_t index);
+
+		device_ptr device(const boost::asio::ip::address_v6& address);
+		void schedule(const device_ptr& dev);
+		void pump();
+		void start(const request_ptr& req);
+		void finish(const request_ptr& req);
+		void fail(const request_ptr& req, const GenericException& error);
+		void sample_rtt(device_state& dev, boost::posix_time::time_duration rtt);
+
+		void detach_query(const query_ptr& query);
+		void collect_matches(const query_key& key, const Packet& packet,
+				const boost::asio::ip::udp::endpoint& from, std::vector<query_ptr>& matches);
+
 		void queue_query(
 				const boost::asio::ip::address_v6& device,
 				const Packet::Ptr& packet,
 				const Socket::filter_t& filter,
+				const filtering::Constraints& constraints,
 				const boost::function<void (const Packet&)>& response_cb,
 				const boost::function<void (const GenericException&)>& failure_cb,
 				int max_tries);
 
 	public:
-		DeviceInterrogator(hexabus::Socket& socket);
+		// bounds of the retransmission timeout, and its value for unknown devices
+		static const boost::posix_time::time_duration InitialTimeout;
+		static const boost::posix_time::time_duration MinTimeout;
+		static const boost::posix_time::time_duration MaxTimeout;
+		// default time a request is retried for
+		static const boost::posix_time::time_duration MaxRequestTime;
+
+		DeviceInterrogator(hexabus::Socket& socket, size_t window = 32, size_t device_window = 2);
+
+		size_t window() const { return _window; }
+		size_t device_window() const { return _device_window; }
+		void set_window(size_t window, size_t device_window);
+
+		boost::posix_time::time_duration max_timeout() const { return _max_timeout; }
+		boost::posix_time::time_duration max_request_time() const { return _max_request_time; }
+		// lower the upper bound of the retransmission timeout (at least MinTimeout), or the retry time
+		void set_timeouts(const boost::posix_time::time_duration& max_timeout,
+				const boost::posix_time::time_duration& max_request_time);
+
+		// requests that have been sent and not yet answered or timed out
+		size_t requests_in_flight() const { return in_flight; }
+
+		// when the first request to device was sent, not_a_date_time if none was sent yet
+		boost::posix_time::ptime first_sent(const boost::asio::ip::address_v6& device) const;
+		// fail all requests to device that are waiting or in flight with operation_aborted
+		void cancel(const boost::asio::ip::address_v6& device);
 
 		template<typename Packet, typename Filter>
 		void send_request(
@@ -70,6 +228,7 @@ class DeviceInterrogator {
 					device,
 					hexabus::Packet::Ptr(new Packet(packet)),
 					hexabus::filtering::sourceIP() == device && filter,
+					hexabus::filtering::constraints(filter),
 					response_cb,
 					failure_cb,
 					max_tries);
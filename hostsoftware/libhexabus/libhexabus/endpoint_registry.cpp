@@ -1,12 +1,20 @@
 #include "libhexabus/endpoint_registry.hpp"
 
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/info_parser.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include "private/paths.hpp"
+#include "private/mapped_file.hpp"
 #include "error.hpp"
 
 using namespace hexabus;
@@ -23,16 +31,221 @@ static boost::filesystem::path path_from_env_or_default()
 	}
 }
 
-EndpointRegistry::EndpointRegistry()
-	: _path(path_from_env_or_default())
+boost::filesystem::path EndpointRegistry::cache_directory()
 {
-	reload();
+	if (const char* dir = std::getenv("HXB_ENDPOINT_REGISTRY_CACHE"))
+		return dir;
+	if (const char* dir = std::getenv("XDG_CACHE_HOME"))
+		return boost::filesystem::path(dir) / "libhexabus";
+	if (const char* dir = std::getenv("HOME"))
+		return boost::filesystem::path(dir) / ".cache" / "libhexabus";
+
+	return boost::filesystem::path();
 }
 
-EndpointRegistry::EndpointRegistry(const boost::filesystem::path& path)
-	: _path(path)
+namespace {
+
+typedef EndpointRegistry::table_t table_t;
+typedef std::tr1::shared_ptr<const table_t> table_ptr;
+
+struct source_file {
+	std::string contents;
+	uint32_t crc;
+};
+
+struct loaded_table {
+	uint32_t source_crc;
+	table_ptr table;
+};
+
+/*
+ * Compiled registry file: a header, the records sorted by EID, and the
+ * strings referenced by the records. Integers are stored in host byte order,
+ * the file is only a cache for the local machine.
+ */
+const char cache_magic[8] = { 'H', 'X', 'B', 'R', 'E', 'G', 0, 1 };
+
+struct cache_header {
+	char magic[8];
+	uint32_t source_crc;
+	uint32_t source_size;
+	uint32_t count;
+	uint32_t strings_size;
+	// of records and strings
+	uint32_t payload_crc;
+};
+
+struct cache_record {
+	uint32_t eid;
+	uint32_t description_offset;
+	uint32_t description_length;
+	uint32_t unit_offset;
+	uint32_t unit_length;
+	uint8_t type;
+	uint8_t access;
+	uint8_t function;
+	uint8_t has_unit;
+};
+
+struct EidLess {
+	bool operator()(const table_t::value_type& entry, uint32_t eid) const { return entry.first < eid; }
+	bool operator()(uint32_t eid, const table_t::value_type& entry) const { return eid < entry.first; }
+};
+
+}
+
+static source_file read_source(const boost::filesystem::path& path)
 {
-	reload();
+	boost::filesystem::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+
+	if (!file.good())
+		throw GenericException("Endpoint registry file not found");
+
+	source_file result;
+	result.contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	boost::crc_32_type crc;
+	crc.process_bytes(result.contents.data(), result.contents.size());
+	result.crc = crc.checksum();
+
+	return result;
+}
+
+static boost::filesystem::path cache_path(const boost::filesystem::path& path)
+{
+	boost::filesystem::path dir = EndpointRegistry::cache_directory();
+	if (dir.empty())
+		return dir;
+
+	std::string absolute = boost::filesystem::absolute(path).string();
+	boost::crc_32_type crc;
+	crc.process_bytes(absolute.data(), absolute.size());
+
+	std::ostringstream name;
+	name << "endpoint_registry-" << std::hex << crc.checksum() << ".bin";
+	return dir / name.str();
+}
+
+static table_ptr load_compiled(const boost::filesystem::path& path, const source_file& source)
+{
+	mapped_file file(path, sizeof(cache_header));
+	if (!file.valid())
+		return table_ptr();
+
+	const char* data = static_cast<const char*>(file.data);
+	cache_header header;
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, cache_magic, sizeof(cache_magic))
+			|| header.source_crc != source.crc
+			|| header.source_size != source.contents.size()
+			|| header.count > (file.size - sizeof(header)) / sizeof(cache_record)
+			|| header.strings_size != file.size - sizeof(header) - header.count * sizeof(cache_record))
+		return table_ptr();
+
+	const char* payload = data + sizeof(header);
+	size_t payload_size = file.size - sizeof(header);
+	const char* strings = payload + header.count * sizeof(cache_record);
+
+	boost::crc_32_type crc;
+	crc.process_bytes(payload, payload_size);
+	if (crc.checksum() != header.payload_crc)
+		return table_ptr();
+
+	std::tr1::shared_ptr<table_t> table(new table_t);
+	table->reserve(header.count);
+
+	for (uint32_t i = 0; i < header.count; i++) {
+		cache_record rec;
+		memcpy(&rec, payload + i * sizeof(rec), sizeof(rec));
+
+		if (rec.description_offset > header.strings_size
+				|| rec.description_length > header.strings_size - rec.description_offset
+				|| rec.unit_offset > header.strings_size
+				|| rec.unit_length > header.strings_size - rec.unit_offset
+				|| (i > 0 && rec.eid <= table->back().first))
+			return table_ptr();
+
+		boost::optional<std::string> unit;
+		if (rec.has_unit)
+			unit = std::string(strings + rec.unit_offset, rec.unit_length);
+
+		table->push_back(std::make_pair(rec.eid, EndpointDescriptor(
+				rec.eid,
+				std::string(strings + rec.description_offset, rec.description_length),
+				unit,
+				hxb_datatype(rec.type),
+				EndpointDescriptor::Access(rec.access),
+				EndpointDescriptor::Function(rec.function))));
+	}
+
+	return table;
+}
+
+static void write_compiled(const boost::filesystem::path& path, const source_file& source, const table_t& table)
+{
+	std::vector<cache_record> records;
+	std::string strings;
+
+	for (table_t::const_iterator it = table.begin(), end = table.end(); it != end; ++it) {
+		const EndpointDescriptor& ep = it->second;
+		cache_record rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.eid = ep.eid();
+		rec.description_offset = strings.size();
+		rec.description_length = ep.description().size();
+		strings += ep.description();
+		rec.has_unit = bool(ep.unit());
+		if (ep.unit()) {
+			rec.unit_offset = strings.size();
+			rec.unit_length = ep.unit()->size();
+			strings += *ep.unit();
+		}
+		rec.type = ep.type();
+		rec.access = ep.access();
+		rec.function = ep.function();
+
+		records.push_back(rec);
+	}
+
+	cache_header header;
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.source_crc = source.crc;
+	header.source_size = source.contents.size();
+	header.count = records.size();
+	header.strings_size = strings.size();
+
+	boost::crc_32_type crc;
+	if (!records.empty())
+		crc.process_bytes(&records[0], records.size() * sizeof(cache_record));
+	crc.process_bytes(strings.data(), strings.size());
+	header.payload_crc = crc.checksum();
+
+	// the cache is only an optimization, failing to write it is not an error
+	try {
+		boost::filesystem::create_directories(path.parent_path());
+
+		std::ostringstream tmp_name;
+		tmp_name << path.string() << ".tmp" << getpid();
+		boost::filesystem::path tmp(tmp_name.str());
+
+		{
+			boost::filesystem::ofstream out(tmp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			if (!records.empty())
+				out.write(reinterpret_cast<const char*>(&records[0]), records.size() * sizeof(cache_record));
+			out.write(strings.data(), strings.size());
+			if (!out.good()) {
+				out.close();
+				boost::filesystem::remove(tmp);
+				return;
+			}
+		}
+
+		boost::filesystem::rename(tmp, path);
+	} catch (const boost::filesystem::filesystem_error&) {
+	}
 }
 
 static std::string single_child(const boost::property_tree::ptree& tree, const std::string& key, uint32_t eid)
@@ -59,13 +272,9 @@ static std::string single_child(const boost::property_tree::ptree& tree, const s
 	return tree.find(key)->second.get_value<std::string>();
 }
 
-void EndpointRegistry::reload()
+static table_ptr parse(const source_file& source)
 {
-	boost::filesystem::ifstream file(_path, std::ios_base::in);
-
-	if (!file.good())
-		throw GenericException("Endpoint registry file not found");
-
+	std::istringstream file(source.contents);
 	boost::property_tree::ptree ptree;
 
 	try {
@@ -141,6 +350,11 @@ void EndpointRegistry::reload()
 			function = EndpointDescriptor::actor;
 		else if (boost::equals(function_str, "infrastructure"))
 			function = EndpointDescriptor::infrastructure;
+		else {
+			std::ostringstream o;
+			o << "Invalid function " << function_str << " for EID " << eid;
+			throw GenericException(o.str());
+		}
 
 		access_str = single_child(it->second, "access", eid);
 		if (boost::equals(access_str, "R"))
@@ -158,22 +372,88 @@ void EndpointRegistry::reload()
 		eids.insert(std::make_pair(eid, EndpointDescriptor(eid, description, unit, type, access, function)));
 	}
 
-	_eids = eids;
+	return table_ptr(new table_t(eids.begin(), eids.end()));
+}
+
+static boost::mutex& tables_mutex()
+{
+	static boost::mutex mutex;
+	return mutex;
+}
+
+// tables loaded by this process, by registry file
+static std::map<boost::filesystem::path, loaded_table>& loaded_tables()
+{
+	static std::map<boost::filesystem::path, loaded_table> tables;
+	return tables;
+}
+
+static table_ptr load(const boost::filesystem::path& path, bool check)
+{
+	boost::mutex::scoped_lock lock(tables_mutex());
+
+	std::map<boost::filesystem::path, loaded_table>::iterator it = loaded_tables().find(path);
+	if (it != loaded_tables().end() && !check)
+		return it->second.table;
+
+	source_file source = read_source(path);
+	if (it != loaded_tables().end() && it->second.source_crc == source.crc)
+		return it->second.table;
+
+	boost::filesystem::path compiled = cache_path(path);
+	table_ptr table;
+
+	if (!compiled.empty())
+		table = load_compiled(compiled, source);
+
+	if (!table) {
+		table = parse(source);
+		if (!compiled.empty())
+			write_compiled(compiled, source, *table);
+	}
+
+	loaded_table& entry = loaded_tables()[path];
+	entry.source_crc = source.crc;
+	entry.table = table;
+
+	return table;
+}
+
+EndpointRegistry::EndpointRegistry()
+	: _path(path_from_env_or_default())
+{
+	_eids = load(_path, false);
+}
+
+EndpointRegistry::EndpointRegistry(const boost::filesystem::path& path)
+	: _path(path)
+{
+	_eids = load(_path, false);
+}
+
+void EndpointRegistry::reload()
+{
+	_eids = load(_path, true);
 }
 
 EndpointRegistry::const_iterator EndpointRegistry::begin() const
 {
-	return _eids.begin();
+	return _eids->begin();
 }
 
 EndpointRegistry::const_iterator EndpointRegistry::end() const
 {
-	return _eids.end();
+	return _eids->end();
 }
 
 EndpointRegistry::const_iterator EndpointRegistry::find(uint32_t eid) const
 {
-	return _eids.find(eid);
+	const_iterator it = std::lower_bound(_eids->begin(), _eids->end(), eid, EidLess());
+
+	if (it != _eids->end() && it->first == eid)
+		return it;
+	else
+		return _eids->end();
 }
 
 const EndpointDescriptor& EndpointRegistry::lookup(uint32_t eid) const
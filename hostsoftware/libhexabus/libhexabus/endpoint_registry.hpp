@@ -3,7 +3,8 @@
 
 #include <stdint.h>
 #include <string>
-#include <map>
+#include <vector>
+#include <tr1/memory>
 
 #include <boost/filesystem.hpp>
 #include <boost/optional.hpp>
@@ -61,15 +62,35 @@ namespace hexabus {
 
 
 
+	/**
+	 * Read-only view of an endpoint registry file.
+	 *
+	 * Registries are shared: all instances for the same file use one immutable
+	 * table per process, which is loaded by the first instance. A compiled form
+	 * of each registry file is cached on disk (see cache_directory()), so that
+	 * the INFO file only needs to be parsed again when its contents change.
+	 * The strings of the compiled form are copied into the table once per
+	 * process, descriptors hand out std::string references and do not keep
+	 * the cache file mapped.
+	 * reload() checks the file for changes and rebuilds the table if needed.
+	 *
+	 * Copies of a registry share its table, so copying is cheap. A copy never
+	 * changes when the original is reloaded; see RegistryWatcher for reloading
+	 * a registry while it is in use.
+	 */
 	class EndpointRegistry {
+		public:
+			typedef std::vector<std::pair<uint32_t, EndpointDescriptor> > table_t;
+
 		private:
-			std::map<uint32_t, EndpointDescriptor> _eids;
+			// sorted by EID
+			std::tr1::shared_ptr<const table_t> _eids;
 			boost::filesystem::path _path;
 
 		public:
 			static const char* default_path;
 
-			typedef std::map<uint32_t, EndpointDescriptor>::const_iterator const_iterator;
+			typedef table_t::const_iterator const_iterator;
 
 			EndpointRegistry();
 			EndpointRegistry(const boost::filesystem::path& path);
@@ -83,6 +104,20 @@ namespace hexabus {
 			const EndpointDescriptor& lookup(uint32_t eid) const;
 
 			void reload();
+
+			/**
+			 * Copy of the registry as it is now. Readers that use the registry over
+			 * several steps should take a snapshot, it stays consistent even if
+			 * the registry is replaced in between.
+			 */
+			EndpointRegistry snapshot() const { return *this; }
+
+			/**
+			 * Directory for compiled registries: $HXB_ENDPOINT_REGISTRY_CACHE if set,
+			 * $XDG_CACHE_HOME/libhexabus or ~/.cache/libhexabus otherwise. Empty if
+			 * none of these is available, compiled registries are not used then.
+			 */
+			static boost::filesystem::path cache_directory();
 	};
 
 
@@ -16,22 +16,36 @@ namespace filtering {
 	template<typename T>
 	struct is_filter : boost::mpl::false_ {};
 
-	template<typename Type>
-	struct IsOfType {
+	/*
+	 * Besides value() and operator(), every filter reports two sets of packet
+	 * classes (see packet.hpp): domain() is the set of classes for which value()
+	 * may be defined, candidates() the set for which operator() may be true.
+	 * Both are conservative, and let subscribers skip filters that cannot
+	 * match a packet at all.
+	 */
+
+	template<packet_class_mask Mask>
+	struct IsOfClass {
 		typedef bool value_type;
 		typedef boost::optional<value_type> result_type;
 
 		result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 		{
-			return dynamic_cast<const Type*>(&packet);
+			return bool(packet.packetClass() & Mask);
 		}
 
 		bool operator()(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 		{
 			return *value(packet, from);
 		}
+
+		packet_class_mask domain() const { return all_packet_classes; }
+		packet_class_mask candidates() const { return Mask; }
 	};
 
+	template<typename Type>
+	struct IsOfType : IsOfClass<packet_class<Type>::mask> {};
+
 	struct IsError : IsOfType<ErrorPacket> {};
 
 	template<>
@@ -43,8 +57,9 @@ namespace filtering {
 
 		result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 		{
-			return dynamic_cast<const EIDPacket*>(&packet)
-				? result_type(static_cast<const EIDPacket&>(packet).eid())
+			const EIDPacket* p = packet_cast<EIDPacket>(&packet);
+			return p
+				? result_type(p->eid())
 				: result_type();
 		}
 
@@ -53,6 +68,9 @@ namespace filtering {
 			result_type v = value(packet, from);
 			return v && *v;
 		}
+
+		packet_class_mask domain() const { return packet_class<EIDPacket>::mask; }
+		packet_class_mask candidates() const { return domain(); }
 	};
 
 	template<>
@@ -75,8 +93,9 @@ namespace filtering {
 
 		result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 		{
-			return dynamic_cast<const ValuePacket<TValue>*>(&packet)
-				? result_type(static_cast<const ValuePacket<TValue>&>(packet).value())
+			const ValuePacket<TValue>* p = packet_cast<ValuePacket<TValue> >(&packet);
+			return p
+				? result_type(p->value())
 				: result_type();
 		}
 
@@ -85,6 +104,9 @@ namespace filtering {
 			result_type v = value(packet, from);
 			return v && *v;
 		}
+
+		packet_class_mask domain() const { return packet_class<ValuePacket<TValue> >::mask; }
+		packet_class_mask candidates() const { return domain(); }
 	};
 
 	template<typename T>
@@ -107,6 +129,17 @@ namespace filtering {
 	template<>
 	struct is_filter<IsEndpointInfo> : boost::mpl::true_ {};
 
+	// info or write packets of any datatype
+	struct IsAnyInfo : IsOfClass<packet_class_row<HXB_PTYPE_INFO>::value> {};
+
+	template<>
+	struct is_filter<IsAnyInfo> : boost::mpl::true_ {};
+
+	struct IsAnyWrite : IsOfClass<packet_class_row<HXB_PTYPE_WRITE>::value> {};
+
+	template<>
+	struct is_filter<IsAnyWrite> : boost::mpl::true_ {};
+
 	struct SourceIP {
 		typedef boost::asio::ip::address_v6 value_type;
 		typedef boost::optional<value_type> result_type;
@@ -115,6 +148,9 @@ namespace filtering {
 		{
 			return from.address().to_v6();
 		}
+
+		packet_class_mask domain() const { return all_packet_classes; }
+		packet_class_mask candidates() const { return all_packet_classes; }
 	};
 
 	template<>
@@ -133,6 +169,9 @@ namespace filtering {
 		{
 			return *value(packet, from);
 		}
+
+		packet_class_mask domain() const { return all_packet_classes; }
+		packet_class_mask candidates() const { return all_packet_classes; }
 	};
 
 	template<>
@@ -152,6 +191,8 @@ namespace filtering {
 				: _value(value)
 			{}
 
+			const value_type& get() const { return _value; }
+
 			result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 			{
 				return _value;
@@ -161,6 +202,9 @@ namespace filtering {
 			{
 				return _value;
 			}
+
+			packet_class_mask domain() const { return all_packet_classes; }
+			packet_class_mask candidates() const { return all_packet_classes; }
 	};
 
 	template<typename TValue>
@@ -179,6 +223,9 @@ namespace filtering {
 		{
 			return true;
 		}
+
+		packet_class_mask domain() const { return all_packet_classes; }
+		packet_class_mask candidates() const { return all_packet_classes; }
 	};
 
 	template<>
@@ -195,6 +242,8 @@ namespace filtering {
 	template<typename TValue>
 	static inline IsWrite<TValue> isWrite() { return IsWrite<TValue>(); }
 	static inline IsEndpointInfo isEndpointInfo() { return IsEndpointInfo(); }
+	static inline IsAnyInfo isAnyInfo() { return IsAnyInfo(); }
+	static inline IsAnyWrite isAnyWrite() { return IsAnyWrite(); }
 	static inline SourceIP sourceIP() { return SourceIP(); }
 	static inline SourcePort sourcePort() { return SourcePort(); }
 	template<typename TValue>
@@ -225,6 +274,9 @@ namespace filtering {
 				{
 					return *value(packet, from);
 				}
+
+				packet_class_mask domain() const { return all_packet_classes; }
+				packet_class_mask candidates() const { return _item.domain(); }
 		};
 
 	}
@@ -260,6 +312,9 @@ namespace filtering {
 					result_type v = value(packet, from);
 					return v && *v;
 				}
+
+				packet_class_mask domain() const { return _exp.domain(); }
+				packet_class_mask candidates() const { return domain(); }
 		};
 
 	}
@@ -285,6 +340,9 @@ namespace filtering {
 					: _left(left), _right(right)
 				{}
 
+				const Left& left() const { return _left; }
+				const Right& right() const { return _right; }
+
 				result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 				{
 					typename Left::result_type l = _left.value(packet, from);
@@ -305,6 +363,9 @@ namespace filtering {
 					result_type v = value(packet, from);
 					return v && *v;
 				}
+
+				packet_class_mask domain() const { return _left.domain() & _right.domain(); }
+				packet_class_mask candidates() const { return domain(); }
 		};
 
 	}
@@ -328,6 +389,9 @@ namespace filtering {
 					: _left(left), _right(right)
 				{}
 
+				const Left& left() const { return _left; }
+				const Right& right() const { return _right; }
+
 				result_type value(const Packet& packet, const boost::asio::ip::udp::endpoint& from) const
 				{
 					typename Left::result_type l = _left.value(packet, from);
@@ -358,6 +422,14 @@ namespace filtering {
 					result_type v = value(packet, from);
 					return v && *v;
 				}
+
+				packet_class_mask domain() const { return _left.domain() | _right.domain(); }
+				packet_class_mask candidates() const
+				{
+					return IsAnd
+						? _left.candidates() & _right.candidates()
+						: _left.candidates() | _right.candidates();
+				}
 		};
 
 	}
@@ -409,6 +481,71 @@ namespace filtering {
 
 #undef BINARY_OP
 
+	/**
+	 * Everything a filter requires of the packets it accepts that can be
+	 * determined without looking at a packet: the candidate packet classes
+	 * and, for conjunctions containing eid() == x or sourceIP() == x, the
+	 * EID or source address. Used by SocketBase to index subscriptions.
+	 */
+	struct Constraints {
+		packet_class_mask classes;
+		boost::optional<uint32_t> eid;
+		boost::optional<boost::asio::ip::address_v6> source;
+	};
+
+	namespace detail {
+
+		template<typename Exp>
+		void collect_constraints(const Exp& exp, Constraints& c)
+		{
+		}
+
+		template<typename T>
+		void collect_constraints(const ast::BinaryExpression<EID, Constant<T>, std::equal_to>& exp, Constraints& c)
+		{
+			if (!c.eid)
+				c.eid = uint32_t(exp.right().get());
+		}
+
+		template<typename T>
+		void collect_constraints(const ast::BinaryExpression<Constant<T>, EID, std::equal_to>& exp, Constraints& c)
+		{
+			if (!c.eid)
+				c.eid = uint32_t(exp.left().get());
+		}
+
+		template<typename T>
+		void collect_constraints(const ast::BinaryExpression<SourceIP, Constant<T>, std::equal_to>& exp, Constraints& c)
+		{
+			if (!c.source)
+				c.source = boost::asio::ip::address_v6(exp.right().get());
+		}
+
+		template<typename T>
+		void collect_constraints(const ast::BinaryExpression<Constant<T>, SourceIP, std::equal_to>& exp, Constraints& c)
+		{
+			if (!c.source)
+				c.source = boost::asio::ip::address_v6(exp.left().get());
+		}
+
+		template<typename Left, typename Right>
+		void collect_constraints(const ast::BooleanShortcutExpression<Left, Right, true>& exp, Constraints& c)
+		{
+			collect_constraints(exp.left(), c);
+			collect_constraints(exp.right(), c);
+		}
+
+	}
+
+	template<typename Filter>
+	Constraints constraints(const Filter& filter)
+	{
+		Constraints c;
+		c.classes = filter.candidates();
+		detail::collect_constraints(filter, c);
+		return c;
+	}
+
 }}
 
 #endif
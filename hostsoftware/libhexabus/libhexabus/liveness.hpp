@@ -4,6 +4,7 @@
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include "clock.hpp"
 #include "socket.hpp"
 
 namespace hexabus {
@@ -11,7 +12,7 @@ namespace hexabus {
 		private:
 			Socket& _socket;
 			boost::posix_time::time_duration _interval;
-			boost::asio::deadline_timer _timer;
+			hexabus::Timer _timer;
 			bool _running;
 
 			void armTimer();
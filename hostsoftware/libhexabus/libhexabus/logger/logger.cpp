@@ -1,97 +1,83 @@
 #include "logger.hpp"
 
-#include "../../../shared/endpoints.h"
-#define DEBUG 0
+#include <libhexabus/config.h>
 
+#include "../../../shared/endpoints.h"
 
 using namespace hexabus;
 
-void Logger::operator()(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint& from)
+void Logger::operator()(const hexabus::PacketView& packet, const boost::asio::ip::udp::endpoint& from)
 {
 	source = from.address().to_v6();
 	visitPacket(packet);
 }
 
-void Logger::visit(const hexabus::InfoPacket<bool>& info)
-{
-	accept_packet(info.value(), info.eid());
-}
-
-void Logger::visit(const hexabus::InfoPacket<uint8_t>& info)
-{
-	accept_packet(info.value(), info.eid());
-}
-
-void Logger::visit(const hexabus::InfoPacket<uint32_t>& info)
-{
-	accept_packet(info.value(), info.eid());
-}
-
-void Logger::visit(const hexabus::InfoPacket<float>& info)
-{
-	accept_packet(info.value(), info.eid());
-}
-
-void Logger::visit(const hexabus::InfoPacket<boost::posix_time::time_duration>& info)
+void Logger::visitInfo(const hexabus::PacketView& info)
 {
-	accept_packet(info.value().total_seconds(), info.eid());
+	if (info.isNumeric())
+		accept_packet(info.numericValue(), info.eid());
 }
 
-const char* Logger::eid_to_unit(uint32_t eid)
+std::string Logger::eid_to_unit(uint32_t eid)
 {
-	hexabus::EndpointRegistry::const_iterator it;
+	hexabus::EndpointRegistry snapshot = registry.snapshot();
+	hexabus::EndpointRegistry::const_iterator it = snapshot.find(eid);
 
-	it = registry.find(eid);
-	if (it == registry.end() || !it->second.unit()) {
+	if (it == snapshot.end() || !it->second.unit()) {
 		return "unknown";
 	} else {
-		return it->second.unit()->c_str();
+		return *it->second.unit();
 	}
 }
 
-void Logger::on_sensor_name_received(const std::string& sensor_id, const boost::asio::ip::address_v6& address, const hexabus::Packet& ep_info)
+void Logger::store_reading(const klio::Sensor::Ptr& sensor, klio::timestamp_t ts, double value)
 {
-  double msecs1;
-  double msecs2;
-  double mdiff;
-      
-  struct timeval tv1;
-  struct timeval tv2;
+#if LOGGER_STATISTICS
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	record_reading(sensor, ts, value);
+	stats.recording_time += boost::posix_time::microsec_clock::universal_time() - start;
+#else
+	record_reading(sensor, ts, value);
+#endif
+}
 
-  gettimeofday(&tv1, NULL) ;
-  msecs1=(double)tv1.tv_sec + ((double)tv1.tv_usec/1000000);
+void Logger::on_sensor_name_received(const SensorKey& key, const boost::asio::ip::address_v6& address, const hexabus::Packet& ep_info)
+{
+	new_sensor_t& backlog = new_sensor_backlog[key];
 
 	klio::Sensor::Ptr sensor = sensor_factory.createSensor(
-			sensor_id,
+			backlog.sensor_id,
 			static_cast<const hexabus::EndpointInfoPacket&>(ep_info).value(),
-			eid_to_unit(new_sensor_backlog[sensor_id].first),
+			eid_to_unit(backlog.eid),
 			sensor_timezone);
 
 	new_sensor_found(sensor, address);
-	sensor_cache.insert(std::make_pair(sensor_id, sensor));
+	sensor_cache.insert(key, sensor);
+#if LOGGER_STATISTICS
+	stats.sensors_created++;
+#endif
 
-	new_sensor_t& backlog = new_sensor_backlog[sensor_id];
 	klio::readings_it_t it, end;
-	for (it = backlog.second.begin(), end = backlog.second.end(); it != end; ++it) {
-		record_reading(sensor, it->first, it->second);
+	for (it = backlog.readings.begin(), end = backlog.readings.end(); it != end; ++it) {
+		store_reading(sensor, it->first, it->second);
 	}
 
-	new_sensor_backlog.erase(sensor_id);
-
-  gettimeofday(&tv2, NULL) ;
-  msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-  mdiff = msecs2 - msecs1;
-  std::cout << "Time in on_sensor_name_received " << mdiff << std::endl;
+	new_sensor_backlog.erase(key);
 }
 
-void Logger::on_sensor_error(const std::string& sensor_id, const hexabus::GenericException& err)
+void Logger::on_sensor_error(const SensorKey& key, const hexabus::GenericException& err)
 {
+	new_sensor_t& backlog = new_sensor_backlog[key];
+
 	std::cerr
 		<< "Error getting device name: " << err.what() << ", "
-		<< "dropping " << new_sensor_backlog[sensor_id].second.size() 
-		<< " readings from " << sensor_id << std::endl;
+		<< "dropping " << backlog.readings.size()
+		<< " readings from " << backlog.sensor_id << std::endl;
 
-	new_sensor_backlog.erase(sensor_id);
+#if LOGGER_STATISTICS
+	stats.readings_dropped += backlog.readings.size();
+#endif
+	new_sensor_backlog.erase(key);
 }
 
 std::string Logger::get_sensor_id(const boost::asio::ip::address_v6& source, uint32_t eid)
@@ -103,67 +89,60 @@ std::string Logger::get_sensor_id(const boost::asio::ip::address_v6& source, uin
 
 void Logger::accept_packet(double value, uint32_t eid)
 {
-  double msecs1;
-  double msecs2;
-  double mdiff;
-      
-  struct timeval tv1;
-  struct timeval tv2;
+	SensorKey key(source, eid);
+	klio::timestamp_t now = tc.get_timestamp();
 
-  gettimeofday(&tv1, NULL) ;
-  msecs1=(double)tv1.tv_sec + ((double)tv1.tv_usec/1000000);
+#if LOGGER_STATISTICS
+	stats.readings++;
+#endif
 
 	/**
-	 * 1. Create unique ID for each info message and sensor,
-	 * <ip>-<endpoint>
+	 * 1. Look for a sensor instance we already know. This is the common case
+	 * and must not allocate.
 	 */
-	std::string sensor_id(get_sensor_id(source, eid));
+	if (const klio::Sensor::Ptr* sensor = sensor_cache.find(key)) {
+#if LOGGER_STATISTICS
+		stats.cache_hits++;
+#endif
+		store_reading(*sensor, now, value);
+		return;
+	}
 
 	/**
-	 * 2. Ask for a sensor instance. If none is known for this
-	 * sensor, create a new one.
+	 * 2. If the device is being asked for its name already, keep the reading
+	 * until the sensor has been created.
 	 */
+	boost::unordered_map<SensorKey, new_sensor_t>::iterator pending = new_sensor_backlog.find(key);
+	if (pending != new_sensor_backlog.end()) {
+		pending->second.readings.insert(std::make_pair(now, value));
+		return;
+	}
 
-	klio::Sensor::Ptr sensor;
-	klio::timestamp_t now = tc.get_timestamp();
+	/**
+	 * 3. Ask the store for the sensor, identified by <ip>-<endpoint>. If it
+	 * does not know the sensor either, query the device name to create one.
+	 */
+	std::string sensor_id(get_sensor_id(source, eid));
 
-	if (sensor_cache.count(sensor_id)) {
-		sensor = sensor_cache[sensor_id];
-#if DEBUG
-    gettimeofday(&tv2, NULL) ;
-    msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-    mdiff = msecs2 - msecs1;
-    std::cout << "Time in accept_packet (-cache 1)" << mdiff << std::endl;
-#endif // DEBUG
-	} else {
-		sensor = lookup_sensor(sensor_id);
-#if DEBUG
-    gettimeofday(&tv2, NULL) ;
-    msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-    mdiff = msecs2 - msecs1;
-    std::cout << "Time in accept_packet (2)" << mdiff << std::endl;
-#endif // DEBUG
-	}
+#if LOGGER_STATISTICS
+	stats.store_lookups++;
+#endif
+	klio::Sensor::Ptr sensor = lookup_sensor(sensor_id);
 
 	if (sensor) {
-		/**
-		 * 3. Use the sensor instance to save the value.
-		 */
-		record_reading(sensor, now, value);
+		sensor_cache.insert(key, sensor);
+		store_reading(sensor, now, value);
 	} else {
-		if (!new_sensor_backlog.count(sensor_id)) {
-			new_sensor_backlog[sensor_id].first = eid;
-			interrogator.send_request(
-					source,
-					hexabus::EndpointQueryPacket(EP_DEVICE_DESCRIPTOR),
-					hexabus::filtering::IsEndpointInfo(),
-					boost::bind(&Logger::on_sensor_name_received, this, sensor_id, source, _1),
-					boost::bind(&Logger::on_sensor_error, this, sensor_id, _1));
-		}
-		new_sensor_backlog[sensor_id].second.insert(std::make_pair(now, value));
+		new_sensor_t& backlog = new_sensor_backlog[key];
+		backlog.sensor_id = sensor_id;
+		backlog.eid = eid;
+		backlog.readings.insert(std::make_pair(now, value));
+
+		interrogator.send_request(
+				source,
+				hexabus::EndpointQueryPacket(EP_DEVICE_DESCRIPTOR),
+				hexabus::filtering::IsEndpointInfo(),
+				boost::bind(&Logger::on_sensor_name_received, this, key, source, _1),
+				boost::bind(&Logger::on_sensor_error, this, key, _1));
 	}
-  gettimeofday(&tv2, NULL) ;
-  msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-  mdiff = msecs2 - msecs1;
-  std::cout << "Time in accept_packet " << mdiff << std::endl;
 }
@@ -2,18 +2,42 @@
 #define LIBHEXALOG_LOGGER_HPP 1
 
 #include <string>
-#include <map>
+#include <stdint.h>
+
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <libklio/sensor.hpp>
 #include <libklio/time.hpp>
 #include <libklio/sensor-factory.hpp>
 #include <libhexabus/socket.hpp>
+#include <libhexabus/packet_view.hpp>
 #include <libhexabus/endpoint_registry.hpp>
 #include <libhexabus/device_interrogator.hpp>
+#include <libhexabus/logger/sensor_cache.hpp>
 
 namespace hexabus {
 
-class Logger : private PacketVisitor {
+class Logger : private PacketViewVisitor {
+	public:
+		/**
+		 * Counters for the readings passed through the logger. Only maintained
+		 * if libhexabus was configured with LOGGER_STATISTICS, all zero
+		 * otherwise.
+		 */
+		struct Statistics {
+			uint64_t readings;
+			uint64_t cache_hits;
+			uint64_t store_lookups;
+			uint64_t sensors_created;
+			uint64_t readings_dropped;
+			boost::posix_time::time_duration recording_time;
+
+			Statistics()
+				: readings(0), cache_hits(0), store_lookups(0), sensors_created(0), readings_dropped(0)
+			{}
+		};
+
 	protected:
 		klio::TimeConverter& tc;
 		klio::SensorFactory& sensor_factory;
@@ -22,47 +46,34 @@ class Logger : private PacketVisitor {
 
 		hexabus::EndpointRegistry& registry;
 
-		typedef std::pair<uint32_t, klio::readings_t> new_sensor_t;
-		std::map<std::string, new_sensor_t> new_sensor_backlog;
-		std::map<std::string, klio::Sensor::Ptr> sensor_cache;
+		// readings of sensors that are not in the store yet, kept until the
+		// device name has been queried
+		struct new_sensor_t {
+			std::string sensor_id;
+			uint32_t eid;
+			klio::readings_t readings;
+		};
+
+		boost::unordered_map<SensorKey, new_sensor_t> new_sensor_backlog;
+		SensorCache<klio::Sensor::Ptr> sensor_cache;
+		Statistics stats;
 
 		boost::asio::ip::address_v6 source;
 
-		virtual const char* eid_to_unit(uint32_t eid);
+		virtual std::string eid_to_unit(uint32_t eid);
+		// only called when a sensor is not in the cache yet
 		virtual std::string get_sensor_id(const boost::asio::ip::address_v6& source, uint32_t eid);
 
-		void on_sensor_name_received(const std::string& sensor_name, const boost::asio::ip::address_v6& address, const hexabus::Packet& ep_info);
+		void on_sensor_name_received(const SensorKey& key, const boost::asio::ip::address_v6& address, const hexabus::Packet& ep_info);
 
-		void on_sensor_error(const std::string& sensor_name, const hexabus::GenericException& err);
+		void on_sensor_error(const SensorKey& key, const hexabus::GenericException& err);
 
 		void accept_packet(double value, uint32_t eid);
+		void store_reading(const klio::Sensor::Ptr& sensor, klio::timestamp_t ts, double value);
+
+		virtual void visitInfo(const hexabus::PacketView& info);
 
-		virtual void visit(const hexabus::InfoPacket<bool>& info);
-		virtual void visit(const hexabus::InfoPacket<uint8_t>& info);
-		virtual void visit(const hexabus::InfoPacket<uint32_t>& info);
-		virtual void visit(const hexabus::InfoPacket<float>& info);
-		virtual void visit(const hexabus::InfoPacket<boost::posix_time::time_duration>& info);
-
-		// FIXME: handle these properly, we should not drop valid info packets
-		virtual void visit(const hexabus::InfoPacket<boost::posix_time::ptime>& info) {} 
-		virtual void visit(const hexabus::InfoPacket<std::string>& info) {} 
-		virtual void visit(const hexabus::InfoPacket<boost::array<char, 16> >& info) {}
-		virtual void visit(const hexabus::InfoPacket<boost::array<char, 65> >& info) {}
-
-		virtual void visit(const hexabus::ErrorPacket& error) {}
-		virtual void visit(const hexabus::QueryPacket& query) {}
-		virtual void visit(const hexabus::EndpointQueryPacket& endpointQuery) {}
-		virtual void visit(const hexabus::EndpointInfoPacket& endpointInfo) {}
-
-		virtual void visit(const hexabus::WritePacket<bool>& write) {}
-		virtual void visit(const hexabus::WritePacket<uint8_t>& write) {}
-		virtual void visit(const hexabus::WritePacket<uint32_t>& write) {}
-		virtual void visit(const hexabus::WritePacket<float>& write) {}
-		virtual void visit(const hexabus::WritePacket<boost::posix_time::ptime>& write) {}
-		virtual void visit(const hexabus::WritePacket<boost::posix_time::time_duration>& write) {}
-		virtual void visit(const hexabus::WritePacket<std::string>& write) {}
-		virtual void visit(const hexabus::WritePacket<boost::array<char, 16> >& write) {}
-		virtual void visit(const hexabus::WritePacket<boost::array<char, 65> >& write) {}
+		// FIXME: handle non-numeric info packets properly, we should not drop valid info packets
 
 	protected:
 		virtual void record_reading(klio::Sensor::Ptr sensor, klio::timestamp_t ts, double value) = 0;
@@ -83,7 +94,9 @@ class Logger : private PacketVisitor {
 		{
 		}
 
-		void operator()(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint& from);
+		void operator()(const hexabus::PacketView& packet, const boost::asio::ip::udp::endpoint& from);
+
+		const Statistics& statistics() const { return stats; }
 };
 
 }
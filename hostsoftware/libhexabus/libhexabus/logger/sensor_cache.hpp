@@ -0,0 +1,146 @@
+#ifndef LIBHEXALOG_SENSOR_CACHE_HPP
+#define LIBHEXALOG_SENSOR_CACHE_HPP 1
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/asio/ip/address_v6.hpp>
+
+namespace hexabus {
+
+/**
+ * Identifies a sensor by device address and endpoint. The address is kept as
+ * two 64 bit integers so that keys can be compared and hashed without
+ * touching the address bytes one by one.
+ */
+struct SensorKey {
+	uint64_t prefix;
+	uint64_t interface_id;
+	uint32_t eid;
+
+	SensorKey()
+		: prefix(0), interface_id(0), eid(0)
+	{}
+
+	SensorKey(const boost::asio::ip::address_v6& address, uint32_t eid)
+		: eid(eid)
+	{
+		boost::asio::ip::address_v6::bytes_type bytes = address.to_bytes();
+
+		prefix = 0;
+		interface_id = 0;
+		for (size_t i = 0; i < 8; i++) {
+			prefix = (prefix << 8) | bytes[i];
+			interface_id = (interface_id << 8) | bytes[i + 8];
+		}
+	}
+
+	bool operator==(const SensorKey& other) const
+	{
+		return interface_id == other.interface_id && eid == other.eid && prefix == other.prefix;
+	}
+
+	bool operator!=(const SensorKey& other) const { return !(*this == other); }
+
+	bool operator<(const SensorKey& other) const
+	{
+		if (prefix != other.prefix)
+			return prefix < other.prefix;
+		if (interface_id != other.interface_id)
+			return interface_id < other.interface_id;
+		return eid < other.eid;
+	}
+
+	uint64_t hash() const
+	{
+		// most of the entropy is in the interface id and the eid, mix all of it
+		// into the low bits used to index the table
+		uint64_t h = interface_id ^ (prefix * 0x9e3779b97f4a7c15ULL) ^ (uint64_t(eid) << 32 | eid);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+};
+
+inline size_t hash_value(const SensorKey& key)
+{
+	return size_t(key.hash());
+}
+
+/**
+ * Open addressing hash map from SensorKey to Value, used for the per-reading
+ * lookups in the logger. Entries are never removed, since a sensor, once
+ * known, stays known for the lifetime of the logger. Value must be default
+ * constructible; slots holding a default constructed value are treated as
+ * empty, so only values that test true may be inserted.
+ */
+template<typename Value>
+class SensorCache {
+	private:
+		struct slot {
+			SensorKey key;
+			Value value;
+		};
+
+		std::vector<slot> _slots;
+		size_t _size;
+
+		size_t index_of(const SensorKey& key) const
+		{
+			size_t mask = _slots.size() - 1;
+			size_t index = size_t(key.hash()) & mask;
+
+			while (_slots[index].value && _slots[index].key != key)
+				index = (index + 1) & mask;
+
+			return index;
+		}
+
+		void grow()
+		{
+			std::vector<slot> old(_slots.size() * 2);
+			old.swap(_slots);
+
+			for (typename std::vector<slot>::iterator it = old.begin(), end = old.end(); it != end; ++it) {
+				if (it->value)
+					_slots[index_of(it->key)] = *it;
+			}
+		}
+
+	public:
+		SensorCache()
+			: _slots(64), _size(0)
+		{}
+
+		size_t size() const { return _size; }
+
+		/**
+		 * Returns a pointer to the value stored for key, or 0 if there is none.
+		 * The pointer is valid until the next insert().
+		 */
+		const Value* find(const SensorKey& key) const
+		{
+			const slot& s = _slots[index_of(key)];
+			return s.value ? &s.value : 0;
+		}
+
+		void insert(const SensorKey& key, const Value& value)
+		{
+			if (2 * (_size + 1) > _slots.size())
+				grow();
+
+			slot& s = _slots[index_of(key)];
+			if (!s.value)
+				_size++;
+
+			s.key = key;
+			s.value = value;
+		}
+};
+
+}
+
+#endif
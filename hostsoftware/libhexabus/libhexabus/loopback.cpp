@@ -0,0 +1,402 @@
+#include "loopback.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "clock.hpp"
+
+namespace hexabus {
+	class LoopbackTransport : public Transport, public std::tr1::enable_shared_from_this<LoopbackTransport> {
+		private:
+			struct datagram {
+				boost::asio::ip::udp::endpoint from;
+				std::tr1::shared_ptr<std::vector<char> > data;
+			};
+
+			LoopbackNetwork& network;
+			boost::asio::io_service& io;
+
+			boost::asio::ip::udp::endpoint local;
+			bool bound;
+			bool multicastLoopback;
+			std::vector<boost::asio::ip::address_v6> groups;
+
+			// protects the receive state, datagrams arrive from any thread
+			boost::mutex mutex;
+			std::deque<datagram> inbox;
+			ReceiveBuffer* buffer;
+			receive_handler_t handler;
+			// set while a completion of the pending receive is posted
+			bool completing;
+
+			void ensureBound();
+			void postCompletion();
+			static void complete(const std::tr1::weak_ptr<LoopbackTransport>& self);
+
+		public:
+			LoopbackTransport(LoopbackNetwork& network, boost::asio::io_service& io)
+				: network(network), io(io), bound(false), multicastLoopback(true), buffer(0), completing(false)
+			{}
+			~LoopbackTransport();
+
+			void bind(const boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err);
+			boost::asio::ip::udp::endpoint localEndpoint() const { return local; }
+			void close();
+
+			void setReuseAddress(bool reuse, boost::system::error_code& err) {}
+			void setMulticastHops(int hops, boost::system::error_code& err) {}
+			void setMulticastLoopback(bool loopback, boost::system::error_code& err) { multicastLoopback = loopback; }
+			void setOutboundInterface(const std::string& dev, boost::system::error_code& err) {}
+			void joinGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err);
+			void leaveGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err);
+
+			void send(const char* data, size_t size, const boost::asio::ip::udp::endpoint& dest,
+					boost::system::error_code& err);
+
+			void asyncReceive(ReceiveBuffer& buffer, const receive_handler_t& handler);
+			void cancel();
+
+			// called by the network for every datagram that reaches the socket
+			bool enqueue(const boost::asio::ip::udp::endpoint& from, const std::tr1::shared_ptr<std::vector<char> >& data,
+					size_t limit);
+	};
+}
+
+using namespace hexabus;
+
+LoopbackTransport::~LoopbackTransport()
+{
+	close();
+}
+
+void LoopbackTransport::ensureBound()
+{
+	if (!bound) {
+		boost::system::error_code err;
+		bind(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6(), 0), err);
+	}
+}
+
+void LoopbackTransport::bind(const boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err)
+{
+	if (bound) {
+		err = boost::asio::error::invalid_argument;
+		return;
+	}
+
+	local = ep;
+	network.bind(shared_from_this(), local, err);
+	if (!err)
+		bound = true;
+}
+
+void LoopbackTransport::close()
+{
+	if (bound) {
+		for (size_t i = 0; i < groups.size(); i++)
+			network.leave(this, LoopbackNetwork::group_key(groups[i], local.port()));
+		groups.clear();
+
+		network.unbind(this, local);
+		bound = false;
+	}
+
+	cancel();
+}
+
+void LoopbackTransport::joinGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err)
+{
+	ensureBound();
+	if (std::find(groups.begin(), groups.end(), group) != groups.end())
+		return;
+
+	groups.push_back(group);
+	network.join(shared_from_this(), LoopbackNetwork::group_key(group, local.port()));
+}
+
+void LoopbackTransport::leaveGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err)
+{
+	std::vector<boost::asio::ip::address_v6>::iterator it = std::find(groups.begin(), groups.end(), group);
+	if (it == groups.end())
+		return;
+
+	groups.erase(it);
+	network.leave(this, LoopbackNetwork::group_key(group, local.port()));
+}
+
+void LoopbackTransport::send(const char* data, size_t size, const boost::asio::ip::udp::endpoint& dest,
+		boost::system::error_code& err)
+{
+	ensureBound();
+	network.transmit(this, multicastLoopback, local, dest, data, size);
+}
+
+void LoopbackTransport::asyncReceive(ReceiveBuffer& buffer, const receive_handler_t& handler)
+{
+	ensureBound();
+
+	boost::mutex::scoped_lock lock(mutex);
+	this->buffer = &buffer;
+	this->handler = handler;
+	if (!inbox.empty())
+		postCompletion();
+}
+
+void LoopbackTransport::cancel()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (handler) {
+		io.post(boost::bind(handler, boost::system::error_code(boost::asio::error::operation_aborted), 0));
+		handler.clear();
+		buffer = 0;
+	}
+}
+
+bool LoopbackTransport::enqueue(const boost::asio::ip::udp::endpoint& from,
+		const std::tr1::shared_ptr<std::vector<char> >& data, size_t limit)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (inbox.size() >= limit)
+		return false;
+
+	datagram d = { from, data };
+	inbox.push_back(d);
+	if (handler)
+		postCompletion();
+
+	return true;
+}
+
+void LoopbackTransport::postCompletion()
+{
+	if (completing)
+		return;
+
+	completing = true;
+	io.post(boost::bind(&LoopbackTransport::complete, std::tr1::weak_ptr<LoopbackTransport>(shared_from_this())));
+}
+
+void LoopbackTransport::complete(const std::tr1::weak_ptr<LoopbackTransport>& self)
+{
+	std::tr1::shared_ptr<LoopbackTransport> t = self.lock();
+	if (!t)
+		return;
+
+	boost::mutex::scoped_lock lock(t->mutex);
+	t->completing = false;
+	if (!t->handler)
+		return;
+
+	ReceiveBuffer& buffer = *t->buffer;
+	size_t count = std::min(t->inbox.size(), buffer.capacity());
+	for (size_t i = 0; i < count; i++) {
+		const datagram& d = t->inbox.front();
+		// longer datagrams are truncated, as they would be by a socket
+		size_t size = std::min(d.data->size(), buffer.packetSize);
+
+		if (size)
+			memcpy(buffer.packet(i), &(*d.data)[0], size);
+		buffer.sizes[i] = size;
+		buffer.endpoints[i] = d.from;
+		t->inbox.pop_front();
+	}
+
+	receive_handler_t handler;
+	handler.swap(t->handler);
+	t->buffer = 0;
+	lock.unlock();
+
+	handler(boost::system::error_code(), count);
+}
+
+
+
+LoopbackNetwork::LoopbackNetwork(boost::asio::io_service& io, const Conditions& conditions, uint32_t seed)
+	: TransportProvider(io), _conditions(conditions), _random(seed), _next_port(49152)
+{
+	_stats.sent = _stats.delivered = _stats.lost = _stats.unreachable = _stats.overflows = 0;
+}
+
+LoopbackNetwork& LoopbackNetwork::install(boost::asio::io_service& io, const Conditions& conditions, uint32_t seed)
+{
+	LoopbackNetwork* network = new LoopbackNetwork(io, conditions, seed);
+
+	boost::asio::add_service<TransportProvider>(io, network);
+	return *network;
+}
+
+Transport::Ptr LoopbackNetwork::createTransport()
+{
+	return Transport::Ptr(new LoopbackTransport(*this, io));
+}
+
+LoopbackNetwork::Conditions LoopbackNetwork::conditions()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	return _conditions;
+}
+
+void LoopbackNetwork::setConditions(const Conditions& conditions)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	_conditions = conditions;
+}
+
+LoopbackNetwork::Statistics LoopbackNetwork::statistics()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	return _stats;
+}
+
+void LoopbackNetwork::bind(const transport_ref& transport, boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	if (ep.port() == 0) {
+		// ports of unbound sockets are never reused while they are bound
+		do {
+			ep.port(_next_port++);
+			if (_next_port == 0)
+				_next_port = 49152;
+		} while (_bound.count(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6(), ep.port())));
+	}
+
+	// sockets bound to a group only receive through the groups they joined
+	if (ep.address().is_multicast())
+		return;
+
+	std::map<boost::asio::ip::udp::endpoint, transport_ref>::iterator it = _bound.find(ep);
+	if (it != _bound.end() && !it->second.expired()) {
+		err = boost::asio::error::address_in_use;
+		return;
+	}
+
+	_bound[ep] = transport;
+}
+
+/*
+ * Transports leave the network when they are destroyed, when their weak
+ * references have expired already. Expired entries are removed along with
+ * the transport, but entries another transport has taken over are kept.
+ */
+void LoopbackNetwork::unbind(const LoopbackTransport* transport, const boost::asio::ip::udp::endpoint& ep)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	std::map<boost::asio::ip::udp::endpoint, transport_ref>::iterator it = _bound.find(ep);
+
+	if (it != _bound.end() && (it->second.expired() || it->second.lock().get() == transport))
+		_bound.erase(it);
+}
+
+void LoopbackNetwork::join(const transport_ref& transport, const group_key& group)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	_members[group].push_back(transport);
+}
+
+void LoopbackNetwork::leave(const LoopbackTransport* transport, const group_key& group)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	std::map<group_key, std::vector<transport_ref> >::iterator it = _members.find(group);
+	if (it == _members.end())
+		return;
+
+	std::vector<transport_ref>& members = it->second;
+	size_t kept = 0;
+	for (size_t i = 0; i < members.size(); i++) {
+		std::tr1::shared_ptr<LoopbackTransport> member = members[i].lock();
+		if (member && member.get() != transport)
+			members[kept++] = members[i];
+	}
+	members.resize(kept);
+
+	if (members.empty())
+		_members.erase(it);
+}
+
+void LoopbackNetwork::transmit(const LoopbackTransport* sender, bool multicast_loopback,
+		const boost::asio::ip::udp::endpoint& from, const boost::asio::ip::udp::endpoint& dest,
+		const char* data, size_t size)
+{
+	std::vector<std::pair<transport_ref, boost::posix_time::time_duration> > receivers;
+	boost::system::error_code no_error;
+
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		std::vector<transport_ref> targets;
+
+		_stats.sent++;
+		if (dest.address().is_multicast()) {
+			std::map<group_key, std::vector<transport_ref> >::const_iterator it =
+				_members.find(group_key(dest.address().to_v6(), dest.port()));
+			if (it != _members.end()) {
+				for (size_t i = 0; i < it->second.size(); i++) {
+					if (multicast_loopback || it->second[i].lock().get() != sender)
+						targets.push_back(it->second[i]);
+				}
+			}
+		} else {
+			std::map<boost::asio::ip::udp::endpoint, transport_ref>::const_iterator it = _bound.find(dest);
+			if (it == _bound.end())
+				it = _bound.find(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v6(), dest.port()));
+			if (it != _bound.end())
+				targets.push_back(it->second);
+		}
+
+		if (targets.empty())
+			_stats.unreachable++;
+
+		for (size_t i = 0; i < targets.size(); i++) {
+			if (_conditions.loss > 0 && _random() / 4294967296.0 < _conditions.loss) {
+				_stats.lost++;
+				continue;
+			}
+
+			boost::posix_time::time_duration delay = _conditions.latency;
+			if (_conditions.jitter.total_microseconds() > 0)
+				delay += boost::posix_time::microseconds(long(_conditions.jitter.total_microseconds() * (_random() / 4294967296.0)));
+
+			receivers.push_back(std::make_pair(targets[i], delay));
+		}
+	}
+
+	if (receivers.empty())
+		return;
+
+	std::tr1::shared_ptr<std::vector<char> > datagram(new std::vector<char>(data, data + size));
+	Clock& clock = boost::asio::use_service<Clock>(io);
+	boost::posix_time::ptime now = clock.now();
+
+	for (size_t i = 0; i < receivers.size(); i++) {
+		if (receivers[i].second.total_microseconds() > 0) {
+			clock.schedule(now + receivers[i].second,
+					boost::bind(&LoopbackNetwork::deliver, this, receivers[i].first, datagram, from, _1));
+		} else {
+			deliver(receivers[i].first, datagram, from, no_error);
+		}
+	}
+}
+
+void LoopbackNetwork::deliver(const transport_ref& to, const std::tr1::shared_ptr<std::vector<char> >& data,
+		const boost::asio::ip::udp::endpoint& from, const boost::system::error_code& error)
+{
+	std::tr1::shared_ptr<LoopbackTransport> t = to.lock();
+	if (error || !t)
+		return;
+
+	size_t limit = conditions().queueLimit;
+	bool queued = t->enqueue(from, data, limit);
+
+	boost::mutex::scoped_lock lock(_mutex);
+	if (queued)
+		_stats.delivered++;
+	else
+		_stats.overflows++;
+}
@@ -0,0 +1,101 @@
+#ifndef LIBHEXABUS_LOOPBACK_HPP
+#define LIBHEXABUS_LOOPBACK_HPP 1
+
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <vector>
+
+#include "transport.hpp"
+
+namespace hexabus {
+	class LoopbackTransport;
+
+	/**
+	 * Network that connects the sockets of an io_service within the process,
+	 * for tests and load tests that need many devices but no interfaces.
+	 *
+	 * Sockets bound to an address receive datagrams sent to it, sockets
+	 * that joined a group receive datagrams sent to the group and their
+	 * port. Sockets that are not bound get the unspecified address and a
+	 * port of their own when they first send. Interface names are ignored.
+	 *
+	 * Every datagram is delayed by the latency plus a random part of the
+	 * jitter and may be lost, independently for each receiver. Delays are
+	 * measured by the Clock of the io_service. Together with a VirtualClock
+	 * this simulates a network: the same seed gives the same losses and
+	 * delays, and timeouts of minutes take no time at all.
+	 */
+	class LoopbackNetwork : public TransportProvider {
+		public:
+			struct Conditions {
+				boost::posix_time::time_duration latency;
+				boost::posix_time::time_duration jitter;
+				// probability that a datagram is lost
+				double loss;
+				// datagrams waiting for a socket before further ones are dropped
+				size_t queueLimit;
+
+				Conditions()
+					: latency(boost::posix_time::seconds(0)), jitter(boost::posix_time::seconds(0)),
+					loss(0), queueLimit(1024)
+				{}
+			};
+
+			struct Statistics {
+				uint64_t sent;
+				uint64_t delivered;
+				uint64_t lost;
+				// datagrams no socket was bound for
+				uint64_t unreachable;
+				// datagrams dropped because the queue of the receiver was full
+				uint64_t overflows;
+			};
+
+			/**
+			 * Make a LoopbackNetwork create the transports of all sockets on
+			 * io. This must happen before the first socket is created.
+			 */
+			static LoopbackNetwork& install(boost::asio::io_service& io,
+					const Conditions& conditions = Conditions(), uint32_t seed = 0);
+
+			Transport::Ptr createTransport();
+
+			Conditions conditions();
+			void setConditions(const Conditions& conditions);
+
+			Statistics statistics();
+
+		private:
+			friend class LoopbackTransport;
+
+			typedef std::tr1::weak_ptr<LoopbackTransport> transport_ref;
+			typedef std::pair<boost::asio::ip::address_v6, unsigned short> group_key;
+
+			boost::mutex _mutex;
+			Conditions _conditions;
+			Statistics _stats;
+			boost::random::mt19937 _random;
+			unsigned short _next_port;
+
+			std::map<boost::asio::ip::udp::endpoint, transport_ref> _bound;
+			std::map<group_key, std::vector<transport_ref> > _members;
+
+			LoopbackNetwork(boost::asio::io_service& io, const Conditions& conditions, uint32_t seed);
+
+			void bind(const transport_ref& transport, boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err);
+			void unbind(const LoopbackTransport* transport, const boost::asio::ip::udp::endpoint& ep);
+			void join(const transport_ref& transport, const group_key& group);
+			void leave(const LoopbackTransport* transport, const group_key& group);
+
+			void transmit(const LoopbackTransport* sender, bool multicast_loopback,
+					const boost::asio::ip::udp::endpoint& from, const boost::asio::ip::udp::endpoint& dest,
+					const char* data, size_t size);
+			void deliver(const transport_ref& to, const std::tr1::shared_ptr<std::vector<char> >& data,
+					const boost::asio::ip::udp::endpoint& from, const boost::system::error_code& error);
+	};
+}
+
+#endif
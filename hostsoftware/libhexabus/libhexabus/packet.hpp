@@ -29,6 +29,78 @@
 namespace hexabus {
 	class PacketVisitor;
 
+	/**
+	 * Packet classes are identified by the packet type and the datatype of the
+	 * value carried by the packet object (HXB_DTYPE_UNDEFINED for packets
+	 * without a value, HXB_DTYPE_128STRING for endpoint infos). Every class is
+	 * one bit in a 64 bit mask, which allows type checks of packets and filters
+	 * without RTTI.
+	 */
+	typedef uint64_t packet_class_mask;
+
+	enum {
+		PACKET_DATATYPE_COUNT = HXB_DTYPE_16BYTES + 1
+	};
+
+	template<uint8_t Type>
+	struct packet_type_index;
+
+	template<> struct packet_type_index<HXB_PTYPE_ERROR> { static const int value = 0; };
+	template<> struct packet_type_index<HXB_PTYPE_INFO> { static const int value = 1; };
+	template<> struct packet_type_index<HXB_PTYPE_QUERY> { static const int value = 2; };
+	template<> struct packet_type_index<HXB_PTYPE_WRITE> { static const int value = 3; };
+	template<> struct packet_type_index<HXB_PTYPE_EPINFO> { static const int value = 4; };
+	template<> struct packet_type_index<HXB_PTYPE_EPQUERY> { static const int value = 5; };
+
+	BOOST_STATIC_ASSERT(6 * PACKET_DATATYPE_COUNT <= 64);
+
+	// a single class
+	template<uint8_t Type, uint8_t Datatype>
+	struct packet_class_bit {
+		static const packet_class_mask value = packet_class_mask(1) << (packet_type_index<Type>::value * PACKET_DATATYPE_COUNT + Datatype);
+	};
+
+	// all classes of a packet type
+	template<uint8_t Type>
+	struct packet_class_row {
+		static const packet_class_mask value = ((packet_class_mask(1) << PACKET_DATATYPE_COUNT) - 1) << (packet_type_index<Type>::value * PACKET_DATATYPE_COUNT);
+	};
+
+	static const packet_class_mask all_packet_classes = ~packet_class_mask(0);
+
+	static inline packet_class_mask packet_class_of(uint8_t type, uint8_t valueType)
+	{
+		int index;
+		switch (type) {
+			case HXB_PTYPE_ERROR: index = packet_type_index<HXB_PTYPE_ERROR>::value; break;
+			case HXB_PTYPE_INFO: index = packet_type_index<HXB_PTYPE_INFO>::value; break;
+			case HXB_PTYPE_QUERY: index = packet_type_index<HXB_PTYPE_QUERY>::value; break;
+			case HXB_PTYPE_WRITE: index = packet_type_index<HXB_PTYPE_WRITE>::value; break;
+			case HXB_PTYPE_EPINFO: index = packet_type_index<HXB_PTYPE_EPINFO>::value; break;
+			case HXB_PTYPE_EPQUERY: index = packet_type_index<HXB_PTYPE_EPQUERY>::value; break;
+			default: return 0;
+		}
+
+		if (valueType >= PACKET_DATATYPE_COUNT)
+			return 0;
+
+		return packet_class_mask(1) << (index * PACKET_DATATYPE_COUNT + valueType);
+	}
+
+	// datatype constant of a C++ value type
+	template<typename TValue>
+	struct datatype_of;
+
+	template<> struct datatype_of<bool> { static const uint8_t value = HXB_DTYPE_BOOL; };
+	template<> struct datatype_of<uint8_t> { static const uint8_t value = HXB_DTYPE_UINT8; };
+	template<> struct datatype_of<uint32_t> { static const uint8_t value = HXB_DTYPE_UINT32; };
+	template<> struct datatype_of<float> { static const uint8_t value = HXB_DTYPE_FLOAT; };
+	template<> struct datatype_of<boost::posix_time::ptime> { static const uint8_t value = HXB_DTYPE_DATETIME; };
+	template<> struct datatype_of<boost::posix_time::time_duration> { static const uint8_t value = HXB_DTYPE_TIMESTAMP; };
+	template<> struct datatype_of<std::string> { static const uint8_t value = HXB_DTYPE_128STRING; };
+	template<> struct datatype_of<boost::array<char, 16> > { static const uint8_t value = HXB_DTYPE_16BYTES; };
+	template<> struct datatype_of<boost::array<char, 65> > { static const uint8_t value = HXB_DTYPE_65BYTES; };
+
 	class Packet {
 		public:
 			typedef std::tr1::shared_ptr<Packet> Ptr;
@@ -36,10 +108,11 @@ namespace hexabus {
 		private:
 			uint8_t _type;
 			uint8_t _flags;
+			packet_class_mask _class;
 
 		protected:
-			Packet(uint8_t type, uint8_t flags = 0)
-				: _type(type), _flags(flags)
+			Packet(uint8_t type, uint8_t flags = 0, uint8_t valueType = HXB_DTYPE_UNDEFINED)
+				: _type(type), _flags(flags), _class(packet_class_of(type, valueType))
 			{}
 
 		public:
@@ -47,6 +120,7 @@ namespace hexabus {
 
 			uint8_t type() const { return _type; }
 			uint8_t flags() const { return _flags; }
+			packet_class_mask packetClass() const { return _class; }
 
 			virtual void accept(PacketVisitor& visitor) const = 0;
 	};
@@ -117,8 +191,8 @@ namespace hexabus {
 			uint32_t _eid;
 
 		public:
-			EIDPacket(uint8_t type, uint32_t eid, uint8_t flags = 0)
-				: Packet(type, flags), _eid(eid)
+			EIDPacket(uint8_t type, uint32_t eid, uint8_t flags = 0, uint8_t valueType = HXB_DTYPE_UNDEFINED)
+				: Packet(type, flags, valueType), _eid(eid)
 			{}
 
 			uint32_t eid() const { return _eid; }
@@ -154,7 +228,8 @@ namespace hexabus {
 
 		public:
 			TypedPacket(uint8_t type, uint32_t eid, uint8_t datatype, uint8_t flags = 0)
-				: EIDPacket(type, eid, flags), _datatype(datatype)
+				: EIDPacket(type, eid, flags, type == HXB_PTYPE_EPINFO ? uint8_t(HXB_DTYPE_128STRING) : datatype),
+				_datatype(datatype)
 			{}
 
 			uint8_t datatype() const { return _datatype; }
@@ -174,26 +249,11 @@ namespace hexabus {
 					|| boost::is_same<TValue, boost::array<char, 65> >::value),
 				"I don't know how to handle that type");
 
-			static uint8_t calculateDatatype()
-			{
-				return boost::is_same<TValue, bool>::value ? HXB_DTYPE_BOOL :
-					boost::is_same<TValue, uint8_t>::value ? HXB_DTYPE_UINT8 :
-					boost::is_same<TValue, uint32_t>::value ? HXB_DTYPE_UINT32 :
-					boost::is_same<TValue, float>::value ? HXB_DTYPE_FLOAT :
-					boost::is_same<TValue, boost::posix_time::ptime>::value ? HXB_DTYPE_DATETIME :
-					boost::is_same<TValue, boost::posix_time::time_duration>::value ? HXB_DTYPE_TIMESTAMP :
-					boost::is_same<TValue, boost::array<char, 16> >::value
-						? HXB_DTYPE_16BYTES :
-					boost::is_same<TValue, boost::array<char, 65> >::value
-						? HXB_DTYPE_65BYTES :
-					(throw "BUG: Unknown datatype!", HXB_DTYPE_UNDEFINED);
-			}
-
 			TValue _value;
 
 		protected:
 			ValuePacket(uint8_t type, uint32_t eid, const TValue& value, uint8_t flags = 0)
-				: TypedPacket(type, eid, calculateDatatype(), flags), _value(value)
+				: TypedPacket(type, eid, datatype_of<TValue>::value, flags), _value(value)
 			{}
 
 		public:
@@ -262,6 +322,49 @@ namespace hexabus {
 				visitor.visit(*this);
 			}
 	};
+	template<typename T>
+	struct packet_class;
+
+	template<> struct packet_class<Packet> { static const packet_class_mask mask = all_packet_classes; };
+	template<> struct packet_class<ErrorPacket> { static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_ERROR, HXB_DTYPE_UNDEFINED>::value; };
+	template<> struct packet_class<EIDPacket> { static const packet_class_mask mask = all_packet_classes & ~packet_class_row<HXB_PTYPE_ERROR>::value; };
+	template<> struct packet_class<QueryPacket> { static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_QUERY, HXB_DTYPE_UNDEFINED>::value; };
+	template<> struct packet_class<EndpointQueryPacket> { static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_EPQUERY, HXB_DTYPE_UNDEFINED>::value; };
+	template<> struct packet_class<TypedPacket> {
+		static const packet_class_mask mask = packet_class_row<HXB_PTYPE_INFO>::value
+			| packet_class_row<HXB_PTYPE_WRITE>::value
+			| packet_class_row<HXB_PTYPE_EPINFO>::value;
+	};
+	template<> struct packet_class<EndpointInfoPacket> { static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_EPINFO, HXB_DTYPE_128STRING>::value; };
+
+	template<typename TValue>
+	struct packet_class<InfoPacket<TValue> > {
+		static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_INFO, datatype_of<TValue>::value>::value;
+	};
+
+	template<typename TValue>
+	struct packet_class<WritePacket<TValue> > {
+		static const packet_class_mask mask = packet_class_bit<HXB_PTYPE_WRITE, datatype_of<TValue>::value>::value;
+	};
+
+	template<typename TValue>
+	struct packet_class<ValuePacket<TValue> > {
+		static const packet_class_mask mask = packet_class<InfoPacket<TValue> >::mask
+			| packet_class<WritePacket<TValue> >::mask
+			| (boost::is_same<TValue, std::string>::value ? packet_class<EndpointInfoPacket>::mask : 0);
+	};
+
+	/**
+	 * Checked downcast of packets, like dynamic_cast but without RTTI.
+	 * Returns NULL if the packet is not of type T.
+	 */
+	template<typename T>
+	const T* packet_cast(const Packet* packet)
+	{
+		return packet && (packet->packetClass() & packet_class<T>::mask)
+			? static_cast<const T*>(packet)
+			: NULL;
+	}
 };
 
 #endif
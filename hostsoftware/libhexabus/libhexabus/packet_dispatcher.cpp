@@ -0,0 +1,233 @@
+#include "packet_dispatcher.hpp"
+
+#include <algorithm>
+
+using namespace hexabus;
+
+static int class_index(packet_class_mask mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(mask);
+#else
+	int index = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
+
+PacketDispatcher::PacketDispatcher()
+	: _nextSeq(0), _subscriptions(0), _pruneAt(32), _depth(0), _dirty(false)
+{
+}
+
+hexabus::connection PacketDispatcher::subscribe(const callback_t& callback, const filter_t& filter,
+		const filtering::Constraints& constraints)
+{
+	Subscription::Ptr sub(new Subscription);
+
+	sub->seq = _nextSeq++;
+	sub->filter = filter;
+	sub->constraints = constraints;
+	hexabus::connection result = sub->callback.connect(callback);
+
+	if (_depth) {
+		_pending.push_back(sub);
+	} else {
+		insert(sub);
+		if (_subscriptions >= _pruneAt)
+			prune();
+	}
+
+	return result;
+}
+
+void PacketDispatcher::insert(const Subscription::Ptr& sub)
+{
+	const filtering::Constraints& c = sub->constraints;
+
+	// the filter can never match
+	if (!c.classes)
+		return;
+
+	_subscriptions++;
+	if (c.eid) {
+		_byEID[*c.eid].push_back(sub);
+	} else if (c.source) {
+		_bySource[*c.source].push_back(sub);
+	} else {
+		for (int i = 0; i < 64; i++) {
+			if (c.classes & (packet_class_mask(1) << i))
+				_byClass[i].push_back(sub);
+		}
+	}
+}
+
+namespace {
+	template<typename Ptr>
+	struct IsDead {
+		bool operator()(const Ptr& sub) const { return sub->callback.empty(); }
+	};
+
+	template<typename Map>
+	size_t prune_map(Map& map)
+	{
+		typedef typename Map::mapped_type list_t;
+		size_t live = 0;
+
+		for (typename Map::iterator it = map.begin(), end = map.end(); it != end; ) {
+			list_t& list = it->second;
+			list.erase(
+				std::remove_if(list.begin(), list.end(), IsDead<typename list_t::value_type>()),
+				list.end());
+
+			live += list.size();
+			if (list.empty())
+				map.erase(it++);
+			else
+				++it;
+		}
+
+		return live;
+	}
+
+	template<typename List>
+	bool has_live(const List& list)
+	{
+		for (typename List::const_iterator it = list.begin(), end = list.end(); it != end; ++it) {
+			if (!(*it)->callback.empty())
+				return true;
+		}
+		return false;
+	}
+}
+
+bool PacketDispatcher::empty() const
+{
+	if (has_live(_pending))
+		return false;
+	if (!_subscriptions)
+		return true;
+
+	for (std::map<uint32_t, list_t>::const_iterator it = _byEID.begin(), end = _byEID.end(); it != end; ++it) {
+		if (has_live(it->second))
+			return false;
+	}
+	for (std::map<boost::asio::ip::address_v6, list_t>::const_iterator it = _bySource.begin(), end = _bySource.end(); it != end; ++it) {
+		if (has_live(it->second))
+			return false;
+	}
+	for (int i = 0; i < 64; i++) {
+		if (has_live(_byClass[i]))
+			return false;
+	}
+
+	return true;
+}
+
+void PacketDispatcher::prune()
+{
+	size_t live = prune_map(_byEID) + prune_map(_bySource);
+
+	for (int i = 0; i < 64; i++) {
+		list_t& list = _byClass[i];
+		list.erase(
+			std::remove_if(list.begin(), list.end(), IsDead<Subscription::Ptr>()),
+			list.end());
+
+		// count every subscription only in the first bucket it appears in
+		for (list_t::const_iterator it = list.begin(), end = list.end(); it != end; ++it) {
+			if (class_index((*it)->constraints.classes) == i)
+				live++;
+		}
+	}
+
+	_subscriptions = live;
+	_pruneAt = std::max<size_t>(32, 2 * live);
+	_dirty = false;
+}
+
+void PacketDispatcher::finishDispatch()
+{
+	for (list_t::const_iterator it = _pending.begin(), end = _pending.end(); it != end; ++it)
+		insert(*it);
+	_pending.clear();
+
+	if (_dirty || _subscriptions >= _pruneAt)
+		prune();
+}
+
+void PacketDispatcher::invoke(const Subscription& sub, const Packet& packet, const boost::asio::ip::udp::endpoint& from)
+{
+	if (sub.callback.empty()) {
+		_dirty = true;
+		return;
+	}
+
+	if ((sub.constraints.classes & packet.packetClass()) && sub.filter(packet, from))
+		sub.callback(packet, from);
+}
+
+struct PacketDispatcher::DispatchGuard {
+	PacketDispatcher& dispatcher;
+
+	DispatchGuard(PacketDispatcher& dispatcher)
+		: dispatcher(dispatcher)
+	{
+		++dispatcher._depth;
+	}
+
+	~DispatchGuard()
+	{
+		if (!--dispatcher._depth)
+			dispatcher.finishDispatch();
+	}
+};
+
+void PacketDispatcher::dispatch(const Packet& packet, const boost::asio::ip::udp::endpoint& from)
+{
+	packet_class_mask cls = packet.packetClass();
+	if (!cls)
+		return;
+
+	const list_t* lists[3];
+	size_t count = 0;
+
+	lists[count++] = &_byClass[class_index(cls)];
+
+	if (!_byEID.empty()) {
+		const EIDPacket* eidPacket = packet_cast<EIDPacket>(&packet);
+		if (eidPacket) {
+			std::map<uint32_t, list_t>::const_iterator it = _byEID.find(eidPacket->eid());
+			if (it != _byEID.end())
+				lists[count++] = &it->second;
+		}
+	}
+
+	if (!_bySource.empty() && from.address().is_v6()) {
+		std::map<boost::asio::ip::address_v6, list_t>::const_iterator it = _bySource.find(from.address().to_v6());
+		if (it != _bySource.end())
+			lists[count++] = &it->second;
+	}
+
+	DispatchGuard guard(*this);
+
+	// the lists are sorted by subscription order and are not modified while
+	// dispatching, merge them to call the subscribers in order
+	size_t pos[3] = { 0, 0, 0 };
+	for (;;) {
+		int next = -1;
+		for (size_t i = 0; i < count; i++) {
+			if (pos[i] < lists[i]->size()
+					&& (next < 0 || (*lists[i])[pos[i]]->seq < (*lists[next])[pos[next]]->seq))
+				next = i;
+		}
+
+		if (next < 0)
+			break;
+
+		invoke(*(*lists[next])[pos[next]++], packet, from);
+	}
+}
@@ -0,0 +1,78 @@
+#ifndef LIBHEXABUS_PACKET_DISPATCHER_HPP
+#define LIBHEXABUS_PACKET_DISPATCHER_HPP 1
+
+#include <map>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include "signals.hpp"
+#include "packet.hpp"
+#include "filtering.hpp"
+
+namespace hexabus {
+
+	/**
+	 * Delivers packets to filtered subscriptions without evaluating every
+	 * filter for every packet. Subscriptions are indexed by the constraints of
+	 * their filter: by EID or source address if the filter requires one, by
+	 * packet class otherwise. Only subscriptions from the matching buckets are
+	 * considered for a packet, in the order they were made.
+	 *
+	 * Subscriptions made or cancelled from within a callback take effect after
+	 * the current packet has been dispatched.
+	 */
+	class PacketDispatcher {
+		public:
+			typedef boost::function<bool (const Packet& packet, const boost::asio::ip::udp::endpoint& from)> filter_t;
+			typedef boost::function<void (const Packet& packet, const boost::asio::ip::udp::endpoint& from)> callback_t;
+
+		private:
+			struct Subscription {
+				typedef std::tr1::shared_ptr<Subscription> Ptr;
+
+				uint64_t seq;
+				filter_t filter;
+				filtering::Constraints constraints;
+				hexabus::signal<void (const Packet&, const boost::asio::ip::udp::endpoint&)> callback;
+			};
+
+			typedef std::vector<Subscription::Ptr> list_t;
+
+			list_t _byClass[64];
+			std::map<uint32_t, list_t> _byEID;
+			std::map<boost::asio::ip::address_v6, list_t> _bySource;
+			list_t _pending;
+
+			uint64_t _nextSeq;
+			size_t _subscriptions;
+			size_t _pruneAt;
+			unsigned _depth;
+			bool _dirty;
+
+			void insert(const Subscription::Ptr& sub);
+			void prune();
+			void finishDispatch();
+
+			struct DispatchGuard;
+			friend struct DispatchGuard;
+
+			void invoke(const Subscription& sub, const Packet& packet, const boost::asio::ip::udp::endpoint& from);
+
+		public:
+			PacketDispatcher();
+
+			hexabus::connection subscribe(const callback_t& callback, const filter_t& filter,
+					const filtering::Constraints& constraints);
+
+			void dispatch(const Packet& packet, const boost::asio::ip::udp::endpoint& from);
+
+			/**
+			 * True if no subscription is connected. Cancelled subscriptions are
+			 * only removed from the index lazily, so this looks for a live one.
+			 */
+			bool empty() const;
+	};
+
+}
+
+#endif
@@ -0,0 +1,364 @@
+#include <libhexabus/packet_view.hpp>
+
+#include <stdexcept>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "crc.hpp"
+#include "error.hpp"
+
+#include "../../../shared/hexabus_definitions.h"
+
+using namespace hexabus;
+
+// offsets of the fields in the wire format
+enum {
+	OFS_TYPE = 4,
+	OFS_FLAGS = 5,
+	OFS_ERROR_CODE = 6,
+	OFS_EID = 6,
+	OFS_DATATYPE = 10,
+	OFS_VALUE = 11,
+
+	STRING_LENGTH = ValuePacket<std::string>::max_length + 1
+};
+
+size_t PacketView::valueLength(uint8_t datatype)
+{
+	switch (datatype) {
+		case HXB_DTYPE_BOOL: return 1;
+		case HXB_DTYPE_UINT8: return 1;
+		case HXB_DTYPE_UINT32: return 4;
+		case HXB_DTYPE_DATETIME: return 8;
+		case HXB_DTYPE_FLOAT: return 4;
+		case HXB_DTYPE_128STRING: return STRING_LENGTH;
+		case HXB_DTYPE_TIMESTAMP: return 4;
+		case HXB_DTYPE_65BYTES: return 65;
+		case HXB_DTYPE_16BYTES: return 16;
+		default: return 0;
+	}
+}
+
+PacketView::PacketView(const void* data, size_t size)
+	: _data(reinterpret_cast<const char*>(data)), _size(0), _datatype(HXB_DTYPE_UNDEFINED)
+{
+	if (!data)
+		throw std::invalid_argument("data");
+
+	if (size < strlen(HXB_HEADER))
+		throw BadPacketException("Packet too short");
+	if (memcmp(HXB_HEADER, _data, strlen(HXB_HEADER)))
+		throw BadPacketException("Invalid header");
+	if (size < OFS_FLAGS + 1)
+		throw BadPacketException("Packet too short");
+
+	_type = u8_at(OFS_TYPE);
+	_flags = u8_at(OFS_FLAGS);
+
+	size_t payloadEnd;
+	switch (_type) {
+		case HXB_PTYPE_ERROR:
+			payloadEnd = OFS_ERROR_CODE + 1;
+			break;
+
+		case HXB_PTYPE_QUERY:
+		case HXB_PTYPE_EPQUERY:
+			payloadEnd = OFS_EID + 4;
+			break;
+
+		case HXB_PTYPE_INFO:
+		case HXB_PTYPE_WRITE:
+			if (size < OFS_DATATYPE + 1)
+				throw BadPacketException("Packet too short");
+			_datatype = u8_at(OFS_DATATYPE);
+			if (!valueLength(_datatype))
+				throw BadPacketException("Invalid datatype");
+			payloadEnd = OFS_VALUE + valueLength(_datatype);
+			break;
+
+		case HXB_PTYPE_EPINFO:
+			if (size < OFS_DATATYPE + 1)
+				throw BadPacketException("Packet too short");
+			_datatype = u8_at(OFS_DATATYPE);
+			payloadEnd = OFS_VALUE + STRING_LENGTH;
+			break;
+
+		default:
+			throw BadPacketException("Unknown packet type");
+	}
+
+	if (size < payloadEnd + sizeof(uint16_t))
+		throw BadPacketException("Packet too short");
+
+	_size = payloadEnd + sizeof(uint16_t);
+
+	if (hexabus::crc(_data, payloadEnd) != u16_at(payloadEnd))
+		throw BadPacketException("Bad checksum");
+
+	if (_type == HXB_PTYPE_EPINFO || _datatype == HXB_DTYPE_128STRING) {
+		if (!memchr(_data + OFS_VALUE, '\0', STRING_LENGTH))
+			throw BadPacketException("Unterminated string");
+	} else if (_datatype == HXB_DTYPE_DATETIME) {
+		value<boost::posix_time::ptime>();
+	}
+}
+
+uint8_t PacketView::u8_at(size_t offset) const
+{
+	return _data[offset];
+}
+
+uint16_t PacketView::u16_at(size_t offset) const
+{
+	uint16_t result;
+	memcpy(&result, _data + offset, sizeof(result));
+	return ntohs(result);
+}
+
+uint32_t PacketView::u32_at(size_t offset) const
+{
+	uint32_t result;
+	memcpy(&result, _data + offset, sizeof(result));
+	return ntohl(result);
+}
+
+void PacketView::checkDatatype(uint8_t datatype) const
+{
+	if ((_type != HXB_PTYPE_INFO && _type != HXB_PTYPE_WRITE) || _datatype != datatype)
+		throw GenericException("Packet does not carry a value of the requested type");
+}
+
+uint32_t PacketView::eid() const
+{
+	if (!hasEID())
+		throw GenericException("Packet has no EID");
+
+	return u32_at(OFS_EID);
+}
+
+uint8_t PacketView::errorCode() const
+{
+	if (_type != HXB_PTYPE_ERROR)
+		throw GenericException("Packet is not an error packet");
+
+	return u8_at(OFS_ERROR_CODE);
+}
+
+namespace hexabus {
+
+template<>
+bool PacketView::value<bool>() const
+{
+	checkDatatype(HXB_DTYPE_BOOL);
+	return u8_at(OFS_VALUE);
+}
+
+template<>
+uint8_t PacketView::value<uint8_t>() const
+{
+	checkDatatype(HXB_DTYPE_UINT8);
+	return u8_at(OFS_VALUE);
+}
+
+template<>
+uint32_t PacketView::value<uint32_t>() const
+{
+	checkDatatype(HXB_DTYPE_UINT32);
+	return u32_at(OFS_VALUE);
+}
+
+template<>
+float PacketView::value<float>() const
+{
+	checkDatatype(HXB_DTYPE_FLOAT);
+
+	union {
+		uint32_t u32;
+		float f;
+	} c = { u32_at(OFS_VALUE) };
+
+	return c.f;
+}
+
+template<>
+boost::posix_time::ptime PacketView::value<boost::posix_time::ptime>() const
+{
+	checkDatatype(HXB_DTYPE_DATETIME);
+
+	uint8_t hour = u8_at(OFS_VALUE + 0);
+	uint8_t minute = u8_at(OFS_VALUE + 1);
+	uint8_t second = u8_at(OFS_VALUE + 2);
+	uint8_t day = u8_at(OFS_VALUE + 3);
+	uint8_t month = u8_at(OFS_VALUE + 4);
+	uint16_t year = u16_at(OFS_VALUE + 5);
+	uint8_t weekday = u8_at(OFS_VALUE + 7);
+
+	try {
+		boost::posix_time::ptime dt(
+			boost::gregorian::date(year, month, day),
+			boost::posix_time::hours(hour)
+				+ boost::posix_time::minutes(minute)
+				+ boost::posix_time::seconds(second));
+
+		if (dt.date().day_of_week() != weekday)
+			throw BadPacketException("Invalid datetime format");
+
+		return dt;
+	} catch (const std::out_of_range&) {
+		throw BadPacketException("Invalid datetime format");
+	}
+}
+
+template<>
+boost::posix_time::time_duration PacketView::value<boost::posix_time::time_duration>() const
+{
+	checkDatatype(HXB_DTYPE_TIMESTAMP);
+	return boost::posix_time::seconds(u32_at(OFS_VALUE));
+}
+
+template<>
+std::string PacketView::value<std::string>() const
+{
+	return stringValue();
+}
+
+template<>
+boost::array<char, 16> PacketView::value<boost::array<char, 16> >() const
+{
+	checkDatatype(HXB_DTYPE_16BYTES);
+
+	boost::array<char, 16> result;
+	memcpy(result.data(), _data + OFS_VALUE, result.size());
+	return result;
+}
+
+template<>
+boost::array<char, 65> PacketView::value<boost::array<char, 65> >() const
+{
+	checkDatatype(HXB_DTYPE_65BYTES);
+
+	boost::array<char, 65> result;
+	memcpy(result.data(), _data + OFS_VALUE, result.size());
+	return result;
+}
+
+}
+
+const char* PacketView::stringValue() const
+{
+	if (_type != HXB_PTYPE_EPINFO)
+		checkDatatype(HXB_DTYPE_128STRING);
+
+	return _data + OFS_VALUE;
+}
+
+const char* PacketView::valueData() const
+{
+	if (_type != HXB_PTYPE_INFO && _type != HXB_PTYPE_WRITE && _type != HXB_PTYPE_EPINFO)
+		throw GenericException("Packet carries no value");
+
+	return _data + OFS_VALUE;
+}
+
+size_t PacketView::valueSize() const
+{
+	switch (_type) {
+		case HXB_PTYPE_INFO:
+		case HXB_PTYPE_WRITE:
+			return valueLength(_datatype);
+
+		case HXB_PTYPE_EPINFO:
+			return STRING_LENGTH;
+
+		default:
+			return 0;
+	}
+}
+
+bool PacketView::isNumeric() const
+{
+	if (_type != HXB_PTYPE_INFO && _type != HXB_PTYPE_WRITE)
+		return false;
+
+	switch (_datatype) {
+		case HXB_DTYPE_BOOL:
+		case HXB_DTYPE_UINT8:
+		case HXB_DTYPE_UINT32:
+		case HXB_DTYPE_FLOAT:
+		case HXB_DTYPE_TIMESTAMP:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+double PacketView::numericValue() const
+{
+	if (!isNumeric())
+		throw GenericException("Packet does not carry a numeric value");
+
+	switch (_datatype) {
+		case HXB_DTYPE_BOOL: return value<bool>();
+		case HXB_DTYPE_UINT8: return value<uint8_t>();
+		case HXB_DTYPE_UINT32: return value<uint32_t>();
+		case HXB_DTYPE_FLOAT: return value<float>();
+		case HXB_DTYPE_TIMESTAMP: return u32_at(OFS_VALUE);
+		default: return 0;
+	}
+}
+
+template<typename T>
+static Packet::Ptr makeValuePacket(const PacketView& view)
+{
+	if (view.type() == HXB_PTYPE_INFO) {
+		return Packet::Ptr(new InfoPacket<T>(view.eid(), view.value<T>(), view.flags()));
+	} else {
+		return Packet::Ptr(new WritePacket<T>(view.eid(), view.value<T>(), view.flags()));
+	}
+}
+
+Packet::Ptr PacketView::toPacket() const
+{
+	switch (_type) {
+		case HXB_PTYPE_ERROR:
+			return Packet::Ptr(new ErrorPacket(errorCode(), _flags));
+
+		case HXB_PTYPE_QUERY:
+			return Packet::Ptr(new QueryPacket(eid(), _flags));
+
+		case HXB_PTYPE_EPQUERY:
+			return Packet::Ptr(new EndpointQueryPacket(eid(), _flags));
+
+		case HXB_PTYPE_EPINFO:
+			return Packet::Ptr(new EndpointInfoPacket(eid(), _datatype, stringValue(), _flags));
+
+		case HXB_PTYPE_INFO:
+		case HXB_PTYPE_WRITE:
+			switch (_datatype) {
+				case HXB_DTYPE_BOOL: return makeValuePacket<bool>(*this);
+				case HXB_DTYPE_UINT8: return makeValuePacket<uint8_t>(*this);
+				case HXB_DTYPE_UINT32: return makeValuePacket<uint32_t>(*this);
+				case HXB_DTYPE_FLOAT: return makeValuePacket<float>(*this);
+				case HXB_DTYPE_DATETIME: return makeValuePacket<boost::posix_time::ptime>(*this);
+				case HXB_DTYPE_TIMESTAMP: return makeValuePacket<boost::posix_time::time_duration>(*this);
+				case HXB_DTYPE_128STRING: return makeValuePacket<std::string>(*this);
+				case HXB_DTYPE_16BYTES: return makeValuePacket<boost::array<char, 16> >(*this);
+				case HXB_DTYPE_65BYTES: return makeValuePacket<boost::array<char, 65> >(*this);
+			}
+	}
+
+	throw BadPacketException("Unknown packet type");
+}
+
+void PacketView::accept(PacketViewVisitor& visitor) const
+{
+	switch (_type) {
+		case HXB_PTYPE_ERROR: visitor.visitError(*this); break;
+		case HXB_PTYPE_QUERY: visitor.visitQuery(*this); break;
+		case HXB_PTYPE_EPQUERY: visitor.visitEndpointQuery(*this); break;
+		case HXB_PTYPE_EPINFO: visitor.visitEndpointInfo(*this); break;
+		case HXB_PTYPE_INFO: visitor.visitInfo(*this); break;
+		case HXB_PTYPE_WRITE: visitor.visitWrite(*this); break;
+	}
+}
@@ -0,0 +1,127 @@
+#ifndef LIBHEXABUS_PACKET_VIEW_HPP
+#define LIBHEXABUS_PACKET_VIEW_HPP 1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <boost/array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <libhexabus/hexabus_types.h>
+#include <libhexabus/packet.hpp>
+
+namespace hexabus {
+	class PacketViewVisitor;
+
+	/**
+	 * Non-owning view of a serialized packet.
+	 *
+	 * Constructing a view validates header, length and checksum of the buffer
+	 * in place and throws BadPacketException if any of them is broken, just
+	 * like deserialize() does. No memory is allocated on success; all
+	 * accessors read directly from the underlying buffer, which must outlive
+	 * the view.
+	 */
+	class PacketView {
+		private:
+			const char* _data;
+			size_t _size;
+			uint8_t _type;
+			uint8_t _flags;
+			uint8_t _datatype;
+
+			uint8_t u8_at(size_t offset) const;
+			uint16_t u16_at(size_t offset) const;
+			uint32_t u32_at(size_t offset) const;
+
+			void checkDatatype(uint8_t datatype) const;
+
+		public:
+			PacketView(const void* data, size_t size);
+
+			/**
+			 * Length of the wire representation of a value of the given datatype,
+			 * or 0 if the datatype is unknown.
+			 */
+			static size_t valueLength(uint8_t datatype);
+
+			const char* data() const { return _data; }
+			// length of the packet including the checksum, trailing garbage excluded
+			size_t size() const { return _size; }
+
+			uint8_t type() const { return _type; }
+			uint8_t flags() const { return _flags; }
+
+			bool hasEID() const { return _type != HXB_PTYPE_ERROR; }
+			uint32_t eid() const;
+
+			// HXB_DTYPE_UNDEFINED for packets that carry no datatype
+			uint8_t datatype() const { return _datatype; }
+
+			uint8_t errorCode() const;
+
+			// class of the packet object toPacket() would create, see packet.hpp
+			packet_class_mask packetClass() const
+			{
+				return packet_class_of(_type, _type == HXB_PTYPE_EPINFO ? uint8_t(HXB_DTYPE_128STRING) : _datatype);
+			}
+
+			/**
+			 * Typed value of an info or write packet. T must match the datatype
+			 * of the packet, otherwise a GenericException is thrown.
+			 */
+			template<typename T>
+			T value() const;
+
+			// NUL-terminated string of 128STRING values and endpoint infos, points into the buffer
+			const char* stringValue() const;
+			// raw value bytes of info, write and endpoint info packets, points into the buffer
+			const char* valueData() const;
+			size_t valueSize() const;
+
+			/**
+			 * Whether the value of this packet can be represented as a double
+			 * (bool, uint8, uint32, float and timestamp values).
+			 */
+			bool isNumeric() const;
+			double numericValue() const;
+
+			/**
+			 * Copy the contents of the view into a heap-allocated packet object.
+			 */
+			Packet::Ptr toPacket() const;
+
+			void accept(PacketViewVisitor& visitor) const;
+	};
+
+	template<> bool PacketView::value<bool>() const;
+	template<> uint8_t PacketView::value<uint8_t>() const;
+	template<> uint32_t PacketView::value<uint32_t>() const;
+	template<> float PacketView::value<float>() const;
+	template<> boost::posix_time::ptime PacketView::value<boost::posix_time::ptime>() const;
+	template<> boost::posix_time::time_duration PacketView::value<boost::posix_time::time_duration>() const;
+	template<> std::string PacketView::value<std::string>() const;
+	template<> boost::array<char, 16> PacketView::value<boost::array<char, 16> >() const;
+	template<> boost::array<char, 65> PacketView::value<boost::array<char, 65> >() const;
+
+	/**
+	 * Dispatches on the packet type of a view. All methods default to doing
+	 * nothing, so visitors only need to override what they are interested in.
+	 */
+	class PacketViewVisitor {
+		public:
+			virtual ~PacketViewVisitor() {}
+
+			virtual void visitError(const PacketView& error) {}
+			virtual void visitQuery(const PacketView& query) {}
+			virtual void visitEndpointQuery(const PacketView& endpointQuery) {}
+			virtual void visitEndpointInfo(const PacketView& endpointInfo) {}
+			virtual void visitInfo(const PacketView& info) {}
+			virtual void visitWrite(const PacketView& write) {}
+
+			void visitPacket(const PacketView& packet)
+			{
+				packet.accept(*this);
+			}
+	};
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef LIBHEXABUS_MAPPED_FILE_HPP
+#define LIBHEXABUS_MAPPED_FILE_HPP 1
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace hexabus {
+
+	// read-only mapping of a whole file. invalid if the file could not be
+	// mapped or is shorter than min_size
+	struct mapped_file : private boost::noncopyable {
+		int fd;
+		void* data;
+		size_t size;
+
+		mapped_file(const boost::filesystem::path& path, size_t min_size = 1)
+			: fd(-1), data(MAP_FAILED), size(0)
+		{
+			struct stat st;
+
+			fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0 || fstat(fd, &st) || st.st_size < off_t(min_size) || !st.st_size)
+				return;
+
+			size = st.st_size;
+			data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+
+		~mapped_file()
+		{
+			if (data != MAP_FAILED)
+				munmap(data, size);
+			if (fd >= 0)
+				close(fd);
+		}
+
+		bool valid() const { return data != MAP_FAILED; }
+		const char* bytes() const { return static_cast<const char*>(data); }
+	};
+
+}
+
+#endif
@@ -8,6 +8,8 @@
 
 namespace hexabus {
 	std::vector<char> serialize(const Packet& packet);
+	// appends the wire representation of packet to target
+	void serialize(const Packet& packet, std::vector<char>& target);
 
 	void deserialize(const void* packet, size_t size, PacketVisitor& handler);
 	Packet::Ptr deserialize(const void* packet, size_t size);
@@ -0,0 +1,373 @@
+#include "libhexabus/reading_spool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "private/mapped_file.hpp"
+#include "error.hpp"
+
+using namespace hexabus;
+
+const size_t ReadingSpool::WriteBufferSize;
+const size_t ReadingSpool::MaxSegmentSize;
+
+namespace {
+
+const char segment_magic[8] = { 'H', 'X', 'B', 'S', 'P', 'O', 'O', 1 };
+const char* segment_suffix = ".spool";
+const char* head_file = "head";
+
+struct record_header {
+	uint32_t crc;
+	uint16_t sensor_size;
+	uint16_t reserved;
+	int64_t ts;
+	double value;
+};
+
+uint32_t record_crc(const record_header& header, const char* sensor)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(reinterpret_cast<const char*>(&header) + sizeof(header.crc), sizeof(header) - sizeof(header.crc));
+	crc.process_bytes(sensor, header.sensor_size);
+	return crc.checksum();
+}
+
+/*
+ * Reads the record at offset and advances offset past it. Returns false,
+ * leaving offset alone, if there is no intact record at offset.
+ */
+bool read_record(const char* data, size_t size, uint64_t& offset, ReadingSpool::Reading* target)
+{
+	record_header header;
+	if (size < offset || size - offset < sizeof(header))
+		return false;
+
+	memcpy(&header, data + offset, sizeof(header));
+	const char* sensor = data + offset + sizeof(header);
+	if (header.sensor_size > size - offset - sizeof(header) || record_crc(header, sensor) != header.crc)
+		return false;
+
+	if (target) {
+		target->sensor.assign(sensor, header.sensor_size);
+		target->ts = header.ts;
+		target->value = header.value;
+	}
+
+	offset += sizeof(header) + header.sensor_size;
+	return true;
+}
+
+void throw_errno(const std::string& what, const boost::filesystem::path& path)
+{
+	throw GenericException(what + " " + path.string() + ": " + strerror(errno));
+}
+
+}
+
+ReadingSpool::ReadingSpool(const boost::filesystem::path& dir, uint64_t max_bytes)
+	: _dir(dir), _max_bytes(max_bytes),
+		_segment_size(std::max<uint64_t>(std::min<uint64_t>(MaxSegmentSize, max_bytes / 4), 4096)),
+		_fd(-1), _head_offset(sizeof(segment_magic)), _head_readings(0),
+		_peeked(false), _peek_seq(0), _peek_offset(0), _peek_readings(0), _peek_count(0),
+		_buffered(0), _pending(0), _size(0), _dropped(0)
+{
+	boost::filesystem::create_directories(_dir);
+	open_segments();
+}
+
+ReadingSpool::~ReadingSpool()
+{
+	try {
+		write_buffer();
+	} catch (...) {
+	}
+
+	if (_fd >= 0)
+		close(_fd);
+}
+
+boost::filesystem::path ReadingSpool::segment_path(uint64_t seq) const
+{
+	std::string name = boost::lexical_cast<std::string>(seq);
+
+	// zero-padded so that segments sort by name
+	return _dir / (std::string(20 - name.size(), '0') + name + segment_suffix);
+}
+
+void ReadingSpool::open_segments()
+{
+	std::vector<uint64_t> seqs;
+	boost::filesystem::directory_iterator it(_dir), end;
+	for (; it != end; ++it) {
+		std::string name = it->path().filename().string();
+		if (name.size() <= strlen(segment_suffix)
+				|| name.compare(name.size() - strlen(segment_suffix), std::string::npos, segment_suffix))
+			continue;
+
+		try {
+			seqs.push_back(boost::lexical_cast<uint64_t>(name.substr(0, name.size() - strlen(segment_suffix))));
+		} catch (const boost::bad_lexical_cast&) {
+		}
+	}
+	std::sort(seqs.begin(), seqs.end());
+
+	for (std::vector<uint64_t>::const_iterator seq = seqs.begin(); seq != seqs.end(); ++seq) {
+		boost::filesystem::path path = segment_path(*seq);
+		segment s = { *seq, 0, 0 };
+
+		{
+			mapped_file file(path, sizeof(segment_magic));
+			if (file.valid() && !memcmp(file.bytes(), segment_magic, sizeof(segment_magic))) {
+				s.size = sizeof(segment_magic);
+				while (read_record(file.bytes(), file.size, s.size, 0))
+					s.readings++;
+			}
+		}
+
+		if (!s.size) {
+			boost::filesystem::remove(path);
+			continue;
+		}
+
+		// drop whatever a crash left behind
+		if (truncate(path.c_str(), s.size))
+			throw_errno("Could not truncate", path);
+
+		_segments.push_back(s);
+		_size += s.size;
+		_pending += s.readings;
+	}
+
+	if (_segments.empty())
+		return;
+
+	boost::filesystem::ifstream in(_dir / head_file);
+	uint64_t seq, offset, readings;
+	if (in >> seq >> offset >> readings) {
+		while (_segments.size() > 1 && _segments.front().seq < seq) {
+			_size -= _segments.front().size;
+			_pending -= _segments.front().readings;
+			boost::filesystem::remove(segment_path(_segments.front().seq));
+			_segments.pop_front();
+		}
+
+		const segment& head = _segments.front();
+		if (head.seq == seq && offset <= head.size && readings <= head.readings) {
+			_head_offset = offset;
+			_head_readings = readings;
+			_pending -= readings;
+		}
+	}
+
+	_fd = open(segment_path(_segments.back().seq).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (_fd < 0)
+		throw_errno("Could not open", segment_path(_segments.back().seq));
+}
+
+void ReadingSpool::start_segment()
+{
+	uint64_t seq = _segments.empty() ? 0 : _segments.back().seq + 1;
+	boost::filesystem::path path = segment_path(seq);
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw_errno("Could not create", path);
+
+	if (write(fd, segment_magic, sizeof(segment_magic)) != ssize_t(sizeof(segment_magic))) {
+		close(fd);
+		boost::filesystem::remove(path);
+		throw_errno("Could not write", path);
+	}
+
+	// make sure the new segment is still there after a crash
+	int dir = open(_dir.c_str(), O_RDONLY | O_CLOEXEC);
+	if (dir >= 0) {
+		fsync(dir);
+		close(dir);
+	}
+
+	if (_fd >= 0)
+		close(_fd);
+	_fd = fd;
+
+	segment s = { seq, sizeof(segment_magic), 0 };
+	_segments.push_back(s);
+	_size += s.size;
+
+	if (_segments.size() == 1) {
+		_head_offset = s.size;
+		_head_readings = 0;
+	}
+}
+
+void ReadingSpool::append(const std::string& sensor, int64_t ts, double value)
+{
+	if (sensor.size() > 0xFFFF)
+		throw GenericException("Sensor id too long: " + sensor.substr(0, 64) + "...");
+
+	record_header header;
+	header.sensor_size = sensor.size();
+	header.reserved = 0;
+	header.ts = ts;
+	header.value = value;
+	header.crc = record_crc(header, sensor.c_str());
+
+	const char* bytes = reinterpret_cast<const char*>(&header);
+	_buffer.insert(_buffer.end(), bytes, bytes + sizeof(header));
+	_buffer.insert(_buffer.end(), sensor.begin(), sensor.end());
+	_buffered++;
+	_pending++;
+
+	if (_buffer.size() >= WriteBufferSize)
+		write_buffer();
+}
+
+void ReadingSpool::write_buffer()
+{
+	if (_buffer.empty())
+		return;
+
+	if (_fd < 0 || _segments.back().size >= _segment_size)
+		start_segment();
+
+	segment& s = _segments.back();
+	size_t written = 0;
+	while (written < _buffer.size()) {
+		ssize_t rc = write(_fd, &_buffer[written], _buffer.size() - written);
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc <= 0) {
+			int err = errno;
+			// records after a torn one would be lost when reading
+			if (ftruncate(_fd, s.size)) {
+				close(_fd);
+				_fd = -1;
+			}
+			errno = err;
+			throw_errno("Could not write", segment_path(s.seq));
+		}
+		written += rc;
+	}
+
+	s.size += _buffer.size();
+	s.readings += _buffered;
+	_size += _buffer.size();
+
+	_buffer.clear();
+	_buffered = 0;
+
+	while (_size > _max_bytes && _segments.size() > 1)
+		drop_oldest();
+}
+
+void ReadingSpool::sync()
+{
+	write_buffer();
+
+	if (_fd >= 0 && fdatasync(_fd))
+		throw_errno("Could not sync", segment_path(_segments.back().seq));
+}
+
+void ReadingSpool::drop_oldest()
+{
+	const segment& oldest = _segments.front();
+
+	_dropped += oldest.readings - _head_readings;
+	_pending -= oldest.readings - _head_readings;
+	_size -= oldest.size;
+	boost::filesystem::remove(segment_path(oldest.seq));
+	_segments.pop_front();
+
+	_head_offset = sizeof(segment_magic);
+	_head_readings = 0;
+	_peeked = false;
+	save_head();
+}
+
+size_t ReadingSpool::peek(size_t max, readings_t& target)
+{
+	target.clear();
+	_peeked = false;
+
+	write_buffer();
+
+	for (size_t i = 0; i < _segments.size() && target.size() < max; i++) {
+		const segment& s = _segments[i];
+		uint64_t offset = i ? sizeof(segment_magic) : _head_offset;
+		uint64_t readings = i ? 0 : _head_readings;
+
+		if (offset < s.size) {
+			mapped_file file(segment_path(s.seq));
+			if (!file.valid())
+				throw_errno("Could not read", segment_path(s.seq));
+
+			Reading r;
+			size_t size = std::min<uint64_t>(file.size, s.size);
+			while (target.size() < max && read_record(file.bytes(), size, offset, &r)) {
+				target.push_back(r);
+				readings++;
+			}
+		}
+
+		_peek_seq = s.seq;
+		_peek_offset = offset;
+		_peek_readings = readings;
+	}
+
+	_peek_count = target.size();
+	_peeked = !target.empty();
+	return target.size();
+}
+
+void ReadingSpool::consume()
+{
+	if (!_peeked)
+		return;
+
+	while (_segments.front().seq < _peek_seq) {
+		_size -= _segments.front().size;
+		boost::filesystem::remove(segment_path(_segments.front().seq));
+		_segments.pop_front();
+	}
+
+	_head_offset = _peek_offset;
+	_head_readings = _peek_readings;
+	_pending -= _peek_count;
+	_peeked = false;
+
+	if (_head_offset >= _segments.front().size && _segments.size() > 1) {
+		_size -= _segments.front().size;
+		boost::filesystem::remove(segment_path(_segments.front().seq));
+		_segments.pop_front();
+
+		_head_offset = sizeof(segment_magic);
+		_head_readings = 0;
+	}
+
+	save_head();
+}
+
+void ReadingSpool::save_head()
+{
+	boost::filesystem::path tmp = _dir / (std::string(head_file) + ".new");
+
+	{
+		boost::filesystem::ofstream out(tmp);
+		out << _segments.front().seq << ' ' << _head_offset << ' ' << _head_readings << std::endl;
+		if (!out)
+			throw GenericException("Could not write " + tmp.string());
+	}
+
+	boost::filesystem::rename(tmp, _dir / head_file);
+}
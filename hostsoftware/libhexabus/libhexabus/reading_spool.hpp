@@ -0,0 +1,118 @@
+#ifndef LIBHEXABUS_READING_SPOOL_HPP
+#define LIBHEXABUS_READING_SPOOL_HPP 1
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include <tr1/memory>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace hexabus {
+
+	/**
+	 * Bounded on-disk queue of sensor readings, used to keep readings across
+	 * upstream outages and restarts.
+	 *
+	 * Readings are appended to segment files in the spool directory, each
+	 * record carries a CRC so that a record torn by a crash is discarded when
+	 * the spool is opened again. Appended readings are buffered in memory
+	 * until the buffer fills up or sync() is called, which also syncs the
+	 * segment to disk; callers choose how often to pay for that.
+	 *
+	 * Readings are taken from the spool in two steps: peek() returns the
+	 * oldest readings without removing them, consume() removes them once they
+	 * have been delivered. The position of the oldest reading is kept in a
+	 * file of its own, so readings are delivered at least once.
+	 *
+	 * If the segments grow beyond max_bytes, the oldest segment is deleted
+	 * along with the readings in it.
+	 *
+	 * A spool must only be opened once at a time, it is not thread-safe.
+	 */
+	class ReadingSpool : private boost::noncopyable {
+		public:
+			typedef std::tr1::shared_ptr<ReadingSpool> Ptr;
+
+			struct Reading {
+				std::string sensor;
+				int64_t ts;
+				double value;
+			};
+			typedef std::vector<Reading> readings_t;
+
+			static const size_t WriteBufferSize = 64 * 1024;
+			static const size_t MaxSegmentSize = 1024 * 1024;
+
+			// opens the spool in dir, creating it if it does not exist
+			ReadingSpool(const boost::filesystem::path& dir, uint64_t max_bytes);
+			// writes buffered readings, without syncing them
+			~ReadingSpool();
+
+			void append(const std::string& sensor, int64_t ts, double value);
+			// writes all buffered readings and syncs them to disk
+			void sync();
+
+			/**
+			 * Replaces the contents of target with up to max of the oldest
+			 * readings in the spool and returns their number. The readings stay
+			 * in the spool until consume() is called.
+			 */
+			size_t peek(size_t max, readings_t& target);
+			// removes the readings returned by the last peek()
+			void consume();
+
+			// readings in the spool, including buffered ones
+			uint64_t pending() const { return _pending; }
+			// size of all segments on disk
+			uint64_t size() const { return _size; }
+			// readings deleted because the spool was full
+			uint64_t dropped() const { return _dropped; }
+
+		private:
+			struct segment {
+				uint64_t seq;
+				uint64_t size;
+				uint64_t readings;
+			};
+
+			boost::filesystem::path _dir;
+			uint64_t _max_bytes;
+			uint64_t _segment_size;
+
+			// oldest first, readings are appended to the last one
+			std::deque<segment> _segments;
+			int _fd;
+
+			// first unconsumed reading in the oldest segment
+			uint64_t _head_offset;
+			uint64_t _head_readings;
+
+			// end of the readings returned by peek(), valid if _peeked is set
+			bool _peeked;
+			uint64_t _peek_seq;
+			uint64_t _peek_offset;
+			uint64_t _peek_readings;
+			uint64_t _peek_count;
+
+			std::vector<char> _buffer;
+			uint64_t _buffered;
+
+			uint64_t _pending;
+			uint64_t _size;
+			uint64_t _dropped;
+
+			boost::filesystem::path segment_path(uint64_t seq) const;
+
+			void open_segments();
+			void start_segment();
+			void write_buffer();
+			void drop_oldest();
+			void save_head();
+	};
+
+}
+
+#endif
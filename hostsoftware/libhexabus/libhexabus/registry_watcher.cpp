@@ -0,0 +1,168 @@
+#include "registry_watcher.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#if HAS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+
+using namespace hexabus;
+
+const boost::posix_time::time_duration RegistryWatcher::SettleTime = boost::posix_time::milliseconds(200);
+
+RegistryWatcher::RegistryWatcher(boost::asio::io_service& io, EndpointRegistry& registry)
+	: _io(io),
+		_registry(registry),
+		_owner(new Owner),
+#if HAS_LINUX
+		_inotify(io),
+#endif
+		_settle(io),
+		_loading(false),
+		_changed(false)
+{
+	_owner->watcher = this;
+
+#if HAS_LINUX
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		throw GenericException(std::string("Could not watch endpoint registry: ") + strerror(errno));
+
+	_inotify.assign(fd);
+
+	// watch the directory, editors and package managers replace the file
+	boost::filesystem::path dir = registry.path().parent_path();
+	if (dir.empty())
+		dir = ".";
+
+	if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		throw GenericException(std::string("Could not watch endpoint registry: ") + strerror(errno));
+
+	beginRead();
+#endif
+}
+
+RegistryWatcher::~RegistryWatcher()
+{
+	_owner->watcher = 0;
+	_loader.join();
+}
+
+hexabus::connection RegistryWatcher::onReload(const on_reload_slot_t& callback)
+{
+	return _reloaded.connect(callback);
+}
+
+hexabus::connection RegistryWatcher::onError(const on_error_slot_t& callback)
+{
+	return _failed.connect(callback);
+}
+
+void RegistryWatcher::beginRead()
+{
+#if HAS_LINUX
+	_inotify.async_read_some(boost::asio::buffer(_events),
+			boost::bind(&RegistryWatcher::eventsRead, this,
+				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+#endif
+}
+
+void RegistryWatcher::eventsRead(const boost::system::error_code& err, size_t size)
+{
+#if HAS_LINUX
+	if (err == boost::asio::error::operation_aborted)
+		return;
+
+	if (err) {
+		fail(GenericException("Could not watch endpoint registry: " + err.message()));
+		return;
+	}
+
+	std::string name = _registry.path().filename().string();
+	bool changed = false;
+
+	for (size_t offset = 0; offset + sizeof(struct inotify_event) <= size; ) {
+		struct inotify_event event;
+		memcpy(&event, _events.data() + offset, sizeof(event));
+
+		if (event.len && name == _events.data() + offset + sizeof(event))
+			changed = true;
+
+		offset += sizeof(event) + event.len;
+	}
+
+	if (changed) {
+		_settle.expires_from_now(SettleTime);
+		_settle.async_wait(boost::bind(&RegistryWatcher::settled, this, boost::asio::placeholders::error));
+	}
+
+	beginRead();
+#endif
+}
+
+void RegistryWatcher::settled(const boost::system::error_code& err)
+{
+	if (err)
+		return;
+
+	if (_loading) {
+		_changed = true;
+	} else {
+		beginLoad();
+	}
+}
+
+void RegistryWatcher::beginLoad()
+{
+	_loading = true;
+	_changed = false;
+
+	_loader.join();
+	_loader = boost::thread(&RegistryWatcher::load, _owner, boost::ref(_io), _registry.snapshot());
+}
+
+void RegistryWatcher::fail(const GenericException& error)
+{
+	if (_failed.empty())
+		std::cerr << error.what() << ", keeping previous endpoint registry" << std::endl;
+	else
+		_failed(error);
+}
+
+void RegistryWatcher::load(std::tr1::shared_ptr<Owner> owner, boost::asio::io_service& io, EndpointRegistry registry)
+{
+	std::tr1::shared_ptr<EndpointRegistry> result;
+	std::string error;
+
+	try {
+		registry.reload();
+		result.reset(new EndpointRegistry(registry));
+	} catch (const std::exception& e) {
+		error = e.what();
+	}
+
+	io.post(boost::bind(&RegistryWatcher::loaded, owner, result, error));
+}
+
+void RegistryWatcher::loaded(std::tr1::shared_ptr<Owner> owner, std::tr1::shared_ptr<EndpointRegistry> registry,
+		const std::string& error)
+{
+	RegistryWatcher* watcher = owner->watcher;
+	if (!watcher)
+		return;
+
+	watcher->_loading = false;
+	if (watcher->_changed)
+		watcher->beginLoad();
+
+	if (registry) {
+		watcher->_registry = *registry;
+		watcher->_reloaded();
+	} else {
+		watcher->fail(GenericException("Could not reload endpoint registry: " + error));
+	}
+}
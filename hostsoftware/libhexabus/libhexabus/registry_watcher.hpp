@@ -0,0 +1,78 @@
+#ifndef LIBHEXABUS_REGISTRY__WATCHER_HPP
+#define LIBHEXABUS_REGISTRY__WATCHER_HPP 1
+
+#include <string>
+
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <libhexabus/config.h>
+#include <libhexabus/endpoint_registry.hpp>
+#include <libhexabus/error.hpp>
+#include <libhexabus/signals.hpp>
+
+namespace hexabus {
+
+	/**
+	 * Reloads an endpoint registry when its file changes (using inotify, on
+	 * Linux only).
+	 *
+	 * The new table is built on a separate thread. It replaces the table of
+	 * the watched registry from within the io_service, so code running in the
+	 * io_service sees the registry change only between two handlers. If the
+	 * changed file cannot be loaded, the registry keeps its current table and
+	 * the error is passed to the onError callbacks, or printed to stderr if
+	 * there are none.
+	 */
+	class RegistryWatcher {
+		public:
+			typedef boost::function<void ()> on_reload_slot_t;
+			typedef boost::function<void (const GenericException& error)> on_error_slot_t;
+
+			// time to wait for further changes before reloading
+			static const boost::posix_time::time_duration SettleTime;
+
+		private:
+			struct Owner {
+				RegistryWatcher* watcher;
+			};
+
+			boost::asio::io_service& _io;
+			EndpointRegistry& _registry;
+			std::tr1::shared_ptr<Owner> _owner;
+
+#if HAS_LINUX
+			boost::asio::posix::stream_descriptor _inotify;
+			boost::array<char, 4096> _events;
+#endif
+			boost::asio::deadline_timer _settle;
+			boost::thread _loader;
+			bool _loading;
+			bool _changed;
+
+			hexabus::signal<void ()> _reloaded;
+			hexabus::signal<void (const GenericException&)> _failed;
+
+			void beginRead();
+			void eventsRead(const boost::system::error_code& err, size_t size);
+			void settled(const boost::system::error_code& err);
+			void beginLoad();
+			void fail(const GenericException& error);
+
+			static void load(std::tr1::shared_ptr<Owner> owner, boost::asio::io_service& io, EndpointRegistry registry);
+			static void loaded(std::tr1::shared_ptr<Owner> owner, std::tr1::shared_ptr<EndpointRegistry> registry,
+					const std::string& error);
+
+		public:
+			RegistryWatcher(boost::asio::io_service& io, EndpointRegistry& registry);
+			~RegistryWatcher();
+
+			hexabus::connection onReload(const on_reload_slot_t& callback);
+			hexabus::connection onError(const on_error_slot_t& callback);
+	};
+
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <libhexabus/private/serialization.hpp>
+#include <libhexabus/packet_view.hpp>
 
 #include <stdexcept>
 #include <algorithm>
@@ -272,259 +273,22 @@ void BinarySerializer::visit(const WritePacket<boost::array<char, 65> >& write)
 
 // }}}
 
-std::vector<char> hexabus::serialize(const Packet& packet)
+void hexabus::serialize(const Packet& packet, std::vector<char>& target)
 {
-	std::vector<char> result;
-	BinarySerializer serializer(result);
+	BinarySerializer serializer(target);
 
 	serializer.visitPacket(packet);
-
-	return result;
-}
-
-// {{{ Binary deserialization
-
-class BinaryDeserializer {
-	private:
-		const char* _packet;
-		size_t _offset;
-		size_t _size;
-
-		void checkLength(size_t min);
-
-		void readHeader();
-
-		uint8_t read_u8();
-		uint16_t read_u16();
-		uint32_t read_u32();
-		float read_float();
-		template<size_t L>
-		boost::array<char, L> read_bytes();
-		std::string read_string();
-
-		template<typename T>
-		Packet::Ptr checkInfo(bool info, uint32_t eid, const T& value, uint8_t flags);
-
-		template<typename T>
-		Packet::Ptr check(const T& packet);
-
-	public:
-		BinaryDeserializer(const char* packet, size_t size)
-			: _packet(packet), _offset(0), _size(size)
-		{
-			if (!packet)
-				throw std::invalid_argument("packet");
-		}
-
-		Packet::Ptr deserialize();
-};
-
-void BinaryDeserializer::checkLength(size_t min)
-{
-	if (_size - _offset < min)
-		throw BadPacketException("Packet too short");
-}
-
-void BinaryDeserializer::readHeader()
-{
-	checkLength(strlen(HXB_HEADER));
-
-	if (memcmp(HXB_HEADER, _packet + _offset, strlen(HXB_HEADER)))
-		throw BadPacketException("Invalid header");
-
-	_offset += strlen(HXB_HEADER);
-}
-
-uint8_t BinaryDeserializer::read_u8()
-{
-	checkLength(sizeof(uint8_t));
-
-	return *(_packet + _offset++);
-}
-
-uint16_t BinaryDeserializer::read_u16()
-{
-	checkLength(sizeof(uint16_t));
-
-	union {
-		char raw[sizeof(uint16_t)];
-		uint16_t u16;
-	} c;
-	memcpy(c.raw, _packet + _offset, sizeof(c.raw));
-
-	_offset += sizeof(uint16_t);
-	return ntohs(c.u16);
 }
 
-uint32_t BinaryDeserializer::read_u32()
-{
-	checkLength(sizeof(uint32_t));
-
-	union C {
-		char raw[sizeof(uint32_t)];
-		uint32_t u32;
-	} c;
-	memcpy(c.raw, _packet + _offset, sizeof(c.raw));
-
-	_offset += sizeof(uint32_t);
-	return ntohl(c.u32);
-}
-
-float BinaryDeserializer::read_float()
-{
-	union {
-		uint32_t u32;
-		float f;
-	} c = { read_u32() };
-
-	return c.f;
-}
-
-template<size_t L>
-boost::array<char, L> BinaryDeserializer::read_bytes()
-{
-	checkLength(L);
-
-	boost::array<char, L> result;
-	std::copy(_packet + _offset, _packet + _offset + L, result.begin());
-	_offset += L;
-
-	return result;
-}
-
-std::string BinaryDeserializer::read_string()
+std::vector<char> hexabus::serialize(const Packet& packet)
 {
-	checkLength(ValuePacket<std::string>::max_length);
-
-	if (!std::find(_packet + _offset, _packet + _offset + ValuePacket<std::string>::max_length, '\0'))
-		throw BadPacketException("Unterminated string");
+	std::vector<char> result;
 
-	std::string result(_packet + _offset);
-	_offset += ValuePacket<std::string>::max_length + 1;
+	serialize(packet, result);
 
 	return result;
 }
 
-template<typename T>
-Packet::Ptr BinaryDeserializer::checkInfo(bool info, uint32_t eid, const T& value, uint8_t flags)
-{
-	if (info) {
-		return check(InfoPacket<T>(eid, value, flags));
-	} else {
-		return check(WritePacket<T>(eid, value, flags));
-	}
-}
-
-template<typename T>
-Packet::Ptr BinaryDeserializer::check(const T& packet)
-{
-	uint16_t crc = hexabus::crc(_packet, _offset);
-	if (crc != read_u16()) {
-		throw BadPacketException("Bad checksum");
-	}
-
-	return Packet::Ptr(new T(packet));
-}
-
-Packet::Ptr BinaryDeserializer::deserialize()
-{
-	readHeader();
-
-	uint8_t type = read_u8();
-	uint8_t flags = read_u8();
-
-	switch (type) {
-		case HXB_PTYPE_ERROR:
-			{
-				uint8_t code = read_u8();
-				return check(ErrorPacket(code, flags));
-			}
-
-		case HXB_PTYPE_INFO:
-		case HXB_PTYPE_WRITE:
-			{
-				bool info = type == HXB_PTYPE_INFO;
-				uint32_t eid = read_u32();
-				uint8_t datatype = read_u8();
-
-				switch (datatype) {
-					case HXB_DTYPE_BOOL:
-						return checkInfo<bool>(info, eid, read_u8(), flags);
-
-					case HXB_DTYPE_UINT8:
-						return checkInfo<uint8_t>(info, eid, read_u8(), flags);
-
-					case HXB_DTYPE_UINT32:
-						return checkInfo<uint32_t>(info, eid, read_u32(), flags);
-
-					case HXB_DTYPE_FLOAT:
-						return checkInfo<float>(info, eid, read_float(), flags);
-
-					case HXB_DTYPE_DATETIME:
-						{
-							uint8_t hour = read_u8();
-							uint8_t minute = read_u8();
-							uint8_t second = read_u8();
-							uint8_t day = read_u8();
-							uint8_t month = read_u8();
-							uint16_t year = read_u8();
-							uint8_t weekday = read_u8();
-
-							boost::posix_time::ptime dt(
-								boost::gregorian::date(year, month, day),
-								boost::posix_time::hours(hour)
-									+ boost::posix_time::minutes(minute)
-									+ boost::posix_time::seconds(second));
-
-							if (dt.date().day_of_week() != weekday)
-								throw BadPacketException("Invalid datetime format");
-
-							return checkInfo<boost::posix_time::ptime>(info, eid, dt, flags);
-						}
-
-					case HXB_DTYPE_TIMESTAMP:
-						return checkInfo<boost::posix_time::time_duration>(info, eid, boost::posix_time::seconds(read_u32()), flags);
-
-					case HXB_DTYPE_128STRING:
-						return checkInfo<std::string>(info, eid, read_string(), flags);
-
-					case HXB_DTYPE_16BYTES:
-						return checkInfo<boost::array<char, 16> >(info, eid, read_bytes<16>(), flags);
-
-					case HXB_DTYPE_65BYTES:
-						return checkInfo<boost::array<char, 65> >(info, eid, read_bytes<65>(), flags);
-
-					default:
-						throw BadPacketException("Invalid datatype");
-				}
-			}
-
-		case HXB_PTYPE_QUERY:
-			{
-				uint32_t eid = read_u32();
-				return check(QueryPacket(eid, flags));
-			}
-
-		case HXB_PTYPE_EPQUERY:
-			{
-				uint32_t eid = read_u32();
-				return check(EndpointQueryPacket(eid, flags));
-			}
-
-		case HXB_PTYPE_EPINFO:
-			{
-				uint32_t eid = read_u32();
-				uint8_t datatype = read_u8();
-				return check(EndpointInfoPacket(eid, datatype, read_string(), flags));
-			}
-
-		default:
-			throw BadPacketException("Unknown packet type");
-	}
-}
-
-// }}}
-
 void hexabus::deserialize(const void* packet, size_t size, PacketVisitor& handler)
 {
 	deserialize(packet, size)->accept(handler);
@@ -532,5 +296,5 @@ void hexabus::deserialize(const void* packet, size_t size, PacketVisitor& handle
 
 Packet::Ptr hexabus::deserialize(const void* packet, size_t size)
 {
-	return BinaryDeserializer(reinterpret_cast<const char*>(packet), size).deserialize();
+	return PacketView(packet, size).toPacket();
 }
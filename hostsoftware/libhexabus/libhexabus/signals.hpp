@@ -0,0 +1,285 @@
+#ifndef LIBHEXABUS_SIGNALS_HPP
+#define LIBHEXABUS_SIGNALS_HPP 1
+
+#include <libhexabus/config.h>
+
+#if UNSYNCHRONIZED_SIGNALS
+#include <vector>
+#include <tr1/memory>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#else
+#include <boost/signals2.hpp>
+#endif
+
+/**
+ * Signal and connection types used for callbacks throughout libhexabus.
+ *
+ * By default these are the boost::signals2 types. When configured with
+ * UNSYNCHRONIZED_SIGNALS, a lightweight implementation is used instead that
+ * takes no locks and does not copy the slot list when a signal is emitted.
+ * It has the same connect/disconnect semantics (including connecting and
+ * disconnecting slots from within a slot) and the same return values, but
+ * signals and connections must only be used from a single thread, e.g. if
+ * everything runs on one io_service thread.
+ */
+namespace hexabus {
+
+#if !UNSYNCHRONIZED_SIGNALS
+
+	typedef boost::signals2::connection connection;
+	typedef boost::signals2::scoped_connection scoped_connection;
+
+	template<typename Signature>
+	class signal : public boost::signals2::signal<Signature> {
+	};
+
+#else
+
+	namespace detail {
+		struct slot_state {
+			bool connected;
+
+			slot_state() : connected(true) {}
+		};
+	}
+
+	class connection {
+		private:
+			std::tr1::weak_ptr<detail::slot_state> _slot;
+
+		public:
+			connection() {}
+			explicit connection(const std::tr1::weak_ptr<detail::slot_state>& slot)
+				: _slot(slot)
+			{}
+
+			void disconnect() const
+			{
+				std::tr1::shared_ptr<detail::slot_state> slot = _slot.lock();
+				if (slot)
+					slot->connected = false;
+			}
+
+			bool connected() const
+			{
+				std::tr1::shared_ptr<detail::slot_state> slot = _slot.lock();
+				return slot && slot->connected;
+			}
+	};
+
+	class scoped_connection : public connection, private boost::noncopyable {
+		public:
+			scoped_connection() {}
+			scoped_connection(const connection& other)
+				: connection(other)
+			{}
+
+			~scoped_connection()
+			{
+				disconnect();
+			}
+
+			scoped_connection& operator=(const connection& other)
+			{
+				disconnect();
+				connection::operator=(other);
+				return *this;
+			}
+
+			connection release()
+			{
+				connection result = *this;
+				connection::operator=(connection());
+				return result;
+			}
+	};
+
+	namespace detail {
+		template<typename Signature>
+		struct slot : slot_state {
+			typedef std::tr1::shared_ptr<slot> Ptr;
+
+			boost::function<Signature> fn;
+
+			slot(const boost::function<Signature>& fn) : fn(fn) {}
+		};
+
+		/*
+		 * Slot list shared with emissions in progress. Emitting takes a reference
+		 * to the current list and never modifies it; connect() modifies the list
+		 * in place if no emission holds it, and copies it otherwise. Disconnected
+		 * slots are only marked as such and dropped on the next connect().
+		 */
+		template<typename Signature>
+		class signal_base : private boost::noncopyable {
+			public:
+				typedef boost::function<Signature> slot_type;
+
+			protected:
+				typedef std::vector<typename slot<Signature>::Ptr> list_t;
+				typedef std::tr1::shared_ptr<list_t> list_ptr;
+
+				list_ptr _slots;
+
+			public:
+				signal_base() : _slots(new list_t) {}
+
+				~signal_base()
+				{
+					disconnect_all_slots();
+				}
+
+				connection connect(const slot_type& fn)
+				{
+					if (!_slots.unique())
+						_slots.reset(new list_t(*_slots));
+
+					list_t& slots = *_slots;
+					for (typename list_t::iterator it = slots.begin(); it != slots.end(); ) {
+						if ((*it)->connected)
+							++it;
+						else
+							it = slots.erase(it);
+					}
+
+					typename slot<Signature>::Ptr s(new slot<Signature>(fn));
+					slots.push_back(s);
+					return connection(std::tr1::weak_ptr<slot_state>(s));
+				}
+
+				void disconnect_all_slots()
+				{
+					for (typename list_t::const_iterator it = _slots->begin(), end = _slots->end(); it != end; ++it)
+						(*it)->connected = false;
+				}
+
+				size_t num_slots() const
+				{
+					size_t result = 0;
+					for (typename list_t::const_iterator it = _slots->begin(), end = _slots->end(); it != end; ++it)
+						result += (*it)->connected;
+					return result;
+				}
+
+				bool empty() const
+				{
+					for (typename list_t::const_iterator it = _slots->begin(), end = _slots->end(); it != end; ++it) {
+						if ((*it)->connected)
+							return false;
+					}
+					return true;
+				}
+		};
+
+		// like signals2, return the result of the last slot called, if any
+		template<typename R>
+		struct last_value {
+			typedef boost::optional<R> result_type;
+
+			result_type value;
+
+			template<typename Call>
+			void operator()(const Call& call) { value = call(); }
+
+			result_type result() const { return value; }
+		};
+
+		template<>
+		struct last_value<void> {
+			typedef void result_type;
+
+			void result() const {}
+
+			template<typename Call>
+			void operator()(const Call& call) { call(); }
+		};
+
+		template<typename Slot>
+		struct call0 {
+			const Slot& s;
+			call0(const Slot& s) : s(s) {}
+			typename Slot::result_type operator()() const { return s(); }
+		};
+
+		template<typename Slot, typename A1>
+		struct call1 {
+			const Slot& s;
+			A1 a1;
+			call1(const Slot& s, A1 a1) : s(s), a1(a1) {}
+			typename Slot::result_type operator()() const { return s(a1); }
+		};
+
+		template<typename Slot, typename A1, typename A2>
+		struct call2 {
+			const Slot& s;
+			A1 a1;
+			A2 a2;
+			call2(const Slot& s, A1 a1, A2 a2) : s(s), a1(a1), a2(a2) {}
+			typename Slot::result_type operator()() const { return s(a1, a2); }
+		};
+	}
+
+	template<typename Signature>
+	class signal;
+
+	template<typename R>
+	class signal<R ()> : public detail::signal_base<R ()> {
+		public:
+			typename detail::last_value<R>::result_type operator()() const
+			{
+				typedef typename detail::signal_base<R ()>::list_t list_t;
+				std::tr1::shared_ptr<list_t> slots = this->_slots;
+				detail::last_value<R> result;
+
+				for (typename list_t::const_iterator it = slots->begin(), end = slots->end(); it != end; ++it) {
+					if ((*it)->connected)
+						result(detail::call0<typename detail::signal_base<R ()>::slot_type>((*it)->fn));
+				}
+
+				return result.result();
+			}
+	};
+
+	template<typename R, typename A1>
+	class signal<R (A1)> : public detail::signal_base<R (A1)> {
+		public:
+			typename detail::last_value<R>::result_type operator()(A1 a1) const
+			{
+				typedef typename detail::signal_base<R (A1)>::list_t list_t;
+				std::tr1::shared_ptr<list_t> slots = this->_slots;
+				detail::last_value<R> result;
+
+				for (typename list_t::const_iterator it = slots->begin(), end = slots->end(); it != end; ++it) {
+					if ((*it)->connected)
+						result(detail::call1<typename detail::signal_base<R (A1)>::slot_type, A1>((*it)->fn, a1));
+				}
+
+				return result.result();
+			}
+	};
+
+	template<typename R, typename A1, typename A2>
+	class signal<R (A1, A2)> : public detail::signal_base<R (A1, A2)> {
+		public:
+			typename detail::last_value<R>::result_type operator()(A1 a1, A2 a2) const
+			{
+				typedef typename detail::signal_base<R (A1, A2)>::list_t list_t;
+				std::tr1::shared_ptr<list_t> slots = this->_slots;
+				detail::last_value<R> result;
+
+				for (typename list_t::const_iterator it = slots->begin(), end = slots->end(); it != end; ++it) {
+					if ((*it)->connected)
+						result(detail::call2<typename detail::signal_base<R (A1, A2)>::slot_type, A1, A2>((*it)->fn, a1, a2));
+				}
+
+				return result.result();
+			}
+	};
+
+#endif
+
+}
+
+#endif
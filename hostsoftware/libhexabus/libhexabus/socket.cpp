@@ -4,122 +4,134 @@
 #include "packet.hpp"
 #include "crc.hpp"
 #include "error.hpp"
+#include "clock.hpp"
 #include "private/serialization.hpp"
 
 #include <iostream>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <errno.h>
-#include <cstring>
 
 #include <boost/bind.hpp>
+#include <boost/optional.hpp>
 #include <boost/scope_exit.hpp>
 
 #include "../../../shared/hexabus_definitions.h"
 
 
 using namespace hexabus;
-namespace bs2 = boost::signals2;
 
 const boost::asio::ip::address_v6 SocketBase::GroupAddress = boost::asio::ip::address_v6::from_string(HXB_GROUP);
+const size_t SocketBase::MaxPacketSize;
 
 
 
 SocketBase::SocketBase(boost::asio::io_service& io)
 	: io(io),
-	socket(io),
-	data(1024, 0) // ensure arg1 >= max packet size
+	transport(boost::asio::use_service<TransportProvider>(io).createTransport()),
+	socketStrand(io),
+	receiveBuffer(MaxPacketSize, 1),
+	receivePending(false),
+	batchSize(1)
 {
-	openSocket();
 }
 
 SocketBase::~SocketBase()
 {
-	boost::system::error_code err;
-
-	socket.close(err);
-	// FIXME: maybe errors should be logged somewhere
+	transport->close();
 }
 
-void SocketBase::openSocket()
+void SocketBase::setReceiveBatchSize(size_t count)
 {
-	boost::system::error_code err;
+	if (count == 0)
+		throw std::invalid_argument("count");
 
-	socket.open(boost::asio::ip::udp::v6(), err);
-	if (err)
-		throw NetworkException("open", err);
+	batchSize = count;
+	beginReceive();
 }
 
-int SocketBase::iface_idx(const std::string& iface)
+void SocketBase::beginReceive()
 {
-	int if_index = if_nametoindex(iface.c_str());
-	if (if_index == 0) {
-		throw NetworkException(
-				"iface_idx",
-				boost::system::error_code(
-					boost::system::errc::no_such_device,
-					boost::system::generic_category()));
-	}
+	if (receivePending || (packetReceived.empty() && packetViewReceived.empty() && dispatcher.empty()))
+		return;
+
+	// a completion of a receive into the old buffer may already be queued,
+	// so the buffer is only replaced while no receive is pending
+	if (receiveBuffer.capacity() != batchSize)
+		receiveBuffer = ReceiveBuffer(MaxPacketSize, batchSize);
 
-	return if_index;
+	receivePending = true;
+	transport->asyncReceive(receiveBuffer,
+			socketStrand.wrap(boost::bind(&SocketBase::receiveHandler,
+				this,
+				_1,
+				_2)));
 }
 
-void SocketBase::beginReceive()
+void SocketBase::deliver(const char* packet, size_t size, const boost::asio::ip::udp::endpoint& from)
 {
-	if (!packetReceived.empty()) {
-		socket.cancel();
-		socket.async_receive_from(boost::asio::buffer(data, data.size()), remoteEndpoint,
-				boost::bind(&Socket::packetReceivedHandler,
-					this,
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred));
+	boost::optional<PacketView> view;
+	try {
+		view = PacketView(packet, std::min(size, MaxPacketSize));
+	} catch (const GenericException& ge) {
+		asyncError(ge);
+		return;
+	}
+
+	packetViewReceived(*view, from);
+	if (!packetReceived.empty() || !dispatcher.empty()) {
+		Packet::Ptr packet = view->toPacket();
+
+		dispatcher.dispatch(*packet, from);
+		packetReceived(packet, from);
 	}
 }
 
-void SocketBase::packetReceivedHandler(const boost::system::error_code& error, size_t size)
+void SocketBase::receiveHandler(const boost::system::error_code& error, size_t count)
 {
-	if (error.value() == boost::system::errc::operation_canceled) {
+	if (error == boost::asio::error::operation_aborted)
 		return;
-	} else if (error) {
+
+	receivePending = false;
+	if (error && !count) {
 		asyncError(NetworkException("receive", error));
-	} else {
-		Packet::Ptr packet;
-
-		SocketBase* _this = this;
-		BOOST_SCOPE_EXIT((_this)) {
-			_this->beginReceive();
-		} BOOST_SCOPE_EXIT_END
-
-		try {
-			packet = deserialize(&data[0], std::min(size, data.size()));
-		} catch (const GenericException& ge) {
-			asyncError(ge);
-			return;
-		}
-		packetReceived(packet, remoteEndpoint);
+		return;
 	}
-}
 
-static void predicated_receive(const Packet::Ptr& packet, const boost::asio::ip::udp::endpoint& from,
-		const Socket::on_packet_received_slot_t& slot, const Socket::filter_t& filter)
-{
-	if (filter(*packet, from))
-		slot(*packet, from);
+	SocketBase* _this = this;
+	BOOST_SCOPE_EXIT((_this)) {
+		_this->beginReceive();
+	} BOOST_SCOPE_EXIT_END
+
+	for (size_t i = 0; i < count; i++)
+		deliver(receiveBuffer.packet(i), receiveBuffer.sizes[i], receiveBuffer.endpoints[i]);
+
+	if (error)
+		asyncError(NetworkException("receive", error));
 }
 
-bs2::connection SocketBase::onPacketReceived(
+hexabus::connection SocketBase::onPacketReceived(
 		const on_packet_received_slot_t& callback,
 		const filter_t& filter)
 {
-	bs2::connection result = packetReceived.connect(
-			boost::bind(predicated_receive, _1, _2, callback, filter));
+	// opaque filters can match any packet, subscribing them to the
+	// dispatcher without constraints keeps all callbacks in connection order
+	filtering::Constraints constraints;
+	constraints.classes = all_packet_classes;
+	hexabus::connection result = dispatcher.subscribe(callback, filter, constraints);
 
 	beginReceive();
 
 	return result;
 }
 
-bs2::connection SocketBase::onAsyncError(const on_async_error_slot_t& callback)
+hexabus::connection SocketBase::onPacketViewReceived(const on_packet_view_received_slot_t& callback)
+{
+	hexabus::connection result = packetViewReceived.connect(callback);
+
+	beginReceive();
+
+	return result;
+}
+
+hexabus::connection SocketBase::onAsyncError(const on_async_error_slot_t& callback)
 {
 	return asyncError.connect(callback);
 }
@@ -130,7 +142,7 @@ static void receive_handler(
 		std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint>& target,
 		const SocketBase::filter_t& filter,
 		boost::asio::io_service& io,
-		boost::signals2::scoped_connection& sc)
+		hexabus::scoped_connection& sc)
 {
 	if (filter(*packet, remote)) {
 		target = std::make_pair(packet, remote);
@@ -141,7 +153,7 @@ static void receive_handler(
 
 static void timeout_handler(const boost::system::error_code& error,
 		boost::asio::io_service& io,
-		boost::signals2::scoped_connection& sc)
+		hexabus::scoped_connection& sc)
 {
 	if (!error) {
 		io.stop();
@@ -160,7 +172,7 @@ std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint> SocketBase::receive(
 {
 	std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint> result;
 
-	boost::signals2::scoped_connection rc(
+	hexabus::scoped_connection rc(
 		packetReceived.connect(
 			boost::bind(
 				receive_handler,
@@ -170,11 +182,11 @@ std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint> SocketBase::receive(
 				boost::cref(filter),
 				boost::ref(io),
 				boost::ref(rc))));
-	boost::signals2::scoped_connection ec(
+	hexabus::scoped_connection ec(
 		asyncError.connect(
 			boost::bind(error_handler, _1)));
 
-	boost::asio::deadline_timer timer(io);
+	Timer timer(io);
 	if (!timeout.is_pos_infinity()) {
 		timer.expires_from_now(timeout);
 		timer.async_wait(
@@ -188,7 +200,11 @@ std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint> SocketBase::receive(
 	beginReceive();
 
 	ioService().reset();
-	ioService().run();
+	// simulated time only passes while the clock runs the io_service
+	if (VirtualClock* clock = dynamic_cast<VirtualClock*>(&boost::asio::use_service<Clock>(io)))
+		clock->run();
+	else
+		ioService().run();
 
 	return result;
 }
@@ -199,11 +215,11 @@ void Listener::configureSocket()
 {
 	boost::system::error_code err;
 
-	socket.set_option(boost::asio::socket_base::reuse_address(true), err);
+	transport->setReuseAddress(true, err);
 	if (err)
 		throw NetworkException("open", err);
 
-	socket.bind(boost::asio::ip::udp::endpoint(GroupAddress, HXB_PORT), err);
+	transport->bind(boost::asio::ip::udp::endpoint(GroupAddress, HXB_PORT), err);
 	if (err)
 		throw NetworkException("open", err);
 }
@@ -212,9 +228,7 @@ void Listener::listen(const std::string& dev)
 {
 	boost::system::error_code err;
 
-	int if_index = dev.size() ? iface_idx(dev) : 0;
-
-	socket.set_option(boost::asio::ip::multicast::join_group(GroupAddress, if_index), err);
+	transport->joinGroup(GroupAddress, dev, err);
 	if (err)
 		throw NetworkException("listen", err);
 }
@@ -223,9 +237,7 @@ void Listener::ignore(const std::string& dev)
 {
 	boost::system::error_code err;
 
-	int if_index = dev.size() ? iface_idx(dev) : 0;
-
-	socket.set_option(boost::asio::ip::multicast::leave_group(GroupAddress), err);
+	transport->leaveGroup(GroupAddress, dev, err);
 	if (err)
 		throw NetworkException("ignore", err);
 }
@@ -236,11 +248,11 @@ void Socket::configureSocket()
 {
 	boost::system::error_code err;
 
-	socket.set_option(boost::asio::ip::multicast::hops(64), err);
+	transport->setMulticastHops(64, err);
 	if (err)
 		throw NetworkException("open", err);
 
-	socket.set_option(boost::asio::ip::multicast::enable_loopback(true));
+	transport->setMulticastLoopback(true, err);
 	if (err)
 		throw NetworkException("open", err);
 }
@@ -249,8 +261,7 @@ void Socket::mcast_from(const std::string& dev)
 {
 	boost::system::error_code err;
 
-	int if_index = iface_idx(dev);
-	socket.set_option(boost::asio::ip::multicast::outbound_interface(if_index), err);
+	transport->setOutboundInterface(dev, err);
 	if (err)
 		throw NetworkException("mcast_from", err);
 }
@@ -259,7 +270,7 @@ void Socket::bind(const boost::asio::ip::udp::endpoint& ep)
 {
 	boost::system::error_code err;
 
-	socket.bind(ep, err);
+	transport->bind(ep, err);
 	if (err)
 		throw NetworkException("bind", err);
 }
@@ -268,9 +279,45 @@ void Socket::send(const Packet& packet, const boost::asio::ip::udp::endpoint& de
 {
 	boost::system::error_code err;
 
-	std::vector<char> data = serialize(packet);
+	// serialize behind the queued packets, if any, to reuse the buffer
+	size_t start = sendBuffer.size();
+	serialize(packet, sendBuffer);
+
+	transport->send(&sendBuffer[start], sendBuffer.size() - start, dest, err);
+	sendBuffer.resize(start);
+	if (err)
+		throw NetworkException("send", err);
+}
+
+void Socket::send(const std::vector<char>& packet, const boost::asio::ip::udp::endpoint& dest)
+{
+	boost::system::error_code err;
 
-	socket.send_to(boost::asio::buffer(&data[0], data.size()), dest, 0, err);
+	transport->send(&packet[0], packet.size(), dest, err);
 	if (err)
 		throw NetworkException("send", err);
 }
+
+void Socket::queue(const Packet& packet, const boost::asio::ip::udp::endpoint& dest)
+{
+	sendOffsets.push_back(sendBuffer.size());
+	sendDestinations.push_back(dest);
+	serialize(packet, sendBuffer);
+}
+
+Socket::send_errors_t Socket::flush()
+{
+	send_errors_t errors;
+
+	if (sendDestinations.empty())
+		return errors;
+
+	sendOffsets.push_back(sendBuffer.size());
+	transport->send(&sendBuffer[0], sendOffsets, sendDestinations, errors);
+
+	sendBuffer.clear();
+	sendOffsets.clear();
+	sendDestinations.clear();
+
+	return errors;
+}
@@ -5,38 +5,54 @@
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
 #include <string>
-#include <boost/signals2.hpp>
+#include "signals.hpp"
 #include <boost/date_time.hpp>
+#include <libhexabus/config.h>
 #include "error.hpp"
 #include "packet.hpp"
+#include "packet_view.hpp"
 #include "filtering.hpp"
+#include "packet_dispatcher.hpp"
+#include "transport.hpp"
 
 namespace hexabus {
+	/**
+	 * Sockets move their datagrams through a Transport created by the
+	 * TransportProvider of their io_service, which is a UDP socket unless
+	 * another network (e.g. a LoopbackNetwork) has been installed.
+	 */
 	class SocketBase {
 		public:
 			typedef boost::function<bool (const Packet& packet, const boost::asio::ip::udp::endpoint& from)> filter_t;
 			typedef boost::function<void (const Packet& packet, const boost::asio::ip::udp::endpoint& from)> on_packet_received_slot_t;
+			typedef boost::function<void (const PacketView& packet, const boost::asio::ip::udp::endpoint& from)> on_packet_view_received_slot_t;
 
-			typedef boost::signals2::signal<void (const GenericException& error)> on_async_error_t;
+			typedef hexabus::signal<void (const GenericException& error)> on_async_error_t;
 			typedef on_async_error_t::slot_type on_async_error_slot_t;
 
 			static const boost::asio::ip::address_v6 GroupAddress;
+			// size of a single receive buffer, must be >= max packet size
+			static const size_t MaxPacketSize = 1024;
 
 		private:
-			void openSocket();
+			void deliver(const char* packet, size_t size, const boost::asio::ip::udp::endpoint& from);
 
 		protected:
 			boost::asio::io_service& io;
-			boost::asio::ip::udp::socket socket;
-			boost::asio::ip::udp::endpoint remoteEndpoint;
-			boost::signals2::signal<void (const Packet::Ptr&, const boost::asio::ip::udp::endpoint&)> packetReceived;
+			Transport::Ptr transport;
+			boost::asio::io_service::strand socketStrand;
+			hexabus::signal<void (const Packet::Ptr&, const boost::asio::ip::udp::endpoint&)> packetReceived;
+			hexabus::signal<void (const PacketView&, const boost::asio::ip::udp::endpoint&)> packetViewReceived;
+			PacketDispatcher dispatcher;
 			on_async_error_t asyncError;
-			std::vector<char> data;
 
-			int iface_idx(const std::string& iface);
+			ReceiveBuffer receiveBuffer;
+			bool receivePending;
+			// applied to receiveBuffer when no receive is pending
+			size_t batchSize;
 
 			void beginReceive();
-			void packetReceivedHandler(const boost::system::error_code& error, size_t size);
+			void receiveHandler(const boost::system::error_code& error, size_t count);
 
 		public:
 			SocketBase(boost::asio::io_service& io);
@@ -45,7 +61,7 @@ namespace hexabus {
 
 			boost::asio::ip::udp::endpoint localEndpoint() const
 			{
-				return socket.local_endpoint();
+				return transport->localEndpoint();
 			}
 
 			boost::asio::io_service& ioService()
@@ -53,10 +69,58 @@ namespace hexabus {
 				return io;
 			}
 
-			boost::signals2::connection onPacketReceived(
+			/**
+			 * Receive handlers, and with them all packet callbacks, run on this
+			 * strand. If the io_service is run by several threads, everything
+			 * else that uses the socket (e.g. sending) has to run on the strand
+			 * as well, and callbacks should be connected before the threads are
+			 * started.
+			 */
+			boost::asio::io_service::strand& strand()
+			{
+				return socketStrand;
+			}
+
+			/**
+			 * Number of datagrams read from the socket per wakeup. With a batch
+			 * size of 1 (the default), every packet is received with its own
+			 * asynchronous operation. Larger values wait for the socket to become
+			 * readable and then drain up to that many queued datagrams at once
+			 * (with a single recvmmsg call on Linux) before re-arming. A new
+			 * batch size takes effect once the pending receive has completed.
+			 */
+			size_t receiveBatchSize() const { return batchSize; }
+			void setReceiveBatchSize(size_t count);
+
+			hexabus::connection onPacketReceived(
 					const on_packet_received_slot_t& callback,
 					const filter_t& filter = filtering::any());
-			boost::signals2::connection onAsyncError(const on_async_error_slot_t& callback);
+			/**
+			 * Subscriptions with filter expressions built from the primitives in
+			 * filtering.hpp are indexed by the packet classes, EID and source
+			 * address their filter can match, and only see packets that satisfy
+			 * these constraints. Opaque filters are evaluated for every packet.
+			 * Callbacks of both kinds are called in the order they were connected.
+			 */
+			template<typename Filter>
+			typename boost::enable_if<filtering::is_filter<Filter>, hexabus::connection>::type onPacketReceived(
+					const on_packet_received_slot_t& callback,
+					const Filter& filter)
+			{
+				hexabus::connection result = dispatcher.subscribe(callback, filter, filtering::constraints(filter));
+
+				beginReceive();
+
+				return result;
+			}
+			/**
+			 * Like onPacketReceived, but the callback gets a view into the receive
+			 * buffer instead of a packet object. The view is only valid for the
+			 * duration of the call. As long as only view callbacks are connected,
+			 * received packets are never copied to the heap.
+			 */
+			hexabus::connection onPacketViewReceived(const on_packet_view_received_slot_t& callback);
+			hexabus::connection onAsyncError(const on_async_error_slot_t& callback);
 
 			std::pair<Packet::Ptr, boost::asio::ip::udp::endpoint> receive(
 					const filter_t& filter = filtering::any(),
@@ -79,7 +143,14 @@ namespace hexabus {
 	};
 
 	class Socket : public SocketBase {
+		public:
+			typedef Transport::send_errors_t send_errors_t;
+
 		private:
+			std::vector<char> sendBuffer;
+			std::vector<size_t> sendOffsets;
+			std::vector<boost::asio::ip::udp::endpoint> sendDestinations;
+
 			void configureSocket();
 
 		public:
@@ -102,6 +173,32 @@ namespace hexabus {
 				send(packet, boost::asio::ip::udp::endpoint(dest, 61616));
 			}
 			void send(const Packet& packet, const boost::asio::ip::udp::endpoint& dest);
+			/**
+			 * Send a packet that has been serialized before, e.g. a response
+			 * that is kept ready for repeated requests.
+			 */
+			void send(const std::vector<char>& packet, const boost::asio::ip::udp::endpoint& dest);
+
+			/**
+			 * Serialize packet into the send queue of the socket. Queued packets
+			 * are not sent until flush() is called.
+			 */
+			void queue(const Packet& packet, const boost::asio::ip::address_v6& dest = GroupAddress)
+			{
+				queue(packet, boost::asio::ip::udp::endpoint(dest, 61616));
+			}
+			void queue(const Packet& packet, const boost::asio::ip::udp::endpoint& dest);
+
+			size_t queued() const { return sendDestinations.size(); }
+
+			/**
+			 * Send all queued packets (with as few sendmmsg calls as possible on
+			 * Linux) and empty the queue. Failures do not abort the flush, each
+			 * packet that could not be sent is reported with its destination.
+			 * Like send(), flush() waits while the send buffer of the socket is
+			 * full.
+			 */
+			send_errors_t flush();
 	};
 }
 
@@ -0,0 +1,769 @@
+#include "libhexabus/time_series_store.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "private/mapped_file.hpp"
+#include "error.hpp"
+
+using namespace hexabus;
+
+const uint32_t TimeSeriesStore::BlockSize;
+const TimeSeriesStore::timestamp_t TimeSeriesStore::DefaultPartition;
+
+namespace {
+
+const char segment_magic[8] = { 'H', 'X', 'B', 'T', 'S', 'E', 'G', 1 };
+const char block_magic[4] = { 'H', 'X', 'B', 'b' };
+const char log_magic[4] = { 'H', 'X', 'B', 'l' };
+
+struct segment_header {
+	char magic[8];
+	int64_t partition;
+	uint32_t series;
+	uint32_t reserved;
+};
+
+struct block_header {
+	char magic[4];
+	uint32_t count;
+	int64_t first;
+	int64_t last;
+	uint32_t size;
+	uint32_t crc;
+};
+
+// readings written to the log by one flush
+struct log_header {
+	char magic[4];
+	uint32_t count;
+	uint32_t crc;
+};
+
+struct log_reading {
+	int64_t ts;
+	double value;
+};
+
+struct block_entry {
+	int64_t first;
+	int64_t last;
+	uint32_t count;
+	uint32_t size;
+	// offset of the payload in the segment
+	size_t payload;
+};
+
+/*
+ * Collects the intact blocks of a segment, starting at offset or just after
+ * the segment header if offset is 0, and returns the offset just past the
+ * last one, or 0 if the segment header is broken. Everything after the
+ * first damaged block is considered lost.
+ */
+size_t scan_segment(const char* data, size_t size, uint32_t series, int64_t partition,
+		size_t offset, std::vector<block_entry>* blocks)
+{
+	if (!offset) {
+		segment_header header;
+		if (size < sizeof(header))
+			return 0;
+
+		memcpy(&header, data, sizeof(header));
+		if (memcmp(header.magic, segment_magic, sizeof(segment_magic))
+				|| header.series != series || header.partition != partition)
+			return 0;
+
+		offset = sizeof(header);
+	}
+
+	while (size - offset >= sizeof(block_header)) {
+		block_header header;
+		memcpy(&header, data + offset, sizeof(header));
+
+		if (memcmp(header.magic, block_magic, sizeof(block_magic))
+				|| header.size > size - offset - sizeof(block_header))
+			break;
+
+		boost::crc_32_type crc;
+		crc.process_bytes(data + offset + sizeof(block_header), header.size);
+		if (crc.checksum() != header.crc)
+			break;
+
+		if (blocks) {
+			block_entry block = { header.first, header.last, header.count, header.size, offset + sizeof(block_header) };
+			blocks->push_back(block);
+		}
+		offset += sizeof(block_header) + header.size;
+	}
+
+	return offset;
+}
+
+class bit_reader {
+	private:
+		const unsigned char* _data;
+		size_t _bits;
+		size_t _pos;
+
+	public:
+		bit_reader(const char* data, size_t size)
+			: _data(reinterpret_cast<const unsigned char*>(data)), _bits(size * 8), _pos(0)
+		{}
+
+		uint64_t read(unsigned count)
+		{
+			if (count > _bits - _pos)
+				throw GenericException("Corrupt time series block");
+
+			uint64_t result = 0;
+			while (count) {
+				unsigned offset = _pos % 8;
+				unsigned n = std::min(count, 8 - offset);
+				unsigned chunk = (_data[_pos / 8] >> (8 - offset - n)) & ((1u << n) - 1);
+
+				result = (result << n) | chunk;
+				_pos += n;
+				count -= n;
+			}
+
+			return result;
+		}
+
+		bool bit() { return read(1); }
+};
+
+void throw_errno(const std::string& what, const boost::filesystem::path& path)
+{
+	throw GenericException(what + " " + path.string() + ": " + strerror(errno));
+}
+
+std::string sanitize(std::string field)
+{
+	std::replace(field.begin(), field.end(), '\t', ' ');
+	std::replace(field.begin(), field.end(), '\n', ' ');
+	return field;
+}
+
+// compares values bitwise, so NaNs are equal
+bool same_reading(const std::pair<int64_t, double>& a, const std::pair<int64_t, double>& b)
+{
+	return a.first == b.first && !memcmp(&a.second, &b.second, sizeof(a.second));
+}
+
+const char* series_file = "series";
+const char* series_file_header = "# hexabus time series store, partition ";
+
+}
+
+TimeSeriesStore::Encoder::Encoder()
+	: _free_bits(0), _count(0), _first(0), _last(0),
+		_prev_ts(0), _prev_delta(0), _prev_value(0),
+		// no window yet, leading zeroes are capped at 31
+		_prev_leading(64), _prev_trailing(0)
+{
+}
+
+void TimeSeriesStore::Encoder::write_bits(uint64_t bits, unsigned count)
+{
+	while (count) {
+		if (!_free_bits) {
+			_data.push_back(0);
+			_free_bits = 8;
+		}
+
+		unsigned n = std::min<unsigned>(count, _free_bits);
+		unsigned chunk = (bits >> (count - n)) & ((1u << n) - 1);
+
+		_data.back() |= chunk << (_free_bits - n);
+		_free_bits -= n;
+		count -= n;
+	}
+}
+
+void TimeSeriesStore::Encoder::append(timestamp_t ts, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	if (!_count) {
+		write_bits(ts, 64);
+		write_bits(bits, 64);
+		_first = _last = ts;
+	} else {
+		// timestamps may be anywhere in the range of timestamp_t, the
+		// differences wrap around and are stored in two's complement
+		uint64_t delta = uint64_t(ts) - uint64_t(_prev_ts);
+		int64_t dod = int64_t(delta - _prev_delta);
+
+		if (dod == 0) {
+			write_bits(0, 1);
+		} else if (dod >= -63 && dod <= 64) {
+			write_bits(2, 2);
+			write_bits(dod + 63, 7);
+		} else if (dod >= -255 && dod <= 256) {
+			write_bits(6, 3);
+			write_bits(dod + 255, 9);
+		} else if (dod >= -2047 && dod <= 2048) {
+			write_bits(14, 4);
+			write_bits(dod + 2047, 12);
+		} else {
+			write_bits(15, 4);
+			write_bits(dod, 64);
+		}
+		_prev_delta = delta;
+
+		uint64_t x = bits ^ _prev_value;
+		if (!x) {
+			write_bits(0, 1);
+		} else {
+			unsigned leading = std::min(__builtin_clzll(x), 31);
+			unsigned trailing = __builtin_ctzll(x);
+
+			if (leading >= _prev_leading && trailing >= _prev_trailing) {
+				write_bits(2, 2);
+				write_bits(x >> _prev_trailing, 64 - _prev_leading - _prev_trailing);
+			} else {
+				unsigned length = 64 - leading - trailing;
+
+				write_bits(3, 2);
+				write_bits(leading, 5);
+				write_bits(length - 1, 6);
+				write_bits(x >> trailing, length);
+
+				_prev_leading = leading;
+				_prev_trailing = trailing;
+			}
+		}
+
+		_first = std::min(_first, ts);
+		_last = std::max(_last, ts);
+	}
+
+	_prev_ts = ts;
+	_prev_value = bits;
+	_count++;
+}
+
+void TimeSeriesStore::decode(const char* data, size_t size, uint32_t count, readings_t& target)
+{
+	if (!count)
+		return;
+
+	bit_reader in(data, size);
+
+	timestamp_t ts = in.read(64);
+	uint64_t bits = in.read(64);
+	uint64_t delta = 0;
+	unsigned leading = 0;
+	unsigned trailing = 0;
+
+	for (uint32_t i = 0; ; i++) {
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		target.push_back(std::make_pair(ts, value));
+
+		if (i + 1 == count)
+			break;
+
+		int64_t dod;
+		if (!in.bit())
+			dod = 0;
+		else if (!in.bit())
+			dod = int64_t(in.read(7)) - 63;
+		else if (!in.bit())
+			dod = int64_t(in.read(9)) - 255;
+		else if (!in.bit())
+			dod = int64_t(in.read(12)) - 2047;
+		else
+			dod = in.read(64);
+
+		delta += uint64_t(dod);
+		ts = timestamp_t(uint64_t(ts) + delta);
+
+		if (in.bit()) {
+			if (in.bit()) {
+				leading = in.read(5);
+				unsigned length = in.read(6) + 1;
+				if (leading + length > 64)
+					throw GenericException("Corrupt time series block");
+				trailing = 64 - leading - length;
+			}
+
+			bits ^= in.read(64 - leading - trailing) << trailing;
+		}
+	}
+}
+
+struct TimeSeriesStore::open_block {
+	Encoder encoder;
+	timestamp_t partition;
+	// readings appended since the last flush
+	readings_t pending;
+
+	// segment known to end after a valid block, and where
+	bool has_segment;
+	timestamp_t segment;
+	off_t segment_end;
+
+	// end of the log, and whether it is synced up to there
+	off_t log_end;
+	bool log_synced;
+
+	open_block()
+		: partition(0), has_segment(false), segment(0), segment_end(0), log_end(0), log_synced(true)
+	{}
+};
+
+struct TimeSeriesStore::segment_index {
+	// offset just past the last block indexed
+	size_t end;
+	std::vector<block_entry> blocks;
+
+	segment_index() : end(0) {}
+};
+
+TimeSeriesStore::TimeSeriesStore(const boost::filesystem::path& root, timestamp_t partition)
+	: _root(root), _partition(partition), _buffered(0)
+{
+	if (_partition <= 0)
+		throw GenericException("Invalid partition length");
+
+	boost::filesystem::create_directories(_root);
+
+	if (boost::filesystem::exists(_root / series_file)) {
+		load_series();
+	} else {
+		boost::filesystem::ofstream out(_root / series_file);
+		out << series_file_header << _partition << std::endl;
+		if (!out)
+			throw GenericException("Could not create time series store " + _root.string());
+	}
+}
+
+TimeSeriesStore::~TimeSeriesStore()
+{
+	try {
+		flush(true);
+	} catch (...) {
+	}
+}
+
+void TimeSeriesStore::load_series()
+{
+	boost::filesystem::ifstream in(_root / series_file);
+	std::string line;
+
+	if (!std::getline(in, line) || line.compare(0, strlen(series_file_header), series_file_header))
+		throw GenericException("Invalid time series store " + _root.string());
+
+	try {
+		_partition = boost::lexical_cast<timestamp_t>(line.substr(strlen(series_file_header)));
+	} catch (const boost::bad_lexical_cast&) {
+		throw GenericException("Invalid time series store " + _root.string());
+	}
+
+	while (std::getline(in, line)) {
+		std::vector<std::string> fields;
+		size_t start = 0;
+		for (;;) {
+			size_t end = line.find('\t', start);
+			fields.push_back(line.substr(start, end - start));
+			if (end == std::string::npos)
+				break;
+			start = end + 1;
+		}
+
+		if (fields.size() != 5 || fields[0] != boost::lexical_cast<std::string>(_series.size()))
+			throw GenericException("Invalid series list in time series store " + _root.string());
+
+		Series s = { uint32_t(_series.size()), fields[1], fields[2], fields[3], fields[4] };
+		_by_external_id[s.external_id] = s.id;
+		_series.push_back(s);
+		_open.push_back(open_block_ptr(new open_block));
+		replay_log(s.id, *_open.back());
+	}
+}
+
+void TimeSeriesStore::replay_log(uint32_t series, open_block& block)
+{
+	boost::filesystem::path path = log_path(series);
+	readings_t logged;
+	size_t end = 0;
+
+	{
+		mapped_file file(path);
+		if (!file.valid())
+			return;
+
+		while (file.size - end >= sizeof(log_header)) {
+			log_header header;
+			memcpy(&header, file.bytes() + end, sizeof(header));
+
+			size_t size = size_t(header.count) * sizeof(log_reading);
+			if (memcmp(header.magic, log_magic, sizeof(log_magic)) || size > file.size - end - sizeof(header))
+				break;
+
+			const char* readings = file.bytes() + end + sizeof(header);
+
+			boost::crc_32_type crc;
+			crc.process_bytes(readings, size);
+			if (crc.checksum() != header.crc)
+				break;
+
+			for (uint32_t i = 0; i < header.count; i++) {
+				log_reading reading;
+				memcpy(&reading, readings + i * sizeof(reading), sizeof(reading));
+
+				logged.push_back(std::make_pair(reading.ts, reading.value));
+			}
+			end += sizeof(header) + size;
+		}
+
+		// a crash after the block was written to its segment but before the
+		// log was emptied leaves the block in both. The last readings of the
+		// block may not have been flushed to the log yet.
+		if (!logged.empty()) {
+			timestamp_t partition = partition_of(logged[0].first);
+			mapped_file segment(segment_path(series, partition));
+			const segment_index* index = segment.valid() ? index_segment(series, partition, segment) : 0;
+
+			if (index && !index->blocks.empty() && index->blocks.back().count >= logged.size()) {
+				const block_entry& last = index->blocks.back();
+				readings_t written;
+
+				decode(segment.bytes() + last.payload, last.size, last.count, written);
+				if (std::equal(logged.begin(), logged.end(), written.begin(), same_reading)) {
+					logged.clear();
+					end = 0;
+				}
+			}
+		}
+
+		// drop whatever a crash left behind
+		if (end < file.size && truncate(path.c_str(), end))
+			throw_errno("Could not truncate", path);
+	}
+
+	for (readings_t::const_iterator it = logged.begin(), e = logged.end(); it != e; ++it) {
+		block.partition = partition_of(it->first);
+		block.encoder.append(it->first, it->second);
+	}
+	block.log_end = end;
+}
+
+const TimeSeriesStore::Series* TimeSeriesStore::find_series(const std::string& external_id) const
+{
+	std::map<std::string, uint32_t>::const_iterator it = _by_external_id.find(external_id);
+
+	return it != _by_external_id.end() ? &_series[it->second] : 0;
+}
+
+const TimeSeriesStore::Series& TimeSeriesStore::add_series(const std::string& external_id, const std::string& name,
+		const std::string& unit, const std::string& timezone)
+{
+	if (find_series(external_id))
+		throw GenericException("Series " + external_id + " exists already");
+
+	Series s = { uint32_t(_series.size()), sanitize(external_id), sanitize(name), sanitize(unit), sanitize(timezone) };
+
+	boost::filesystem::create_directories(_root / boost::lexical_cast<std::string>(s.id));
+
+	boost::filesystem::ofstream out(_root / series_file, std::ios_base::out | std::ios_base::app);
+	out << s.id << '\t' << s.external_id << '\t' << s.name << '\t' << s.unit << '\t' << s.timezone << std::endl;
+	if (!out)
+		throw GenericException("Could not add series to time series store " + _root.string());
+
+	_by_external_id[s.external_id] = s.id;
+	_series.push_back(s);
+	_open.push_back(open_block_ptr(new open_block));
+
+	return _series.back();
+}
+
+TimeSeriesStore::timestamp_t TimeSeriesStore::partition_of(timestamp_t ts) const
+{
+	timestamp_t offset = ts % _partition;
+	if (offset < 0)
+		offset += _partition;
+
+	return ts - offset;
+}
+
+boost::filesystem::path TimeSeriesStore::segment_path(uint32_t series, timestamp_t partition) const
+{
+	return _root / boost::lexical_cast<std::string>(series) / (boost::lexical_cast<std::string>(partition) + ".seg");
+}
+
+boost::filesystem::path TimeSeriesStore::log_path(uint32_t series) const
+{
+	return _root / boost::lexical_cast<std::string>(series) / "open.log";
+}
+
+void TimeSeriesStore::append(uint32_t series, timestamp_t ts, double value)
+{
+	if (series >= _open.size())
+		throw GenericException("Unknown series");
+
+	open_block& block = *_open[series];
+	timestamp_t partition = partition_of(ts);
+
+	if (block.encoder.count() && block.partition != partition)
+		close_block(series, block);
+
+	block.partition = partition;
+	block.encoder.append(ts, value);
+	block.pending.push_back(std::make_pair(ts, value));
+	_buffered++;
+
+	if (block.encoder.count() == BlockSize)
+		close_block(series, block);
+}
+
+void TimeSeriesStore::flush(bool sync)
+{
+	for (uint32_t series = 0; series < _open.size(); series++) {
+		open_block& block = *_open[series];
+
+		if (!block.pending.empty() || (sync && !block.log_synced))
+			write_log(series, block, sync);
+	}
+}
+
+void TimeSeriesStore::write_log(uint32_t series, open_block& block, bool sync)
+{
+	boost::filesystem::path path = log_path(series);
+
+	// the log of a new block starts empty, even if emptying it failed before
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (block.log_end ? 0 : O_TRUNC), 0644);
+	if (fd < 0)
+		throw_errno("Could not open", path);
+
+	try {
+		if (!block.pending.empty()) {
+			std::vector<char> buffer(sizeof(log_header) + block.pending.size() * sizeof(log_reading));
+
+			for (size_t i = 0; i < block.pending.size(); i++) {
+				log_reading reading = { block.pending[i].first, block.pending[i].second };
+				memcpy(&buffer[sizeof(log_header) + i * sizeof(reading)], &reading, sizeof(reading));
+			}
+
+			log_header header;
+			memcpy(header.magic, log_magic, sizeof(log_magic));
+			header.count = block.pending.size();
+
+			boost::crc_32_type crc;
+			crc.process_bytes(&buffer[sizeof(header)], buffer.size() - sizeof(header));
+			header.crc = crc.checksum();
+			memcpy(&buffer[0], &header, sizeof(header));
+
+			if (pwrite(fd, &buffer[0], buffer.size(), block.log_end) != ssize_t(buffer.size()))
+				throw_errno("Could not write", path);
+
+			block.log_end += buffer.size();
+			block.log_synced = false;
+		}
+
+		if (sync && !block.log_synced) {
+			if (fdatasync(fd))
+				throw_errno("Could not sync", path);
+			block.log_synced = true;
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+
+	_buffered -= block.pending.size();
+	block.pending.clear();
+}
+
+void TimeSeriesStore::close_block(uint32_t series, open_block& block)
+{
+	// readings in the log must not be lost when it is emptied
+	bool logged = block.log_end > 0;
+	write_block(series, block, logged);
+
+	_buffered -= block.pending.size();
+	block.pending.clear();
+	block.encoder = Encoder();
+	block.log_end = 0;
+	block.log_synced = true;
+
+	if (logged) {
+		boost::filesystem::path path = log_path(series);
+		if (truncate(path.c_str(), 0))
+			throw_errno("Could not truncate", path);
+	}
+}
+
+void TimeSeriesStore::write_block(uint32_t series, open_block& block, bool sync)
+{
+	boost::filesystem::path path = segment_path(series, block.partition);
+
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw_errno("Could not open", path);
+
+	try {
+		if (!block.has_segment || block.segment != block.partition) {
+			mapped_file file(path);
+			size_t end = file.valid()
+				? scan_segment(file.bytes(), file.size, series, block.partition, 0, 0)
+				: 0;
+
+			if (!end) {
+				segment_header header;
+				memcpy(header.magic, segment_magic, sizeof(segment_magic));
+				header.partition = block.partition;
+				header.series = series;
+				header.reserved = 0;
+
+				if (pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+					throw_errno("Could not write", path);
+				end = sizeof(header);
+			}
+
+			// drop whatever a crash left behind
+			if (ftruncate(fd, end))
+				throw_errno("Could not truncate", path);
+
+			block.has_segment = true;
+			block.segment = block.partition;
+			block.segment_end = end;
+		}
+
+		const std::vector<char>& payload = block.encoder.data();
+
+		block_header header;
+		memcpy(header.magic, block_magic, sizeof(block_magic));
+		header.count = block.encoder.count();
+		header.first = block.encoder.first();
+		header.last = block.encoder.last();
+		header.size = payload.size();
+
+		boost::crc_32_type crc;
+		crc.process_bytes(&payload[0], payload.size());
+		header.crc = crc.checksum();
+
+		std::vector<char> buffer(sizeof(header) + payload.size());
+		memcpy(&buffer[0], &header, sizeof(header));
+		memcpy(&buffer[sizeof(header)], &payload[0], payload.size());
+
+		if (pwrite(fd, &buffer[0], buffer.size(), block.segment_end) != ssize_t(buffer.size()))
+			throw_errno("Could not write", path);
+		if (sync && fdatasync(fd))
+			throw_errno("Could not sync", path);
+
+		block.segment_end += buffer.size();
+	} catch (...) {
+		// rescan the segment on the next write
+		block.has_segment = false;
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+}
+
+const TimeSeriesStore::segment_index* TimeSeriesStore::index_segment(uint32_t series, timestamp_t partition,
+		const mapped_file& file) const
+{
+	segment_index_ptr& index = _indices[std::make_pair(series, partition)];
+
+	// blocks are only appended while the store is open, so only the blocks
+	// after the ones indexed are new
+	if (!index || index->end > file.size)
+		index.reset(new segment_index);
+
+	index->end = scan_segment(file.bytes(), file.size, series, partition, index->end, &index->blocks);
+	return index.get();
+}
+
+namespace {
+
+bool earlier(const std::pair<int64_t, double>& a, const std::pair<int64_t, double>& b)
+{
+	return a.first < b.first;
+}
+
+void collect(const TimeSeriesStore::readings_t& block, int64_t from, int64_t to, TimeSeriesStore::readings_t& target)
+{
+	for (TimeSeriesStore::readings_t::const_iterator it = block.begin(), end = block.end(); it != end; ++it) {
+		if (it->first >= from && it->first < to)
+			target.push_back(*it);
+	}
+}
+
+}
+
+TimeSeriesStore::readings_t TimeSeriesStore::read(uint32_t series, timestamp_t from, timestamp_t to) const
+{
+	if (series >= _open.size())
+		throw GenericException("Unknown series");
+
+	readings_t result;
+	if (from >= to)
+		return result;
+
+	std::vector<timestamp_t> partitions;
+	boost::filesystem::path dir = _root / boost::lexical_cast<std::string>(series);
+	boost::filesystem::directory_iterator it, end;
+	if (boost::filesystem::is_directory(dir))
+		it = boost::filesystem::directory_iterator(dir);
+
+	for (; it != end; ++it) {
+		std::string name = it->path().filename().string();
+		if (it->path().extension() != ".seg")
+			continue;
+
+		char* name_end;
+		timestamp_t partition = strtoll(name.c_str(), &name_end, 10);
+		if (name_end != name.c_str() + name.size() - 4)
+			continue;
+
+		if (partition < to && partition + _partition > from)
+			partitions.push_back(partition);
+	}
+	std::sort(partitions.begin(), partitions.end());
+
+	readings_t block;
+	for (std::vector<timestamp_t>::const_iterator p = partitions.begin(); p != partitions.end(); ++p) {
+		mapped_file file(segment_path(series, *p));
+		if (!file.valid())
+			continue;
+
+		const segment_index* index = index_segment(series, *p, file);
+
+		for (std::vector<block_entry>::const_iterator b = index->blocks.begin(); b != index->blocks.end(); ++b) {
+			if (b->last < from || b->first >= to)
+				continue;
+
+			block.clear();
+			decode(file.bytes() + b->payload, b->size, b->count, block);
+			collect(block, from, to, result);
+		}
+	}
+
+	const open_block& open = *_open[series];
+	if (open.encoder.count() && open.encoder.last() >= from && open.encoder.first() < to) {
+		block.clear();
+		decode(&open.encoder.data()[0], open.encoder.data().size(), open.encoder.count(), block);
+		collect(block, from, to, result);
+	}
+
+	// readings arriving out of order end up in later blocks
+	std::stable_sort(result.begin(), result.end(), earlier);
+	return result;
+}
@@ -0,0 +1,152 @@
+#ifndef LIBHEXABUS_TIME_SERIES_STORE_HPP
+#define LIBHEXABUS_TIME_SERIES_STORE_HPP 1
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <tr1/memory>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace hexabus {
+
+	struct mapped_file;
+
+	/**
+	 * Append-only store for sensor readings.
+	 *
+	 * Every series is stored in one segment file per time partition, one day by
+	 * default. A segment is a sequence of blocks of up to BlockSize readings.
+	 * Timestamps are encoded as deltas of deltas, values as the XOR with the
+	 * previous value (as in Facebook's Gorilla), so regular readings of slowly
+	 * changing values take a few bits each. Blocks are only ever appended; a
+	 * block cut short by a crash is ignored when reading and overwritten by the
+	 * next append to its segment.
+	 *
+	 * The last block of a series stays open in memory until it is full or a
+	 * reading of another partition arrives. flush() does not close it, but
+	 * appends the readings since the last flush to the log of the series, which
+	 * is replayed into the open block when the store is opened again. Readings
+	 * are visible to read() immediately. read() only looks at the partitions
+	 * and blocks overlapping the requested range, the blocks of a segment are
+	 * indexed when it is first read. Segments are memory mapped for reading.
+	 *
+	 * Layout of the store directory:
+	 *   series              one line per series: id, external id, name, unit
+	 *                       and timezone, separated by tabs
+	 *   <id>/<start>.seg    segment of series <id> for the partition starting
+	 *                       at <start>
+	 *   <id>/open.log       flushed readings of the open block of series <id>
+	 *
+	 * A store must only be opened once at a time, it is not thread-safe.
+	 */
+	class TimeSeriesStore : private boost::noncopyable {
+		public:
+			typedef std::tr1::shared_ptr<TimeSeriesStore> Ptr;
+			typedef int64_t timestamp_t;
+			typedef std::vector<std::pair<timestamp_t, double> > readings_t;
+
+			struct Series {
+				uint32_t id;
+				std::string external_id;
+				std::string name;
+				std::string unit;
+				std::string timezone;
+			};
+
+			static const uint32_t BlockSize = 1024;
+			static const timestamp_t DefaultPartition = 86400;
+
+			/**
+			 * Opens the store in root, creating it if it does not exist. The
+			 * partition length of an existing store is kept.
+			 */
+			TimeSeriesStore(const boost::filesystem::path& root, timestamp_t partition = DefaultPartition);
+			// flushes all buffered readings
+			~TimeSeriesStore();
+
+			const boost::filesystem::path& root() const { return _root; }
+			timestamp_t partition() const { return _partition; }
+
+			const std::vector<Series>& series() const { return _series; }
+			// returns 0 if there is no series with this external id
+			const Series* find_series(const std::string& external_id) const;
+			const Series& add_series(const std::string& external_id, const std::string& name,
+					const std::string& unit, const std::string& timezone);
+
+			void append(uint32_t series, timestamp_t ts, double value);
+			// writes all buffered readings to the logs, and syncs them if sync is set
+			void flush(bool sync = false);
+
+			// readings of series with from <= timestamp < to, ordered by timestamp
+			readings_t read(uint32_t series, timestamp_t from, timestamp_t to) const;
+
+			// readings buffered but not flushed yet
+			size_t buffered() const { return _buffered; }
+
+			// block encoding, exposed for the benefit of the tests
+			class Encoder;
+			static void decode(const char* data, size_t size, uint32_t count, readings_t& target);
+
+		private:
+			struct open_block;
+			typedef std::tr1::shared_ptr<open_block> open_block_ptr;
+			struct segment_index;
+			typedef std::tr1::shared_ptr<segment_index> segment_index_ptr;
+			typedef std::map<std::pair<uint32_t, timestamp_t>, segment_index_ptr> segment_indices_t;
+
+			boost::filesystem::path _root;
+			timestamp_t _partition;
+			std::vector<Series> _series;
+			std::map<std::string, uint32_t> _by_external_id;
+			std::vector<open_block_ptr> _open;
+			size_t _buffered;
+			// blocks of the segments read so far
+			mutable segment_indices_t _indices;
+
+			timestamp_t partition_of(timestamp_t ts) const;
+			boost::filesystem::path segment_path(uint32_t series, timestamp_t partition) const;
+			boost::filesystem::path log_path(uint32_t series) const;
+
+			void load_series();
+			void replay_log(uint32_t series, open_block& block);
+			void write_log(uint32_t series, open_block& block, bool sync);
+			void write_block(uint32_t series, open_block& block, bool sync);
+			void close_block(uint32_t series, open_block& block);
+			const segment_index* index_segment(uint32_t series, timestamp_t partition, const mapped_file& file) const;
+	};
+
+	class TimeSeriesStore::Encoder {
+		private:
+			std::vector<char> _data;
+			uint8_t _free_bits;
+
+			uint32_t _count;
+			timestamp_t _first;
+			timestamp_t _last;
+
+			timestamp_t _prev_ts;
+			uint64_t _prev_delta;
+			uint64_t _prev_value;
+			unsigned _prev_leading;
+			unsigned _prev_trailing;
+
+			void write_bits(uint64_t bits, unsigned count);
+
+		public:
+			Encoder();
+
+			void append(timestamp_t ts, double value);
+
+			uint32_t count() const { return _count; }
+			// smallest and largest timestamp in the block
+			timestamp_t first() const { return _first; }
+			timestamp_t last() const { return _last; }
+			const std::vector<char>& data() const { return _data; }
+	};
+
+}
+
+#endif
@@ -0,0 +1,282 @@
+#include "transport.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <poll.h>
+#include <errno.h>
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "error.hpp"
+
+using namespace hexabus;
+
+void Transport::send(const char* buffer, const std::vector<size_t>& offsets,
+		const std::vector<boost::asio::ip::udp::endpoint>& destinations, send_errors_t& errors)
+{
+	for (size_t i = 0; i < destinations.size(); i++) {
+		boost::system::error_code err;
+
+		send(buffer + offsets[i], offsets[i + 1] - offsets[i], destinations[i], err);
+		if (err)
+			errors.push_back(std::make_pair(destinations[i], err));
+	}
+}
+
+
+
+boost::asio::io_service::id TransportProvider::id;
+
+TransportProvider::TransportProvider(boost::asio::io_service& io)
+	: boost::asio::io_service::service(io), io(io)
+{
+}
+
+Transport::Ptr TransportProvider::createTransport()
+{
+	return Transport::Ptr(new UdpTransport(io));
+}
+
+
+
+UdpTransport::UdpTransport(boost::asio::io_service& io)
+	: socket(io)
+{
+	boost::system::error_code err;
+
+	socket.open(boost::asio::ip::udp::v6(), err);
+	if (err)
+		throw NetworkException("open", err);
+}
+
+UdpTransport::~UdpTransport()
+{
+	close();
+}
+
+int UdpTransport::iface_idx(const std::string& iface, boost::system::error_code& err)
+{
+	if (iface.empty())
+		return 0;
+
+	int if_index = if_nametoindex(iface.c_str());
+	if (if_index == 0) {
+		err = boost::system::error_code(
+				boost::system::errc::no_such_device,
+				boost::system::generic_category());
+	}
+
+	return if_index;
+}
+
+void UdpTransport::bind(const boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err)
+{
+	socket.bind(ep, err);
+}
+
+boost::asio::ip::udp::endpoint UdpTransport::localEndpoint() const
+{
+	return socket.local_endpoint();
+}
+
+void UdpTransport::close()
+{
+	boost::system::error_code err;
+
+	socket.close(err);
+	// FIXME: maybe errors should be logged somewhere
+}
+
+void UdpTransport::setReuseAddress(bool reuse, boost::system::error_code& err)
+{
+	socket.set_option(boost::asio::socket_base::reuse_address(reuse), err);
+}
+
+void UdpTransport::setMulticastHops(int hops, boost::system::error_code& err)
+{
+	socket.set_option(boost::asio::ip::multicast::hops(hops), err);
+}
+
+void UdpTransport::setMulticastLoopback(bool loopback, boost::system::error_code& err)
+{
+	socket.set_option(boost::asio::ip::multicast::enable_loopback(loopback), err);
+}
+
+void UdpTransport::setOutboundInterface(const std::string& dev, boost::system::error_code& err)
+{
+	int if_index = iface_idx(dev, err);
+	if (!err)
+		socket.set_option(boost::asio::ip::multicast::outbound_interface(if_index), err);
+}
+
+void UdpTransport::joinGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err)
+{
+	int if_index = iface_idx(dev, err);
+	if (!err)
+		socket.set_option(boost::asio::ip::multicast::join_group(group, if_index), err);
+}
+
+void UdpTransport::leaveGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err)
+{
+	int if_index = iface_idx(dev, err);
+	if (!err)
+		socket.set_option(boost::asio::ip::multicast::leave_group(group, if_index), err);
+}
+
+void UdpTransport::send(const char* data, size_t size, const boost::asio::ip::udp::endpoint& dest,
+		boost::system::error_code& err)
+{
+	socket.send_to(boost::asio::buffer(data, size), dest, 0, err);
+}
+
+void UdpTransport::send(const char* buffer, const std::vector<size_t>& offsets,
+		const std::vector<boost::asio::ip::udp::endpoint>& destinations, send_errors_t& errors)
+{
+#if HAS_LINUX
+	size_t count = destinations.size();
+
+	sendHeaders.resize(count);
+	sendVectors.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		sendVectors[i].iov_base = const_cast<char*>(buffer + offsets[i]);
+		sendVectors[i].iov_len = offsets[i + 1] - offsets[i];
+
+		memset(&sendHeaders[i], 0, sizeof(sendHeaders[i]));
+		sendHeaders[i].msg_hdr.msg_name = const_cast<boost::asio::ip::udp::endpoint&>(destinations[i]).data();
+		sendHeaders[i].msg_hdr.msg_namelen = destinations[i].size();
+		sendHeaders[i].msg_hdr.msg_iov = &sendVectors[i];
+		sendHeaders[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int fd = socket.native_handle();
+	for (size_t i = 0; i < count; ) {
+		// UIO_MAXIOV limits the number of messages per call
+		unsigned int chunk = std::min<size_t>(count - i, 1024);
+		int sent = ::sendmmsg(fd, &sendHeaders[i], chunk, 0);
+
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+
+			// the send buffer is full. Wait until it drains and send the rest,
+			// as a blocking send_to would, instead of dropping the batch
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				if (::poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+					continue;
+			}
+
+			// sendmmsg only fails if the first message fails, skip over it
+			errors.push_back(std::make_pair(destinations[i],
+						boost::system::error_code(errno, boost::system::system_category())));
+			i++;
+		} else {
+			i += sent;
+		}
+	}
+#else
+	Transport::send(buffer, offsets, destinations, errors);
+#endif
+}
+
+void UdpTransport::asyncReceive(ReceiveBuffer& buffer, const receive_handler_t& handler)
+{
+	if (buffer.capacity() > 1) {
+		socket.async_receive(boost::asio::null_buffers(),
+				boost::bind(&UdpTransport::ready,
+					this,
+					boost::ref(buffer),
+					handler,
+					boost::asio::placeholders::error));
+	} else {
+		socket.async_receive_from(boost::asio::buffer(buffer.packet(0), buffer.packetSize), buffer.endpoints[0],
+				boost::bind(&UdpTransport::received,
+					this,
+					boost::ref(buffer),
+					handler,
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred));
+	}
+}
+
+void UdpTransport::received(ReceiveBuffer& buffer, const receive_handler_t& handler,
+		const boost::system::error_code& error, size_t size)
+{
+	buffer.sizes[0] = size;
+	handler(error, error ? 0 : 1);
+}
+
+void UdpTransport::ready(ReceiveBuffer& buffer, const receive_handler_t& handler,
+		const boost::system::error_code& error)
+{
+	if (error) {
+		handler(error, 0);
+		return;
+	}
+
+	boost::system::error_code err;
+	size_t count = drain(buffer, err);
+
+	handler(err, count);
+}
+
+size_t UdpTransport::drain(ReceiveBuffer& buffer, boost::system::error_code& err)
+{
+	int fd = socket.native_handle();
+	size_t capacity = buffer.capacity();
+
+#if HAS_LINUX
+	receiveHeaders.resize(capacity);
+	receiveVectors.resize(capacity);
+	for (size_t i = 0; i < capacity; i++) {
+		receiveVectors[i].iov_base = buffer.packet(i);
+		receiveVectors[i].iov_len = buffer.packetSize;
+
+		memset(&receiveHeaders[i], 0, sizeof(receiveHeaders[i]));
+		receiveHeaders[i].msg_hdr.msg_name = buffer.endpoints[i].data();
+		receiveHeaders[i].msg_hdr.msg_namelen = buffer.endpoints[i].capacity();
+		receiveHeaders[i].msg_hdr.msg_iov = &receiveVectors[i];
+		receiveHeaders[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int count = ::recvmmsg(fd, &receiveHeaders[0], capacity, MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			err = boost::system::error_code(errno, boost::system::system_category());
+		return 0;
+	}
+
+	for (int i = 0; i < count; i++) {
+		buffer.endpoints[i].resize(receiveHeaders[i].msg_hdr.msg_namelen);
+		buffer.sizes[i] = receiveHeaders[i].msg_len;
+	}
+
+	return count;
+#else
+	size_t count;
+	for (count = 0; count < capacity; count++) {
+		socklen_t len = buffer.endpoints[count].capacity();
+		ssize_t size = ::recvfrom(fd, buffer.packet(count), buffer.packetSize, MSG_DONTWAIT,
+				buffer.endpoints[count].data(), &len);
+		if (size < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				err = boost::system::error_code(errno, boost::system::system_category());
+			break;
+		}
+
+		buffer.endpoints[count].resize(len);
+		buffer.sizes[count] = size;
+	}
+
+	return count;
+#endif
+}
+
+void UdpTransport::cancel()
+{
+	boost::system::error_code err;
+
+	socket.cancel(err);
+}
@@ -0,0 +1,152 @@
+#ifndef LIBHEXABUS_TRANSPORT_HPP
+#define LIBHEXABUS_TRANSPORT_HPP 1
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <libhexabus/config.h>
+#include <libhexabus/common.hpp>
+#if HAS_LINUX
+#include <sys/socket.h>
+#endif
+#include <string>
+#include <vector>
+
+namespace hexabus {
+	/**
+	 * Datagrams received by one asynchronous receive of a transport. The
+	 * buffer holds up to capacity() datagrams of at most packetSize bytes,
+	 * datagram i starts at data[i * packetSize].
+	 */
+	struct ReceiveBuffer {
+		size_t packetSize;
+		std::vector<char> data;
+		std::vector<boost::asio::ip::udp::endpoint> endpoints;
+		std::vector<size_t> sizes;
+
+		ReceiveBuffer(size_t packetSize, size_t capacity)
+			: packetSize(packetSize), data(packetSize * capacity, 0), endpoints(capacity), sizes(capacity)
+		{}
+
+		size_t capacity() const { return sizes.size(); }
+		char* packet(size_t i) { return &data[i * packetSize]; }
+	};
+
+	/**
+	 * Moves datagrams for a SocketBase. Errors are reported through error
+	 * codes, the socket turns them into NetworkExceptions.
+	 *
+	 * A transport is used by its socket only, from one thread at a time.
+	 * Receive handlers are invoked through the io_service the transport was
+	 * created for.
+	 */
+	class Transport : private boost::noncopyable {
+		public:
+			typedef std::tr1::shared_ptr<Transport> Ptr;
+			typedef std::vector<std::pair<boost::asio::ip::udp::endpoint, boost::system::error_code> > send_errors_t;
+			typedef boost::function<void (const boost::system::error_code& error, size_t count)> receive_handler_t;
+
+			virtual ~Transport() {}
+
+			virtual void bind(const boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err) = 0;
+			virtual boost::asio::ip::udp::endpoint localEndpoint() const = 0;
+			virtual void close() = 0;
+
+			virtual void setReuseAddress(bool reuse, boost::system::error_code& err) = 0;
+			virtual void setMulticastHops(int hops, boost::system::error_code& err) = 0;
+			virtual void setMulticastLoopback(bool loopback, boost::system::error_code& err) = 0;
+			// an empty device name selects the default interface
+			virtual void setOutboundInterface(const std::string& dev, boost::system::error_code& err) = 0;
+			virtual void joinGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err) = 0;
+			virtual void leaveGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err) = 0;
+
+			virtual void send(const char* data, size_t size, const boost::asio::ip::udp::endpoint& dest,
+					boost::system::error_code& err) = 0;
+			/**
+			 * Send the datagrams [offsets[i], offsets[i + 1]) of buffer to
+			 * destinations[i]. Failures do not stop the other datagrams from
+			 * being sent, each is reported with its destination.
+			 */
+			virtual void send(const char* buffer, const std::vector<size_t>& offsets,
+					const std::vector<boost::asio::ip::udp::endpoint>& destinations, send_errors_t& errors);
+
+			/**
+			 * Wait for at least one datagram and fill buffer with as many as are
+			 * available, up to its capacity. The handler gets the number of
+			 * datagrams received, or operation_aborted if the receive is
+			 * cancelled. Only one receive may be pending at a time.
+			 */
+			virtual void asyncReceive(ReceiveBuffer& buffer, const receive_handler_t& handler) = 0;
+			virtual void cancel() = 0;
+	};
+
+	/**
+	 * The io_service service that creates the transports of all sockets on
+	 * an io_service. This one creates UdpTransports, other networks replace
+	 * it (see LoopbackNetwork) before the first socket is created.
+	 */
+	class TransportProvider : public boost::asio::io_service::service {
+		public:
+			static boost::asio::io_service::id id;
+
+			explicit TransportProvider(boost::asio::io_service& io);
+
+			virtual Transport::Ptr createTransport();
+
+		protected:
+			boost::asio::io_service& io;
+
+		private:
+			void shutdown_service() {}
+	};
+
+	/**
+	 * Transport on a UDP/IPv6 socket. Sends and receives of batches use
+	 * sendmmsg and recvmmsg on Linux.
+	 */
+	class UdpTransport : public Transport {
+		private:
+			boost::asio::ip::udp::socket socket;
+#if HAS_LINUX
+			// receives complete outside the strand of the socket, so sends and
+			// receives must not share buffers
+			std::vector<struct mmsghdr> sendHeaders;
+			std::vector<struct iovec> sendVectors;
+			std::vector<struct mmsghdr> receiveHeaders;
+			std::vector<struct iovec> receiveVectors;
+#endif
+
+			int iface_idx(const std::string& iface, boost::system::error_code& err);
+
+			size_t drain(ReceiveBuffer& buffer, boost::system::error_code& err);
+			void received(ReceiveBuffer& buffer, const receive_handler_t& handler,
+					const boost::system::error_code& error, size_t size);
+			void ready(ReceiveBuffer& buffer, const receive_handler_t& handler,
+					const boost::system::error_code& error);
+
+		public:
+			UdpTransport(boost::asio::io_service& io);
+			~UdpTransport();
+
+			void bind(const boost::asio::ip::udp::endpoint& ep, boost::system::error_code& err);
+			boost::asio::ip::udp::endpoint localEndpoint() const;
+			void close();
+
+			void setReuseAddress(bool reuse, boost::system::error_code& err);
+			void setMulticastHops(int hops, boost::system::error_code& err);
+			void setMulticastLoopback(bool loopback, boost::system::error_code& err);
+			void setOutboundInterface(const std::string& dev, boost::system::error_code& err);
+			void joinGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err);
+			void leaveGroup(const boost::asio::ip::address_v6& group, const std::string& dev, boost::system::error_code& err);
+
+			void send(const char* data, size_t size, const boost::asio::ip::udp::endpoint& dest,
+					boost::system::error_code& err);
+			void send(const char* buffer, const std::vector<size_t>& offsets,
+					const std::vector<boost::asio::ip::udp::endpoint>& destinations, send_errors_t& errors);
+
+			void asyncReceive(ReceiveBuffer& buffer, const receive_handler_t& handler);
+			void cancel();
+	};
+}
+
+#endif
@@ -3,12 +3,15 @@
 #include <map>
 #include <set>
 #include <string.h>
+#include <libhexabus/config.h>
 #include <libhexabus/common.hpp>
 #include <libhexabus/crc.hpp>
 #include <libhexabus/packet.hpp>
 #include <libhexabus/socket.hpp>
 #include <libhexabus/device_interrogator.hpp>
 #include <libhexabus/endpoint_registry.hpp>
+#include <libhexabus/registry_watcher.hpp>
+#include <libhexabus/time_series_store.hpp>
 
 #include <libklio/common.hpp>
 #include <sstream>
@@ -19,10 +22,9 @@
 #include <libklio/sqlite3/sqlite3-store.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/lambda/lambda.hpp>
-#include <boost/lambda/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
 
 // commandline parsing.
 #include <boost/program_options.hpp>
@@ -35,25 +37,26 @@ namespace po = boost::program_options;
 #pragma GCC diagnostic warning "-Wstrict-aliasing"
 
 #include <unistd.h>
+#include <sys/wait.h>
 
 #include <libhexabus/logger/logger.hpp>
 
 #include "resolv.hpp"
+#include "store_writer.hpp"
 using boost::format;
 using boost::io::group;
 
-#define KLIO_AUTOCOMMIT 0
-
 class Logger : public hexabus::Logger {
 private:
   bfs::path store_file;
-  klio::SQLite3Store::Ptr store;
-  unsigned int _packet_counter;
-  unsigned int _packet_counter_max;
+  hexabus::StoreWriter& writer;
+  std::string compressor;
+  boost::thread rotation;
 
   klio::Sensor::Ptr lookup_sensor(const std::string& id)
 		{
-			std::vector<klio::Sensor::Ptr> sensors = store->get_sensors_by_external_id(id);
+			boost::mutex::scoped_lock lock(writer.storeMutex());
+			std::vector<klio::Sensor::Ptr> sensors = writer.store()->get_sensors_by_external_id(id);
 			
 			if (!sensors.size())
 				return klio::Sensor::Ptr();
@@ -62,115 +65,204 @@ private:
 
   void new_sensor_found(klio::Sensor::Ptr sensor, const boost::asio::ip::address_v6&)
 		{
-			store->add_sensor(sensor);
+			boost::mutex::scoped_lock lock(writer.storeMutex());
+			writer.store()->add_sensor(sensor);
 			std::cout << "Created new sensor: " << sensor->str() << std::endl;
-#if KLIO_AUTOCOMMIT
-      store->commit_transaction();
-      store->start_transaction();
-#endif
 		}
 
   void record_reading(klio::Sensor::Ptr sensor, klio::timestamp_t ts, double value)
 		{
-      double msecs1;
-      double msecs2;
-      double mdiff;
-      
-      struct timeval tv1;
-      struct timeval tv2;
-#if KLIO_AUTOCOMMIT
-      if( _packet_counter > _packet_counter_max ) {
-        _packet_counter = 0;
-        std::cout<<"need to commit fitst"<< std::endl;
-        store->commit_transaction();
-        store->start_transaction();
-      }
-#endif
+			writer.add_reading(sensor, ts, value);
+		}
+
+  bfs::path archive_name() const
+		{
+      const boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+
+      std::string s;
+      s= str( format("%04d%02d%02d-%02d%02d")        % now.date().year_month_day().year
+              % now.date().year_month_day().month.as_number()
+              % now.date().year_month_day().day.as_number()
+              % now.time_of_day().hours()
+              % now.time_of_day().minutes());
+
+      std::string name(store_file.string());
+      name+=".";
+      name+=s;
+
+			return bfs::path(name);
+		}
+
+  /*
+   * Runs on the writer thread between two transactions. Moves the current
+   * store out of the way, puts the prepared store in its place and opens it.
+   */
+  klio::SQLite3Store::Ptr switch_store(const klio::SQLite3Store::Ptr& old,
+      const bfs::path& archive,
+      const bfs::path& next,
+      const std::vector<klio::Sensor::Ptr>& copied)
+		{
+			// buffered readings must reach the old file before it is renamed, sqlite
+			// would put its journal next to the new store otherwise
+			old->flush(true);
+
+			bfs::rename(store_file, archive);
+			try {
+				bfs::rename(next, store_file);
+
+				klio::StoreFactory store_factory;
+				klio::SQLite3Store::Ptr store = store_factory.open_sqlite3_store(store_file, false, true, 30,
+						klio::SQLite3Store::OS_SYNC_OFF);
+
+				// sensors created while the new store was prepared
+				std::set<boost::uuids::uuid> known;
+				for (std::vector<klio::Sensor::Ptr>::const_iterator it = copied.begin(); it != copied.end(); ++it)
+					known.insert((*it)->uuid());
+
+				std::vector<klio::Sensor::Ptr> sensors = old->get_sensors();
+				for (std::vector<klio::Sensor::Ptr>::const_iterator it = sensors.begin(); it != sensors.end(); ++it) {
+					if (!known.count((*it)->uuid()))
+						store->add_sensor(*it);
+				}
+
+				return store;
+			} catch (...) {
+				boost::system::error_code err;
+				bfs::rename(store_file, next, err);
+				bfs::rename(archive, store_file, err);
+				throw;
+			}
+		}
+
+  void rotate(const bfs::path& archive)
+		{
+			bfs::path next(store_file.string() + ".new");
+
+			std::cout << "Rotating store " << store_file << " to " << archive << std::endl;
 			try {
+				// the new store is set up while readings still go to the old one
+				std::vector<klio::Sensor::Ptr> sensors;
+				{
+					boost::mutex::scoped_lock lock(writer.storeMutex());
+					sensors = writer.store()->get_sensors();
+				}
+
+				bfs::remove(next);
+
+				klio::StoreFactory store_factory;
+				klio::SQLite3Store::Ptr prepared = store_factory.create_sqlite3_store(next, false, true, 30);
+				for (std::vector<klio::Sensor::Ptr>::const_iterator it = sensors.begin(); it != sensors.end(); ++it)
+					prepared->add_sensor(*it);
+				prepared->close();
+
+				klio::SQLite3Store::Ptr old = writer.switchStore(
+						boost::bind(&Logger::switch_store, this, _1, archive, next, sensors));
+
+				old->close();
+				std::cout << "Store rotated to " << archive << std::endl;
+			} catch (const std::exception& e) {
+				std::cerr << "Failed to rotate store " << store_file << ": " << e.what() << std::endl;
+
+				boost::system::error_code err;
+				bfs::remove(next, err);
+				return;
+			}
+
+			if (!compressor.empty())
+				compress(archive);
+		}
 
-        gettimeofday(&tv1, NULL) ;
-        msecs1=(double)tv1.tv_sec + ((double)tv1.tv_usec/1000000);
-				std::cout << "Call Record-Reading at " <<  tv1.tv_sec << "." << tv1.tv_usec << std::endl;
-
-				store->add_reading(sensor, ts, value);
-        _packet_counter++;
-        gettimeofday(&tv2, NULL) ;
-        msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-        mdiff = msecs2 - msecs1;
-        
-				std::cout << "Added reading " << value << " to sensor " << sensor->name() << " ("<<sensor->external_id()<< ")" << "t="<< ts << " diff=" <<mdiff << std::endl;
-			} catch (klio::StoreException const& ex) {
-        gettimeofday(&tv2, NULL) ;
-        msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-        mdiff = msecs2 - msecs1;
-
-				std::cout << "Failed to record reading to sensor " << sensor->name()<< " ("<<sensor->external_id()<< ")"<< "t="<< ts << " diff=" << mdiff<< " : " << ex.what() << std::endl;
-			} catch (std::exception const& ex) {
-        gettimeofday(&tv2, NULL) ;
-        msecs2=(double)tv2.tv_sec + ((double)tv2.tv_usec/1000000);
-        mdiff = msecs2 - msecs1;
-
-				std::cout << "Failed to record reading to sensor " << sensor->name()<< " ("<<sensor->external_id()<< ")"<< "t="<< ts << " diff=" << mdiff<< " : " << ex.what() << std::endl;
+  void compress(const bfs::path& file)
+		{
+			pid_t pid = fork();
+			if (pid == 0) {
+				execlp(compressor.c_str(), compressor.c_str(), file.c_str(), (char*) 0);
+				_exit(127);
 			}
+
+			int status;
+			if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				std::cerr << "Failed to compress " << file << " with " << compressor << std::endl;
 		}
 
 public:
   Logger(const bfs::path& store_file,
-         klio::SQLite3Store::Ptr& store,
+         hexabus::StoreWriter& writer,
+         const std::string& compressor,
          klio::TimeConverter& tc,
          klio::SensorFactory& sensor_factory,
          const std::string& sensor_timezone,
          hexabus::DeviceInterrogator& interrogator,
          hexabus::EndpointRegistry& reg)
-			: hexabus::Logger(tc, sensor_factory, sensor_timezone, interrogator, reg), store_file(store_file), store(store)
-      , _packet_counter(0)
-      , _packet_counter_max(10)
+			: hexabus::Logger(tc, sensor_factory, sensor_timezone, interrogator, reg), store_file(store_file)
+      , writer(writer), compressor(compressor)
 		{
 		}
 
+  /**
+   * Starts rotating the store in the background. Readings are queued by the
+   * writer while the stores are swapped, no packets are lost.
+   */
   void rotate_stores()
 		{
-			std::cout << "Rotating store " << store_file << "..." << std::endl;
-			std::cout << "Rotating store call flush " << store_file << "..." << std::endl;
-      fflush(stdout);
-			try {
-        store->flush(true);
-			} catch (klio::StoreException const& ex) {
-				std::cout << "Failed to flush the buffers : " << ex.what() << std::endl;
-      }
-      std::cout << "Rotating store flushed " << store_file << "..." << std::endl;
-      fflush(stdout);
+			if (rotation.joinable() && !rotation.timed_join(boost::posix_time::seconds(0))) {
+				std::cerr << "Store rotation still in progress, ignoring request" << std::endl;
+				return;
+			}
 
-			std::cout << "Reopening store" << std::endl;
+			rotation = boost::thread(boost::bind(&Logger::rotate, this, archive_name()));
+		}
 
-      const boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
+  void wait_for_rotation()
+		{
+			if (rotation.joinable())
+				rotation.join();
+		}
+};
 
-      std::string s;
-      s= str( format("%04d%02d%02d-%02d%02d")        % now.date().year_month_day().year
-              % now.date().year_month_day().month.as_number()
-              % now.date().year_month_day().day.as_number()
-              % now.time_of_day().hours()
-              % now.time_of_day().minutes());
+/*
+ * Logs into a hexabus::TimeSeriesStore instead of a klio store. The store
+ * is only touched from the io thread, readings are written out by flush().
+ */
+class TimeSeriesLogger : public hexabus::Logger {
+private:
+  hexabus::TimeSeriesStore& store;
+  boost::unordered_map<const klio::Sensor*, uint32_t> series_ids;
 
-      std::string name(store_file.string());
-      name+=".";
-      name+=s;
-      
-      bfs::path dbname(name);
-      std::cout << "===> renaming to: "<< name<<std::endl;
-      fflush(stdout);
-			try {
-        store->rotate(dbname);
-			} catch (klio::StoreException const& ex) {
-				std::cout << "Failed to rotate the klio-databse : " << ex.what() << std::endl;
-      }
-      
-
-#if KLIO_AUTOCOMMIT
-      store->start_transaction();
-#endif
+  klio::Sensor::Ptr lookup_sensor(const std::string& id)
+		{
+			const hexabus::TimeSeriesStore::Series* series = store.find_series(id);
+
+			if (!series)
+				return klio::Sensor::Ptr();
+
+			klio::Sensor::Ptr sensor = sensor_factory.createSensor(series->external_id, series->name,
+					series->unit, series->timezone);
+			series_ids[sensor.get()] = series->id;
+			return sensor;
+		}
 
-			std::cout << "Rotation done" << std::endl;
+  void new_sensor_found(klio::Sensor::Ptr sensor, const boost::asio::ip::address_v6&)
+		{
+			series_ids[sensor.get()] = store.add_series(sensor->external_id(), sensor->name(),
+					sensor->unit(), sensor->timezone()).id;
+			std::cout << "Created new sensor: " << sensor->str() << std::endl;
+		}
+
+  void record_reading(klio::Sensor::Ptr sensor, klio::timestamp_t ts, double value)
+		{
+			store.append(series_ids[sensor.get()], ts, value);
+		}
+
+public:
+  TimeSeriesLogger(hexabus::TimeSeriesStore& store,
+         klio::TimeConverter& tc,
+         klio::SensorFactory& sensor_factory,
+         const std::string& sensor_timezone,
+         hexabus::DeviceInterrogator& interrogator,
+         hexabus::EndpointRegistry& reg)
+			: hexabus::Logger(tc, sensor_factory, sensor_timezone, interrogator, reg), store(store)
+		{
 		}
 };
 
@@ -191,6 +283,132 @@ enum ErrorCode {
 };
 
 
+static void print_statistics(const hexabus::StoreWriter::Statistics& stats)
+{
+	std::cout << "Readings queued: " << stats.queued
+		<< ", written: " << stats.written
+		<< ", failed: " << stats.failed
+		<< ", dropped: " << stats.dropped
+		<< ", transactions: " << stats.transactions
+		<< ", longest queue: " << stats.max_queue_length << std::endl;
+}
+
+#if LOGGER_STATISTICS
+static void print_statistics(const hexabus::Logger::Statistics& stats)
+{
+	std::cout << "Readings: " << stats.readings
+		<< ", cache hits: " << stats.cache_hits
+		<< ", store lookups: " << stats.store_lookups
+		<< ", sensors created: " << stats.sensors_created
+		<< ", dropped: " << stats.readings_dropped
+		<< ", time recording: " << stats.recording_time << std::endl;
+}
+#endif
+
+static void rotate_requested(boost::asio::signal_set& signals, Logger& logger, hexabus::StoreWriter& writer,
+		const boost::system::error_code& err)
+{
+	if (err)
+		return;
+
+	print_statistics(writer.statistics());
+#if LOGGER_STATISTICS
+	print_statistics(logger.statistics());
+#endif
+
+	logger.rotate_stores();
+
+	signals.async_wait(boost::bind(&rotate_requested, boost::ref(signals), boost::ref(logger), boost::ref(writer), _1));
+}
+
+static void flush_time_series(boost::asio::deadline_timer& timer, hexabus::TimeSeriesStore& store,
+		boost::posix_time::time_duration interval, const boost::system::error_code& err)
+{
+	if (err)
+		return;
+
+	try {
+		store.flush();
+	} catch (const hexabus::GenericException& e) {
+		std::cerr << "Failed to flush readings: " << e.what() << std::endl;
+	}
+
+	timer.expires_from_now(interval);
+	timer.async_wait(boost::bind(&flush_time_series, boost::ref(timer), boost::ref(store), interval, _1));
+}
+
+static void sync_requested(boost::asio::signal_set& signals, hexabus::TimeSeriesStore& store,
+		TimeSeriesLogger& logger, const boost::system::error_code& err)
+{
+	if (err)
+		return;
+
+#if LOGGER_STATISTICS
+	print_statistics(logger.statistics());
+#endif
+
+	try {
+		store.flush(true);
+	} catch (const hexabus::GenericException& e) {
+		std::cerr << "Failed to flush readings: " << e.what() << std::endl;
+	}
+
+	signals.async_wait(boost::bind(&sync_requested, boost::ref(signals), boost::ref(store), boost::ref(logger), _1));
+}
+
+/*
+ * Logs into a time series store. Readings are written out every
+ * flush_interval and synced to disk on SIGHUP and at exit. The store is
+ * partitioned by time, so there is nothing to rotate.
+ */
+static int log_to_time_series(boost::asio::io_service& io,
+		const boost::asio::ip::address_v6& addr,
+		const std::string& interface,
+		const bfs::path& root,
+		const std::string& sensor_timezone,
+		boost::posix_time::time_duration flush_interval)
+{
+	hexabus::TimeSeriesStore store(root);
+	std::cout << "opened time series store: " << root << std::endl;
+
+	hexabus::Listener listener(io);
+	hexabus::Socket network(io);
+	klio::SensorFactory sensor_factory;
+	klio::TimeConverter tc;
+	hexabus::DeviceInterrogator di(network);
+	hexabus::EndpointRegistry reg;
+	hexabus::RegistryWatcher reg_watcher(io, reg);
+
+	TimeSeriesLogger logger(store, tc, sensor_factory, sensor_timezone, di, reg);
+
+	network.bind(addr);
+	listener.listen(interface);
+	listener.setReceiveBatchSize(32);
+	listener.onPacketViewReceived(boost::ref(logger));
+
+	boost::asio::deadline_timer flush_timer(io, flush_interval);
+	boost::asio::signal_set sync_handler(io, SIGHUP);
+	boost::asio::signal_set terminate_handler(io, SIGTERM);
+
+	flush_timer.async_wait(
+			boost::bind(&flush_time_series, boost::ref(flush_timer), boost::ref(store), flush_interval, _1));
+	sync_handler.async_wait(
+			boost::bind(&sync_requested, boost::ref(sync_handler), boost::ref(store), boost::ref(logger), _1));
+	terminate_handler.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+
+	io.run();
+
+	std::cout << "Terminating hexalog."<< std::endl;
+#if LOGGER_STATISTICS
+	print_statistics(logger.statistics());
+#endif
+
+	store.flush(true);
+	fflush(stdout);
+
+	return ERR_NONE;
+}
+
 int main(int argc, char** argv)
 {
 	std::ostringstream oss;
@@ -200,9 +418,15 @@ int main(int argc, char** argv)
 		("help,h", "produce help message")
 		("version,v", "print version and exit")
 		("storefile,s", po::value<std::string>(), "the data store to use")
+		("format", po::value<std::string>()->default_value("sqlite"), "format of the data store, sqlite or tsdb")
 		("timezone,t", po::value<std::string>(), "the timezone to use for new sensors")
 		("interface,I", po::value<std::string>(), "interface to listen on")
-		("bind,b", po::value<std::string>(), "address to bind to");
+		("bind,b", po::value<std::string>(), "address to bind to")
+		("batch-size", po::value<size_t>()->default_value(500), "maximum number of readings per transaction")
+		("batch-interval", po::value<unsigned>()->default_value(2000), "maximum time in milliseconds before readings are committed")
+		("queue-size", po::value<size_t>()->default_value(16384), "number of readings to queue while the store is busy")
+		("max-block", po::value<unsigned>()->default_value(100), "time in milliseconds to wait for the store when the queue is full before dropping readings")
+		("compress", po::value<std::string>(), "program to compress rotated stores with, e.g. xz");
 
 	po::positional_options_description p;
 	p.add("interface", 1);
@@ -255,31 +479,43 @@ int main(int argc, char** argv)
 		}
 	}
 
+	std::string format(vm["format"].as<std::string>());
+	if (format != "sqlite" && format != "tsdb") {
+		std::cerr << "Unknown store format " << format << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+
+	std::string sensor_timezone("Europe/Berlin"); 
+	if (! vm.count("timezone")) {
+		std::cerr << "Using default timezone " << sensor_timezone 
+              << ", change with -t <NEW_TIMEZONE>" << std::endl;
+	} else {
+		sensor_timezone=vm["timezone"].as<std::string>();
+	}
+
 	try {
 		klio::StoreFactory store_factory; 
     klio::SQLite3Store::Ptr store;
 
 		std::string storefile(vm["storefile"].as<std::string>());
+		if (format == "tsdb")
+			return log_to_time_series(io, addr, interface, storefile, sensor_timezone,
+					boost::posix_time::milliseconds(vm["batch-interval"].as<unsigned>()));
+
 		bfs::path db(storefile);
 		if (! bfs::exists(db)) {
 			std::cerr << "Database " << db << " does not exist, cannot continue." << std::endl;
 			std::cerr << "Hint: you can create a database using klio-store create <dbfile>" << std::endl;
 			return ERR_PARAMETER_VALUE_INVALID;
 		}
-#if KLIO_AUTOCOMMIT
-		store = store_factory.open_sqlite3_store(db, false, true, 30);
-    store->start_transaction();
-#else
-		store = store_factory.open_sqlite3_store(db, true, true, 30, klio::SQLite3Store::OS_SYNC_OFF);
-#endif
+		// transactions are managed by the store writer
+		store = store_factory.open_sqlite3_store(db, false, true, 30, klio::SQLite3Store::OS_SYNC_OFF);
 
-		std::string sensor_timezone("Europe/Berlin"); 
-		if (! vm.count("timezone")) {
-			std::cerr << "Using default timezone " << sensor_timezone 
-                << ", change with -t <NEW_TIMEZONE>" << std::endl;
-		} else {
-			sensor_timezone=vm["timezone"].as<std::string>();
-		}
+		hexabus::StoreWriter writer(store,
+				vm["queue-size"].as<size_t>(),
+				vm["batch-size"].as<size_t>(),
+				boost::posix_time::milliseconds(vm["batch-interval"].as<unsigned>()),
+				boost::posix_time::milliseconds(vm["max-block"].as<unsigned>()));
 
 		hexabus::Listener listener(io);
 
@@ -289,42 +525,41 @@ int main(int argc, char** argv)
 		klio::TimeConverter tc;
 		hexabus::DeviceInterrogator di(network);
 		hexabus::EndpointRegistry reg;
+		hexabus::RegistryWatcher reg_watcher(io, reg);
 
-		Logger logger(storefile, store, tc, sensor_factory, sensor_timezone, di, reg);
+		std::string compressor;
+		if (vm.count("compress"))
+			compressor = vm["compress"].as<std::string>();
+
+		Logger logger(storefile, writer, compressor, tc, sensor_factory, sensor_timezone, di, reg);
 
 		network.bind(addr);
 		listener.listen(interface);
-		listener.onPacketReceived(boost::ref(logger));
+		listener.setReceiveBatchSize(32);
+		listener.onPacketViewReceived(boost::ref(logger));
 
 		boost::asio::signal_set rotate_handler(io, SIGHUP);
 		boost::asio::signal_set terminate_handler(io, SIGTERM);
 
-    bool term_received = false;
-		while (!term_received) {
-			bool hup_received = false;
-
-			using namespace boost::lambda;
-			rotate_handler.async_wait(
-        (var(hup_received) = true,
-         boost::lambda::bind(&boost::asio::io_service::stop, &io)));
-			terminate_handler.async_wait(
-        (var(term_received) = true,
-         boost::lambda::bind(&boost::asio::io_service::stop, &io)));
-
-			io.reset();
-			io.run();
-
-			if (hup_received) {
-				logger.rotate_stores();
-			} else {
-				break;
-			}
-		}
-    std::cout << "Terminating hexalog."<< std::endl;
-    store->flush(true);
-    store->close();
-    fflush(stdout);
-    
+		rotate_handler.async_wait(
+				boost::bind(&rotate_requested, boost::ref(rotate_handler), boost::ref(logger), boost::ref(writer), _1));
+		terminate_handler.async_wait(boost::bind(&boost::asio::io_service::stop, &io));
+
+		io.run();
+
+		std::cout << "Terminating hexalog."<< std::endl;
+		logger.wait_for_rotation();
+		writer.stop();
+
+		print_statistics(writer.statistics());
+#if LOGGER_STATISTICS
+		print_statistics(logger.statistics());
+#endif
+
+		writer.store()->flush(true);
+		writer.store()->close();
+		fflush(stdout);
+
 	} catch (const hexabus::NetworkException& e) {
 		std::cerr << "Network error: " << e.code().message() << std::endl;
 		return ERR_NETWORK;
@@ -295,7 +295,7 @@ int main(int argc, char** argv)
 			if(!vm.count("noinfo")) {
 				ba::ip::address_v6 ip;
 				rcv_callback cb = {&ip, &io};
-				boost::signals2::connection con = network.onPacketReceived(cb, hexabus::filtering::isInfo<uint32_t>() && (hexabus::filtering::eid() == EP_DEVICE_DESCRIPTOR));
+				hexabus::connection con = network.onPacketReceived(cb, hexabus::filtering::isInfo<uint32_t>() && (hexabus::filtering::eid() == EP_DEVICE_DESCRIPTOR));
 				io.run();
 				con.disconnect();
 				if(verbose)
@@ -0,0 +1,207 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <libhexabus/config.h>
+#include <libhexabus/common.hpp>
+#include <libhexabus/error.hpp>
+#include <libhexabus/time_series_store.hpp>
+
+#include <libklio/common.hpp>
+#include <libklio/store.hpp>
+#include <libklio/store-factory.hpp>
+#include <libklio/sensor.hpp>
+#include <libklio/sensor-factory.hpp>
+#include <libklio/sqlite3/sqlite3-store.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+// commandline parsing.
+#include <boost/program_options.hpp>
+#include <boost/program_options/positional_options.hpp>
+namespace po = boost::program_options;
+
+enum ErrorCode {
+	ERR_NONE = 0,
+
+	ERR_UNKNOWN_PARAMETER = 1,
+	ERR_PARAMETER_MISSING = 2,
+	ERR_PARAMETER_FORMAT = 3,
+	ERR_PARAMETER_VALUE_INVALID = 4,
+
+	ERR_KLIO = 6,
+
+	ERR_OTHER = 127
+};
+
+typedef hexabus::TimeSeriesStore::readings_t readings_t;
+
+static int import_store(const bfs::path& db, const bfs::path& root)
+{
+	if (!bfs::exists(db)) {
+		std::cerr << "Database " << db << " does not exist, cannot continue." << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+
+	klio::StoreFactory store_factory;
+	klio::SQLite3Store::Ptr source = store_factory.open_sqlite3_store(db, true, true, 30);
+	hexabus::TimeSeriesStore target(root);
+
+	std::vector<klio::Sensor::Ptr> sensors = source->get_sensors();
+	for (std::vector<klio::Sensor::Ptr>::const_iterator it = sensors.begin(); it != sensors.end(); ++it) {
+		const klio::Sensor::Ptr& sensor = *it;
+		const hexabus::TimeSeriesStore::Series* series = target.find_series(sensor->external_id());
+
+		if (!series)
+			series = &target.add_series(sensor->external_id(), sensor->name(), sensor->unit(), sensor->timezone());
+
+		klio::readings_t_Ptr readings = source->get_all_readings(sensor);
+		for (klio::readings_it_t r = readings->begin(); r != readings->end(); ++r)
+			target.append(series->id, r->first, r->second);
+
+		std::cout << "Imported " << readings->size() << " readings of " << sensor->external_id() << std::endl;
+	}
+
+	source->close();
+	target.flush(true);
+	return ERR_NONE;
+}
+
+static int export_store(const bfs::path& root, const bfs::path& db)
+{
+	if (!bfs::is_directory(root)) {
+		std::cerr << "Time series store " << root << " does not exist, cannot continue." << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+	if (bfs::exists(db)) {
+		std::cerr << "Database " << db << " exists already, not overwriting it." << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+
+	klio::StoreFactory store_factory;
+	klio::SensorFactory sensor_factory;
+	hexabus::TimeSeriesStore source(root);
+	klio::SQLite3Store::Ptr target = store_factory.create_sqlite3_store(db, true, true, 30);
+
+	const std::vector<hexabus::TimeSeriesStore::Series>& series = source.series();
+	for (std::vector<hexabus::TimeSeriesStore::Series>::const_iterator it = series.begin(); it != series.end(); ++it) {
+		klio::Sensor::Ptr sensor = sensor_factory.createSensor(it->external_id, it->name, it->unit, it->timezone);
+		target->add_sensor(sensor);
+
+		readings_t readings = source.read(it->id, 0, std::numeric_limits<hexabus::TimeSeriesStore::timestamp_t>::max());
+		klio::readings_t converted;
+		for (readings_t::const_iterator r = readings.begin(); r != readings.end(); ++r)
+			converted.insert(converted.end(), std::make_pair(r->first, r->second));
+		target->add_readings(sensor, converted);
+
+		std::cout << "Exported " << converted.size() << " readings of " << it->external_id << std::endl;
+	}
+
+	target->close();
+	return ERR_NONE;
+}
+
+static int dump_series(const bfs::path& root, const std::string& external_id,
+		hexabus::TimeSeriesStore::timestamp_t from, hexabus::TimeSeriesStore::timestamp_t to)
+{
+	if (!bfs::is_directory(root)) {
+		std::cerr << "Time series store " << root << " does not exist, cannot continue." << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+
+	hexabus::TimeSeriesStore store(root);
+	const hexabus::TimeSeriesStore::Series* series = store.find_series(external_id);
+	if (!series) {
+		std::cerr << "No series " << external_id << " in " << root << std::endl;
+		return ERR_PARAMETER_VALUE_INVALID;
+	}
+
+	readings_t readings = store.read(series->id, from, to);
+	for (readings_t::const_iterator it = readings.begin(); it != readings.end(); ++it)
+		std::cout << it->first << "\t" << it->second << "\n";
+	std::cout << std::flush;
+
+	return ERR_NONE;
+}
+
+int main(int argc, char** argv)
+{
+	std::ostringstream oss;
+	oss << "Usage: " << argv[0] << " <command> <args...>" << std::endl
+		<< std::endl
+		<< "Commands:" << std::endl
+		<< "  import <sqlite store> <tsdb dir>     copy all sensors and readings of a klio store" << std::endl
+		<< "  export <tsdb dir> <sqlite store>     create a klio store from a time series store" << std::endl
+		<< "  dump <tsdb dir> <id> [from] [to]     print the readings of a series, optionally" << std::endl
+		<< "                                       limited to from <= timestamp < to" << std::endl;
+	po::options_description desc(oss.str());
+	desc.add_options()
+		("help,h", "produce help message")
+		("version,v", "print version and exit")
+		("command", po::value<std::vector<std::string> >(), "command and its arguments");
+
+	po::positional_options_description p;
+	p.add("command", -1);
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).
+				options(desc).positional(p).run(), vm);
+		po::notify(vm);
+	} catch (const std::exception& e) {
+		std::cerr << "Cannot process commandline options: " << e.what() << std::endl;
+		return ERR_UNKNOWN_PARAMETER;
+	}
+
+	if (vm.count("help")) {
+		std::cout << desc << std::endl;
+		return ERR_NONE;
+	}
+
+	if (vm.count("version")) {
+		std::cout << "libhexabus version " << hexabus::version() << std::endl;
+		return ERR_NONE;
+	}
+
+	if (!vm.count("command")) {
+		std::cerr << "You must specify a command." << std::endl;
+		return ERR_PARAMETER_MISSING;
+	}
+
+	std::vector<std::string> args(vm["command"].as<std::vector<std::string> >());
+	const std::string& command = args[0];
+
+	try {
+		if (command == "import" && args.size() == 3) {
+			return import_store(args[1], args[2]);
+		} else if (command == "export" && args.size() == 3) {
+			return export_store(args[1], args[2]);
+		} else if (command == "dump" && args.size() >= 3 && args.size() <= 5) {
+			hexabus::TimeSeriesStore::timestamp_t from = std::numeric_limits<hexabus::TimeSeriesStore::timestamp_t>::min();
+			hexabus::TimeSeriesStore::timestamp_t to = std::numeric_limits<hexabus::TimeSeriesStore::timestamp_t>::max();
+
+			try {
+				if (args.size() > 3)
+					from = boost::lexical_cast<hexabus::TimeSeriesStore::timestamp_t>(args[3]);
+				if (args.size() > 4)
+					to = boost::lexical_cast<hexabus::TimeSeriesStore::timestamp_t>(args[4]);
+			} catch (const boost::bad_lexical_cast&) {
+				std::cerr << "Timestamps must be given in seconds since the epoch" << std::endl;
+				return ERR_PARAMETER_FORMAT;
+			}
+
+			return dump_series(args[1], args[2], from, to);
+		} else {
+			std::cerr << "Unknown command or wrong number of arguments: " << command << std::endl;
+			std::cerr << desc << std::endl;
+			return ERR_PARAMETER_MISSING;
+		}
+	} catch (const klio::GenericException& e) {
+		std::cerr << "Klio error: " << e.reason() << std::endl;
+		return ERR_KLIO;
+	} catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return ERR_OTHER;
+	}
+}
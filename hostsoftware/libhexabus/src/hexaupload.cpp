@@ -49,7 +49,7 @@ class RetryingPacketSender {
 		hexabus::Socket& socket;
 		boost::asio::ip::address_v6 target;
 		int retryLimit;
-		boost::signals2::scoped_connection errorHandler;
+		hexabus::scoped_connection errorHandler;
 
 		const hexabus::Packet* packet;
 		ErrorCode result;
@@ -131,7 +131,7 @@ class RetryingPacketSender {
 
 class RemoteStateMachine : protected RetryingPacketSender {
 	private:
-		boost::signals2::connection replyHandler;
+		hexabus::connection replyHandler;
 
 		STM_state_t reqState;
 
@@ -205,7 +205,7 @@ static const size_t UploadChunkSize = EE_STATEMACHINE_CHUNK_SIZE;
 
 class ChunkSender : protected RetryingPacketSender {
 	private:
-		boost::signals2::connection replyHandler;
+		hexabus::connection replyHandler;
 
 		void onReply(const hexabus::Packet& packet, const boost::asio::ip::udp::endpoint& from)
 		{
@@ -0,0 +1,96 @@
+#ifndef SPSC_QUEUE_HPP_
+#define SPSC_QUEUE_HPP_ 1
+
+#include <vector>
+#include <algorithm>
+
+#include <boost/noncopyable.hpp>
+
+namespace hexabus {
+
+	/**
+	 * Bounded single producer, single consumer queue. push() and pop() never
+	 * block and never allocate; exactly one thread may push and exactly one
+	 * thread may pop at any given time.
+	 */
+	template<typename T>
+	class SPSCQueue : private boost::noncopyable {
+		private:
+			std::vector<T> _ring;
+			size_t _mask;
+
+			// positions grow without bound and are taken modulo the ring size.
+			// keep them on separate cache lines, each is written by one side only
+			char _pad0[64];
+			size_t _head;
+			char _pad1[64];
+			size_t _tail;
+			char _pad2[64];
+
+			static size_t load(const size_t& pos)
+			{
+				return __atomic_load_n(&pos, __ATOMIC_ACQUIRE);
+			}
+
+			static void store(size_t& pos, size_t value)
+			{
+				__atomic_store_n(&pos, value, __ATOMIC_RELEASE);
+			}
+
+			static size_t ring_size(size_t capacity)
+			{
+				size_t size = 1;
+				while (size < capacity)
+					size *= 2;
+				return size;
+			}
+
+		public:
+			// capacity is rounded up to the next power of two
+			explicit SPSCQueue(size_t capacity)
+				: _ring(ring_size(std::max<size_t>(capacity, 1))),
+					_mask(_ring.size() - 1),
+					_head(0),
+					_tail(0)
+			{}
+
+			size_t capacity() const { return _ring.size(); }
+
+			// exact when called from either the producer or the consumer while the
+			// other side is idle, a snapshot otherwise
+			size_t size() const { return load(_tail) - load(_head); }
+
+			bool empty() const { return size() == 0; }
+
+			bool push(const T& value)
+			{
+				size_t tail = _tail;
+				if (tail - load(_head) == _ring.size())
+					return false;
+
+				_ring[tail & _mask] = value;
+				store(_tail, tail + 1);
+				return true;
+			}
+
+			/**
+			 * Moves the oldest element into value. The slot is reset to T() so
+			 * that the queue does not keep references alive.
+			 */
+			bool pop(T& value)
+			{
+				size_t head = _head;
+				if (head == load(_tail))
+					return false;
+
+				T& slot = _ring[head & _mask];
+				std::swap(value, slot);
+				slot = T();
+				store(_head, head + 1);
+				return true;
+			}
+	};
+
+}
+
+#endif
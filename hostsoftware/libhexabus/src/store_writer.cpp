@@ -0,0 +1,272 @@
+#include "store_writer.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+using namespace hexabus;
+
+const boost::posix_time::time_duration StoreWriter::DropReportInterval = boost::posix_time::seconds(10);
+
+StoreWriter::StoreWriter(const klio::SQLite3Store::Ptr& store,
+		size_t queue_size,
+		size_t batch_size,
+		boost::posix_time::time_duration batch_interval,
+		boost::posix_time::time_duration max_block)
+	: _store(store),
+		_batch_size(std::max<size_t>(batch_size, 1)),
+		_batch_interval(batch_interval),
+		_max_block(max_block),
+		_queue(queue_size),
+		_stopping(false),
+		_sync_requested(0),
+		_synced(0),
+		_switch_request(0),
+		_writer_waiting(false),
+		_written(0),
+		_failed(0),
+		_transactions(0),
+		_batch_readings(0),
+		_batch_written(0),
+		_queued(0),
+		_dropped(0),
+		_next_drop_report(boost::posix_time::neg_infin),
+		_max_queue_length(0)
+{
+	_thread = boost::thread(boost::bind(&StoreWriter::run, this));
+}
+
+StoreWriter::~StoreWriter()
+{
+	stop();
+}
+
+void StoreWriter::wake()
+{
+	// pairs with the fence in wait_for_work: either the writer sees the new
+	// reading before it goes to sleep, or we see that it is waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&_writer_waiting, __ATOMIC_RELAXED)) {
+		boost::mutex::scoped_lock lock(_mutex);
+		_wakeup.notify_one();
+	}
+}
+
+bool StoreWriter::add_reading(const klio::Sensor::Ptr& sensor, klio::timestamp_t ts, double value)
+{
+	reading r;
+	r.sensor = sensor;
+	r.ts = ts;
+	r.value = value;
+
+	if (!_queue.push(r)) {
+		boost::mutex::scoped_lock lock(_mutex);
+		boost::system_time until = boost::get_system_time() + _max_block;
+
+		_wakeup.notify_one();
+		while (!_queue.push(r)) {
+			if (!_progress.timed_wait(lock, until)) {
+				if (_queue.push(r))
+					break;
+
+				_dropped++;
+				if (until >= _next_drop_report) {
+					std::cerr << "Store writer queue full, " << _dropped << " readings dropped so far" << std::endl;
+					_next_drop_report = until + DropReportInterval;
+				}
+				return false;
+			}
+		}
+	} else {
+		wake();
+	}
+
+	_queued++;
+	_max_queue_length = std::max(_max_queue_length, _queue.size());
+	return true;
+}
+
+void StoreWriter::sync()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+	uint64_t ticket = ++_sync_requested;
+
+	_wakeup.notify_one();
+	while (_synced < ticket)
+		_progress.wait(lock);
+}
+
+klio::SQLite3Store::Ptr StoreWriter::switchStore(const store_switch_t& fn)
+{
+	switch_request req;
+	req.fn = fn;
+	req.done = false;
+
+	boost::mutex::scoped_lock lock(_mutex);
+	while (_switch_request)
+		_progress.wait(lock);
+
+	_switch_request = &req;
+	_wakeup.notify_one();
+	while (!req.done)
+		_progress.wait(lock);
+
+	if (!req.previous)
+		throw std::runtime_error(req.error);
+
+	return req.previous;
+}
+
+void StoreWriter::stop()
+{
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		_stopping = true;
+		_wakeup.notify_one();
+	}
+
+	if (_thread.joinable())
+		_thread.join();
+}
+
+StoreWriter::Statistics StoreWriter::statistics() const
+{
+	Statistics result;
+
+	result.queued = _queued;
+	result.written = __atomic_load_n(&_written, __ATOMIC_RELAXED);
+	result.failed = __atomic_load_n(&_failed, __ATOMIC_RELAXED);
+	result.dropped = _dropped;
+	result.transactions = __atomic_load_n(&_transactions, __ATOMIC_RELAXED);
+	result.max_queue_length = _max_queue_length;
+
+	return result;
+}
+
+void StoreWriter::wait_for_work(boost::mutex::scoped_lock& lock, const boost::system_time* deadline)
+{
+	__atomic_store_n(&_writer_waiting, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (_queue.empty() && !_stopping && _synced == _sync_requested && !_switch_request) {
+		if (!deadline) {
+			_wakeup.wait(lock);
+		} else if (!_wakeup.timed_wait(lock, *deadline)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&_writer_waiting, false, __ATOMIC_RELAXED);
+}
+
+void StoreWriter::begin_transaction()
+{
+	_batch_deadline = boost::get_system_time() + _batch_interval;
+
+	try {
+		_store->start_transaction();
+	} catch (const std::exception& e) {
+		std::cerr << "Failed to start transaction: " << e.what() << std::endl;
+	}
+}
+
+void StoreWriter::commit_transaction()
+{
+	try {
+		_store->commit_transaction();
+		__atomic_add_fetch(&_written, _batch_written, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&_transactions, 1, __ATOMIC_RELAXED);
+	} catch (const std::exception& e) {
+		std::cerr << "Failed to commit " << _batch_written << " readings: " << e.what() << std::endl;
+		__atomic_add_fetch(&_failed, _batch_written, __ATOMIC_RELAXED);
+	}
+
+	_batch_readings = 0;
+	_batch_written = 0;
+}
+
+/*
+ * Writes queued readings into the open transaction, or a new one, until the
+ * transaction is full or the queue is empty. Commits the transaction if it is
+ * full, expired or if flush is set and the queue has been emptied.
+ */
+void StoreWriter::write_batch(bool flush)
+{
+	boost::mutex::scoped_lock lock(_store_mutex);
+	reading r;
+
+	while (_batch_readings < _batch_size && _queue.pop(r)) {
+		if (!_batch_readings)
+			begin_transaction();
+		_batch_readings++;
+
+		try {
+			_store->add_reading(r.sensor, r.ts, r.value);
+			_batch_written++;
+		} catch (const std::exception& e) {
+			std::cerr << "Failed to record reading to sensor " << r.sensor->name()
+				<< " (" << r.sensor->external_id() << ") t=" << r.ts << ": " << e.what() << std::endl;
+			__atomic_add_fetch(&_failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (_batch_readings && (_batch_readings == _batch_size
+				|| boost::get_system_time() >= _batch_deadline
+				|| (flush && _queue.empty())))
+		commit_transaction();
+}
+
+void StoreWriter::switch_store(switch_request& req)
+{
+	boost::mutex::scoped_lock lock(_store_mutex);
+
+	if (_batch_readings)
+		commit_transaction();
+
+	try {
+		klio::SQLite3Store::Ptr next = req.fn(_store);
+		req.previous = _store;
+		_store = next;
+	} catch (const std::exception& e) {
+		req.error = e.what();
+	}
+}
+
+void StoreWriter::run()
+{
+	for (;;) {
+		uint64_t sync_ticket;
+		bool stopping;
+		switch_request* req;
+
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+			wait_for_work(lock, _batch_readings ? &_batch_deadline : 0);
+			sync_ticket = _sync_requested;
+			stopping = _stopping;
+			req = _switch_request;
+		}
+
+		write_batch(stopping || sync_ticket != _synced);
+
+		if (req)
+			switch_store(*req);
+
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+			bool idle = !_batch_readings && _queue.empty();
+
+			if (req) {
+				req->done = true;
+				_switch_request = 0;
+			}
+			if (idle)
+				_synced = sync_ticket;
+			_progress.notify_all();
+
+			if (stopping && idle)
+				break;
+		}
+	}
+}
@@ -0,0 +1,146 @@
+#ifndef STORE_WRITER_HPP_
+#define STORE_WRITER_HPP_ 1
+
+#include <stdint.h>
+
+#include <libklio/sensor.hpp>
+#include <libklio/sqlite3/sqlite3-store.hpp>
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "spsc_queue.hpp"
+
+namespace hexabus {
+
+	/**
+	 * Writes readings to a klio store from a thread of its own, so that slow
+	 * commits do not hold up packet reception.
+	 *
+	 * Readings are queued by add_reading() and written in transactions of up to
+	 * batch_size readings. A transaction is committed once it is full or
+	 * batch_interval after its first reading, whichever comes first. If the
+	 * queue is full, add_reading() waits up to max_block for the writer to make
+	 * room and drops the reading if it does not.
+	 *
+	 * add_reading() must only be called from one thread. Everybody else who
+	 * uses the store while the writer runs must hold storeMutex().
+	 *
+	 * switchStore() replaces the store between two transactions without
+	 * stopping the queue, which is used to rotate stores while readings keep
+	 * coming in.
+	 */
+	class StoreWriter : private boost::noncopyable {
+		public:
+			struct Statistics {
+				uint64_t queued;
+				uint64_t written;
+				uint64_t failed;
+				uint64_t dropped;
+				uint64_t transactions;
+				size_t max_queue_length;
+			};
+
+			typedef boost::function<klio::SQLite3Store::Ptr (const klio::SQLite3Store::Ptr&)> store_switch_t;
+
+			StoreWriter(const klio::SQLite3Store::Ptr& store,
+					size_t queue_size,
+					size_t batch_size,
+					boost::posix_time::time_duration batch_interval,
+					boost::posix_time::time_duration max_block);
+			~StoreWriter();
+
+			bool add_reading(const klio::Sensor::Ptr& sensor, klio::timestamp_t ts, double value);
+
+			// waits until all readings queued so far have been committed
+			void sync();
+			// writes all queued readings and stops the writer thread. neither sync()
+			// nor switchStore() may be called afterwards
+			void stop();
+
+			/**
+			 * Commits the open transaction and calls fn on the writer thread with
+			 * the store mutex held. The store returned by fn is used for all
+			 * further readings. Blocks until fn has been called and returns the
+			 * previous store; exceptions thrown by fn are rethrown as
+			 * std::runtime_error and leave the store unchanged.
+			 */
+			klio::SQLite3Store::Ptr switchStore(const store_switch_t& fn);
+
+			boost::mutex& storeMutex() { return _store_mutex; }
+			// the store currently written to. hold storeMutex() while using it
+			const klio::SQLite3Store::Ptr& store() const { return _store; }
+
+			// must be called from the thread calling add_reading()
+			Statistics statistics() const;
+
+		private:
+			struct reading {
+				klio::Sensor::Ptr sensor;
+				klio::timestamp_t ts;
+				double value;
+
+				reading() : ts(0), value(0) {}
+			};
+
+			struct switch_request {
+				store_switch_t fn;
+				klio::SQLite3Store::Ptr previous;
+				std::string error;
+				bool done;
+			};
+
+			static const boost::posix_time::time_duration DropReportInterval;
+
+			klio::SQLite3Store::Ptr _store;
+			size_t _batch_size;
+			boost::posix_time::time_duration _batch_interval;
+			boost::posix_time::time_duration _max_block;
+
+			SPSCQueue<reading> _queue;
+
+			boost::mutex _store_mutex;
+
+			// protects the fields below, waits and wakeups of both threads
+			boost::mutex _mutex;
+			boost::condition_variable _wakeup;
+			boost::condition_variable _progress;
+			bool _stopping;
+			uint64_t _sync_requested;
+			uint64_t _synced;
+			switch_request* _switch_request;
+
+			// accessed atomically
+			bool _writer_waiting;
+			uint64_t _written;
+			uint64_t _failed;
+			uint64_t _transactions;
+
+			// only touched by the writer thread
+			size_t _batch_readings;
+			size_t _batch_written;
+			boost::system_time _batch_deadline;
+
+			// only touched by the thread calling add_reading()
+			uint64_t _queued;
+			uint64_t _dropped;
+			boost::system_time _next_drop_report;
+			size_t _max_queue_length;
+
+			boost::thread _thread;
+
+			void run();
+			void wait_for_work(boost::mutex::scoped_lock& lock, const boost::system_time* deadline);
+			void wake();
+			void write_batch(bool flush);
+			void switch_store(switch_request& req);
+
+			void begin_transaction();
+			void commit_transaction();
+	};
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <boost/crc.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <libhexabus/crc.hpp>
+
+static uint16_t reference_crc(const void* input, size_t size)
+{
+	boost::crc_optimal<16, 0x1021, 0x0000, 0, true, true> crc;
+	crc.process_bytes(input, size);
+	return crc.checksum();
+}
+
+template<typename F>
+static void bench(const char* name, F fn, const std::vector<char>& data, size_t size, size_t rounds)
+{
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	uint16_t sum = 0;
+	for (size_t i = 0; i < rounds; i++)
+		sum += fn(&data[i % 64], size);
+
+	boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+	double ns = elapsed.total_microseconds() * 1000.0 / rounds;
+
+	std::cout << name << "\t" << size << " bytes\t" << ns << " ns/call\t"
+		<< (size / ns) * 1000 << " MB/s\t(" << sum << ")" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	size_t rounds = argc > 1 ? atol(argv[1]) : 2000000;
+	// typical hexabus packet sizes: query, uint32 info, string info
+	const size_t sizes[] = { 10, 15, 139, 1024 };
+
+	std::vector<char> data(1024 + 64);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = rand();
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench("boost", reference_crc, data, sizes[i], rounds);
+		bench("table", hexabus::crc, data, sizes[i], rounds);
+	}
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+#define BOOST_TEST_MODULE crc_test
+#include <boost/test/unit_test.hpp>
+#include <boost/crc.hpp>
+#include <vector>
+#include <stdlib.h>
+#include <libhexabus/crc.hpp>
+
+static uint16_t reference_crc(const void* input, size_t size)
+{
+	boost::crc_optimal<16, 0x1021, 0x0000, 0, true, true> crc;
+	crc.process_bytes(input, size);
+	return crc.checksum();
+}
+
+BOOST_AUTO_TEST_CASE ( check_crc_known_value ) {
+	const char check[] = "123456789";
+
+	BOOST_CHECK_EQUAL(hexabus::crc(check, 9), 0x2189);
+	BOOST_CHECK_EQUAL(hexabus::crc(check, 0), 0);
+}
+
+BOOST_AUTO_TEST_CASE ( check_crc_matches_boost ) {
+	std::vector<unsigned char> data(300);
+
+	srand(42);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = rand();
+
+	// cover all alignments and all tail lengths of the 8 byte loop
+	for (size_t offset = 0; offset < 8; offset++) {
+		for (size_t size = 0; size + offset <= data.size(); size++) {
+			if (hexabus::crc(&data[offset], size) != reference_crc(&data[offset], size))
+				BOOST_FAIL("CRC differs from reference at offset " << offset << ", size " << size);
+		}
+	}
+}
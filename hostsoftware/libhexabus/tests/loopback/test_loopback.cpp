@@ -0,0 +1,289 @@
+#define BOOST_TEST_MODULE loopback_test
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cstdlib>
+#include <libhexabus/clock.hpp>
+#include <libhexabus/device.hpp>
+#include <libhexabus/device_interrogator.hpp>
+#include <libhexabus/loopback.hpp>
+#include <libhexabus/socket.hpp>
+
+namespace ip = boost::asio::ip;
+namespace pt = boost::posix_time;
+
+static ip::address_v6 device_address(int i)
+{
+	return ip::address_v6::from_string("fd00::" + boost::lexical_cast<std::string>(i + 1));
+}
+
+static void count_packet(int& count, const hexabus::Packet&, const ip::udp::endpoint&)
+{
+	count++;
+}
+
+BOOST_AUTO_TEST_CASE ( check_loopback_delivery ) {
+	boost::asio::io_service io;
+	hexabus::LoopbackNetwork& network = hexabus::LoopbackNetwork::install(io);
+
+	hexabus::Listener listener(io);
+	hexabus::Socket device(io), client(io);
+	int heard = 0, answered = 0;
+
+	listener.listen("eth0");
+	listener.onPacketReceived(boost::bind(count_packet, boost::ref(heard), _1, _2));
+	device.bind(ip::udp::endpoint(device_address(0), 61616));
+	device.onPacketReceived(boost::bind(count_packet, boost::ref(answered), _1, _2));
+
+	client.send(hexabus::InfoPacket<uint32_t>(2, 1));
+	client.send(hexabus::QueryPacket(2), device_address(0));
+	client.send(hexabus::QueryPacket(2), device_address(1));
+	io.run();
+
+	BOOST_CHECK_EQUAL(heard, 1);
+	BOOST_CHECK_EQUAL(answered, 1);
+
+	hexabus::LoopbackNetwork::Statistics stats = network.statistics();
+	BOOST_CHECK_EQUAL(stats.sent, 3u);
+	BOOST_CHECK_EQUAL(stats.delivered, 2u);
+	BOOST_CHECK_EQUAL(stats.unreachable, 1u);
+
+	// an address is only bound once
+	hexabus::Socket other(io);
+	BOOST_CHECK_THROW(other.bind(ip::udp::endpoint(device_address(0), 61616)), hexabus::NetworkException);
+}
+
+BOOST_AUTO_TEST_CASE ( check_batch_size_change ) {
+	boost::asio::io_service io;
+	hexabus::LoopbackNetwork::install(io);
+
+	hexabus::Socket device(io), client(io);
+	int received = 0;
+
+	device.bind(ip::udp::endpoint(device_address(0), 61616));
+	device.setReceiveBatchSize(4);
+	device.onPacketReceived(boost::bind(count_packet, boost::ref(received), _1, _2));
+
+	for (int i = 0; i < 3; i++)
+		client.send(hexabus::QueryPacket(2), device_address(0));
+
+	// the completion of the pending receive is queued already and fills
+	// the buffer of the old size
+	device.setReceiveBatchSize(1);
+	BOOST_CHECK_EQUAL(device.receiveBatchSize(), 1u);
+
+	for (int i = 0; i < 2; i++)
+		client.send(hexabus::QueryPacket(2), device_address(0));
+	io.run();
+
+	BOOST_CHECK_EQUAL(received, 5);
+}
+
+static void record(std::vector<std::string>& log, hexabus::Timer& timer, const std::string& name,
+		const boost::system::error_code& error)
+{
+	log.push_back(name + (error ? " aborted" : "") + " at " + pt::to_simple_string(timer.now()));
+}
+
+static void record_call(std::vector<int>& calls, int id)
+{
+	calls.push_back(id);
+}
+
+BOOST_AUTO_TEST_CASE ( check_callback_order ) {
+	using namespace hexabus::filtering;
+
+	boost::asio::io_service io;
+	hexabus::LoopbackNetwork::install(io);
+	hexabus::Socket device(io), client(io);
+	std::vector<int> calls;
+
+	device.bind(ip::udp::endpoint(device_address(0), 61616));
+	// indexed and opaque filters are called in the order they were connected
+	device.onPacketReceived(boost::bind(record_call, boost::ref(calls), 0), isQuery());
+	device.onPacketReceived(boost::bind(record_call, boost::ref(calls), 1));
+	device.onPacketReceived(boost::bind(record_call, boost::ref(calls), 2), eid() == 2u);
+	device.onPacketReceived(boost::bind(record_call, boost::ref(calls), 3));
+
+	client.send(hexabus::QueryPacket(2), device_address(0));
+	io.run();
+
+	int expected[] = { 0, 1, 2, 3 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(calls.begin(), calls.end(), expected, expected + 4);
+}
+
+BOOST_AUTO_TEST_CASE ( check_virtual_clock ) {
+	boost::asio::io_service io;
+	hexabus::VirtualClock& clock = hexabus::VirtualClock::install(io);
+	pt::ptime start = clock.now();
+	std::vector<std::string> log;
+
+	hexabus::Timer hour(io, pt::hours(1)), minute(io, pt::minutes(1)), never(io, pt::hours(2));
+	hour.async_wait(boost::bind(record, boost::ref(log), boost::ref(hour), "hour", _1));
+	minute.async_wait(boost::bind(record, boost::ref(log), boost::ref(minute), "minute", _1));
+	never.async_wait(boost::bind(record, boost::ref(log), boost::ref(never), "never", _1));
+
+	clock.runFor(pt::minutes(90));
+	BOOST_CHECK_EQUAL(clock.now(), start + pt::minutes(90));
+	never.cancel();
+	clock.run();
+
+	BOOST_REQUIRE_EQUAL(log.size(), 3u);
+	BOOST_CHECK_EQUAL(log[0], "minute at 2000-Jan-01 00:01:00");
+	BOOST_CHECK_EQUAL(log[1], "hour at 2000-Jan-01 01:00:00");
+	BOOST_CHECK_EQUAL(log[2], "never aborted at 2000-Jan-01 01:30:00");
+	BOOST_CHECK_EQUAL(clock.pending(), 0u);
+}
+
+static uint32_t read_value(int i)
+{
+	return i;
+}
+
+static void answered(int& count, int i, const hexabus::Packet& packet)
+{
+	const hexabus::InfoPacket<uint32_t>* info = dynamic_cast<const hexabus::InfoPacket<uint32_t>*>(&packet);
+	if (info && info->value() == uint32_t(i))
+		count++;
+}
+
+static void failed(int& count, const hexabus::GenericException&)
+{
+	count++;
+}
+
+static void failed_at(std::vector<pt::ptime>& times, hexabus::Timer& timer, const hexabus::GenericException&)
+{
+	times.push_back(timer.now());
+}
+
+BOOST_AUTO_TEST_CASE ( check_unresponsive_device ) {
+	boost::asio::io_service io;
+	hexabus::VirtualClock& clock = hexabus::VirtualClock::install(io);
+	hexabus::LoopbackNetwork::install(io);
+	pt::ptime start = clock.now();
+
+	hexabus::Socket socket(io);
+	hexabus::Timer timer(io);
+	hexabus::DeviceInterrogator interrogator(socket);
+	std::vector<pt::ptime> failures;
+
+	// what hexinfo asks of a device, nobody answers
+	for (uint32_t eid = 0; eid < 9; eid++) {
+		interrogator.send_request(device_address(0), hexabus::EndpointQueryPacket(eid),
+				hexabus::filtering::eid() == eid,
+				boost::function<void (const hexabus::Packet&)>(),
+				boost::bind(failed_at, boost::ref(failures), boost::ref(timer), _1));
+	}
+	clock.run();
+
+	// the device window sends two requests at a time, each is retried for
+	// MaxRequestTime at most, and timeouts of both double the timeout once
+	BOOST_REQUIRE_EQUAL(failures.size(), 9u);
+	BOOST_CHECK_EQUAL(failures[0] - start, hexabus::DeviceInterrogator::MaxRequestTime);
+	BOOST_CHECK_EQUAL(failures[1] - start, hexabus::DeviceInterrogator::MaxRequestTime);
+	BOOST_CHECK_EQUAL(failures[8] - start, hexabus::DeviceInterrogator::MaxRequestTime * 5);
+}
+
+static void cancel_device(hexabus::DeviceInterrogator& interrogator, const ip::address_v6& device)
+{
+	interrogator.cancel(device);
+}
+
+BOOST_AUTO_TEST_CASE ( check_cancelled_device ) {
+	boost::asio::io_service io;
+	hexabus::VirtualClock& clock = hexabus::VirtualClock::install(io);
+	hexabus::LoopbackNetwork::install(io);
+	pt::ptime start = clock.now();
+
+	hexabus::Socket socket(io);
+	hexabus::Timer timer(io), cancel_timer(io);
+	hexabus::DeviceInterrogator interrogator(socket);
+	std::vector<pt::ptime> failures;
+
+	BOOST_CHECK(interrogator.first_sent(device_address(0)).is_not_a_date_time());
+	for (uint32_t eid = 0; eid < 9; eid++) {
+		interrogator.send_request(device_address(0), hexabus::EndpointQueryPacket(eid),
+				hexabus::filtering::eid() == eid,
+				boost::function<void (const hexabus::Packet&)>(),
+				boost::bind(failed_at, boost::ref(failures), boost::ref(timer), _1));
+	}
+	BOOST_CHECK_EQUAL(interrogator.first_sent(device_address(0)), start);
+
+	// requests in flight and waiting ones fail at once, and free the window
+	cancel_timer.expires_from_now(pt::seconds(1));
+	cancel_timer.async_wait(boost::bind(cancel_device, boost::ref(interrogator), device_address(0)));
+	clock.run();
+
+	BOOST_REQUIRE_EQUAL(failures.size(), 9u);
+	BOOST_CHECK_EQUAL(failures[0] - start, pt::seconds(1));
+	BOOST_CHECK_EQUAL(failures[8] - start, pt::seconds(1));
+	BOOST_CHECK_EQUAL(interrogator.requests_in_flight(), 0u);
+}
+
+struct simulation_result {
+	int answers, failures;
+	hexabus::LoopbackNetwork::Statistics stats;
+};
+
+static simulation_result simulate(int devices, uint32_t seed)
+{
+	boost::asio::io_service io;
+	hexabus::VirtualClock& clock = hexabus::VirtualClock::install(io);
+	hexabus::LoopbackNetwork::Conditions conditions;
+	conditions.latency = pt::milliseconds(20);
+	conditions.jitter = pt::milliseconds(30);
+	conditions.loss = 0.1;
+	hexabus::LoopbackNetwork& network = hexabus::LoopbackNetwork::install(io, conditions, seed);
+
+	// devices broadcast at random times
+	srand(seed);
+
+	std::vector<hexabus::Device*> simulated;
+	for (int i = 0; i < devices; i++) {
+		std::vector<std::string> addresses(1, device_address(i).to_string());
+		hexabus::Device* device = new hexabus::Device(io, std::vector<std::string>(), addresses, 60);
+
+		hexabus::TypedEndpointFunctions<uint32_t>::Ptr ep(new hexabus::TypedEndpointFunctions<uint32_t>(2, "value"));
+		ep->onRead(boost::bind(read_value, i));
+		device->addEndpoint(ep);
+		simulated.push_back(device);
+	}
+
+	hexabus::Socket socket(io);
+	hexabus::DeviceInterrogator interrogator(socket, 64, 1);
+	simulation_result result = { 0, 0 };
+
+	for (int i = 0; i < devices; i++) {
+		interrogator.send_request(device_address(i), hexabus::QueryPacket(2),
+				hexabus::filtering::isInfo<uint32_t>() && hexabus::filtering::eid() == 2u,
+				boost::bind(answered, boost::ref(result.answers), i, _1),
+				boost::bind(failed, boost::ref(result.failures), _1),
+				8);
+	}
+
+	// the broadcast timers of the devices never run out
+	clock.runFor(pt::minutes(5));
+	result.stats = network.statistics();
+
+	BOOST_CHECK_EQUAL(interrogator.requests_in_flight(), 0u);
+	for (size_t i = 0; i < simulated.size(); i++)
+		delete simulated[i];
+
+	return result;
+}
+
+BOOST_AUTO_TEST_CASE ( check_simulated_interrogation ) {
+	simulation_result first = simulate(500, 42);
+
+	BOOST_CHECK_EQUAL(first.answers + first.failures, 500);
+	BOOST_CHECK_GE(first.answers, 495);
+	BOOST_CHECK_GT(first.stats.lost, 0u);
+
+	// the same seed gives the same losses, delays and retries
+	simulation_result second = simulate(500, 42);
+	BOOST_CHECK_EQUAL(second.answers, first.answers);
+	BOOST_CHECK_EQUAL(second.stats.sent, first.stats.sent);
+	BOOST_CHECK_EQUAL(second.stats.lost, first.stats.lost);
+	BOOST_CHECK_EQUAL(second.stats.delivered, first.stats.delivered);
+}
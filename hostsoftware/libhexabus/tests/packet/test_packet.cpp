@@ -2,6 +2,10 @@
 #include <boost/test/unit_test.hpp>
 #include <iostream>
 #include <libhexabus/packet.hpp>
+#include <libhexabus/packet_view.hpp>
+#include <libhexabus/filtering.hpp>
+#include <libhexabus/packet_dispatcher.hpp>
+#include <libhexabus/error.hpp>
 #include <libhexabus/private/serialization.hpp>
 #include "testconfig.h"
 
@@ -136,4 +140,136 @@ BOOST_AUTO_TEST_CASE ( check_write_float_packet_generation ) {
 	if(fail)
 		BOOST_FAIL("Generated packet differs from reference packet.");
 }
+BOOST_AUTO_TEST_CASE ( check_packet_view_parsing ) {
+	std::cout << "Checking packet view against stored reference packet." << std::endl;
+	unsigned char testpacket[] = { 'H', 'X', '0', 'C', // Header
+		0x04,               // Packet Type: Write
+		0x00,               // Flags: None
+		0, 0, 0, 42,        // Endpoint ID: 42
+		0x05,               // Datatype: Float
+		0x41, 0xbb, 0x5c, 0x29, // Value 23.42
+		0x34, 0xf6,         // CRC
+		0xff, 0xff          // trailing garbage
+	};
+
+	hexabus::PacketView view(testpacket, sizeof(testpacket));
+
+	BOOST_CHECK_EQUAL(view.type(), hexabus::HXB_PTYPE_WRITE);
+	BOOST_CHECK_EQUAL(view.eid(), 42U);
+	BOOST_CHECK_EQUAL(view.datatype(), hexabus::HXB_DTYPE_FLOAT);
+	BOOST_CHECK_EQUAL(view.size(), sizeof(testpacket) - 2);
+	BOOST_CHECK_EQUAL(view.value<float>(), 23.42f);
+	BOOST_CHECK(view.isNumeric());
+	BOOST_CHECK_THROW(view.value<uint32_t>(), hexabus::GenericException);
+
+	testpacket[12] ^= 1;
+	BOOST_CHECK_THROW(hexabus::PacketView(testpacket, sizeof(testpacket)), hexabus::BadPacketException);
+	BOOST_CHECK_THROW(hexabus::PacketView(testpacket, 10), hexabus::BadPacketException);
+}
+
+BOOST_AUTO_TEST_CASE ( check_packet_view_roundtrip ) {
+	std::cout << "Checking packet view against serialized packets." << std::endl;
+	boost::posix_time::ptime dt(boost::gregorian::date(2013, 5, 17), boost::posix_time::hours(13) + boost::posix_time::minutes(37));
+
+	std::vector<char> dtp = hexabus::serialize(hexabus::InfoPacket<boost::posix_time::ptime>(5, dt));
+	hexabus::PacketView dtv(&dtp[0], dtp.size());
+	BOOST_CHECK(dtv.value<boost::posix_time::ptime>() == dt);
+	BOOST_CHECK(!dtv.isNumeric());
+
+	std::vector<char> sp = hexabus::serialize(hexabus::EndpointInfoPacket(2, hexabus::HXB_DTYPE_UINT32, "Power meter"));
+	hexabus::PacketView sv(&sp[0], sp.size());
+	BOOST_CHECK_EQUAL(sv.type(), hexabus::HXB_PTYPE_EPINFO);
+	BOOST_CHECK_EQUAL(sv.datatype(), hexabus::HXB_DTYPE_UINT32);
+	BOOST_CHECK_EQUAL(std::string(sv.stringValue()), "Power meter");
+
+	hexabus::Packet::Ptr p = hexabus::deserialize(&sp[0], sp.size());
+	BOOST_CHECK_EQUAL(static_cast<const hexabus::EndpointInfoPacket&>(*p).value(), "Power meter");
+	BOOST_CHECK(hexabus::serialize(*p) == sp);
+}
+BOOST_AUTO_TEST_CASE ( check_packet_cast ) {
+	std::cout << "Checking packet classes and packet_cast." << std::endl;
+	hexabus::InfoPacket<uint32_t> info(32, 5);
+	hexabus::EndpointInfoPacket epinfo(2, hexabus::HXB_DTYPE_UINT32, "Power meter");
+	hexabus::QueryPacket query(32);
+	const hexabus::Packet* p;
+
+	p = &info;
+	BOOST_CHECK(hexabus::packet_cast<hexabus::InfoPacket<uint32_t> >(p) == &info);
+	BOOST_CHECK(hexabus::packet_cast<hexabus::ValuePacket<uint32_t> >(p) == &info);
+	BOOST_CHECK(hexabus::packet_cast<hexabus::EIDPacket>(p) == &info);
+	BOOST_CHECK(!hexabus::packet_cast<hexabus::InfoPacket<float> >(p));
+	BOOST_CHECK(!hexabus::packet_cast<hexabus::WritePacket<uint32_t> >(p));
+
+	p = &epinfo;
+	BOOST_CHECK(hexabus::packet_cast<hexabus::ValuePacket<std::string> >(p) == &epinfo);
+	BOOST_CHECK(!hexabus::packet_cast<hexabus::InfoPacket<std::string> >(p));
+	BOOST_CHECK(!hexabus::packet_cast<hexabus::ErrorPacket>(p));
+
+	std::vector<char> raw = hexabus::serialize(epinfo);
+	BOOST_CHECK_EQUAL(hexabus::PacketView(&raw[0], raw.size()).packetClass(), epinfo.packetClass());
+
+	using namespace hexabus::filtering;
+	boost::asio::ip::udp::endpoint from;
+	BOOST_CHECK_EQUAL((isInfo<uint32_t>() && eid() % 32 == 0).candidates(), info.packetClass());
+	BOOST_CHECK_EQUAL((isQuery() || isInfo<uint32_t>()).candidates(), info.packetClass() | query.packetClass());
+	BOOST_CHECK((isInfo<uint32_t>() && eid() % 32 == 0)(info, from));
+	BOOST_CHECK(!(isInfo<uint32_t>() && eid() % 32 == 0)(query, from));
+	BOOST_CHECK((value<uint32_t>() == 5u)(info, from));
+	BOOST_CHECK(!(eid() == 32u)(epinfo, from));
+	BOOST_CHECK(isAnyInfo()(info, from));
+	BOOST_CHECK(!isAnyWrite()(info, from));
+}
+
+static void record_call(std::vector<int>& calls, int id)
+{
+	calls.push_back(id);
+}
+
+BOOST_AUTO_TEST_CASE ( check_packet_dispatcher ) {
+	std::cout << "Checking indexed packet dispatch." << std::endl;
+	using namespace hexabus::filtering;
+
+	hexabus::PacketDispatcher dispatcher;
+	std::vector<int> calls;
+	boost::asio::ip::address_v6 device = boost::asio::ip::address_v6::from_string("fe80::1");
+	boost::asio::ip::udp::endpoint from(device, 61616);
+	boost::asio::ip::udp::endpoint other(boost::asio::ip::address_v6::from_string("fe80::2"), 61616);
+
+	dispatcher.subscribe(boost::bind(record_call, boost::ref(calls), 0), isQuery(), constraints(isQuery()));
+	hexabus::connection c1 = dispatcher.subscribe(boost::bind(record_call, boost::ref(calls), 1),
+			eid() == 5u && isQuery(), constraints(eid() == 5u && isQuery()));
+	dispatcher.subscribe(boost::bind(record_call, boost::ref(calls), 2),
+			sourceIP() == device && isInfo<uint32_t>(), constraints(sourceIP() == device && isInfo<uint32_t>()));
+	dispatcher.subscribe(boost::bind(record_call, boost::ref(calls), 3), !isError(), constraints(!isError()));
+
+	BOOST_CHECK(constraints(eid() == 5u && isQuery()).eid == 5u);
+	BOOST_CHECK(!constraints(eid() == 5u || isQuery()).eid);
+	BOOST_CHECK(constraints(sourceIP() == device && isInfo<uint32_t>()).source == device);
+
+	dispatcher.dispatch(hexabus::QueryPacket(5), from);
+	dispatcher.dispatch(hexabus::QueryPacket(6), from);
+	dispatcher.dispatch(hexabus::InfoPacket<uint32_t>(5, 1), from);
+	dispatcher.dispatch(hexabus::InfoPacket<uint32_t>(5, 1), other);
+	dispatcher.dispatch(hexabus::ErrorPacket(1), from);
+
+	int expected[] = { 0, 1, 3, 0, 3, 2, 3, 3 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(calls.begin(), calls.end(), expected, expected + sizeof(expected) / sizeof(expected[0]));
+
+	calls.clear();
+	c1.disconnect();
+	dispatcher.dispatch(hexabus::QueryPacket(5), from);
+
+	int expected_disconnected[] = { 0, 3 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(calls.begin(), calls.end(), expected_disconnected, expected_disconnected + 2);
+
+	// cancelled subscriptions no longer count, even before they are pruned
+	hexabus::PacketDispatcher single;
+	BOOST_CHECK(single.empty());
+	hexabus::connection c2 = single.subscribe(boost::bind(record_call, boost::ref(calls), 4),
+			eid() == 5u, constraints(eid() == 5u));
+	BOOST_CHECK(!single.empty());
+	c2.disconnect();
+	BOOST_CHECK(single.empty());
+}
+
 //BOOST_AUTO_TEST_SUITE_END()
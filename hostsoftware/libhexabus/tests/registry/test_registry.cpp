@@ -0,0 +1,146 @@
+#define BOOST_TEST_MODULE registry_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/bind.hpp>
+#include <stdlib.h>
+#include <libhexabus/endpoint_registry.hpp>
+#include <libhexabus/error.hpp>
+#include <libhexabus/registry_watcher.hpp>
+#include "tests/test_helpers.hpp"
+
+namespace fs = boost::filesystem;
+
+static fs::path registry_dir()
+{
+	fs::path dir = work_dir("registry_work");
+
+	fs::create_directories(dir / "cache");
+	setenv("HXB_ENDPOINT_REGISTRY_CACHE", (dir / "cache").c_str(), 1);
+
+	return dir;
+}
+
+static void write_file(const fs::path& path, const std::string& contents)
+{
+	fs::ofstream out(path, std::ios_base::out | std::ios_base::trunc);
+	out << contents;
+}
+
+BOOST_AUTO_TEST_CASE ( check_registry_compiled ) {
+	fs::path dir = registry_dir();
+	fs::copy_file(TEST_ENDPOINT_REGISTRY, dir / "registry");
+
+	hexabus::EndpointRegistry parsed(dir / "registry");
+	BOOST_REQUIRE(parsed.begin() != parsed.end());
+	BOOST_CHECK(!fs::is_empty(dir / "cache"));
+
+	// the same file under a different name is not shared, but loaded from the compiled form
+	fs::path cwd = fs::current_path();
+	fs::current_path(dir);
+	hexabus::EndpointRegistry compiled("registry");
+	fs::current_path(cwd);
+
+	BOOST_REQUIRE_EQUAL(std::distance(parsed.begin(), parsed.end()), std::distance(compiled.begin(), compiled.end()));
+	for (hexabus::EndpointRegistry::const_iterator p = parsed.begin(), c = compiled.begin(); p != parsed.end(); ++p, ++c) {
+		BOOST_CHECK_EQUAL(p->first, c->first);
+		BOOST_CHECK_EQUAL(p->second.eid(), c->second.eid());
+		BOOST_CHECK_EQUAL(p->second.description(), c->second.description());
+		BOOST_CHECK(p->second.unit() == c->second.unit());
+		BOOST_CHECK_EQUAL(p->second.type(), c->second.type());
+		BOOST_CHECK_EQUAL(p->second.access(), c->second.access());
+		BOOST_CHECK_EQUAL(p->second.function(), c->second.function());
+	}
+}
+
+BOOST_AUTO_TEST_CASE ( check_registry_lookup ) {
+	fs::path dir = registry_dir();
+	write_file(dir / "small_registry",
+		"eid 40 {\n type FLOAT\n description \"b\"\n access R\n function sensor\n}\n"
+		"eid 2 {\n type BOOL\n description \"a\"\n unit \"W\"\n access RW\n function actor\n}\n");
+
+	hexabus::EndpointRegistry reg(dir / "small_registry");
+	hexabus::EndpointRegistry shared(dir / "small_registry");
+
+	BOOST_CHECK(reg.begin() == shared.begin());
+	BOOST_CHECK_EQUAL(reg.begin()->first, 2u);
+	BOOST_CHECK_EQUAL(reg.lookup(2).description(), "a");
+	BOOST_CHECK_EQUAL(*reg.lookup(2).unit(), "W");
+	BOOST_CHECK(reg.lookup(2).can_write());
+	BOOST_CHECK_EQUAL(reg.lookup(40).type(), hexabus::HXB_DTYPE_FLOAT);
+	BOOST_CHECK(!reg.lookup(40).unit());
+	BOOST_CHECK(reg.find(3) == reg.end());
+	BOOST_CHECK_THROW(reg.lookup(41), std::out_of_range);
+
+	write_file(dir / "small_registry",
+		"eid 2 {\n type BOOL\n description \"c\"\n access RW\n function nonsense\n}\n");
+	BOOST_CHECK_THROW(reg.reload(), hexabus::GenericException);
+
+	write_file(dir / "small_registry",
+		"eid 2 {\n type BOOL\n description \"c\"\n access RW\n function actor\n}\n");
+	reg.reload();
+	BOOST_CHECK_EQUAL(reg.lookup(2).description(), "c");
+	BOOST_CHECK(reg.find(40) == reg.end());
+	// instances keep their table until they are reloaded
+	BOOST_CHECK_EQUAL(shared.lookup(2).description(), "a");
+}
+
+static void stop_with(boost::asio::io_service& io, std::string& result, const std::string& what)
+{
+	result = what;
+	io.stop();
+}
+
+static void stop_with_error(boost::asio::io_service& io, std::string& result, const hexabus::GenericException&)
+{
+	stop_with(io, result, "error");
+}
+
+static void stop_on_timeout(boost::asio::io_service& io, std::string& result, const boost::system::error_code& err)
+{
+	// the timer of an earlier wait is cancelled when io was stopped by the watcher
+	if (!err)
+		stop_with(io, result, "timeout");
+}
+
+// runs io until the watcher reports a reload or an error to result, or gives up after a few seconds
+static std::string wait_for_watcher(boost::asio::io_service& io, std::string& result)
+{
+	boost::asio::deadline_timer timeout(io, boost::posix_time::seconds(5));
+	timeout.async_wait(boost::bind(stop_on_timeout, boost::ref(io), boost::ref(result), _1));
+
+	io.reset();
+	io.run();
+	return result;
+}
+
+BOOST_AUTO_TEST_CASE ( check_registry_watcher ) {
+	fs::path dir = registry_dir();
+	write_file(dir / "watched_registry",
+		"eid 2 {\n type BOOL\n description \"a\"\n access RW\n function actor\n}\n");
+
+	boost::asio::io_service io;
+	hexabus::EndpointRegistry reg(dir / "watched_registry");
+	hexabus::RegistryWatcher watcher(io, reg);
+	std::string result;
+
+	watcher.onReload(boost::bind(stop_with, boost::ref(io), boost::ref(result), "reload"));
+	watcher.onError(boost::bind(stop_with_error, boost::ref(io), boost::ref(result), _1));
+
+	// changes to other files in the directory are ignored
+	write_file(dir / "other_registry", "");
+
+	write_file(dir / "watched_registry",
+		"eid 2 {\n type BOOL\n description \"b\"\n access RW\n function actor\n}\n"
+		"eid 40 {\n type FLOAT\n description \"c\"\n access R\n function sensor\n}\n");
+	BOOST_REQUIRE_EQUAL(wait_for_watcher(io, result), "reload");
+	BOOST_CHECK_EQUAL(reg.lookup(2).description(), "b");
+	BOOST_CHECK_EQUAL(reg.lookup(40).description(), "c");
+
+	// a broken file is reported and the table is kept
+	write_file(dir / "watched_registry",
+		"eid 2 {\n type BOOL\n description \"d\"\n access RW\n function nonsense\n}\n");
+	BOOST_REQUIRE_EQUAL(wait_for_watcher(io, result), "error");
+	BOOST_CHECK_EQUAL(reg.lookup(2).description(), "b");
+	BOOST_CHECK(reg.find(40) != reg.end());
+}
@@ -0,0 +1,102 @@
+#define BOOST_TEST_MODULE sensor_cache_test
+#include <boost/test/unit_test.hpp>
+#include <boost/lexical_cast.hpp>
+#include <set>
+#include <libhexabus/logger/sensor_cache.hpp>
+
+namespace ip = boost::asio::ip;
+
+typedef hexabus::SensorCache<int> cache_t;
+
+static ip::address_v6 device_address(int i)
+{
+	return ip::address_v6::from_string("fe80::50:c4ff:fe04:" + boost::lexical_cast<std::string>(i));
+}
+
+BOOST_AUTO_TEST_CASE ( check_key_packing ) {
+	ip::address_v6 address = ip::address_v6::from_string("2001:db8:1:2:3:4:5:6");
+	hexabus::SensorKey key(address, 2);
+
+	BOOST_CHECK_EQUAL(key.prefix, 0x20010db800010002ULL);
+	BOOST_CHECK_EQUAL(key.interface_id, 0x0003000400050006ULL);
+	BOOST_CHECK_EQUAL(key.eid, 2u);
+
+	// addresses that differ in either half, or in the eid only, are distinct
+	hexabus::SensorKey other_prefix(ip::address_v6::from_string("2001:db8:1:3:3:4:5:6"), 2);
+	hexabus::SensorKey other_interface(ip::address_v6::from_string("2001:db8:1:2:3:4:5:7"), 2);
+	hexabus::SensorKey other_eid(address, 3);
+
+	BOOST_CHECK(key == hexabus::SensorKey(address, 2));
+	BOOST_CHECK(key != other_prefix);
+	BOOST_CHECK(key != other_interface);
+	BOOST_CHECK(key != other_eid);
+	BOOST_CHECK(key < other_prefix);
+	BOOST_CHECK(key < other_interface);
+	BOOST_CHECK(key < other_eid);
+
+	std::set<uint64_t> hashes;
+	for (int i = 0; i < 100; i++) {
+		for (uint32_t eid = 0; eid < 10; eid++)
+			hashes.insert(hexabus::SensorKey(device_address(i), eid).hash());
+	}
+	BOOST_CHECK_EQUAL(hashes.size(), 1000u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_insert_find ) {
+	cache_t cache;
+	hexabus::SensorKey key(device_address(1), 2);
+
+	BOOST_CHECK_EQUAL(cache.size(), 0u);
+	BOOST_CHECK(!cache.find(key));
+
+	cache.insert(key, 5);
+	BOOST_CHECK_EQUAL(cache.size(), 1u);
+	BOOST_REQUIRE(cache.find(key));
+	BOOST_CHECK_EQUAL(*cache.find(key), 5);
+	BOOST_CHECK(!cache.find(hexabus::SensorKey(device_address(1), 3)));
+	BOOST_CHECK(!cache.find(hexabus::SensorKey(device_address(2), 2)));
+
+	// inserting a known key replaces its value
+	cache.insert(key, 7);
+	BOOST_CHECK_EQUAL(cache.size(), 1u);
+	BOOST_CHECK_EQUAL(*cache.find(key), 7);
+}
+
+BOOST_AUTO_TEST_CASE ( check_collisions ) {
+	cache_t cache;
+	hexabus::SensorKey first(device_address(1), 2);
+
+	// keys that start probing at the same slot of the initial table
+	std::vector<hexabus::SensorKey> colliding(1, first);
+	for (uint32_t eid = 3; colliding.size() < 4; eid++) {
+		hexabus::SensorKey key(device_address(1), eid);
+		if ((key.hash() & 63) == (first.hash() & 63))
+			colliding.push_back(key);
+	}
+
+	for (size_t i = 0; i < colliding.size(); i++)
+		cache.insert(colliding[i], int(i) + 1);
+
+	BOOST_CHECK_EQUAL(cache.size(), colliding.size());
+	for (size_t i = 0; i < colliding.size(); i++) {
+		BOOST_REQUIRE(cache.find(colliding[i]));
+		BOOST_CHECK_EQUAL(*cache.find(colliding[i]), int(i) + 1);
+	}
+	BOOST_CHECK(!cache.find(hexabus::SensorKey(device_address(2), 2)));
+}
+
+BOOST_AUTO_TEST_CASE ( check_growth ) {
+	cache_t cache;
+
+	// far beyond the load factor of the initial 64 slots
+	for (int i = 0; i < 1000; i++)
+		cache.insert(hexabus::SensorKey(device_address(i / 10), i % 10), i + 1);
+
+	BOOST_CHECK_EQUAL(cache.size(), 1000u);
+	for (int i = 0; i < 1000; i++) {
+		const int* value = cache.find(hexabus::SensorKey(device_address(i / 10), i % 10));
+		BOOST_REQUIRE(value);
+		BOOST_CHECK_EQUAL(*value, i + 1);
+	}
+	BOOST_CHECK(!cache.find(hexabus::SensorKey(device_address(100), 0)));
+}
@@ -0,0 +1,112 @@
+#define BOOST_TEST_MODULE spool_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <libhexabus/reading_spool.hpp>
+#include "tests/test_helpers.hpp"
+
+namespace fs = boost::filesystem;
+
+typedef hexabus::ReadingSpool::readings_t readings_t;
+
+static std::string sensor_of(int i)
+{
+	return "fe80::50:c4ff:fe04:" + boost::lexical_cast<std::string>(i % 5) + "-2";
+}
+
+// the readings the tests append, starting at the first-th
+static readings_t appended(int first, int count)
+{
+	readings_t result;
+	for (int i = first; i < first + count; i++) {
+		hexabus::ReadingSpool::Reading r = { sensor_of(i), 1400000000 + i, i * 0.5 };
+		result.push_back(r);
+	}
+	return result;
+}
+
+BOOST_AUTO_TEST_CASE ( check_spool_roundtrip ) {
+	fs::path dir = work_dir("spool_work");
+	readings_t readings;
+
+	{
+		hexabus::ReadingSpool spool(dir, 64 * 1024 * 1024);
+		for (int i = 0; i < 100000; i++)
+			spool.append(sensor_of(i), 1400000000 + i, i * 0.5);
+		BOOST_CHECK_EQUAL(spool.pending(), 100000u);
+
+		BOOST_CHECK_EQUAL(spool.peek(1000, readings), 1000u);
+		check_readings(readings, appended(0, 1000));
+		spool.consume();
+
+		// without consume(), peek() returns the same readings again
+		spool.peek(500, readings);
+		check_readings(readings, appended(1000, 500));
+		spool.peek(500, readings);
+		check_readings(readings, appended(1000, 500));
+		spool.consume();
+
+		BOOST_CHECK_EQUAL(spool.pending(), 98500u);
+		spool.sync();
+	}
+
+	// the position of the oldest reading survives reopening
+	hexabus::ReadingSpool spool(dir, 64 * 1024 * 1024);
+	BOOST_CHECK_EQUAL(spool.pending(), 98500u);
+
+	spool.append(sensor_of(100000), 1400000000 + 100000, 100000 * 0.5);
+	BOOST_CHECK_EQUAL(spool.peek(1000000, readings), 98501u);
+	check_readings(readings, appended(1500, 98501));
+	spool.consume();
+
+	BOOST_CHECK_EQUAL(spool.pending(), 0u);
+	BOOST_CHECK_EQUAL(spool.peek(10, readings), 0u);
+	BOOST_CHECK_EQUAL(spool.dropped(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE ( check_spool_torn_record ) {
+	fs::path dir = work_dir("spool_work");
+	fs::path segment;
+	readings_t readings;
+
+	{
+		hexabus::ReadingSpool spool(dir, 1024 * 1024);
+		for (int i = 0; i < 10; i++)
+			spool.append(sensor_of(i), 1400000000 + i, i * 0.5);
+		spool.sync();
+	}
+
+	for (fs::directory_iterator it(dir), end; it != end; ++it)
+		if (it->path().extension() == ".spool")
+			segment = it->path();
+	BOOST_REQUIRE(!segment.empty());
+
+	// cut the last record short, as a crash while writing would
+	fs::resize_file(segment, fs::file_size(segment) - 3);
+
+	hexabus::ReadingSpool spool(dir, 1024 * 1024);
+	BOOST_CHECK_EQUAL(spool.pending(), 9u);
+
+	spool.append(sensor_of(9), 1400000000 + 9, 9 * 0.5);
+	spool.peek(100, readings);
+	check_readings(readings, appended(0, 10));
+}
+
+BOOST_AUTO_TEST_CASE ( check_spool_bounded ) {
+	fs::path dir = work_dir("spool_work");
+	readings_t readings;
+
+	hexabus::ReadingSpool spool(dir, 256 * 1024);
+	for (int i = 0; i < 100000; i++)
+		spool.append(sensor_of(i), 1400000000 + i, i * 0.5);
+	spool.sync();
+
+	BOOST_CHECK_LE(spool.size(), 256 * 1024u);
+	BOOST_CHECK_GT(spool.dropped(), 0u);
+	BOOST_CHECK_EQUAL(spool.pending() + spool.dropped(), 100000u);
+
+	// the oldest readings are the ones that were dropped
+	int first = spool.dropped();
+	spool.peek(100, readings);
+	check_readings(readings, appended(first, 100));
+}
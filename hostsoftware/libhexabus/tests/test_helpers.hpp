@@ -0,0 +1,57 @@
+#ifndef TESTS_TEST_HELPERS_HPP
+#define TESTS_TEST_HELPERS_HPP 1
+
+#include <cmath>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <libhexabus/reading_spool.hpp>
+#include <libhexabus/time_series_store.hpp>
+#include "testconfig.h"
+
+/**
+ * Helpers shared by the tests, which include this file after defining
+ * BOOST_TEST_MODULE.
+ */
+
+// an empty directory below TEST_WORK_DIR, removed again by the next run
+inline boost::filesystem::path work_dir(const std::string& name)
+{
+	boost::filesystem::path dir = boost::filesystem::path(TEST_WORK_DIR) / name;
+
+	boost::filesystem::remove_all(dir);
+	return dir;
+}
+
+// NaN readings are equal to each other
+inline void check_value(double actual, double expected)
+{
+	if (std::isnan(expected))
+		BOOST_CHECK(std::isnan(actual));
+	else
+		BOOST_CHECK_EQUAL(actual, expected);
+}
+
+inline void check_reading(const hexabus::ReadingSpool::Reading& actual, const hexabus::ReadingSpool::Reading& expected)
+{
+	BOOST_CHECK_EQUAL(actual.sensor, expected.sensor);
+	BOOST_CHECK_EQUAL(actual.ts, expected.ts);
+	check_value(actual.value, expected.value);
+}
+
+inline void check_reading(const hexabus::TimeSeriesStore::readings_t::value_type& actual,
+		const hexabus::TimeSeriesStore::readings_t::value_type& expected)
+{
+	BOOST_CHECK_EQUAL(actual.first, expected.first);
+	check_value(actual.second, expected.second);
+}
+
+template<typename Readings>
+void check_readings(const Readings& actual, const Readings& expected)
+{
+	BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+	for (size_t i = 0; i < actual.size(); i++)
+		check_reading(actual[i], expected[i]);
+}
+
+#endif
@@ -0,0 +1,207 @@
+#define BOOST_TEST_MODULE tsdb_test
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <limits>
+#include <libhexabus/time_series_store.hpp>
+#include <libhexabus/error.hpp>
+#include "tests/test_helpers.hpp"
+
+namespace fs = boost::filesystem;
+
+typedef hexabus::TimeSeriesStore::readings_t readings_t;
+
+BOOST_AUTO_TEST_CASE ( check_tsdb_encoding ) {
+	readings_t input;
+	input.push_back(std::make_pair(-5, 0.0));
+	input.push_back(std::make_pair(0, 0.0));
+	input.push_back(std::make_pair(5, 230.5));
+	input.push_back(std::make_pair(10, 230.5));
+	input.push_back(std::make_pair(70, -1e300));
+	input.push_back(std::make_pair(71, std::numeric_limits<double>::quiet_NaN()));
+	input.push_back(std::make_pair(2000, 1.0 / 3));
+	input.push_back(std::make_pair(1000000, 4.0));
+	input.push_back(std::make_pair(999990, std::numeric_limits<double>::infinity()));
+	// the differences to and between these do not fit into int64_t
+	input.push_back(std::make_pair(std::numeric_limits<int64_t>::min(), 17.25));
+	input.push_back(std::make_pair(std::numeric_limits<int64_t>::max(), 17.5));
+
+	hexabus::TimeSeriesStore::Encoder encoder;
+	for (readings_t::const_iterator it = input.begin(); it != input.end(); ++it)
+		encoder.append(it->first, it->second);
+
+	BOOST_CHECK_EQUAL(encoder.count(), input.size());
+	BOOST_CHECK_EQUAL(encoder.first(), std::numeric_limits<int64_t>::min());
+	BOOST_CHECK_EQUAL(encoder.last(), std::numeric_limits<int64_t>::max());
+
+	readings_t output;
+	hexabus::TimeSeriesStore::decode(&encoder.data()[0], encoder.data().size(), encoder.count(), output);
+	check_readings(output, input);
+
+	// regular readings of a constant value take two bits each
+	hexabus::TimeSeriesStore::Encoder regular;
+	for (int i = 0; i < 1000; i++)
+		regular.append(1400000000 + 10 * i, 42);
+	BOOST_CHECK_LT(regular.data().size(), 16 + 1000 / 4 + 2);
+}
+
+BOOST_AUTO_TEST_CASE ( check_tsdb_store ) {
+	fs::path dir = work_dir("tsdb_work");
+	readings_t power, temperature;
+
+	{
+		hexabus::TimeSeriesStore store(dir, 3600);
+
+		uint32_t p = store.add_series("fe80::1-2", "Power", "W", "Europe/Berlin").id;
+		uint32_t t = store.add_series("fe80::1-3", "Temperature", "degC", "Europe/Berlin").id;
+		BOOST_CHECK_THROW(store.add_series("fe80::1-2", "", "", ""), hexabus::GenericException);
+
+		// spans several partitions and blocks
+		for (int i = 0; i < 5000; i++) {
+			power.push_back(std::make_pair(1000 + 3 * i, 100.0 + i % 7));
+			store.append(p, power.back().first, power.back().second);
+		}
+		for (int i = 0; i < 100; i++) {
+			temperature.push_back(std::make_pair(900 + 60 * i, 20.0 + 0.1 * i));
+			store.append(t, temperature.back().first, temperature.back().second);
+		}
+
+		BOOST_CHECK_GT(store.buffered(), 0u);
+		check_readings(store.read(t, 0, 100000), temperature);
+
+		readings_t range(power.begin() + 1000, power.begin() + 1200);
+		check_readings(store.read(p, range.front().first, range.back().first + 1), range);
+
+		// late readings go to their own partition, reads are sorted
+		store.append(t, 950, 1);
+		temperature.insert(temperature.begin() + 1, std::make_pair(950, 1.0));
+		store.flush();
+		BOOST_CHECK_EQUAL(store.buffered(), 0u);
+	}
+
+	hexabus::TimeSeriesStore store(dir);
+	BOOST_CHECK_EQUAL(store.partition(), 3600);
+	BOOST_REQUIRE_EQUAL(store.series().size(), 2u);
+	BOOST_REQUIRE(store.find_series("fe80::1-3"));
+	BOOST_CHECK_EQUAL(store.find_series("fe80::1-3")->unit, "degC");
+	BOOST_CHECK(!store.find_series("fe80::1-4"));
+
+	check_readings(store.read(0, 0, 1000000), power);
+	check_readings(store.read(1, 0, 1000000), temperature);
+	BOOST_CHECK(store.read(1, 100000, 200000).empty());
+}
+
+BOOST_AUTO_TEST_CASE ( check_tsdb_torn_block ) {
+	const int block = hexabus::TimeSeriesStore::BlockSize;
+	fs::path dir = work_dir("tsdb_work");
+	readings_t expected;
+	fs::path segment;
+
+	{
+		hexabus::TimeSeriesStore store(dir);
+		uint32_t s = store.add_series("a", "a", "W", "UTC").id;
+
+		// two full blocks, the rest stays in the open block
+		for (int i = 0; i < 2 * block + 10; i++) {
+			if (i < block || i >= 2 * block)
+				expected.push_back(std::make_pair(100 + i, double(i)));
+			store.append(s, 100 + i, i);
+		}
+		store.flush();
+
+		segment = fs::path(dir) / "0" / "0.seg";
+		BOOST_REQUIRE(fs::exists(segment));
+	}
+
+	// cut the last block short, as a crash while writing would
+	fs::resize_file(segment, fs::file_size(segment) - 3);
+
+	hexabus::TimeSeriesStore store(dir);
+	check_readings(store.read(0, 0, 100000), expected);
+
+	// the open block is written over the damaged one once it is full
+	for (int i = 0; i < block - 10; i++) {
+		expected.push_back(std::make_pair(100 + 2 * block + 10 + i, 1.0));
+		store.append(0, expected.back().first, expected.back().second);
+	}
+	check_readings(store.read(0, 0, 100000), expected);
+	check_readings(hexabus::TimeSeriesStore(dir).read(0, 0, 100000), expected);
+}
+
+BOOST_AUTO_TEST_CASE ( check_tsdb_closed_log ) {
+	const int block = hexabus::TimeSeriesStore::BlockSize;
+	fs::path dir = work_dir("tsdb_work");
+	fs::path log = dir / "0" / "open.log";
+	fs::path saved = dir / "saved.log";
+	readings_t expected;
+
+	{
+		hexabus::TimeSeriesStore store(dir);
+		uint32_t s = store.add_series("a", "a", "W", "UTC").id;
+
+		for (int i = 0; i < block; i++) {
+			// the last reading closes the block
+			if (i == block - 1)
+				fs::copy_file(log, saved);
+
+			expected.push_back(std::make_pair(100 + i, double(i)));
+			store.append(s, expected.back().first, expected.back().second);
+			store.flush();
+		}
+	}
+
+	// as if the store crashed before the log of the closed block was emptied
+	fs::remove(log);
+	fs::rename(saved, log);
+
+	check_readings(hexabus::TimeSeriesStore(dir).read(0, 0, 100000), expected);
+	BOOST_CHECK_EQUAL(fs::file_size(log), 0u);
+}
+
+static uintmax_t series_size(const fs::path& dir)
+{
+	uintmax_t size = 0;
+
+	for (fs::directory_iterator it(dir), end; it != end; ++it)
+		size += fs::file_size(it->path());
+	return size;
+}
+
+BOOST_AUTO_TEST_CASE ( check_tsdb_frequent_flush ) {
+	fs::path dir = work_dir("tsdb_work");
+	readings_t expected;
+
+	{
+		hexabus::TimeSeriesStore store(dir);
+		uint32_t s = store.add_series("a", "a", "W", "UTC").id;
+
+		// a sensor read every 10 seconds, and a logger flushing after every reading
+		for (int i = 0; i < 5000; i++) {
+			expected.push_back(std::make_pair(1400000000 + 10 * i, 230.0 + (i % 4) * 0.5));
+			store.append(s, expected.back().first, expected.back().second);
+			store.flush();
+		}
+
+		BOOST_CHECK_LT(double(series_size(dir / "0")) / expected.size(), 4.0);
+		check_readings(store.read(s, 0, 2000000000), expected);
+	}
+
+	// the flushed readings of the open block are read back from the log
+	fs::path log = dir / "0" / "open.log";
+	BOOST_REQUIRE(fs::exists(log));
+	{
+		hexabus::TimeSeriesStore store(dir);
+		check_readings(store.read(0, 0, 2000000000), expected);
+	}
+
+	// a flush cut short by a crash is lost, the flushes before it are not
+	fs::resize_file(log, fs::file_size(log) - 3);
+	expected.pop_back();
+
+	hexabus::TimeSeriesStore store(dir);
+	check_readings(store.read(0, 0, 2000000000), expected);
+
+	store.append(0, 1500000000, 1);
+	store.flush();
+	expected.push_back(std::make_pair(1500000000, 1.0));
+	check_readings(hexabus::TimeSeriesStore(dir).read(0, 0, 2000000000), expected);
+}